@@ -1,7 +1,6 @@
 // Copyright (c) .NET Foundation and contributors. All rights reserved.
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
-#include <iostream>
 #include <fcntl.h>
 #include "Profiler.h"
 #include "CComPtr.h"
@@ -10,21 +9,36 @@
 #include "clr_helpers.h"
 #include "il_rewriter.h"
 #include "il_rewriter_wrapper.h"
+#include "enter_leave_hooks.h"
+#include "event_buffer.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+#include "thread_registry.h"
+#include "allocation_profiler.h"
+#include "gc_telemetry.h"
+#include "exception_telemetry.h"
+#include "jit_telemetry.h"
+#include "logger.h"
+#include "metadata_benchmark.h"
+#include "selective_instrumentation.h"
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <cassert>
 
 namespace trace {
-    BOOL debug = false;
-
     Profiler::Profiler() : refCount(0), corProfilerInfo(nullptr)
     {
-        if (debug) std::wcout << "Profiler()" << std::endl;;
+        LOG_DEBUG("Profiler()");
         GetSingletonish() = this;
     }
 
     Profiler::~Profiler()
     {
+        if (attachThread.joinable())
+        {
+            attachThread.join();
+        }
         if (this->corProfilerInfo != nullptr)
         {
             this->corProfilerInfo->Release();
@@ -33,6 +47,13 @@ namespace trace {
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::Initialize(IUnknown *pIProfilerInfoUnk)
+    {
+        // every setting is read once, from the environment and PROFILER_CONFIG_FILE
+        ProfilerConfig::Instance()->Load();
+        return Start(pIProfilerInfoUnk, false);
+    }
+
+    HRESULT Profiler::Start(IUnknown* pIProfilerInfoUnk, bool attaching)
     {
         //  this project agent support net461+ , if support net45 use IProfilerInfo4
         const HRESULT queryHR = pIProfilerInfoUnk->QueryInterface(__uuidof(ICorProfilerInfo8), reinterpret_cast<void **>(&this->corProfilerInfo));
@@ -44,23 +65,256 @@ namespace trace {
 
         const DWORD COR_PRF_ENABLE_REJIT = 0x00040000;
 
-        const DWORD eventMask = COR_PRF_MONITOR_JIT_COMPILATION |
+        attached = attaching;
+        const ConfigSnapshot* config = ProfilerConfig::Instance()->Current();
+        Logger::Instance()->Start(LogSettings::FromConfig(*config));
+
+        // PROFILER_MODE=enterleave measures through enter / leave hooks and PROFILER_MODE=sampling
+        // samples stacks, neither rewrites IL
+        const auto& modeName = config->Value(WStr("PROFILER_MODE"));
+        if (modeName == WStr("enterleave"))
+        {
+            mode = ProfilerMode::EnterLeave;
+        }
+        else if (modeName == WStr("sampling"))
+        {
+            mode = ProfilerMode::Sampling;
+        }
+
+        DWORD eventMask = COR_PRF_MONITOR_JIT_COMPILATION |
             COR_PRF_DISABLE_TRANSPARENCY_CHECKS_UNDER_FULL_TRUST | /* helps the case where this profiler is used on Full CLR */
             COR_PRF_DISABLE_INLINING |
             COR_PRF_MONITOR_MODULE_LOADS |
             COR_PRF_DISABLE_ALL_NGEN_IMAGES |
             COR_PRF_ENABLE_REJIT;
 
-        this->corProfilerInfo->SetEventMask(eventMask);
+        // PROFILER_SELECTIVE_ENABLED=1 leaves precompiled code and inlining alone, only the ReJIT
+        // targets are instrumented and JITInlining keeps just them out of their callers
+        selective = mode == ProfilerMode::Rewrite && config->Flag(WStr("PROFILER_SELECTIVE_ENABLED"));
+        if (selective)
+        {
+            eventMask &= ~(COR_PRF_DISABLE_INLINING | COR_PRF_DISABLE_ALL_NGEN_IMAGES);
+        }
+
+        if (mode == ProfilerMode::EnterLeave)
+        {
+            // inlined and precompiled code never calls the hooks, so both stay disabled
+            eventMask = COR_PRF_MONITOR_ENTERLEAVE |
+                COR_PRF_DISABLE_INLINING |
+                COR_PRF_MONITOR_MODULE_LOADS |
+                COR_PRF_DISABLE_ALL_NGEN_IMAGES;
+        }
+        else if (mode == ProfilerMode::Sampling)
+        {
+            eventMask = COR_PRF_MONITOR_THREADS |
+                COR_PRF_ENABLE_STACK_SNAPSHOT;
+        }
+
+        // allocation sampling runs alongside any mode, ObjectAllocated can only be turned on here
+        bool allocationsEnabled = config->Flag(WStr("PROFILER_ALLOCATIONS_ENABLED"));
+        const auto allocationSettings = AllocationSettings::FromConfig(*config);
+        if (allocationsEnabled)
+        {
+            eventMask |= COR_PRF_ENABLE_OBJECT_ALLOCATED |
+                COR_PRF_MONITOR_OBJECT_ALLOCATED |
+                COR_PRF_MONITOR_GC;
+            if (allocationSettings.stackDepth > 0)
+            {
+                eventMask |= COR_PRF_ENABLE_STACK_SNAPSHOT;
+            }
+        }
+
+        const bool gcEnabled = config->Flag(WStr("PROFILER_GC_ENABLED"));
+        if (gcEnabled)
+        {
+            eventMask |= COR_PRF_MONITOR_GC |
+                COR_PRF_MONITOR_SUSPENDS;
+        }
+
+        const bool exceptionsEnabled = config->Flag(WStr("PROFILER_EXCEPTIONS_ENABLED"));
+        if (exceptionsEnabled)
+        {
+            eventMask |= COR_PRF_MONITOR_EXCEPTIONS;
+        }
+
+        const bool jitTimingEnabled = config->Flag(WStr("PROFILER_JIT_TIMING_ENABLED"));
+        if (jitTimingEnabled)
+        {
+            eventMask |= COR_PRF_MONITOR_JIT_COMPILATION;
+        }
+
+        // the native probe and the hooks never attach a thread to the event pipeline themselves,
+        // ThreadAssignedToOSThread does it on the thread itself
+        const bool eventsEnabled = config->Flag(WStr("PROFILER_EVENTS_ENABLED"));
+        if (eventsEnabled)
+        {
+            eventMask |= COR_PRF_MONITOR_THREADS;
+        }
+
+        if (attaching)
+        {
+            // the enter / leave hooks, ObjectAllocated and the inlining and NGEN switches can only be
+            // set at startup; an attached profiler instruments through ReJIT alone
+            if (mode == ProfilerMode::EnterLeave)
+            {
+                LOG_ERROR("Profiler InitializeForAttach: enter / leave mode cannot attach");
+                return E_FAIL;
+            }
+            if (allocationsEnabled)
+            {
+                LOG_WARNING("Profiler InitializeForAttach: allocation sampling cannot attach, it stays off");
+                allocationsEnabled = false;
+            }
+            // corprof.h predates ReJIT on attach and leaves it out of the allowed flags, CoreCLR 3.0 and
+            // later accept it; without it every RequestReJIT fails with CORPROF_E_REJIT_NOT_ENABLED
+            eventMask &= COR_PRF_ALLOWABLE_AFTER_ATTACH | COR_PRF_ENABLE_REJIT;
+        }
+
+        const HRESULT maskHR = this->corProfilerInfo->SetEventMask(eventMask);
+        if (FAILED(maskHR))
+        {
+            // an attach the runtime cannot honour is refused rather than left instrumenting nothing
+            LOG_ERROR("Profiler {}: SetEventMask {} failed: {}", attaching ? "InitializeForAttach" : "Initialize",
+                Hex(eventMask), Hex(maskHR));
+            return E_FAIL;
+        }
 
-        if (debug) std::wcout << "Profiler Initialize Success\n";
+        if (jitTimingEnabled)
+        {
+            JitTelemetry::Instance()->Start(this->corProfilerInfo, JitTelemetrySettings::FromConfig(*config));
+        }
+
+        if (exceptionsEnabled)
+        {
+            ExceptionTelemetry::Instance()->Start(this->corProfilerInfo, ExceptionSettings::FromConfig(*config));
+        }
+
+        if (gcEnabled)
+        {
+            GcTelemetry::Instance()->Start(this->corProfilerInfo);
+        }
+
+        if (allocationsEnabled)
+        {
+            AllocationProfiler::Instance()->Start(this->corProfilerInfo, allocationSettings);
+        }
+
+        if (eventsEnabled)
+        {
+            PublishProbeCosts();
+            EventPipeline::Instance()->Start(EventPipelineSettings::FromConfig(*config));
+            EventPipeline::Instance()->AttachThread();
+        }
+
+        if (mode == ProfilerMode::Sampling)
+        {
+            sampler.reset(new StackSampler(this->corProfilerInfo, SamplerSettings::FromConfig(*config)));
+            if (!sampler->Start())
+            {
+                sampler.reset();
+                EventPipeline::Instance()->Stop();
+                return E_FAIL;
+            }
+            LOG_INFO("Profiler Initialize Success, sampling mode");
+            return S_OK;
+        }
+
+        if (mode == ProfilerMode::EnterLeave)
+        {
+            const HRESULT hr = EnterLeaveHooks::Instance()->Install(this->corProfilerInfo, HookFilter::FromConfig(*config));
+            if (FAILED(hr))
+            {
+                LOG_ERROR("Profiler Initialize: unable to install enter / leave hooks: {}", Hex(hr));
+                EventPipeline::Instance()->Stop();
+                return E_FAIL;
+            }
+            LOG_INFO("Profiler Initialize Success, enter / leave mode");
+            return S_OK;
+        }
+
+        probeAbi = GetProbeAbi();
+
+        if (config->Flag(WStr("PROFILER_GOVERNOR_ENABLED")))
+        {
+            governor.reset(new OverheadGovernor(this->corProfilerInfo, GovernorSettings::FromConfig(*config, probeAbi)));
+            governor->Start();
+        }
+
+        if (selective)
+        {
+            // every target in a module loaded from now on is rejitted from the background thread
+            SelectiveInstrumentation::Instance()->Start(this->corProfilerInfo, [this](const std::vector<ModuleID>& moduleIds) {
+                // precompiled code of the new modules may have inlined targets selected before they loaded
+                std::vector<ModuleID> inlinerModules;
+                std::vector<mdMethodDef> inlinerMethods;
+                SelectiveInstrumentation::Instance()->FindPrecompiledInliners(moduleIds, inlinerModules, inlinerMethods);
+                if (!inlinerMethods.empty()) {
+                    const HRESULT hr = corProfilerInfo->RequestReJIT((ULONG)inlinerMethods.size(), inlinerModules.data(), inlinerMethods.data());
+                    LOG_INFO("SelectiveInstrumentation: RequestReJIT {} precompiled inliners, result: {}", inlinerMethods.size(), Hex(hr));
+                }
+
+                // only the modules whose string heap has a target's name get a name index
+                const ConfigSnapshot* config = ProfilerConfig::Instance()->Current();
+                std::vector<std::shared_ptr<ModuleMetaInfo>> modules;
+                for (const auto moduleId : moduleIds) {
+                    auto module = ModuleStore::Instance()->Find(moduleId);
+                    if (module != nullptr && MayDefineTarget(*module, config->RejitTargets())) {
+                        modules.push_back(std::move(module));
+                    }
+                }
+                ApplyRejitTargets(ConfigSnapshot(), *config, modules);
+            });
+        }
+
+        // a changed config file re-instruments the methods whose ReJIT target status changed
+        ProfilerConfig::Instance()->Subscribe([this](const ConfigSnapshot& previous, const ConfigSnapshot& current) {
+            ApplyRejitTargets(previous, current, ModuleStore::Instance()->Modules());
+        });
+        ProfilerConfig::Instance()->Watch();
+
+        LOG_INFO("Profiler Initialize Success{}", attaching ? ", attached" : "");
 
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::Shutdown()
     {
-        if (debug) std::wcout << "Profiler Shutdown\n";
+        LOG_INFO("Profiler Shutdown");
+
+        ProfilerConfig::Instance()->Stop();
+
+        if (attachThread.joinable())
+        {
+            attachThread.join();
+        }
+        SelectiveInstrumentation::Instance()->Stop();
+
+        if (governor != nullptr)
+        {
+            governor->Stop();
+        }
+
+        if (sampler != nullptr)
+        {
+            sampler->Stop();
+            sampler->WriteFolded();
+        }
+
+        AllocationProfiler::Instance()->WriteReport();
+        ExceptionTelemetry::Instance()->WriteReport();
+        JitTelemetry::Instance()->WriteReport();
+
+        EventPipeline::Instance()->Stop();
+        Logger::Instance()->Stop();
+
+        // publish whatever the enabled subsystems collected before they are torn down
+        const auto stats = ProfilerStats::Instance()->Snapshot();
+        if (!stats.empty())
+        {
+            ProfilerStats::Instance()->WriteTo(GetStatsPath());
+        }
+        governor.reset();
+        sampler.reset();
 
         if (this->corProfilerInfo != nullptr)
         {
@@ -117,6 +371,11 @@ namespace trace {
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ModuleLoadFinished(ModuleID moduleId, HRESULT hrStatus) 
+    {
+        return RegisterModule(moduleId);
+    }
+
+    HRESULT Profiler::RegisterModule(ModuleID moduleId)
     {
         // used to store info about the modules that will be useful later for rewriting
 
@@ -125,26 +384,25 @@ namespace trace {
             return S_OK;
         }
 
-        if (module_info.assembly.name == "dotnet"_W ||
-            module_info.assembly.name == "MSBuild"_W)
+        if (module_info.assembly.name == WStr("dotnet") ||
+            module_info.assembly.name == WStr("MSBuild"))
         {
             return S_OK;
         }
 
         const auto entryPointToken = module_info.GetEntryPointToken();
-        ModuleMetaInfo* module_metadata = new ModuleMetaInfo(entryPointToken, module_info.assembly.name);
-        {
-            std::lock_guard<std::mutex> guard(mapLock);
-            moduleMetaInfoMap[moduleId] = module_metadata;
+        ModuleStore::Instance()->Add(moduleId, entryPointToken, module_info.assembly.name);
+        if (selective) {
+            SelectiveInstrumentation::Instance()->QueueModule(moduleId);
         }
 
         // only log the load of the module with an entry point, otherwise we'll spam the logs
         if (entryPointToken != mdTokenNil)
         {
-            if (debug) std::wcout << "Assembly: " << module_info.assembly.name << ", EntryPointToken: " << entryPointToken << "\n";
+            LOG_INFO("Assembly: {}, EntryPointToken: {}", module_info.assembly.name, entryPointToken);
         }
 
-        if (module_info.assembly.name == "mscorlib"_W || module_info.assembly.name == "System.Private.CoreLib"_W) {
+        if (module_info.assembly.name == WStr("mscorlib") || module_info.assembly.name == WStr("System.Private.CoreLib")) {
                                   
             if(!corAssemblyProperty.szName.empty()) {
                 return S_OK;
@@ -156,6 +414,20 @@ namespace trace {
                 metadata_interfaces.GetAddressOf());
             RETURN_OK_IF_FAILED(hr);
 
+            const ConfigSnapshot* config = ProfilerConfig::Instance()->Current();
+            if (config->Flag(WStr("PROFILER_ENUM_BENCHMARK"))) {
+                BenchmarkMethodEnumeration(metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport));
+            }
+            if (config->Flag(WStr("PROFILER_SIGNATURE_BENCHMARK"))) {
+                BenchmarkSignatureDecoding(metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport));
+            }
+            if (config->Flag(WStr("PROFILER_TRANSCODE_BENCHMARK"))) {
+                BenchmarkTranscoding(metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport));
+            }
+            if (config->Flag(WStr("PROFILER_FOLD_BENCHMARK"))) {
+                BenchmarkFolding(metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport));
+            }
+
             auto pAssemblyImport = metadata_interfaces.As<IMetaDataAssemblyImport>(
                 IID_IMetaDataAssemblyImport);
             if (pAssemblyImport.IsNull()) {
@@ -194,14 +466,17 @@ namespace trace {
     {
         // remove info about the module on unload
 
-        if (debug) std::wcout << "Profiler::ModuleUnloadFinished, ModuleID: " << moduleId << "\n";
-        {
-            std::lock_guard<std::mutex> guard(mapLock);
-            if (moduleMetaInfoMap.count(moduleId) > 0) {
-                const auto moduleMetaInfo = moduleMetaInfoMap[moduleId];
-                delete moduleMetaInfo;
-                moduleMetaInfoMap.erase(moduleId);
-            }
+        LOG_DEBUG("Profiler::ModuleUnloadFinished, ModuleID: {}", moduleId);
+        ModuleStore::Instance()->Remove(moduleId);
+        SymbolCache::Instance()->ForgetModule(moduleId);
+
+        // the governor reads the hit counters of its methods, so it lets go of them before they are recycled
+        if (governor != nullptr) {
+            governor->ForgetModule(moduleId);
+        }
+        ProbeSiteTable::Instance()->ForgetModule(moduleId);
+        if (selective) {
+            SelectiveInstrumentation::Instance()->ForgetModule(moduleId);
         }
         return S_OK;
     }
@@ -236,7 +511,7 @@ namespace trace {
         return S_OK;
     }
 
-    HRESULT Profiler::RewriteMethod(WSTRING targetFunction, FunctionID functionId)
+    HRESULT Profiler::RewriteMethod(WStringView targetFunction, FunctionID functionId)
     {
         // get the method's module and function token
         mdToken function_token = mdTokenNil;
@@ -244,44 +519,32 @@ namespace trace {
         auto hr = corProfilerInfo->GetFunctionInfo(functionId, NULL, &moduleId, &function_token);
         RETURN_OK_IF_FAILED(hr);
 
-        ModuleMetaInfo* moduleMetaInfo = nullptr;
-        {
-            std::lock_guard<std::mutex> guard(mapLock);
-            if (moduleMetaInfoMap.count(moduleId) > 0) {
-                moduleMetaInfo = moduleMetaInfoMap[moduleId];
-            }
-        }
+        const auto moduleMetaInfo = ModuleStore::Instance()->Find(moduleId);
         if (moduleMetaInfo == nullptr) {
             return S_OK;
         }
 
         // check if method has already been written
-        bool isiLRewrote = false;
-        {
-            std::lock_guard<std::mutex> guard(mapLock);
-            if (iLRewriteMap.count(function_token) > 0) {
-                isiLRewrote = true;
-            }
-        }
-        if (isiLRewrote) {
+        if (moduleMetaInfo->IsRewritten(function_token)) {
             return S_OK;
         }
 
         // call rewrite twice to demo the issue
-        InnerRewrite(targetFunction, moduleId, function_token, NULL);
+        if (InnerRewrite(targetFunction, moduleId, function_token, NULL) == S_FALSE) {
+            return S_OK;
+        }
         InnerRewrite(targetFunction, moduleId, function_token, NULL);
 
-        // exit rewrite lock
-        {
-            std::lock_guard<std::mutex> guard(mapLock);
-            iLRewriteMap[function_token] = true;
-        }
+        // only targets are remembered, other methods cost no bookkeeping
+        moduleMetaInfo->MarkRewritten(function_token);
 
         return S_OK;
     }
 
-    HRESULT Profiler::InnerRewrite(WSTRING targetFunction, ModuleID moduleId, mdToken function_token, ICorProfilerFunctionControl* pICorProfilerFunctionControl)
+    HRESULT Profiler::InnerRewrite(WStringView targetFunction, ModuleID moduleId, mdToken function_token, ICorProfilerFunctionControl* pICorProfilerFunctionControl)
     {
+        RewriteTimer timer;
+
         // extract some COM interfaces needed for querying the meta and rewriting the IL
         CComPtr<IUnknown> metadata_interfaces;
         auto hr = corProfilerInfo->GetModuleMetaData(moduleId, ofRead | ofWrite,
@@ -300,86 +563,139 @@ namespace trace {
         hr = pImport->GetModuleFromScope(&module);
         RETURN_OK_IF_FAILED(hr);
 
-        auto functionInfo = GetFunctionInfo(pImport, function_token);
-        if (!functionInfo.IsValid()) {
+        const auto moduleMetaInfo = ModuleStore::Instance()->Find(moduleId);
+        if (moduleMetaInfo == nullptr) {
             return S_OK;
         }
 
-        FunctionMetaInfo* functionMetadata = new FunctionMetaInfo(moduleId, function_token);
-        {
-            std::lock_guard<std::mutex> guard(mapLock);
-            functionNameMetaInfoMap[functionInfo.type.name + "."_W + functionInfo.name] = functionMetadata;
-        }
-
-
-        // some generic test on the signature and calling convertion
-        hr = functionInfo.signature.TryParse();
+        WCHAR methodNameBuffer[NameMaxSize];
+        ULONG methodNameLength = 0;
+        PCCOR_SIGNATURE rawSignature = nullptr;
+        ULONG rawSignatureLength = 0;
+        hr = pImport->GetMethodProps(function_token, nullptr, methodNameBuffer, NameMaxSize, &methodNameLength, nullptr,
+            &rawSignature, &rawSignatureLength, nullptr, nullptr);
         RETURN_OK_IF_FAILED(hr);
+        if (methodNameLength == 0 || methodNameLength > NameMaxSize) {
+            return S_OK;
+        }
+        const WStringView methodName(methodNameBuffer, methodNameLength - 1);
 
-
-        if (targetFunction != functionInfo.name)
+        // the JIT path rewrites targetFunction, the ReJIT path the configured targets; every method
+        // the JIT compiles gets here, so the method's own name rules most of them out before any full
+        // name is resolved and kept in the module's symbols
+        const ConfigSnapshot* config = ProfilerConfig::Instance()->Current();
+        if (targetFunction.empty() ? !config->MayBeRejitTarget(methodName) : targetFunction != methodName)
         {
+            return S_FALSE;
+        }
+        const SymbolName* fullName = SymbolCache::Instance()->MethodName(pImport, moduleMetaInfo->symbols, function_token);
+        if (fullName == nullptr) {
             return S_OK;
         }
+        if (targetFunction.empty() && !config->IsRejitTarget(fullName->view()))
+        {
+            return S_FALSE;
+        }
+
+        // some generic test on the signature and calling convertion
+        MethodSignature signature(rawSignature, rawSignatureLength);
+        hr = signature.TryParse(moduleMetaInfo->signatures);
+        RETURN_OK_IF_FAILED(hr);
 
-        if (debug) std::wcout << "Starting rewrite: " << functionInfo.type.name << "." << functionInfo.name << std::endl;
+        LOG_DEBUG("Starting rewrite: {}", fullName->view());
 
 
         //return ref not support
         unsigned elementType;
-        auto retTypeFlags = functionInfo.signature.GetRet().GetTypeFlags(elementType);
+        auto retTypeFlags = signature.GetRet().GetTypeFlags(elementType);
         if (retTypeFlags & TypeFlagByRef) {
             return S_OK;
         }
 
 
-        // get a refernce to another COM interface to find an assemble that contains a type from our target functions signature
-        auto importMetaDataAssembly = metadata_interfaces.As<IMetaDataAssemblyImport>(IID_IMetaDataAssemblyImport);
-        if (importMetaDataAssembly.IsNull())
-        {
+        // ask the governor which probe to emit, only methods instrumented through ReJIT are governed
+        // because they are the only ones it can downgrade with RequestReJIT or remove with RequestRevert
+        ProbeSite* probeSite = nullptr;
+        auto variant = ProbeVariant::Full;
+        if (governor != nullptr && pICorProfilerFunctionControl != nullptr) {
+            probeSite = governor->RegisterMethod(moduleId, function_token);
+            variant = governor->GetVariant(moduleId, function_token);
+        }
+
+        if (variant == ProbeVariant::Reverted) {
             return S_OK;
         }
 
-        // get a reference to the middleware / profiler assembly
-        mdAssemblyRef consoleAssemblyRef = FindAssemblyRef(importMetaDataAssembly, ConsoleAssemblyName);
+        const bool nativeProbe = variant == ProbeVariant::Full && probeAbi == ProbeAbi::Native;
+        mdSignature nativeProbeSignature = mdSignatureNil;
+        if (nativeProbe) {
+            // the native probe gets its site as argument, so ungoverned methods need one too
+            if (probeSite == nullptr) {
+                probeSite = ProbeSiteTable::Instance()->GetOrAdd(moduleId, function_token);
+                if (probeSite == nullptr) {
+                    return S_OK;
+                }
+            }
 
-        if (consoleAssemblyRef == mdAssemblyRefNil) {
-            return S_OK;
+            nativeProbeSignature = moduleMetaInfo->nativeProbeSignature.load(std::memory_order_acquire);
+            if (nativeProbeSignature == mdSignatureNil) {
+                hr = GetNativeProbeSignature(metadata_interfaces, corAssemblyProperty, moduleMetaInfo->assemblyRefs, &nativeProbeSignature);
+                RETURN_OK_IF_FAILED(hr);
+                moduleMetaInfo->nativeProbeSignature.store(nativeProbeSignature, std::memory_order_release);
+            }
         }
 
-        mdString testMessageToken;
-        auto testMessage = "Hello from "_W + functionInfo.name + "!"_W;
-        hr = pEmit->DefineUserString(testMessage.data(), (ULONG)testMessage.length(), &testMessageToken);
+        mdString testMessageToken = mdTokenNil;
+        mdMemberRef consoleWriteLineMemberRef = mdMemberRefNil;
+        if (variant == ProbeVariant::Full && !nativeProbe) {
+            // get a refernce to another COM interface to find an assemble that contains a type from our target functions signature
+            auto importMetaDataAssembly = metadata_interfaces.As<IMetaDataAssemblyImport>(IID_IMetaDataAssemblyImport);
+            if (importMetaDataAssembly.IsNull())
+            {
+                return S_OK;
+            }
 
-        // get a reference to the middleware type
-        mdTypeRef consoleTypeRef;
-        hr = pEmit->DefineTypeRefByName(
-            consoleAssemblyRef,
-            ConsoleTypeName.data(),
-            &consoleTypeRef);
-        RETURN_OK_IF_FAILED(hr);
+            // get a reference to the middleware / profiler assembly
+            mdAssemblyRef consoleAssemblyRef = moduleMetaInfo->assemblyRefs.Find(importMetaDataAssembly, ConsoleAssemblyName);
 
-        // build a structure representing the signature of the middleware function to be called
-        auto* consoleWriteLineSig = new COR_SIGNATURE[4];
-        unsigned offset = 0;
-        consoleWriteLineSig[offset++] = IMAGE_CEE_CS_CALLCONV_DEFAULT;
-        consoleWriteLineSig[offset++] = 0x01; // number parameters
-        consoleWriteLineSig[offset++] = ELEMENT_TYPE_VOID; // return type
-        consoleWriteLineSig[offset++] = ELEMENT_TYPE_STRING; // parameter type
-
-        // reference to the signature of the middleware
-        mdMemberRef consoleWriteLineMemberRef;
-        hr = pEmit->DefineMemberRef(
-            consoleTypeRef,
-            ConsoleWriteLineMethodName.data(),
-            consoleWriteLineSig,
-            sizeof(consoleWriteLineSig),
-            &consoleWriteLineMemberRef);
-        RETURN_OK_IF_FAILED(hr);
+            if (consoleAssemblyRef == mdAssemblyRefNil) {
+                return S_OK;
+            }
+
+            auto testMessage = Concat({ WStr("Hello from "), methodName, WStr("!") });
+            hr = pEmit->DefineUserString(testMessage.data(), (ULONG)testMessage.length(), &testMessageToken);
+
+            // get a reference to the middleware type
+            mdTypeRef consoleTypeRef;
+            hr = pEmit->DefineTypeRefByName(
+                consoleAssemblyRef,
+                ConsoleTypeName.data(),
+                &consoleTypeRef);
+            RETURN_OK_IF_FAILED(hr);
+
+            // build a structure representing the signature of the middleware function to be called
+            auto* consoleWriteLineSig = new COR_SIGNATURE[4];
+            unsigned offset = 0;
+            consoleWriteLineSig[offset++] = IMAGE_CEE_CS_CALLCONV_DEFAULT;
+            consoleWriteLineSig[offset++] = 0x01; // number parameters
+            consoleWriteLineSig[offset++] = ELEMENT_TYPE_VOID; // return type
+            consoleWriteLineSig[offset++] = ELEMENT_TYPE_STRING; // parameter type
+
+            // reference to the signature of the middleware
+            hr = pEmit->DefineMemberRef(
+                consoleTypeRef,
+                ConsoleWriteLineMethodName.data(),
+                consoleWriteLineSig,
+                sizeof(consoleWriteLineSig),
+                &consoleWriteLineMemberRef);
+            RETURN_OK_IF_FAILED(hr);
+        }
 
         // start the IL rewriting
+        timer.Next(RewritePhase::Import);
         ILRewriter rewriter(corProfilerInfo, pICorProfilerFunctionControl, moduleId, function_token);
         RETURN_OK_IF_FAILED(rewriter.Import());
+        timer.Next(RewritePhase::Transform);
 
         // find position to start rewriting
         auto pReWriter = &rewriter;
@@ -387,28 +703,58 @@ namespace trace {
         ILInstr* pFirstOriginalInstr = pReWriter->GetILList()->m_pNext;
         reWriterWrapper.SetILPosition(pFirstOriginalInstr);
 
-        // load the functions first parameter on to the stack (zero is this pointer)
-        reWriterWrapper.LoadStr(testMessageToken);
+        if (nativeProbe) {
+            // calli ProfilerProbeEnter(site), the native probe counts the hit itself
+            reWriterWrapper.LoadInt64(reinterpret_cast<INT64>(probeSite));
+            reWriterWrapper.ConvI();
+            reWriterWrapper.CallNative(reinterpret_cast<const void*>(&ProfilerProbeEnter), nativeProbeSignature);
+        }
+        else if (probeSite != nullptr) {
+            // count the call so the governor can measure the method's call rate
+            reWriterWrapper.IncrementCounter(&probeSite->hits);
+        }
+
+        if (variant == ProbeVariant::Full && !nativeProbe) {
+            // load the functions first parameter on to the stack (zero is this pointer)
+            reWriterWrapper.LoadStr(testMessageToken);
 
-        // make the call to target middleware setup function / method
-        reWriterWrapper.CallMember0(consoleWriteLineMemberRef, false);
+            // make the call to target middleware setup function / method
+            reWriterWrapper.CallMember0(consoleWriteLineMemberRef, false);
+        }
 
         // finish rewriting
+        timer.Next(RewritePhase::Export);
         hr = rewriter.Export();
         RETURN_OK_IF_FAILED(hr);
 
-        if (debug) std::wcout << "Finished rewrite: " << functionInfo.type.name << "." << functionInfo.name << "\n";
+        EventPipeline::Instance()->Write(EventKind::MethodInstrumented, function_token, moduleId);
+
+        LOG_DEBUG("Finished rewrite: {}", fullName->view());
 
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::JITCompilationStarted(FunctionID functionId, BOOL fIsSafeToBlock)
     {
-        return RewriteMethod("JitRewriteTarget"_W, functionId);
+        // started before the rewrite, so the compile time includes what the profiler adds to it
+        if (JitTelemetry::Instance()->IsEnabled())
+        {
+            JitTelemetry::Instance()->OnCompilationStarted(functionId, false);
+        }
+        // selective mode instruments through ReJIT only, precompiled code never gets here
+        if (mode != ProfilerMode::Rewrite || selective)
+        {
+            return S_OK;
+        }
+        return RewriteMethod(WStr("JitRewriteTarget"), functionId);
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::JITCompilationFinished(FunctionID functionId, HRESULT hrStatus, BOOL fIsSafeToBlock)
     {
+        if (JitTelemetry::Instance()->IsEnabled())
+        {
+            JitTelemetry::Instance()->OnCompilationFinished(functionId, false);
+        }
         return S_OK;
     }
 
@@ -429,21 +775,33 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::JITInlining(FunctionID callerId, FunctionID calleeId, BOOL *pfShouldInline)
     {
+        // inlining decisions can start before SelectiveInstrumentation has, they are then left alone
+        if (SelectiveInstrumentation::Instance()->IsEnabled() &&
+            !SelectiveInstrumentation::Instance()->ShouldInline(callerId, calleeId))
+        {
+            *pfShouldInline = FALSE;
+        }
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ThreadCreated(ThreadID threadId)
     {
+        ThreadRegistry::Instance()->Add(threadId);
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ThreadDestroyed(ThreadID threadId)
     {
+        ThreadRegistry::Instance()->Remove(threadId);
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ThreadAssignedToOSThread(ThreadID managedThreadId, DWORD osThreadId)
     {
+        ThreadRegistry::Instance()->SetOSThreadId(managedThreadId, osThreadId);
+        // ThreadCreated is raised on the creating thread, this one on the OS thread that will run
+        // the managed thread
+        EventPipeline::Instance()->AttachThread();
         return S_OK;
     }
 
@@ -499,6 +857,10 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::RuntimeSuspendStarted(COR_PRF_SUSPEND_REASON suspendReason)
     {
+        if (GcTelemetry::Instance()->IsEnabled())
+        {
+            GcTelemetry::Instance()->OnSuspendStarted();
+        }
         return S_OK;
     }
 
@@ -519,6 +881,10 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::RuntimeResumeFinished()
     {
+        if (GcTelemetry::Instance()->IsEnabled())
+        {
+            GcTelemetry::Instance()->OnResumeFinished();
+        }
         return S_OK;
     }
 
@@ -539,11 +905,20 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::ObjectAllocated(ObjectID objectId, ClassID classId)
     {
+        // allocations are reported from SetEventMask on, the profiler only starts after it
+        if (AllocationProfiler::Instance()->IsEnabled())
+        {
+            AllocationProfiler::Instance()->OnObjectAllocated(objectId, classId);
+        }
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ObjectsAllocatedByClass(ULONG cClassCount, ClassID classIds[], ULONG cObjects[])
     {
+        if (AllocationProfiler::Instance()->IsEnabled())
+        {
+            AllocationProfiler::Instance()->OnObjectsAllocatedByClass(cClassCount, classIds, cObjects);
+        }
         return S_OK;
     }
 
@@ -559,11 +934,19 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::ExceptionThrown(ObjectID thrownObjectId)
     {
+        if (ExceptionTelemetry::Instance()->IsEnabled())
+        {
+            ExceptionTelemetry::Instance()->OnThrown(thrownObjectId);
+        }
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ExceptionSearchFunctionEnter(FunctionID functionId)
     {
+        if (ExceptionTelemetry::Instance()->IsEnabled())
+        {
+            ExceptionTelemetry::Instance()->OnSearchFunctionEnter(functionId);
+        }
         return S_OK;
     }
 
@@ -599,6 +982,10 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::ExceptionUnwindFunctionEnter(FunctionID functionId)
     {
+        if (ExceptionTelemetry::Instance()->IsEnabled())
+        {
+            ExceptionTelemetry::Instance()->OnUnwindFunctionEnter(functionId);
+        }
         return S_OK;
     }
 
@@ -619,6 +1006,10 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::ExceptionCatcherEnter(FunctionID functionId, ObjectID objectId)
     {
+        if (ExceptionTelemetry::Instance()->IsEnabled())
+        {
+            ExceptionTelemetry::Instance()->OnCatcherEnter(functionId);
+        }
         return S_OK;
     }
 
@@ -639,6 +1030,10 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::ExceptionCLRCatcherFound()
     {
+        if (ExceptionTelemetry::Instance()->IsEnabled())
+        {
+            ExceptionTelemetry::Instance()->OnRuntimeCatcherFound();
+        }
         return S_OK;
     }
 
@@ -654,6 +1049,10 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::GarbageCollectionStarted(int cGenerations, BOOL generationCollected[], COR_PRF_GC_REASON reason)
     {
+        if (GcTelemetry::Instance()->IsEnabled())
+        {
+            GcTelemetry::Instance()->OnGarbageCollectionStarted(cGenerations, generationCollected, reason);
+        }
         return S_OK;
     }
 
@@ -664,11 +1063,19 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::GarbageCollectionFinished()
     {
+        if (GcTelemetry::Instance()->IsEnabled())
+        {
+            GcTelemetry::Instance()->OnGarbageCollectionFinished();
+        }
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::FinalizeableObjectQueued(DWORD finalizerFlags, ObjectID objectID)
     {
+        if (GcTelemetry::Instance()->IsEnabled())
+        {
+            GcTelemetry::Instance()->OnFinalizeableObjectQueued(finalizerFlags);
+        }
         return S_OK;
     }
 
@@ -689,11 +1096,23 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::InitializeForAttach(IUnknown *pProfilerInfoUnk, void *pvClientData, UINT cbClientData)
     {
-        return S_OK;
+        // the process was not started with the profiler's environment, the attach trigger passes
+        // the settings as NAME=value lines
+        const std::string attachSettings = pvClientData == nullptr
+            ? std::string()
+            : std::string(static_cast<const char*>(pvClientData), cbClientData);
+        ProfilerConfig::Instance()->Load(attachSettings);
+        return Start(pProfilerInfoUnk, true);
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ProfilerAttachComplete()
     {
+        LOG_INFO("ProfilerAttachComplete");
+        if (attached && mode == ProfilerMode::Rewrite)
+        {
+            // reading the metadata of every loaded module takes a while, the runtime is not kept waiting
+            attachThread = std::thread(&Profiler::CatchUpLoadedModules, this);
+        }
         return S_OK;
     }
 
@@ -704,29 +1123,39 @@ namespace trace {
 
     HRESULT STDMETHODCALLTYPE Profiler::ReJITCompilationStarted(FunctionID functionId, ReJITID rejitId, BOOL fIsSafeToBlock)
     {
-        if (debug) std::wcout << "ReJITCompilationStarted: starting ..." << std::endl;
+        LOG_TRACE("ReJITCompilationStarted: starting ...");
+        if (JitTelemetry::Instance()->IsEnabled())
+        {
+            JitTelemetry::Instance()->OnCompilationStarted(functionId, true);
+        }
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::GetReJITParameters(ModuleID moduleId, mdMethodDef methodId, ICorProfilerFunctionControl *pFunctionControl)
     {
-        if (debug) std::wcout << "GetReJITParameters: starting ..." << std::endl;
+        LOG_TRACE("GetReJITParameters: starting ...");
 
         // call rewrite twice to demo the issue
-        auto hr = InnerRewrite("ReJitRewriteTarget"_W, moduleId, methodId, pFunctionControl);
-        hr = InnerRewrite("ReJitRewriteTarget"_W, moduleId, methodId, pFunctionControl);
+        auto hr = InnerRewrite(WStringView(), moduleId, methodId, pFunctionControl);
+        hr = InnerRewrite(WStringView(), moduleId, methodId, pFunctionControl);
 
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ReJITCompilationFinished(FunctionID functionId, ReJITID rejitId, HRESULT hrStatus, BOOL fIsSafeToBlock)
     {
-        if (debug) std::wcout << "ReJITCompilationFinished: starting ..." << std::endl;
+        LOG_TRACE("ReJITCompilationFinished: starting ...");
+        if (JitTelemetry::Instance()->IsEnabled())
+        {
+            JitTelemetry::Instance()->OnCompilationFinished(functionId, true);
+        }
+        EventPipeline::Instance()->Write(EventKind::MethodReJitted, functionId, rejitId);
         return S_OK;
     }
 
     HRESULT STDMETHODCALLTYPE Profiler::ReJITError(ModuleID moduleId, mdMethodDef methodId, FunctionID functionId, HRESULT hrStatus)
     {
+        LOG_WARNING("ReJITError: {}, hr: {}", Hex(methodId), Hex(hrStatus));
         return S_OK;
     }
 
@@ -765,39 +1194,201 @@ namespace trace {
         return S_OK;
     }
 
+    bool Profiler::MayDefineTarget(const ModuleMetaInfo& module, const std::vector<WSTRING>& targets)
+    {
+        CComPtr<IUnknown> metadata_interfaces;
+        auto hr = corProfilerInfo->GetModuleMetaData(module.moduleId, ofRead, IID_IMetaDataImport2, metadata_interfaces.GetAddressOf());
+        if (FAILED(hr)) {
+            return false;
+        }
+        const auto metadata_import = metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport);
+        return !metadata_import.IsNull() && MayDefineMethod(metadata_import, targets);
+    }
+
+    const MethodNameIndex* Profiler::NameIndex(ModuleMetaInfo& module)
+    {
+        CComPtr<IUnknown> metadata_interfaces;
+        auto hr = corProfilerInfo->GetModuleMetaData(module.moduleId, ofRead, IID_IMetaDataImport2, metadata_interfaces.GetAddressOf());
+        if (FAILED(hr)) {
+            return nullptr;
+        }
+        const auto metadata_import = metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport);
+        return metadata_import.IsNull() ? nullptr : module.NameIndex(metadata_import);
+    }
+
+    void Profiler::CatchUpLoadedModules()
+    {
+        // modules loaded before the attach never raised ModuleLoadFinished
+        CComPtr<ICorProfilerModuleEnum> modules;
+        HRESULT hr = corProfilerInfo->EnumModules(modules.GetAddressOf());
+        if (FAILED(hr)) {
+            LOG_ERROR("CatchUpLoadedModules: EnumModules failed: {}", Hex(hr));
+            return;
+        }
+
+        const ULONG BatchSize = 64;
+        ModuleID moduleIds[BatchSize];
+        ULONG count = 0;
+        size_t enumerated = 0;
+        do {
+            hr = modules->Next(BatchSize, moduleIds, &count);
+            if (FAILED(hr)) {
+                break;
+            }
+            // a module still loading fails here and is registered by its ModuleLoadFinished
+            for (ULONG i = 0; i < count; i++) {
+                RegisterModule(moduleIds[i]);
+            }
+            enumerated += count;
+        } while (hr == S_OK && count == BatchSize);
+
+        LOG_INFO("CatchUpLoadedModules: {} modules enumerated, result: {}", enumerated, Hex(hr));
+
+        // every target counts as new, they are all rejitted in one request; in selective mode the
+        // modules registered above are already queued for that
+        if (!selective) {
+            ApplyRejitTargets(ConfigSnapshot(), *ProfilerConfig::Instance()->Current(), ModuleStore::Instance()->Modules());
+        }
+    }
+
     HRESULT Profiler::DoRequestReJit(WSTRING functionName)
     {
-        FunctionMetaInfo* functionMetaInfo = nullptr;
-        {
-            std::lock_guard<std::mutex> guard(mapLock);
-            if (functionNameMetaInfoMap.count(functionName) > 0) {
-                functionMetaInfo = functionNameMetaInfoMap[functionName];
+        WStringView assembly;
+        WStringView name(functionName);
+        const auto separator = functionName.find('!');
+        if (separator != WSTRING::npos) {
+            assembly = WStringView(functionName.data(), separator);
+            name = WStringView(functionName.data() + separator + 1, functionName.length() - separator - 1);
+        }
+        const bool prefix = !name.empty() && name.data()[name.length() - 1] == '*';
+        if (prefix) {
+            name = WStringView(name.data(), name.length() - 1);
+        }
+
+        // GetReJITParameters only rewrites configured targets, any other method would be compiled
+        // again with its IL unchanged
+        const ConfigSnapshot* config = ProfilerConfig::Instance()->Current();
+        std::vector<ModuleID> moduleIds;
+        std::vector<mdMethodDef> methodIds;
+        size_t matched = 0;
+        for (const auto& module : ModuleStore::Instance()->Modules()) {
+            if (!assembly.empty() && module->assemblyName != assembly) {
+                continue;
+            }
+            const MethodNameIndex* index = NameIndex(*module);
+            if (index == nullptr) {
+                continue;
+            }
+            const auto range = prefix ? index->FindPrefix(name) : index->Find(name);
+            for (auto method = range.first; method != range.second; ++method) {
+                matched++;
+                if (config->IsRejitTarget(method->fullName)) {
+                    moduleIds.push_back(module->moduleId);
+                    methodIds.push_back(method->token);
+                }
             }
         }
 
-        if (functionMetaInfo == nullptr) {
-            if (debug) std::wcout << "DoRequestReJit: Didn't find required meta data: " << std::endl;
+        if (methodIds.empty()) {
+            if (matched == 0) {
+                LOG_WARNING("DoRequestReJit: Didn't find required meta data");
+            }
+            else {
+                LOG_WARNING("DoRequestReJit: none of the {} methods matching {} is in PROFILER_REJIT_TARGETS", matched, functionName);
+            }
 
             return S_OK;
         }
 
-        int numberMethods = 1;
-        ModuleID* moduleIds = new ModuleID[numberMethods] { functionMetaInfo->moduleId };
-        mdMethodDef* methodIds = new mdMethodDef[numberMethods] { functionMetaInfo->functionToken };
-        HRESULT hr = corProfilerInfo->RequestReJIT(numberMethods, moduleIds, methodIds);
+        HRESULT hr = RejitMethods(moduleIds, methodIds);
 
-        if (debug) std::wcout << "DoRequestReJit: result: " << std::hex << hr << std::dec << std::endl;
+        LOG_DEBUG("DoRequestReJit: {} methods, result: {}", methodIds.size(), Hex(hr));
 
         return S_OK;
     }
 
+    HRESULT Profiler::RejitMethods(std::vector<ModuleID>& moduleIds, std::vector<mdMethodDef>& methodIds)
+    {
+        if (selective) {
+            SelectiveInstrumentation::Instance()->Select(moduleIds, methodIds);
+        }
+        const HRESULT hr = corProfilerInfo->RequestReJIT((ULONG)methodIds.size(), moduleIds.data(), methodIds.data());
+        if (FAILED(hr)) {
+            LOG_ERROR("RequestReJIT of {} methods failed: {}", methodIds.size(), Hex(hr));
+        }
+        return hr;
+    }
+
+    HRESULT Profiler::RevertMethods(std::vector<ModuleID>& moduleIds, std::vector<mdMethodDef>& methodIds)
+    {
+        if (selective) {
+            SelectiveInstrumentation::Instance()->Deselect(moduleIds, methodIds);
+        }
+        std::vector<HRESULT> status(methodIds.size());
+        return corProfilerInfo->RequestRevert((ULONG)methodIds.size(), moduleIds.data(), methodIds.data(), status.data());
+    }
+
+    void Profiler::ApplyRejitTargets(const ConfigSnapshot& previous, const ConfigSnapshot& current,
+        const std::vector<std::shared_ptr<ModuleMetaInfo>>& modules)
+    {
+        if (previous.RejitTargets() == current.RejitTargets()) {
+            return;
+        }
+
+        // the old and new targets are looked up in the name index of every loaded module, the
+        // methods that became targets are rejitted and the ones that stopped being targets
+        // reverted, each in a single request
+        std::vector<ModuleID> rejitModules;
+        std::vector<mdMethodDef> rejitMethods;
+        std::vector<ModuleID> revertModules;
+        std::vector<mdMethodDef> revertMethods;
+        std::vector<const IndexedMethod*> candidates;
+        for (const auto& module : modules) {
+            const MethodNameIndex* index = NameIndex(*module);
+            if (index == nullptr) {
+                continue;
+            }
+            candidates.clear();
+            for (const auto& target : previous.RejitTargets()) {
+                index->FindSuffix(target, candidates);
+            }
+            for (const auto& target : current.RejitTargets()) {
+                index->FindSuffix(target, candidates);
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            for (const IndexedMethod* method : candidates) {
+                const bool was = previous.IsRejitTarget(method->fullName);
+                const bool is = current.IsRejitTarget(method->fullName);
+                if (is && !was) {
+                    rejitModules.push_back(module->moduleId);
+                    rejitMethods.push_back(method->token);
+                }
+                else if (was && !is) {
+                    revertModules.push_back(module->moduleId);
+                    revertMethods.push_back(method->token);
+                }
+            }
+        }
+
+        if (!rejitMethods.empty()) {
+            const HRESULT hr = RejitMethods(rejitModules, rejitMethods);
+            LOG_INFO("ApplyRejitTargets: RequestReJIT {} methods, result: {}", rejitMethods.size(), Hex(hr));
+        }
+        if (!revertMethods.empty()) {
+            const HRESULT hr = RevertMethods(revertModules, revertMethods);
+            LOG_INFO("ApplyRejitTargets: RequestRevert {} methods, result: {}", revertMethods.size(), Hex(hr));
+        }
+    }
+
     extern "C" __declspec(dllexport) HRESULT __cdecl RequestReJit(LPWSTR functionNameChar)
     {
-        if (debug) std::wcout << "RequestReJit: starting ... " << functionNameChar << " !" << std::endl;
+        LOG_DEBUG("RequestReJit: starting ... {} !", functionNameChar);
 
         auto profiler = Profiler::GetSingletonish();
         if (profiler == nullptr) {
-            if (debug) std::wcout << "Unable to request rejit because the profiler reference is invalid." << std::endl;
+            LOG_ERROR("Unable to request rejit because the profiler reference is invalid.");
             return E_FAIL;
         }
         WSTRING functionName(functionNameChar);
@@ -5,31 +5,54 @@
 
 #include <mutex>
 #include <atomic>
+#include <memory>
+#include <thread>
 #include <unordered_map>
 #include "cor.h"
 #include "corprof.h"
 #include "clr_helpers.h"
 #include "il_rewriter.h"
+#include "module_store.h"
+#include "native_probe.h"
+#include "overhead_governor.h"
+#include "profiler_config.h"
+#include "stack_sampler.h"
+#include "symbol_cache.h"
 
 namespace trace {
 
+    // ProfilerMode is chosen once at Initialize from PROFILER_MODE.
+    enum class ProfilerMode {
+        Rewrite,     // inject IL probes, the default
+        EnterLeave,  // enter / leave hooks, no IL rewriting
+        Sampling     // stack sampling, no IL rewriting
+    };
+
     class Profiler : public ICorProfilerCallback8
     {
     private:
         std::atomic<int> refCount;
         // this project agent support net461+ , if support net45 use IProfilerInfo4
         ICorProfilerInfo8* corProfilerInfo;
-        std::mutex mapLock;
-
-        //iLRewriteMap ,because generic method has multi functionid
-        std::unordered_map<mdMethodDef, bool> iLRewriteMap{};
 
         AssemblyProperty corAssemblyProperty{};
 
-        //moduleMetaInfoMap
-        std::unordered_map<ModuleID, ModuleMetaInfo*> moduleMetaInfoMap{};
+        // downgrades or reverts rejit instrumented methods whose probes cost too much, null when disabled
+        std::unique_ptr<OverheadGovernor> governor;
+
+        ProbeAbi probeAbi = ProbeAbi::Managed;
+
+        ProfilerMode mode = ProfilerMode::Rewrite;
+
+        // samples stacks in ProfilerMode::Sampling, null otherwise
+        std::unique_ptr<StackSampler> sampler;
 
-        std::unordered_map<WSTRING, FunctionMetaInfo*> functionNameMetaInfoMap{};
+        // set when the profiler was attached to a running process rather than loaded at startup
+        bool attached = false;
+        // PROFILER_SELECTIVE_ENABLED, precompiled code and inlining are left on
+        bool selective = false;
+        // registers the modules loaded before the attach and rejits their targets
+        std::thread attachThread;
 
     public:
         Profiler();
@@ -165,9 +188,36 @@ namespace trace {
             return count;
         }
 
-        HRESULT RewriteMethod(WSTRING targetFunction, FunctionID functionId);
-        HRESULT InnerRewrite(WSTRING targetFunction, ModuleID moduleId, mdToken function_token, ICorProfilerFunctionControl* pICorProfilerFunctionControl);
+        // Start is the part of Initialize and InitializeForAttach after the settings are loaded.
+        HRESULT Start(IUnknown* pICorProfilerInfoUnk, bool attaching);
+        // RegisterModule records a loaded module in the ModuleStore.
+        HRESULT RegisterModule(ModuleID moduleId);
+        // CatchUpLoadedModules registers the modules EnumModules reports after an attach and
+        // rejits the PROFILER_REJIT_TARGETS found in them with a single RequestReJIT.
+        void CatchUpLoadedModules();
+        HRESULT RewriteMethod(WStringView targetFunction, FunctionID functionId);
+        // InnerRewrite rewrites the method when it is named targetFunction, or with an empty
+        // targetFunction when it is one of the configured PROFILER_REJIT_TARGETS. It returns S_FALSE
+        // when the method is not a target.
+        HRESULT InnerRewrite(WStringView targetFunction, ModuleID moduleId, mdToken function_token, ICorProfilerFunctionControl* pICorProfilerFunctionControl);
+        // ApplyRejitTargets rejits the methods of the modules that are targets in current but not
+        // in previous, and reverts the ones that stopped being targets.
+        void ApplyRejitTargets(const ConfigSnapshot& previous, const ConfigSnapshot& current,
+            const std::vector<std::shared_ptr<ModuleMetaInfo>>& modules);
+        // RejitMethods and RevertMethods issue one RequestReJIT / RequestRevert; in selective mode
+        // they also update the targets kept out of inlining, and rejit the methods that inlined them.
+        HRESULT RejitMethods(std::vector<ModuleID>& moduleIds, std::vector<mdMethodDef>& methodIds);
+        HRESULT RevertMethods(std::vector<ModuleID>& moduleIds, std::vector<mdMethodDef>& methodIds);
+        // DoRequestReJit rejits the methods named "Type.Method" in every loaded module. The name may
+        // start with "Assembly!" to look in one assembly only and end with '*' to match every method
+        // whose full name starts with the rest. It only selects among the configured ReJIT targets,
+        // the methods it matches that are not targets are left alone. Methods that have not been JIT
+        // compiled yet are rejitted when they are.
         HRESULT DoRequestReJit(WSTRING functionName);
+        // MayDefineTarget checks the module's string heap for the targets' names, see MayDefineMethod.
+        bool MayDefineTarget(const ModuleMetaInfo& module, const std::vector<WSTRING>& targets);
+        // NameIndex returns the module's method name index, building it on first use.
+        const MethodNameIndex* NameIndex(ModuleMetaInfo& module);
 
         static Profiler*& GetSingletonish()
         {
@@ -0,0 +1,378 @@
+#include "allocation_profiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include "clr_helpers.h"
+#include "logger.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+#include "timing.h"
+
+namespace trace {
+
+    // ThreadAllocationState is the per thread half of the sampler: the byte budget left before the
+    // next sample and the shard samples go to. Its destructor hands the shard back when the thread
+    // exits.
+    struct ThreadAllocationState {
+        AllocationProfiler::Shard* shard = nullptr;
+        INT64 remaining = 0;
+        UINT64 random = 0;
+        bool started = false;
+        FunctionID frames[AllocationProfiler::MaxStackDepth];
+        unsigned depth = 0;
+        unsigned maxDepth = 0;
+
+        ~ThreadAllocationState() {
+            if (shard != nullptr) {
+                AllocationProfiler::Instance()->ReleaseShard(shard);
+            }
+        }
+    };
+
+    namespace {
+        thread_local ThreadAllocationState threadState;
+
+        UINT32 RoundUpToPowerOfTwo(UINT32 value) {
+            UINT32 result = 16;
+            while (result < value && result < 0x80000000) {
+                result <<= 1;
+            }
+            return result;
+        }
+
+        HRESULT STDMETHODCALLTYPE OnAllocationFrame(FunctionID functionId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo,
+            ULONG32 contextSize, BYTE context[], void* clientData)
+        {
+            auto state = static_cast<ThreadAllocationState*>(clientData);
+            if (functionId != 0) {
+                state->frames[state->depth++] = functionId;
+            }
+            return state->depth < state->maxDepth ? S_OK : S_FALSE;
+        }
+    }
+
+    AllocationSettings AllocationSettings::FromConfig(const ConfigSnapshot& config) {
+        AllocationSettings settings;
+        const auto& interval = config.Value(WStr("PROFILER_ALLOCATIONS_INTERVAL"));
+        if (!interval.empty()) {
+            settings.sampleIntervalBytes = strtoull(ToString(interval).c_str(), nullptr, 10);
+        }
+        if (settings.sampleIntervalBytes == 0) {
+            settings.sampleIntervalBytes = 1;
+        }
+        const auto& depth = config.Value(WStr("PROFILER_ALLOCATIONS_STACK_DEPTH"));
+        if (!depth.empty()) {
+            settings.stackDepth = std::min((unsigned)strtoul(ToString(depth).c_str(), nullptr, 10),
+                AllocationProfiler::MaxStackDepth);
+        }
+        const auto& tableSize = config.Value(WStr("PROFILER_ALLOCATIONS_TABLE_SIZE"));
+        if (!tableSize.empty()) {
+            settings.tableSize = (UINT32)strtoul(ToString(tableSize).c_str(), nullptr, 10);
+        }
+        settings.tableSize = RoundUpToPowerOfTwo(settings.tableSize);
+        const auto& path = config.Value(WStr("PROFILER_ALLOCATIONS_FILE"));
+        settings.path = path.empty()
+            ? "profiler_allocations_" + ToString((uint64_t)GetPID()) + ".txt"
+            : ToString(path);
+        return settings;
+    }
+
+    bool AllocationProfiler::SiteKey::operator==(const SiteKey& other) const {
+        if (classId != other.classId) {
+            return false;
+        }
+        for (unsigned i = 0; i < MaxStackDepth; i++) {
+            if (frames[i] != other.frames[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t AllocationProfiler::SiteKeyHash::operator()(const SiteKey& key) const {
+        size_t hash = std::hash<ClassID>()(key.classId);
+        for (unsigned i = 0; i < MaxStackDepth; i++) {
+            hash = hash * 31 + std::hash<FunctionID>()(key.frames[i]);
+        }
+        return hash;
+    }
+
+    AllocationProfiler::Shard::Shard(UINT32 capacity)
+        : entries_(new Entry[capacity]), mask_(capacity - 1), overflows_(0)
+    {
+        Clear();
+    }
+
+    AllocationProfiler::Shard::~Shard() {
+        delete[] entries_;
+    }
+
+    void AllocationProfiler::Shard::Record(const SiteKey& key, size_t hash, UINT64 bytes) {
+        for (UINT32 probe = 0; probe <= mask_; probe++) {
+            Entry& entry = entries_[(hash + probe) & mask_];
+            if (!entry.used.load(std::memory_order_relaxed)) {
+                entry.key = key;
+                entry.samples.store(1, std::memory_order_relaxed);
+                entry.bytes.store(bytes, std::memory_order_relaxed);
+                entry.used.store(true, std::memory_order_release);
+                return;
+            }
+            if (entry.key == key) {
+                // only this thread stores, so a load and a store stand in for an interlocked add
+                entry.samples.store(entry.samples.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                entry.bytes.store(entry.bytes.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+                return;
+            }
+        }
+        overflows_.store(overflows_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void AllocationProfiler::Shard::MergeInto(std::unordered_map<SiteKey, SiteTotals, SiteKeyHash>& totals) const {
+        for (UINT32 i = 0; i <= mask_; i++) {
+            const Entry& entry = entries_[i];
+            if (!entry.used.load(std::memory_order_acquire)) {
+                continue;
+            }
+            auto& site = totals[entry.key];
+            site.samples += entry.samples.load(std::memory_order_relaxed);
+            site.bytes += entry.bytes.load(std::memory_order_relaxed);
+        }
+    }
+
+    void AllocationProfiler::Shard::Clear() {
+        for (UINT32 i = 0; i <= mask_; i++) {
+            entries_[i].used.store(false, std::memory_order_relaxed);
+            entries_[i].samples.store(0, std::memory_order_relaxed);
+            entries_[i].bytes.store(0, std::memory_order_relaxed);
+        }
+        overflows_.store(0, std::memory_order_relaxed);
+    }
+
+    AllocationProfiler::AllocationProfiler()
+        : enabled_(false), info_(nullptr), failedSizes_(0)
+    {
+    }
+
+    AllocationProfiler::~AllocationProfiler() {
+        for (auto shard : liveShards_) {
+            delete shard;
+        }
+        for (auto shard : freeShards_) {
+            delete shard;
+        }
+    }
+
+    void AllocationProfiler::Start(ICorProfilerInfo4* info, const AllocationSettings& settings) {
+        info_ = info;
+        settings_ = settings;
+        ProfilerStats::Instance()->Register("allocations", [this](StatsWriter& writer) { WriteStats(writer); });
+        enabled_.store(true, std::memory_order_release);
+
+        LOG_INFO("AllocationProfiler: sampling every {} bytes, stack depth {}", settings_.sampleIntervalBytes, settings_.stackDepth);
+    }
+
+    UINT64 AllocationProfiler::NextInterval(UINT64& random) const {
+        // xorshift64, seeded per thread, is plenty for spacing samples
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+
+        // exponentially distributed gaps make the samples a Poisson process over allocated bytes,
+        // so every byte has the same chance of being sampled whatever the allocation pattern
+        const double uniform = ((random >> 11) + 0.5) / 9007199254740992.0;
+        const double interval = -std::log(uniform) * (double)settings_.sampleIntervalBytes;
+        return interval < 1.0 ? 1 : (UINT64)interval;
+    }
+
+    void AllocationProfiler::OnObjectAllocated(ObjectID objectId, ClassID classId) {
+        ThreadAllocationState& state = threadState;
+        if (!state.started) {
+            state.random = ReadTimestamp() ^ (UINT64)(UINT_PTR)&state;
+            if (state.random == 0) {
+                state.random = 1;
+            }
+            state.remaining = (INT64)NextInterval(state.random);
+            state.started = true;
+        }
+
+        SIZE_T size = 0;
+        if (FAILED(info_->GetObjectSize2(objectId, &size))) {
+            failedSizes_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        state.remaining -= (INT64)size;
+        if (state.remaining > 0) {
+            return;
+        }
+        state.remaining = (INT64)NextInterval(state.random);
+
+        if (state.shard == nullptr) {
+            state.shard = AttachCurrentThread();
+        }
+
+        SiteKey key = {};
+        key.classId = classId;
+        if (settings_.stackDepth > 0) {
+            state.depth = 0;
+            state.maxDepth = settings_.stackDepth;
+            // 0 walks the current thread, which is safe from inside the callback
+            info_->DoStackSnapshot(0, &OnAllocationFrame, COR_PRF_SNAPSHOT_DEFAULT, &state, nullptr, 0);
+            std::copy(state.frames, state.frames + state.depth, key.frames);
+        }
+
+        // an allocation of size s is sampled with probability 1 - exp(-s / interval), scaling by its
+        // inverse keeps the byte estimate unbiased for small and large objects alike
+        const double mean = (double)settings_.sampleIntervalBytes;
+        const double probability = 1.0 - std::exp(-(double)size / mean);
+        const UINT64 weight = probability > 0.0 ? (UINT64)((double)size / probability) : settings_.sampleIntervalBytes;
+
+        state.shard->Record(key, SiteKeyHash()(key), weight);
+    }
+
+    void AllocationProfiler::OnObjectsAllocatedByClass(ULONG classCount, ClassID classIds[], ULONG objects[]) {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (ULONG i = 0; i < classCount; i++) {
+            instances_[classIds[i]] += objects[i];
+        }
+    }
+
+    AllocationProfiler::Shard* AllocationProfiler::AttachCurrentThread() {
+        std::lock_guard<std::mutex> guard(lock_);
+        Shard* shard;
+        if (freeShards_.empty()) {
+            shard = new Shard(settings_.tableSize);
+        }
+        else {
+            shard = freeShards_.back();
+            freeShards_.pop_back();
+        }
+        liveShards_.push_back(shard);
+        return shard;
+    }
+
+    void AllocationProfiler::ReleaseShard(Shard* shard) {
+        std::lock_guard<std::mutex> guard(lock_);
+        const auto it = std::find(liveShards_.begin(), liveShards_.end(), shard);
+        if (it == liveShards_.end()) {
+            return;
+        }
+        liveShards_.erase(it);
+        shard->MergeInto(retired_);
+        retiredOverflows_ += shard->Overflows();
+        shard->Clear();
+        freeShards_.push_back(shard);
+    }
+
+    std::unordered_map<AllocationProfiler::SiteKey, AllocationProfiler::SiteTotals, AllocationProfiler::SiteKeyHash>
+        AllocationProfiler::Merge()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto totals = retired_;
+        for (auto shard : liveShards_) {
+            shard->MergeInto(totals);
+        }
+        return totals;
+    }
+
+    bool AllocationProfiler::WriteReport() {
+        if (!IsEnabled()) {
+            return false;
+        }
+
+        const auto sites = Merge();
+
+        struct Row {
+            std::string name;
+            SiteTotals totals;
+            UINT64 instances;
+        };
+
+        std::unordered_map<ClassID, Row> classes;
+        std::vector<std::pair<const SiteKey*, const SiteTotals*>> callSites;
+        for (const auto& site : sites) {
+            auto& row = classes[site.first.classId];
+            row.totals.samples += site.second.samples;
+            row.totals.bytes += site.second.bytes;
+            if (settings_.stackDepth > 0) {
+                callSites.emplace_back(&site.first, &site.second);
+            }
+        }
+
+        std::vector<Row*> rows;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            for (auto& entry : classes) {
+                const auto instances = instances_.find(entry.first);
+                entry.second.instances = instances == instances_.end() ? 0 : instances->second;
+                rows.push_back(&entry.second);
+            }
+        }
+        for (auto& entry : classes) {
+            const auto name = GetClassIdName(info_, entry.first);
+            entry.second.name = name.empty() ? "[unknown]" : ToString(name);
+        }
+        std::sort(rows.begin(), rows.end(), [](const Row* a, const Row* b) { return a->totals.bytes > b->totals.bytes; });
+
+        FILE* file = fopen(settings_.path.c_str(), "w");
+        if (file == nullptr) {
+            LOG_ERROR("AllocationProfiler: unable to open {}", settings_.path);
+            return false;
+        }
+
+        fprintf(file, "# sample interval %llu bytes, estimated bytes / samples / instances / class\n",
+            (unsigned long long)settings_.sampleIntervalBytes);
+        for (const auto row : rows) {
+            fprintf(file, "%llu\t%llu\t%llu\t%s\n", (unsigned long long)row->totals.bytes,
+                (unsigned long long)row->totals.samples, (unsigned long long)row->instances, row->name.c_str());
+        }
+
+        if (!callSites.empty()) {
+            std::sort(callSites.begin(), callSites.end(), [](const std::pair<const SiteKey*, const SiteTotals*>& a,
+                const std::pair<const SiteKey*, const SiteTotals*>& b) { return a.second->bytes > b.second->bytes; });
+
+            std::unordered_map<FunctionID, std::string> functionNames;
+            fprintf(file, "\n# call sites, estimated bytes / samples / class <- allocating frame <- caller ...\n");
+            for (const auto& site : callSites) {
+                std::string line = classes[site.first->classId].name;
+                for (unsigned i = 0; i < MaxStackDepth && site.first->frames[i] != 0; i++) {
+                    auto name = functionNames.find(site.first->frames[i]);
+                    if (name == functionNames.end()) {
+                        const auto resolved = GetFunctionIdName(info_, site.first->frames[i]);
+                        name = functionNames.emplace(site.first->frames[i], resolved.empty() ? "[unknown]" : ToString(resolved)).first;
+                    }
+                    line += " <- ";
+                    line += name->second;
+                }
+                fprintf(file, "%llu\t%llu\t%s\n", (unsigned long long)site.second->bytes,
+                    (unsigned long long)site.second->samples, line.c_str());
+            }
+        }
+
+        fclose(file);
+        return true;
+    }
+
+    void AllocationProfiler::WriteStats(StatsWriter& writer) {
+        const auto sites = Merge();
+        UINT64 samples = 0;
+        UINT64 bytes = 0;
+        for (const auto& site : sites) {
+            samples += site.second.samples;
+            bytes += site.second.bytes;
+        }
+
+        std::lock_guard<std::mutex> guard(lock_);
+        UINT64 overflows = retiredOverflows_;
+        for (auto shard : liveShards_) {
+            overflows += shard->Overflows();
+        }
+        writer.Counter("samples", samples);
+        writer.Counter("estimated_bytes", bytes);
+        writer.Counter("sites", sites.size());
+        writer.Counter("table_overflows", overflows);
+        writer.Counter("failed_sizes", failedSizes_.load(std::memory_order_relaxed));
+        writer.Counter("threads", liveShards_.size());
+    }
+}
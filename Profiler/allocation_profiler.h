@@ -0,0 +1,127 @@
+#ifndef CLR_PROFILER_ALLOCATION_PROFILER_H_
+#define CLR_PROFILER_ALLOCATION_PROFILER_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <corprof.h>
+#include "util.h"
+
+namespace trace {
+
+    class ConfigSnapshot;
+    class StatsWriter;
+
+    struct AllocationSettings {
+        // on average one allocation is sampled per this many bytes
+        UINT64 sampleIntervalBytes = 512 * 1024;
+        // managed frames recorded with each sample, 0 aggregates by class only
+        unsigned stackDepth = 0;
+        // distinct class / call site pairs each thread can hold, rounded up to a power of two
+        UINT32 tableSize = 1024;
+        std::string path;
+
+        static AllocationSettings FromConfig(const ConfigSnapshot& config);
+    };
+
+    // AllocationProfiler samples ObjectAllocated by bytes: every thread counts down a randomised
+    // byte budget and the allocation that crosses it is sampled, so large objects are picked more
+    // often than small ones in proportion to their size. Each sample is weighted so that the totals
+    // estimate the real bytes allocated per class and, with a stack depth, per call site.
+    //
+    // Samples land in a per thread open addressing table that only its owner writes. The tables are
+    // merged when a report or a stats snapshot is taken, and folded into a shared table when their
+    // thread exits.
+    class AllocationProfiler : public Singleton<AllocationProfiler> {
+        friend class Singleton<AllocationProfiler>;
+
+    public:
+        static const unsigned MaxStackDepth = 4;
+
+        void Start(ICorProfilerInfo4* info, const AllocationSettings& settings);
+        bool IsEnabled() const { return enabled_.load(std::memory_order_acquire); }
+
+        // OnObjectAllocated is called for every allocation once IsEnabled, everything but the sampled
+        // ones leaves after a size lookup and a subtraction.
+        void OnObjectAllocated(ObjectID objectId, ClassID classId);
+
+        // OnObjectsAllocatedByClass adds the exact per class instance counts the runtime reports
+        // after each collection.
+        void OnObjectsAllocatedByClass(ULONG classCount, ClassID classIds[], ULONG objects[]);
+
+        // WriteReport writes the merged estimates, largest first, to settings.path.
+        bool WriteReport();
+
+    private:
+        struct SiteKey {
+            ClassID classId;
+            FunctionID frames[MaxStackDepth];
+
+            bool operator==(const SiteKey& other) const;
+        };
+
+        struct SiteKeyHash {
+            size_t operator()(const SiteKey& key) const;
+        };
+
+        struct SiteTotals {
+            UINT64 samples = 0;
+            UINT64 bytes = 0;
+        };
+
+        // an entry is published by setting used after the key is written; the counters are only
+        // ever stored by the owning thread, readers load them relaxed
+        struct Entry {
+            std::atomic<bool> used;
+            SiteKey key;
+            std::atomic<UINT64> samples;
+            std::atomic<UINT64> bytes;
+        };
+
+        class Shard {
+        public:
+            explicit Shard(UINT32 capacity);
+            ~Shard();
+
+            void Record(const SiteKey& key, size_t hash, UINT64 bytes);
+            void MergeInto(std::unordered_map<SiteKey, SiteTotals, SiteKeyHash>& totals) const;
+            void Clear();
+
+            UINT64 Overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+        private:
+            Entry* const entries_;
+            const UINT32 mask_;
+            std::atomic<UINT64> overflows_;
+        };
+
+        AllocationProfiler();
+        ~AllocationProfiler();
+
+        Shard* AttachCurrentThread();
+        void ReleaseShard(Shard* shard);
+        std::unordered_map<SiteKey, SiteTotals, SiteKeyHash> Merge();
+        UINT64 NextInterval(UINT64& random) const;
+        void WriteStats(StatsWriter& writer);
+
+        friend struct ThreadAllocationState;
+
+        std::atomic<bool> enabled_;
+        ICorProfilerInfo4* info_;
+        AllocationSettings settings_;
+
+        // held to attach or release a shard and to merge, never by the allocation fast path
+        std::mutex lock_;
+        std::vector<Shard*> liveShards_;
+        std::vector<Shard*> freeShards_;
+        std::unordered_map<SiteKey, SiteTotals, SiteKeyHash> retired_;
+        UINT64 retiredOverflows_ = 0;
+        std::unordered_map<ClassID, UINT64> instances_;
+
+        std::atomic<UINT64> failedSizes_;
+    };
+}
+
+#endif  // CLR_PROFILER_ALLOCATION_PROFILER_H_
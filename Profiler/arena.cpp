@@ -0,0 +1,22 @@
+#include "arena.h"
+
+namespace trace {
+
+    void* Arena::Allocate(size_t bytes) {
+        bytes = (bytes + alignof(void*) - 1) & ~(alignof(void*) - 1);
+        if (bytes > left_) {
+            const size_t size = bytes > blockSize_ ? bytes : blockSize_;
+            blocks_.emplace_back(new char[size]);
+            next_ = blocks_.back().get();
+            left_ = size;
+            bytes_ += size;
+            if (blockSize_ < MaxBlockSize) {
+                blockSize_ *= 2;
+            }
+        }
+        void* result = next_;
+        next_ += bytes;
+        left_ -= bytes;
+        return result;
+    }
+}
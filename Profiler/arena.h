@@ -0,0 +1,63 @@
+#ifndef CLR_PROFILER_ARENA_H_
+#define CLR_PROFILER_ARENA_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace trace {
+
+    // Arena hands out memory from large blocks that are only freed together, when the arena is
+    // destroyed. Blocks start at initialBlockSize and double up to MaxBlockSize, so an arena that
+    // stays small stays cheap. It is not thread safe.
+    class Arena {
+    public:
+        static const size_t MaxBlockSize = 64 * 1024;
+
+        explicit Arena(size_t initialBlockSize = MaxBlockSize) : blockSize_(initialBlockSize) {}
+
+        void* Allocate(size_t bytes);
+
+        template <typename T>
+        T* AllocateArray(size_t count) {
+            return static_cast<T*>(Allocate(count * sizeof(T)));
+        }
+
+        size_t Bytes() const { return bytes_; }
+
+    private:
+        std::vector<std::unique_ptr<char[]>> blocks_;
+        size_t blockSize_;
+        char* next_ = nullptr;
+        size_t left_ = 0;
+        size_t bytes_ = 0;
+    };
+
+    // ArenaAllocator lets standard containers allocate from an Arena. Deallocation is a no-op, the
+    // memory a container lets go of while it grows is reclaimed with the arena.
+    template <typename T>
+    class ArenaAllocator {
+    public:
+        typedef T value_type;
+
+        explicit ArenaAllocator(Arena* arena) : arena_(arena) {}
+
+        template <typename U>
+        ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena()) {}
+
+        T* allocate(size_t count) { return arena_->AllocateArray<T>(count); }
+        void deallocate(T*, size_t) {}
+
+        Arena* arena() const { return arena_; }
+
+        template <typename U>
+        bool operator==(const ArenaAllocator<U>& other) const { return arena_ == other.arena(); }
+        template <typename U>
+        bool operator!=(const ArenaAllocator<U>& other) const { return arena_ != other.arena(); }
+
+    private:
+        Arena* arena_;
+    };
+}
+
+#endif  // CLR_PROFILER_ARENA_H_
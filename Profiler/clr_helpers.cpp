@@ -1,407 +1,40 @@
-/***************************************************************************************************
-*****************************                Signature                ******************************
-****************************************************************************************************
-
-Sig ::= MethodDefSig | MethodRefSig | StandAloneMethodSig | FieldSig | PropertySig | LocalVarSig
-
-MethodDefSig ::= [[HASTHIS] [EXPLICITTHIS]] (DEFAULT|VARARG|GENERIC GenParamCount) ParamCount RetType Param*
-
-MethodRefSig ::= [[HASTHIS] [EXPLICITTHIS]] VARARG ParamCount RetType Param* [SENTINEL Param+]
-
-StandAloneMethodSig ::=  [[HASTHIS] [EXPLICITTHIS]] (DEFAULT|VARARG|C|STDCALL|THISCALL|FASTCALL)
-                    ParamCount RetType Param* [SENTINEL Param+]
-
-FieldSig ::= FIELD CustomMod* Type
-
-PropertySig ::= PROPERTY [HASTHIS] ParamCount CustomMod* Type Param*
-
-LocalVarSig ::= LOCAL_SIG Count (TYPEDBYREF | ([CustomMod] [Constraint])* [BYREF] Type)+
-
-
--------------
-
-CustomMod ::= ( CMOD_OPT | CMOD_REQD ) ( TypeDefEncoded | TypeRefEncoded )
-
-Constraint ::= #define ELEMENT_TYPE_PINNED
-
-Param ::= CustomMod* ( TYPEDBYREF | [BYREF] Type )
-
-RetType ::= CustomMod* ( VOID | TYPEDBYREF | [BYREF] Type )
-
-Type ::= ( BOOLEAN | CHAR | I1 | U1 | U2 | U2 | I4 | U4 | I8 | U8 | R4 | R8 | I | U |
-                | VALUETYPE TypeDefOrRefEncoded
-                | CLASS TypeDefOrRefEncoded
-                | STRING
-                | OBJECT
-                | PTR CustomMod* VOID
-                | PTR CustomMod* Type
-                | FNPTR MethodDefSig
-                | FNPTR MethodRefSig
-                | ARRAY Type ArrayShape
-                | SZARRAY CustomMod* Type
-                | GENERICINST (CLASS | VALUETYPE) TypeDefOrRefEncoded GenArgCount Type*
-                | VAR Number
-                | MVAR Number
-
-ArrayShape ::= Rank NumSizes Size* NumLoBounds LoBound*
-
-TypeDefOrRefEncoded ::= TypeDefEncoded | TypeRefEncoded
-TypeDefEncoded ::= 32-bit-3-part-encoding-for-typedefs-and-typerefs
-TypeRefEncoded ::= 32-bit-3-part-encoding-for-typedefs-and-typerefs
-
-ParamCount ::= 29-bit-encoded-integer
-GenArgCount ::= 29-bit-encoded-integer
-Count ::= 29-bit-encoded-integer
-Rank ::= 29-bit-encoded-integer
-NumSizes ::= 29-bit-encoded-integer
-Size ::= 29-bit-encoded-integer
-NumLoBounds ::= 29-bit-encoded-integer
-LoBounds ::= 29-bit-encoded-integer
-Number ::= 29-bit-encoded-integer
-
-***************************************************************************************************/
-
 #include "clr_helpers.h"
 #include "macros.h"
-
-#undef IfFalseRetFAIL
-#define IfFalseRetFAIL(EXPR)                       \
-  do {                                        \
-    if ((EXPR) == false) return E_FAIL; \
-  } while (0)
+#include "symbol_cache.h"
+#include "type_name_formatter.h"
 
 namespace trace
 {
-    bool ParseByte(PCCOR_SIGNATURE &pbCur, PCCOR_SIGNATURE pbEnd, unsigned char *pbOut)
-    {
-        if (pbCur < pbEnd)
-        {
-            *pbOut = *pbCur;
-            pbCur++;
-            return true;
-        }
-
-        return false;
-    }
-
-    bool ParseNumber(PCCOR_SIGNATURE &pbCur, PCCOR_SIGNATURE pbEnd, unsigned *pOut)
-    {
-        // parse the variable length number format (0-4 bytes)
-
-        unsigned char b1 = 0, b2 = 0, b3 = 0, b4 = 0;
-
-        // at least one byte in the encoding, read that
-
-        if (!ParseByte(pbCur, pbEnd, &b1))
-            return false;
-
-        if (b1 == 0xff)
-        {
-            // special encoding of 'NULL'
-            // not sure what this means as a number, don't expect to see it except for string lengths
-            // which we don't encounter anyway so calling it an error
-            return false;
-        }
-
-        // early out on 1 byte encoding
-        if ((b1 & 0x80) == 0)
-        {
-            *pOut = (int)b1;
-            return true;
-        }
-
-        // now at least 2 bytes in the encoding, read 2nd byte
-        if (!ParseByte(pbCur, pbEnd, &b2))
-            return false;
-
-        // early out on 2 byte encoding
-        if ((b1 & 0x40) == 0)
-        {
-            *pOut = (((b1 & 0x3f) << 8) | b2);
-            return true;
-        }
-
-        // must be a 4 byte encoding
-
-        if ((b1 & 0x20) != 0)
-        {
-            // 4 byte encoding has this bit clear -- error if not
-            return false;
-        }
-
-        if (!ParseByte(pbCur, pbEnd, &b3))
-            return false;
-
-        if (!ParseByte(pbCur, pbEnd, &b4))
-            return false;
-
-        *pOut = ((b1 & 0x1f) << 24) | (b2 << 16) | (b3 << 8) | b4;
-        return true;
-    }
-
-
-    bool ParseTypeDefOrRefEncoded(PCCOR_SIGNATURE &pbCur, PCCOR_SIGNATURE pbEnd,
-        unsigned char *pIndexTypeOut, unsigned *pIndexOut)
-    {
-        // parse an encoded typedef or typeref
-        unsigned encoded = 0;
-
-        if (!ParseNumber(pbCur, pbEnd, &encoded))
-            return false;
-
-        *pIndexTypeOut = (unsigned char)(encoded & 0x3);
-        *pIndexOut = (encoded >> 2);
-        return true;
-    }
-
-    /*  we don't support
-        PTR CustomMod* VOID
-        PTR CustomMod* Type
-        FNPTR MethodDefSig
-        FNPTR MethodRefSig
-        ARRAY Type ArrayShape
-        CustomMod*
-     */
-    bool ParseType(PCCOR_SIGNATURE &pbCur, PCCOR_SIGNATURE pbEnd)
-    {
-        /*
-        Type ::= ( BOOLEAN | CHAR | I1 | U1 | U2 | U2 | I4 | U4 | I8 | U8 | R4 | R8 | I | U |
-        | VALUETYPE TypeDefOrRefEncoded
-        | CLASS TypeDefOrRefEncoded
-        | STRING
-        | OBJECT
-        | PTR CustomMod* VOID
-        | PTR CustomMod* Type
-        | FNPTR MethodDefSig
-        | FNPTR MethodRefSig
-        | ARRAY Type ArrayShape
-        | SZARRAY CustomMod* Type
-        | GENERICINST (CLASS | VALUETYPE) TypeDefOrRefEncoded GenArgCount Type *
-        | VAR Number
-        | MVAR Number
-
-        */
-
-        unsigned char elem_type;
-        unsigned index;
-        unsigned number;
-        unsigned char indexType;
-
-        if (!ParseByte(pbCur, pbEnd, &elem_type))
-            return false;
-
-        switch (elem_type)
-        {
-        case  ELEMENT_TYPE_BOOLEAN:
-        case  ELEMENT_TYPE_CHAR:
-        case  ELEMENT_TYPE_I1:
-        case  ELEMENT_TYPE_U1:
-        case  ELEMENT_TYPE_U2:
-        case  ELEMENT_TYPE_I2:
-        case  ELEMENT_TYPE_I4:
-        case  ELEMENT_TYPE_U4:
-        case  ELEMENT_TYPE_I8:
-        case  ELEMENT_TYPE_U8:
-        case  ELEMENT_TYPE_R4:
-        case  ELEMENT_TYPE_R8:
-        case  ELEMENT_TYPE_I:
-        case  ELEMENT_TYPE_U:
-        case  ELEMENT_TYPE_STRING:
-        case  ELEMENT_TYPE_OBJECT:
-            // simple types
-            break;
-
-        case  ELEMENT_TYPE_PTR:
-       
-           return false;
-
-        case  ELEMENT_TYPE_CLASS:
-            // CLASS TypeDefOrRefEncoded
-
-            if (!ParseTypeDefOrRefEncoded(pbCur, pbEnd, &indexType, &index))
-                return false;
-            break;
-
-        case  ELEMENT_TYPE_VALUETYPE:
-            //VALUETYPE TypeDefOrRefEncoded
-
-            if (!ParseTypeDefOrRefEncoded(pbCur, pbEnd, &indexType, &index))
-                return false;
-
-            break;
-
-        case  ELEMENT_TYPE_FNPTR:
-            // FNPTR MethodDefSig
-            // FNPTR MethodRefSig
-
-            return false;
-
-        case  ELEMENT_TYPE_ARRAY:
-            // ARRAY Type ArrayShape
-            return false;
-
-        case  ELEMENT_TYPE_SZARRAY:
-            // SZARRAY Type
-
-            if (*pbCur == ELEMENT_TYPE_CMOD_OPT || *pbCur == ELEMENT_TYPE_CMOD_REQD) {
-                return false;
-            }
-
-            if (!ParseType(pbCur, pbEnd))
-                return false;
-
-            break;
-
-        case  ELEMENT_TYPE_GENERICINST:
-            // GENERICINST (CLASS | VALUETYPE) TypeDefOrRefEncoded GenArgCount Type *
-
-            if (!ParseByte(pbCur, pbEnd, &elem_type))
-                return false;
-
-            if (elem_type != ELEMENT_TYPE_CLASS && elem_type != ELEMENT_TYPE_VALUETYPE)
-                return false;
-
-            if (!ParseTypeDefOrRefEncoded(pbCur, pbEnd, &indexType, &index))
-                return false;
-
-            if (!ParseNumber(pbCur, pbEnd, &number))
-                return false;
-
-            for (unsigned i = 0; i < number; i++)
-            {
-                if (!ParseType(pbCur, pbEnd))
-                    return false;
-            }
-
-            break;
-
-        case  ELEMENT_TYPE_VAR:
-            // VAR Number
-            if (!ParseNumber(pbCur, pbEnd, &number))
-                return false;
-
-            break;
-
-        case  ELEMENT_TYPE_MVAR:
-            // MVAR Number
-            if (!ParseNumber(pbCur, pbEnd, &number))
-                return false;
-
-            break;
+    HRESULT MethodSignature::TryParse() {
+        auto signature = std::make_shared<ParsedSignature>();
+        const HRESULT hr = DecodeMethodSignature(pbBase, len, *signature);
+        if (FAILED(hr)) {
+            return hr;
         }
-
-        return true;
+        return Load(signature);
     }
 
-    // Param ::= CustomMod* ( TYPEDBYREF | [BYREF] Type ) 
-    // CustomMod* TYPEDBYREF we don't support
-    bool ParseParam(PCCOR_SIGNATURE &pbCur, PCCOR_SIGNATURE pbEnd)
-    {
-        if (*pbCur == ELEMENT_TYPE_CMOD_OPT || *pbCur == ELEMENT_TYPE_CMOD_REQD) {
-            return false;
+    HRESULT MethodSignature::TryParse(SignatureCache& cache) {
+        auto signature = cache.Get(pbBase, len);
+        if (signature == nullptr) {
+            return E_FAIL;
         }
-
-        if (pbCur >= pbEnd)
-            return false;
-
-        if (*pbCur == ELEMENT_TYPE_TYPEDBYREF)
-        {
-            return false;
-        }
-
-        if (*pbCur == ELEMENT_TYPE_BYREF)
-        {
-            pbCur++;
-        }
-
-        if (!ParseType(pbCur, pbEnd))
-            return false;
-
-        return true;
+        return Load(signature);
     }
 
-    // RetType ::= CustomMod* ( VOID | TYPEDBYREF | [BYREF] Type ) 
-    // CustomMod* TYPEDBYREF we don't support
-    bool ParseRetType(PCCOR_SIGNATURE &pbCur, PCCOR_SIGNATURE pbEnd)
-    {
-        if (*pbCur == ELEMENT_TYPE_CMOD_OPT || *pbCur == ELEMENT_TYPE_CMOD_REQD) {
-            return false;
-        }
-
-        if (pbCur >= pbEnd)
-            return false;
+    HRESULT MethodSignature::Load(std::shared_ptr<const ParsedSignature> signature) {
+        parsed = signature;
+        numberOfTypeArguments = parsed->genericArity;
+        numberOfArguments = (ULONG)parsed->params.size();
 
-        if (*pbCur == ELEMENT_TYPE_TYPEDBYREF)
-        {
-            return false;
+        // the arguments point into the decoded copy of the blob, which lives as long as parsed
+        const PCCOR_SIGNATURE blob = parsed->blob.data();
+        ret = { parsed->ret.offset, parsed->ret.length, blob };
+        params.clear();
+        params.reserve(parsed->params.size());
+        for (const auto& param : parsed->params) {
+            params.push_back({ param.offset, param.length, blob });
         }
-
-        if (*pbCur == ELEMENT_TYPE_VOID)
-        {
-            pbCur++;
-            return true;
-        }
-
-        if (*pbCur == ELEMENT_TYPE_BYREF)
-        {
-            pbCur++;
-        }
-
-        if (!ParseType(pbCur, pbEnd))
-            return false;
-
-        return true;
-    }
-
-    HRESULT MethodSignature::TryParse() {
-
-        PCCOR_SIGNATURE pbCur = pbBase;
-        PCCOR_SIGNATURE pbEnd = pbBase + len;
-        unsigned char elem_type;
-        IfFalseRetFAIL(ParseByte(pbCur, pbEnd, &elem_type));
-        if (elem_type & IMAGE_CEE_CS_CALLCONV_GENERIC) {
-            unsigned gen_param_count;
-            IfFalseRetFAIL(ParseNumber(pbCur, pbEnd, &gen_param_count));
-            numberOfTypeArguments = gen_param_count;
-        }
-
-        unsigned param_count;
-        IfFalseRetFAIL(ParseNumber(pbCur, pbEnd, &param_count));
-        numberOfArguments = param_count;
-
-        const PCCOR_SIGNATURE pbRet = pbCur;
-
-        IfFalseRetFAIL(ParseRetType(pbCur, pbEnd));
-
-        ret.pbBase = pbBase;
-        ret.length = (ULONG)(pbCur - pbRet);
-        ret.offset = (ULONG)(pbCur - pbBase - ret.length);
-
-        auto fEncounteredSentinal = false;
-        for (unsigned i = 0; i < param_count; i++) {
-            if (pbCur >= pbEnd)
-                return E_FAIL;
-
-            if (*pbCur == ELEMENT_TYPE_SENTINEL) {
-                if (fEncounteredSentinal)
-                    return E_FAIL;
-
-                fEncounteredSentinal = true;
-                pbCur++;
-            }
-
-            const PCCOR_SIGNATURE pbParam = pbCur;
-
-            IfFalseRetFAIL(ParseParam(pbCur, pbEnd));
-
-            MethodArgument argument{};
-            argument.pbBase = pbBase;
-            argument.length = (ULONG)(pbCur - pbParam);
-            argument.offset = (ULONG)(pbCur - pbBase - argument.length);
-
-            params.push_back(argument);
-        }
-
         return S_OK;
     }
 
@@ -535,143 +168,12 @@ namespace trace
         return token;
     }
 
-    WSTRING GetSigTypeTokName(PCCOR_SIGNATURE& pbCur, const CComPtr<IMetaDataImport2>& pImport)
-    {
-        WSTRING tokenName = ""_W;
-        bool ref_flag = false;
-        if (*pbCur == ELEMENT_TYPE_BYREF)
-        {
-            pbCur++;
-            ref_flag = true;
-        }
-
-        switch (*pbCur) {
-        case  ELEMENT_TYPE_BOOLEAN:
-            tokenName = SystemBoolean;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_CHAR:
-            tokenName = SystemChar;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_I1:
-            tokenName = SystemByte;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_U1:
-            tokenName = SystemSByte;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_U2:
-            tokenName = SystemUInt16;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_I2:
-            tokenName = SystemInt16;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_I4:
-            tokenName = SystemInt32;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_U4:
-            tokenName = SystemUInt32;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_I8:
-            tokenName = SystemInt64;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_U8:
-            tokenName = SystemUInt64;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_R4:
-            tokenName = SystemSingle;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_R8:
-            tokenName = SystemDouble;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_I:
-            tokenName = SystemIntPtr;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_U:
-            tokenName = SystemUIntPtr;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_STRING:
-            tokenName = SystemString;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_OBJECT:
-            tokenName = SystemObject;
-            pbCur++;
-            break;
-        case  ELEMENT_TYPE_CLASS:
-        case  ELEMENT_TYPE_VALUETYPE:
-        {
-            pbCur++;
-            mdToken token;
-            pbCur += CorSigUncompressToken(pbCur, &token);
-            tokenName = GetTypeInfo(pImport, token).name;
-            break;
-        }
-        case  ELEMENT_TYPE_SZARRAY:
-        {
-            pbCur++;
-            tokenName = GetSigTypeTokName(pbCur, pImport) + "[]"_W;
-            break;
-        }
-        case  ELEMENT_TYPE_GENERICINST:
-        {
-            pbCur++;
-            tokenName = GetSigTypeTokName(pbCur, pImport);
-            tokenName += "["_W;
-            ULONG num = 0;
-            pbCur += CorSigUncompressData(pbCur, &num);
-            for (ULONG i = 0; i < num; i++) {
-                tokenName += GetSigTypeTokName(pbCur, pImport);
-                if (i != num - 1) {
-                    tokenName += ","_W;
-                }
-            }
-            tokenName += "]"_W;
-            break;
-        }
-        case  ELEMENT_TYPE_MVAR:
-        {
-            pbCur++;
-            ULONG num = 0;
-            pbCur += CorSigUncompressData(pbCur, &num);
-            tokenName = "!!"_W + ToWSTRING(std::to_string(num));
-            break;
-        }
-        case  ELEMENT_TYPE_VAR:
-        {
-            pbCur++;
-            ULONG num = 0;
-            pbCur += CorSigUncompressData(pbCur, &num);
-            tokenName = "!"_W + ToWSTRING(std::to_string(num));
-            break;
-        }
-        default:
-            break;
-        }
-
-        if (ref_flag) {
-            tokenName += "&"_W;
-        }
-
-        return tokenName;
-    }
-
-    WSTRING MethodArgument::GetTypeTokName(CComPtr<IMetaDataImport2>& pImport) const
+    WSTRING GetSigTypeTokName(PCCOR_SIGNATURE& pbCur, PCCOR_SIGNATURE pbEnd, const CComPtr<IMetaDataImport2>& pImport)
     {
-        PCCOR_SIGNATURE pbCur = &pbBase[offset];
-        return GetSigTypeTokName(pbCur, pImport);
+        // GetTypeInfo has no module to keep the name in, the thread's buffer at least keeps its capacity
+        static thread_local WSTRING buffer;
+        TypeNameFormatter formatter(pImport, buffer);
+        return formatter.Format(pbCur, pbEnd);
     }
 
     AssemblyInfo GetAssemblyInfo(ICorProfilerInfo3* info,
@@ -691,7 +193,7 @@ namespace trace
         mdAssembly current = mdAssemblyNil;
         auto hr = assembly_import->GetAssemblyFromScope(&current);
         if (FAILED(hr)) {
-            return ""_W;
+            return WSTRING();
         }
         WCHAR name[NameMaxSize];
         DWORD name_len = 0;
@@ -701,7 +203,7 @@ namespace trace
             name, NameMaxSize, &name_len,
             &assembly_metadata, &assembly_flags);
         if (FAILED(hr) || name_len == 0) {
-            return ""_W;
+            return WSTRING();
         }
         return WSTRING(name);
     }
@@ -716,7 +218,7 @@ namespace trace
             assembly_ref, nullptr, nullptr, name, NameMaxSize, &name_len,
             &assembly_metadata, nullptr, nullptr, &assembly_flags);
         if (FAILED(hr) || name_len == 0) {
-            return ""_W;
+            return WSTRING();
         }
         return WSTRING(name);
     }
@@ -732,8 +234,42 @@ namespace trace
         return mdAssemblyRefNil;
     }
 
+    mdAssemblyRef AssemblyRefIndex::Find(const CComPtr<IMetaDataAssemblyImport>& assembly_import,
+        const WSTRING& assembly_name) {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (!built_) {
+            Build(assembly_import);
+        }
+        const auto it = refs_.find(assembly_name);
+        return it == refs_.end() ? mdAssemblyRefNil : it->second;
+    }
+
+    void AssemblyRefIndex::Add(const WSTRING& assembly_name, mdAssemblyRef assembly_ref) {
+        std::lock_guard<std::mutex> guard(lock_);
+        refs_.emplace(assembly_name, assembly_ref);
+    }
+
+    void AssemblyRefIndex::Build(const CComPtr<IMetaDataAssemblyImport>& assembly_import) {
+        std::vector<mdAssemblyRef> assembly_refs;
+        EnumAssemblyRefs(assembly_import).CollectAll(assembly_refs);
+        refs_.reserve(refs_.size() + assembly_refs.size());
+        for (const auto assembly_ref : assembly_refs) {
+            // the first of several refs with the same name wins, as it did for FindAssemblyRef
+            refs_.emplace(GetAssemblyName(assembly_import, assembly_ref), assembly_ref);
+        }
+        built_ = true;
+    }
+
     mdAssemblyRef GetCorLibAssemblyRef(CComPtr<IUnknown>& metadata_interfaces,
-        AssemblyProperty assemblyProperty) {
+        AssemblyProperty assemblyProperty, AssemblyRefIndex& assembly_refs) {
+
+        auto assembly_import = metadata_interfaces.As<IMetaDataAssemblyImport>(IID_IMetaDataAssemblyImport);
+        if (!assembly_import.IsNull()) {
+            const mdAssemblyRef existing = assembly_refs.Find(assembly_import, assemblyProperty.szName);
+            if (existing != mdAssemblyRefNil) {
+                return existing;
+            }
+        }
 
         mdAssemblyRef assembly_ref = mdAssemblyRefNil;
         auto assembly_emit = metadata_interfaces.As<IMetaDataAssemblyEmit>(IID_IMetaDataAssemblyEmit);
@@ -742,7 +278,7 @@ namespace trace
             return assembly_ref;
         }
 
-        assembly_emit->DefineAssemblyRef(
+        const auto hr = assembly_emit->DefineAssemblyRef(
             assemblyProperty.ppbPublicKey,
             assemblyProperty.pcbPublicKey,
             assemblyProperty.szName.data(),
@@ -751,6 +287,9 @@ namespace trace
             sizeof(assemblyProperty.pulHashAlgId),
             assemblyProperty.assemblyFlags,
             &assembly_ref);
+        if (SUCCEEDED(hr)) {
+            assembly_refs.Add(assemblyProperty.szName, assembly_ref);
+        }
         return assembly_ref;
     }
 
@@ -805,7 +344,7 @@ namespace trace
                 return {};
             }
 
-            return { token, GetSigTypeTokName(signature, metadata_import) };
+            return { token, GetSigTypeTokName(signature, signature + signature_length, metadata_import) };
         } break;
         case mdtModuleRef:
             metadata_import->GetModuleRefProps(token, type_name, NameMaxSize,
@@ -873,4 +412,34 @@ namespace trace
         return { token, WSTRING(function_name), type_info,
                 MethodSignature(raw_signature,raw_signature_len) };
     }
+
+    WSTRING GetFunctionIdName(ICorProfilerInfo3* info, const FunctionID& function_id) {
+        return SymbolCache::Instance()->FunctionName(info, function_id).str();
+    }
+
+    WSTRING GetClassIdName(ICorProfilerInfo3* info, const ClassID& class_id) {
+        ModuleID module_id;
+        mdTypeDef type_def = mdTypeDefNil;
+        auto hr = info->GetClassIDInfo(class_id, &module_id, &type_def);
+        if (SUCCEEDED(hr) && type_def != mdTypeDefNil) {
+            return SymbolCache::Instance()->TypeName(info, module_id, type_def).str();
+        }
+
+        // arrays have no TypeDef of their own
+        CorElementType element_type;
+        ClassID element_class_id = 0;
+        ULONG rank = 0;
+        if (info->IsArrayClass(class_id, &element_type, &element_class_id, &rank) == S_OK) {
+            auto name = element_class_id != 0 ? GetClassIdName(info, element_class_id) : WSTRING();
+            if (name.empty()) {
+                return WSTRING();
+            }
+            name += WStr("[");
+            for (ULONG i = 1; i < rank; i++) {
+                name += WStr(",");
+            }
+            return name += WStr("]");
+        }
+        return WSTRING();
+    }
 }
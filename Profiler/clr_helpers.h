@@ -1,11 +1,15 @@
 #ifndef CLR_PROFILER_CLRHELPER_H_
 #define CLR_PROFILER_CLRHELPER_H_
 
-#include <functional>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include "string.h"  // NOLINT
 #include "util.h"
 #include "CComPtr.h"
+#include "signature_decoder.h"
 #include <corprof.h>
 
 namespace trace {
@@ -62,208 +66,182 @@ namespace trace {
     const auto SystemString = "System.String"_W;
     const auto SystemObject = "System.Object"_W;
     const auto SystemException = "System.Exception"_W;
-
-    template <typename T>
-    class EnumeratorIterator;
-
-    template <typename T>
+    const auto SystemVoid = "System.Void"_W;
+    const auto SystemTypedReference = "System.TypedReference"_W;
+
+    // Enumerator walks a metadata enumeration EnumeratorMax tokens at a time. The call that fetches
+    // a batch is the Next template parameter, a lambda around one Enum* member of Interface, so it is
+    // made directly rather than through a type-erased std::function. The single batch buffer lives
+    // in the enumerator; iterators only hold a position in it.
+    template <typename Interface, typename T, typename Next>
     class Enumerator {
-    private:
-        const std::function<HRESULT(HCORENUM*, T[], ULONG, ULONG*)> callback_;
-        const std::function<void(HCORENUM)> close_;
-        mutable HCORENUM ptr_;
-
     public:
-        Enumerator(std::function<HRESULT(HCORENUM*, T[], ULONG, ULONG*)> callback,
-            std::function<void(HCORENUM)> close)
-            : callback_(callback), close_(close), ptr_(nullptr) {}
+        class Iterator {
+        public:
+            Iterator(Enumerator* enumerator, ULONG index) : enumerator_(enumerator), index_(index) {}
 
-        Enumerator(const Enumerator& other) = default;
+            bool operator!=(const Iterator& other) const {
+                return enumerator_ != other.enumerator_ || index_ != other.index_;
+            }
 
-        Enumerator& operator=(const Enumerator& other) = default;
+            const T& operator*() const { return enumerator_->buffer_[index_]; }
 
-        ~Enumerator() { close_(ptr_); }
+            Iterator& operator++() {
+                if (++index_ == enumerator_->count_) {
+                    index_ = 0;
+                    if (!enumerator_->Fill()) {
+                        enumerator_ = nullptr;
+                    }
+                }
+                return *this;
+            }
 
-        EnumeratorIterator<T> begin() const {
-            return EnumeratorIterator<T>(this, S_OK);
-        }
+        private:
+            Enumerator* enumerator_;
+            ULONG index_;
+        };
 
-        EnumeratorIterator<T> end() const {
-            return EnumeratorIterator<T>(this, S_FALSE);
-        }
+        Enumerator(const CComPtr<Interface>& import, Next next)
+            : import_(import), next_(next), handle_(nullptr) {}
 
-        HRESULT Next(T arr[], ULONG max, ULONG* cnt) const {
-            return callback_(&ptr_, arr, max, cnt);
+        Enumerator(Enumerator&& other)
+            : import_(other.import_), next_(other.next_), handle_(other.handle_), count_(other.count_) {
+            std::copy(other.buffer_, other.buffer_ + other.count_, buffer_);
+            other.handle_ = nullptr;
         }
-    };
 
-    template <typename T>
-    class EnumeratorIterator {
-    private:
-        const Enumerator<T>* enumerator_;
-        HRESULT status_ = S_FALSE;
-        T arr_[EnumeratorMax]{};
-        ULONG idx_ = 0;
-        ULONG sz_ = 0;
+        Enumerator(const Enumerator& other) = delete;
+        Enumerator& operator=(const Enumerator& other) = delete;
 
-    public:
-        EnumeratorIterator(const Enumerator<T>* enumerator, HRESULT status)
-            : enumerator_(enumerator) {
-            if (status == S_OK) {
-                status_ = enumerator_->Next(arr_, EnumeratorMax, &sz_);
-                if (status_ == S_OK && sz_ == 0) {
-                    status_ = S_FALSE;
-                }
-            }
-            else {
-                status_ = status;
+        ~Enumerator() {
+            if (handle_ != nullptr) {
+                import_->CloseEnum(handle_);
             }
         }
 
-        bool operator!=(EnumeratorIterator const& other) const {
-            return enumerator_ != other.enumerator_ ||
-                (status_ == S_OK) != (other.status_ == S_OK);
+        Iterator begin() {
+            return Fill() ? Iterator(this, 0) : end();
         }
 
-        T const& operator*() const { return arr_[idx_]; }
+        Iterator end() {
+            return Iterator(nullptr, 0);
+        }
 
-        EnumeratorIterator<T>& operator++() {
-            if (idx_ < sz_ - 1) {
-                idx_++;
-            }
-            else {
-                idx_ = 0;
-                status_ = enumerator_->Next(arr_, EnumeratorMax, &sz_);
-                if (status_ == S_OK && sz_ == 0) {
-                    status_ = S_FALSE;
+        // CollectAll appends every remaining token to tokens, the runtime writes each batch straight
+        // into the vector's storage.
+        HRESULT CollectAll(std::vector<T>& tokens) {
+            for (;;) {
+                const size_t size = tokens.size();
+                tokens.resize(size + EnumeratorMax);
+                ULONG count = 0;
+                const HRESULT hr = next_(import_.Get(), &handle_, tokens.data() + size, EnumeratorMax, &count);
+                tokens.resize(size + (SUCCEEDED(hr) ? count : 0));
+                if (hr != S_OK || count == 0) {
+                    return FAILED(hr) ? hr : S_OK;
                 }
             }
-            return *this;
         }
+
+    private:
+        bool Fill() {
+            count_ = 0;
+            const HRESULT hr = next_(import_.Get(), &handle_, buffer_, EnumeratorMax, &count_);
+            return hr == S_OK && count_ > 0;
+        }
+
+        const CComPtr<Interface> import_;
+        const Next next_;
+        HCORENUM handle_;
+        ULONG count_ = 0;
+        T buffer_[EnumeratorMax];
     };
 
-    static Enumerator<mdTypeDef> EnumTypeDefs(
+    template <typename T, typename Interface, typename Next>
+    Enumerator<Interface, T, Next> MakeEnumerator(const CComPtr<Interface>& import, Next next) {
+        return Enumerator<Interface, T, Next>(import, next);
+    }
+
+    static auto EnumTypeDefs(
         const CComPtr<IMetaDataImport2>& metadata_import) {
-        return Enumerator<mdTypeDef>(
-            [metadata_import](HCORENUM* ptr, mdTypeDef arr[], ULONG max,
-                ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumTypeDefs(ptr, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdTypeDef>(metadata_import,
+            [](IMetaDataImport2* import, HCORENUM* ptr, mdTypeDef arr[], ULONG max, ULONG* cnt) {
+            return import->EnumTypeDefs(ptr, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdTypeRef> EnumTypeRefs(
+    static auto EnumTypeRefs(
         const CComPtr<IMetaDataImport2>& metadata_import) {
-        return Enumerator<mdTypeRef>(
-            [metadata_import](HCORENUM* ptr, mdTypeRef arr[], ULONG max,
-                ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumTypeRefs(ptr, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdTypeRef>(metadata_import,
+            [](IMetaDataImport2* import, HCORENUM* ptr, mdTypeRef arr[], ULONG max, ULONG* cnt) {
+            return import->EnumTypeRefs(ptr, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdMethodDef> EnumMethods(
+    static auto EnumMethods(
         const CComPtr<IMetaDataImport2>& metadata_import,
         const mdToken& parent_token) {
-        return Enumerator<mdMethodDef>(
-            [metadata_import, parent_token](HCORENUM* ptr, mdMethodDef arr[],
-                ULONG max, ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumMethods(ptr, parent_token, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdMethodDef>(metadata_import,
+            [parent_token](IMetaDataImport2* import, HCORENUM* ptr, mdMethodDef arr[], ULONG max, ULONG* cnt) {
+            return import->EnumMethods(ptr, parent_token, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdMemberRef> EnumMemberRefs(
+    static auto EnumMemberRefs(
         const CComPtr<IMetaDataImport2>& metadata_import,
         const mdToken& parent_token) {
-        return Enumerator<mdMemberRef>(
-            [metadata_import, parent_token](HCORENUM* ptr, mdMemberRef arr[],
-                ULONG max, ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumMemberRefs(ptr, parent_token, arr, max,
-                cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdMemberRef>(metadata_import,
+            [parent_token](IMetaDataImport2* import, HCORENUM* ptr, mdMemberRef arr[], ULONG max, ULONG* cnt) {
+            return import->EnumMemberRefs(ptr, parent_token, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdModuleRef> EnumModuleRefs(
+    static auto EnumModuleRefs(
         const CComPtr<IMetaDataImport2>& metadata_import) {
-        return Enumerator<mdModuleRef>(
-            [metadata_import](HCORENUM* ptr, mdModuleRef arr[], ULONG max,
-                ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumModuleRefs(ptr, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdModuleRef>(metadata_import,
+            [](IMetaDataImport2* import, HCORENUM* ptr, mdModuleRef arr[], ULONG max, ULONG* cnt) {
+            return import->EnumModuleRefs(ptr, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdAssemblyRef> EnumAssemblyRefs(
+    static auto EnumAssemblyRefs(
         const CComPtr<IMetaDataAssemblyImport>& assembly_import) {
-        return Enumerator<mdAssemblyRef>(
-            [assembly_import](HCORENUM* ptr, mdAssemblyRef arr[], ULONG max,
-                ULONG* cnt) -> HRESULT {
-            return assembly_import->EnumAssemblyRefs(ptr, arr, max, cnt);
-        },
-            [assembly_import](HCORENUM ptr) -> void {
-            assembly_import->CloseEnum(ptr);
+        return MakeEnumerator<mdAssemblyRef>(assembly_import,
+            [](IMetaDataAssemblyImport* import, HCORENUM* ptr, mdAssemblyRef arr[], ULONG max, ULONG* cnt) {
+            return import->EnumAssemblyRefs(ptr, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdParamDef> EnumParams(
+    static auto EnumParams(
         const CComPtr<IMetaDataImport2>& metadata_import, const mdMethodDef& mb) {
-        return Enumerator<mdParamDef>(
-            [metadata_import, mb](HCORENUM* ptr, mdParamDef arr[], ULONG max,
-                ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumParams(ptr,mb, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdParamDef>(metadata_import,
+            [mb](IMetaDataImport2* import, HCORENUM* ptr, mdParamDef arr[], ULONG max, ULONG* cnt) {
+            return import->EnumParams(ptr, mb, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdGenericParam> EnumGenericParams(
+    static auto EnumGenericParams(
         const CComPtr<IMetaDataImport2>& metadata_import, const mdMethodDef& mb) {
-        return Enumerator<mdGenericParam>(
-            [metadata_import, mb](HCORENUM* ptr, mdGenericParam arr[], ULONG max,
-                ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumGenericParams(ptr, mb, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdGenericParam>(metadata_import,
+            [mb](IMetaDataImport2* import, HCORENUM* ptr, mdGenericParam arr[], ULONG max, ULONG* cnt) {
+            return import->EnumGenericParams(ptr, mb, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdGenericParamConstraint> EnumGenericParamConstraints(
+    static auto EnumGenericParamConstraints(
         const CComPtr<IMetaDataImport2>& metadata_import, const mdGenericParam& mb) {
-        return Enumerator<mdGenericParamConstraint>(
-            [metadata_import, mb](HCORENUM* ptr, mdGenericParamConstraint arr[], ULONG max,
-                ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumGenericParamConstraints(ptr, mb, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdGenericParamConstraint>(metadata_import,
+            [mb](IMetaDataImport2* import, HCORENUM* ptr, mdGenericParamConstraint arr[], ULONG max, ULONG* cnt) {
+            return import->EnumGenericParamConstraints(ptr, mb, arr, max, cnt);
         });
     }
 
-    static Enumerator<mdToken> EnumMembersWithName(
+    static auto EnumMembersWithName(
         const CComPtr<IMetaDataImport2>& metadata_import,
         const mdToken& parent_token,
         LPCWSTR szName) {
-        return Enumerator<mdToken>(
-            [metadata_import, parent_token, szName](HCORENUM* ptr, mdMethodDef arr[],
-                ULONG max, ULONG* cnt) -> HRESULT {
-            return metadata_import->EnumMembersWithName(ptr, parent_token, szName, arr, max, cnt);
-        },
-            [metadata_import](HCORENUM ptr) -> void {
-            metadata_import->CloseEnum(ptr);
+        return MakeEnumerator<mdToken>(metadata_import,
+            [parent_token, szName](IMetaDataImport2* import, HCORENUM* ptr, mdToken arr[], ULONG max, ULONG* cnt) {
+            return import->EnumMembersWithName(ptr, parent_token, szName, arr, max, cnt);
         });
     }
 
@@ -290,26 +268,21 @@ namespace trace {
         bool is_valid() const { return id != 0; }
     };
 
-    class ModuleMetaInfo {
-    private:
+    // AssemblyRefIndex maps the assembly names a module references to their AssemblyRef tokens. It
+    // is read from metadata on the first Find and AssemblyRefs the profiler defines are added with
+    // Add, after that a lookup is one hash probe on the caller's string.
+    class AssemblyRefIndex {
     public:
-        const mdToken entryPointToken;
-        const WSTRING assemblyName;
-        ModuleMetaInfo(mdToken entry_point_token, WSTRING assembly_name)
-            : entryPointToken(entry_point_token),
-              assemblyName(assembly_name){}
+        mdAssemblyRef Find(const CComPtr<IMetaDataAssemblyImport>& assembly_import,
+            const WSTRING& assembly_name);
+        void Add(const WSTRING& assembly_name, mdAssemblyRef assembly_ref);
 
-        mdToken getTypeFromHandleToken = 0;
-    };
-
-    class FunctionMetaInfo {
     private:
-    public:
-        const ModuleID moduleId;
-        const mdToken functionToken;
-        FunctionMetaInfo(ModuleID moduleId, mdToken functionToken)
-            : moduleId(moduleId),
-            functionToken(functionToken) {}
+        void Build(const CComPtr<IMetaDataAssemblyImport>& assembly_import);
+
+        std::mutex lock_;
+        bool built_ = false;
+        std::unordered_map<WSTRING, mdAssemblyRef> refs_;
     };
 
     struct ModuleInfo {
@@ -411,7 +384,6 @@ namespace trace {
         ULONG length;
         PCCOR_SIGNATURE pbBase;
         mdToken GetTypeTok(CComPtr<IMetaDataEmit2>& pEmit, mdAssemblyRef corLibRef) const;
-        WSTRING GetTypeTokName(CComPtr<IMetaDataImport2>& pImport) const;
         int GetTypeFlags(unsigned& elementType) const;
     };
 
@@ -423,6 +395,9 @@ namespace trace {
         ULONG numberOfArguments = 0;     
         MethodArgument ret{};
         std::vector<MethodArgument> params;
+        std::shared_ptr<const ParsedSignature> parsed;
+
+        HRESULT Load(std::shared_ptr<const ParsedSignature> signature);
     public:
         MethodSignature(): pbBase(nullptr), len(0){}
         MethodSignature(PCCOR_SIGNATURE pb, unsigned cbBuffer) {
@@ -435,8 +410,15 @@ namespace trace {
         MethodArgument GetRet() const { return  ret; }
         std::vector<MethodArgument> GetMethodArguments() const { return params; }
         HRESULT TryParse();
+        // TryParse(cache) shares the decoded signature with every method of the module that has
+        // the same signature blob.
+        HRESULT TryParse(SignatureCache& cache);
+        const ParsedSignature* Parsed() const { return parsed.get(); }
         bool operator ==(const MethodSignature& other) const {
-            return memcmp(pbBase, other.pbBase, len);
+            if (parsed != nullptr && other.parsed != nullptr) {
+                return parsed->id == other.parsed->id;
+            }
+            return len == other.len && (len == 0 || memcmp(pbBase, other.pbBase, len) == 0);
         }
         CorCallingConvention CallingConvention() const {
             return CorCallingConvention(len == 0 ? 0 : pbBase[0]);
@@ -475,11 +457,21 @@ namespace trace {
     TypeInfo GetTypeInfo(const CComPtr<IMetaDataImport2>& metadata_import,
         const mdToken& token);
 
+    // GetCorLibAssemblyRef returns the module's AssemblyRef to corlib, defining one when the
+    // module has none yet.
     mdAssemblyRef GetCorLibAssemblyRef(CComPtr<IUnknown>& metadata_interfaces,
-        AssemblyProperty assemblyProperty);
+        AssemblyProperty assemblyProperty, AssemblyRefIndex& assembly_refs);
 
     FunctionInfo GetFunctionInfo(const CComPtr<IMetaDataImport2>& metadata_import,
         const mdToken& token);
+
+    // GetFunctionIdName returns "Type.Method" for a FunctionID, or an empty string
+    // when it cannot be resolved. Names come from the SymbolCache.
+    WSTRING GetFunctionIdName(ICorProfilerInfo3* info, const FunctionID& function_id);
+
+    // GetClassIdName returns the type name for a ClassID, arrays as "Element[]", or an
+    // empty string when it cannot be resolved.
+    WSTRING GetClassIdName(ICorProfilerInfo3* info, const ClassID& class_id);
 }
 
 #endif  // CLR_PROFILER_CLRHELPER_H_
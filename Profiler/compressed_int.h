@@ -0,0 +1,110 @@
+#ifndef CLR_PROFILER_COMPRESSED_INT_H_
+#define CLR_PROFILER_COMPRESSED_INT_H_
+
+#include <cstring>
+#include <corprof.h>
+
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
+
+namespace trace {
+
+    // ECMA-335 II.23.2 compressed unsigned integers: 0xxxxxxx is one byte, 10xxxxxx two and
+    // 110xxxxx four, big-endian. The top three bits of the first byte index both tables.
+    const BYTE CompressedSizes[8] = { 1, 1, 1, 1, 2, 2, 4, 0 };
+    const ULONG CompressedMasks[5] = { 0, 0x7F, 0x3FFF, 0, 0x1FFFFFFF };
+
+    inline UINT32 ReadBigEndian32(PCCOR_SIGNATURE cur) {
+        UINT32 word;
+        memcpy(&word, cur, sizeof(word));
+#if defined(_MSC_VER)
+        return _byteswap_ulong(word);
+#else
+        return __builtin_bswap32(word);
+#endif
+    }
+
+    // DecodeCompressedUnchecked decodes one value when at least four bytes are readable at cur.
+    inline bool DecodeCompressedUnchecked(PCCOR_SIGNATURE& cur, ULONG* out) {
+        const ULONG size = CompressedSizes[*cur >> 5];
+        if (size == 0) {
+            return false;
+        }
+        *out = (ReadBigEndian32(cur) >> (32 - 8 * size)) & CompressedMasks[size];
+        cur += size;
+        return true;
+    }
+
+    // DecodeCompressed decodes one value and moves cur past it, it returns false without moving
+    // cur when the value is malformed or runs past end.
+    inline bool DecodeCompressed(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, ULONG* out) {
+        if (cur >= end) {
+            return false;
+        }
+        if (end - cur >= 4) {
+            return DecodeCompressedUnchecked(cur, out);
+        }
+
+        // the last bytes of a blob, read one at a time
+        const ULONG size = CompressedSizes[*cur >> 5];
+        if (size == 0 || (ULONG)(end - cur) < size) {
+            return false;
+        }
+        ULONG value = 0;
+        for (ULONG i = 0; i < size; i++) {
+            value = (value << 8) | cur[i];
+        }
+        *out = value & CompressedMasks[size];
+        cur += size;
+        return true;
+    }
+
+    // DecodeCompressedRun decodes up to count consecutive values into out and returns how many
+    // were decoded; fewer than count means the next one is malformed or runs past end. While 16
+    // bytes remain, four values at a time are decoded without bounds checks.
+    inline ULONG DecodeCompressedRun(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, ULONG* out, ULONG count) {
+        ULONG decoded = 0;
+        while (count - decoded >= 4 && end - cur >= 16) {
+            for (ULONG i = 0; i < 4; i++, decoded++) {
+                if (!DecodeCompressedUnchecked(cur, &out[decoded])) {
+                    return decoded;
+                }
+            }
+        }
+        for (; decoded < count; decoded++) {
+            if (!DecodeCompressed(cur, end, &out[decoded])) {
+                break;
+            }
+        }
+        return decoded;
+    }
+
+    // SkipCompressedRun moves cur past count values, as in the sizes and lower bounds of an
+    // ArrayShape.
+    inline bool SkipCompressedRun(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, ULONG count) {
+        ULONG values[16];
+        while (count > 0) {
+            const ULONG batch = count < 16 ? count : 16;
+            if (DecodeCompressedRun(cur, end, values, batch) != batch) {
+                return false;
+            }
+            count -= batch;
+        }
+        return true;
+    }
+
+    // DecodeTypeDefOrRef decodes a TypeDefOrRefEncoded token: the table in the two low bits and
+    // the row above them.
+    inline bool DecodeTypeDefOrRef(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, mdToken* out) {
+        static const mdToken Tables[] = { mdtTypeDef, mdtTypeRef, mdtTypeSpec, mdtBaseType };
+        ULONG encoded;
+        if (!DecodeCompressed(cur, end, &encoded)) {
+            return false;
+        }
+        *out = Tables[encoded & 0x3] | (encoded >> 2);
+        return true;
+    }
+}
+
+#endif  // CLR_PROFILER_COMPRESSED_INT_H_
@@ -0,0 +1,184 @@
+#include "enter_leave_hooks.h"
+#include "event_buffer.h"
+#include "logger.h"
+#include "name_folding.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+
+namespace trace {
+
+    namespace {
+        const unsigned CalibrationIterations = 100000;
+
+        template <typename Body>
+        double MeasureNanosecondsPerCall(Body body) {
+            const UINT64 start = ReadTimestamp();
+            for (unsigned i = 0; i < CalibrationIterations; i++) {
+                body();
+            }
+            return TicksToNanoseconds(ReadTimestamp() - start) / CalibrationIterations;
+        }
+    }
+
+    HookFilter HookFilter::FromConfig(const ConfigSnapshot& config) {
+        HookFilter filter;
+        filter.ignoreCase_ = config.Flag(WStr("PROFILER_HOOK_FILTER_IGNORE_CASE"));
+        for (auto rule : config.Values(WStr("PROFILER_HOOK_FILTER"))) {
+            if (filter.ignoreCase_) {
+                rule = FoldName(rule);
+            }
+            if (rule.back() == '*') {
+                filter.prefixes_.push_back(rule.substr(0, rule.length() - 1));
+            }
+            else {
+                filter.exact_.emplace_back(HashSymbolName(rule), rule);
+            }
+        }
+        return filter;
+    }
+
+    bool HookFilter::Matches(const Symbol& fullName) const {
+        if (exact_.empty() && prefixes_.empty()) {
+            return true;
+        }
+        const WStringView name = fullName.View();
+        if (ignoreCase_) {
+            const WSTRING folded = FoldName(name);
+            return Matches(WStringView(folded), HashSymbolName(folded));
+        }
+        return Matches(name, fullName.Hash());
+    }
+
+    bool HookFilter::Matches(WStringView fullName, size_t hash) const {
+        for (const auto& rule : exact_) {
+            if (rule.first == hash && rule.second == fullName) {
+                return true;
+            }
+        }
+        for (const auto& prefix : prefixes_) {
+            if (prefix.length() <= fullName.length() && prefix.compare(0, prefix.length(), fullName.data(), prefix.length()) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    HRESULT EnterLeaveHooks::Install(ICorProfilerInfo4* info, const HookFilter& filter) {
+        info_ = info;
+        filter_ = filter;
+
+        auto hr = info_->SetFunctionIDMapper2(&EnterLeaveHooks::MapFunction, this);
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        hr = info_->SetEnterLeaveFunctionHooks3WithInfo(&ProfilerEnterStub, &ProfilerLeaveStub, &ProfilerTailcallStub);
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        ProfilerStats::Instance()->Register("enter_leave", [this](StatsWriter& writer) { WriteStats(writer); });
+        return S_OK;
+    }
+
+    UINT_PTR STDMETHODCALLTYPE EnterLeaveHooks::MapFunction(FunctionID functionId, void* clientData, BOOL* pbHookFunction) {
+        return static_cast<EnterLeaveHooks*>(clientData)->Map(functionId, pbHookFunction);
+    }
+
+    UINT_PTR EnterLeaveHooks::Map(FunctionID functionId, BOOL* pbHookFunction) {
+        // the mapper runs once per function, before it is first compiled
+        *pbHookFunction = FALSE;
+
+        ModuleID moduleId;
+        mdToken functionToken = mdTokenNil;
+        auto hr = info_->GetFunctionInfo(functionId, NULL, &moduleId, &functionToken);
+        if (FAILED(hr)) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+            return functionId;
+        }
+
+        const Symbol name = SymbolCache::Instance()->MethodName(info_, moduleId, functionToken);
+        if (!name.IsValid() || !filter_.Matches(name)) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+            return functionId;
+        }
+
+        ProbeSite* site = ProbeSiteTable::Instance()->GetOrAdd(moduleId, functionToken);
+        if (site == nullptr) {
+            skipped_.fetch_add(1, std::memory_order_relaxed);
+            return functionId;
+        }
+
+        LOG_DEBUG("EnterLeaveHooks: hooking {}", name.View());
+
+        hooked_.fetch_add(1, std::memory_order_relaxed);
+        *pbHookFunction = TRUE;
+        return reinterpret_cast<UINT_PTR>(site);
+    }
+
+    void EnterLeaveHooks::WriteStats(StatsWriter& writer) {
+        writer.Counter("hooked_functions", hooked_.load(std::memory_order_relaxed));
+        writer.Counter("skipped_functions", skipped_.load(std::memory_order_relaxed));
+    }
+
+    void PublishProbeCosts() {
+        // with the pipeline not running yet the probes stop before writing, so this is the cost of
+        // getting into them and counting the hit; recording adds the event write timed below
+        ProbeSite site{};
+        const double nativeProbe = MeasureNanosecondsPerCall([&site] { ProfilerProbeEnter(&site); });
+
+        // one enter and one leave per call, as the runtime would make them
+        FunctionIDOrClientID clientId;
+        clientId.clientID = reinterpret_cast<UINT_PTR>(&site);
+        const double enterLeaveHook = MeasureNanosecondsPerCall([clientId] {
+            ProfilerEnterStub(clientId, 0);
+            ProfilerLeaveStub(clientId, 0);
+        });
+
+        // the pipeline is not running yet, so the record write is timed on a private ring that is
+        // drained often enough never to fill up
+        ThreadEventBuffer buffer(0, 1024);
+        EventRecord drained[512];
+        unsigned pending = 0;
+        const double eventWrite = MeasureNanosecondsPerCall([&] {
+            buffer.TryWrite(EventKind::MethodEnter, 0, 0);
+            if (++pending == 512) {
+                buffer.Drain(drained, 512);
+                pending = 0;
+            }
+        });
+
+        LOG_INFO("PublishProbeCosts: native probe dispatch {} ns, enter/leave hook dispatch {} ns, event write {} ns",
+            nativeProbe, enterLeaveHook, eventWrite);
+
+        ProfilerStats::Instance()->Register("probe_cost", [=](StatsWriter& writer) {
+            writer.Gauge("native_probe_dispatch_ns", nativeProbe);
+            writer.Gauge("enter_leave_hook_dispatch_ns", enterLeaveHook);
+            writer.Gauge("event_write_ns", eventWrite);
+        });
+    }
+}
+
+extern "C" void ProfilerHookRecord(trace::ProbeSite* site, UINT32 kind, UINT64 timestamp) {
+    if (kind == (UINT32)trace::EventKind::MethodEnter) {
+        site->hits = site->hits + 1;
+    }
+    trace::EventPipeline::Instance()->WriteAttached((trace::EventKind)kind, site->methodDef, site->moduleId, timestamp);
+}
+
+#ifndef PROFILER_HOOK_STUBS
+extern "C" void STDMETHODCALLTYPE ProfilerEnterStub(FunctionIDOrClientID functionIdOrClientId, COR_PRF_ELT_INFO eltInfo) {
+    const UINT64 timestamp = trace::ReadTimestamp();
+    ProfilerHookRecord(reinterpret_cast<trace::ProbeSite*>(functionIdOrClientId.clientID), (UINT32)trace::EventKind::MethodEnter, timestamp);
+}
+
+extern "C" void STDMETHODCALLTYPE ProfilerLeaveStub(FunctionIDOrClientID functionIdOrClientId, COR_PRF_ELT_INFO eltInfo) {
+    const UINT64 timestamp = trace::ReadTimestamp();
+    ProfilerHookRecord(reinterpret_cast<trace::ProbeSite*>(functionIdOrClientId.clientID), (UINT32)trace::EventKind::MethodLeave, timestamp);
+}
+
+extern "C" void STDMETHODCALLTYPE ProfilerTailcallStub(FunctionIDOrClientID functionIdOrClientId, COR_PRF_ELT_INFO eltInfo) {
+    const UINT64 timestamp = trace::ReadTimestamp();
+    ProfilerHookRecord(reinterpret_cast<trace::ProbeSite*>(functionIdOrClientId.clientID), (UINT32)trace::EventKind::MethodLeave, timestamp);
+}
+#endif
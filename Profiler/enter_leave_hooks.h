@@ -0,0 +1,88 @@
+#ifndef CLR_PROFILER_ENTER_LEAVE_HOOKS_H_
+#define CLR_PROFILER_ENTER_LEAVE_HOOKS_H_
+
+#include <atomic>
+#include <utility>
+#include <vector>
+#include <corprof.h>
+#include "native_probe.h"
+#include "string.h"
+#include "symbol_cache.h"
+#include "util.h"
+
+#if defined(_M_X64)
+#define PROFILER_HOOK_STUBS 1
+#endif
+
+namespace trace {
+
+    class ConfigSnapshot;
+    class StatsWriter;
+
+    // HookFilter decides which functions get enter / leave hooks. Rules are "Namespace.Type.Method"
+    // full names, a trailing '*' makes a rule a prefix, and no rules at all matches everything.
+    // With ignoreCase, rules and names are compared after FoldName.
+    class HookFilter {
+    public:
+        // FromConfig reads the ';' separated rules from PROFILER_HOOK_FILTER, and ignoreCase
+        // from PROFILER_HOOK_FILTER_IGNORE_CASE.
+        static HookFilter FromConfig(const ConfigSnapshot& config);
+
+        bool Matches(const Symbol& fullName) const;
+
+    private:
+        bool Matches(WStringView fullName, size_t hash) const;
+
+        bool ignoreCase_ = false;
+        // exact rules with their HashSymbolName, a cached name's hash rules most of them out
+        std::vector<std::pair<size_t, WSTRING>> exact_;
+        std::vector<WSTRING> prefixes_;
+    };
+
+    // EnterLeaveHooks is the alternative to IL rewriting: the runtime calls the hook stubs on entry
+    // to and exit from every function the FunctionIDMapper2 filter selects. The mapper hands the
+    // function's ProbeSite back as client ID, so the stubs record straight into the event pipeline
+    // without any lookup.
+    class EnterLeaveHooks : public Singleton<EnterLeaveHooks> {
+        friend class Singleton<EnterLeaveHooks>;
+
+    public:
+        // Install registers the mapper and the hooks, it must be called from Initialize with
+        // COR_PRF_MONITOR_ENTERLEAVE in the event mask.
+        HRESULT Install(ICorProfilerInfo4* info, const HookFilter& filter);
+
+    private:
+        EnterLeaveHooks() : info_(nullptr), hooked_(0), skipped_(0) {}
+
+        static UINT_PTR STDMETHODCALLTYPE MapFunction(FunctionID functionId, void* clientData, BOOL* pbHookFunction);
+        UINT_PTR Map(FunctionID functionId, BOOL* pbHookFunction);
+        void WriteStats(StatsWriter& writer);
+
+        // the profiler info outlives every callback, so no reference is held
+        ICorProfilerInfo4* info_;
+        HookFilter filter_;
+        std::atomic<UINT64> hooked_;
+        std::atomic<UINT64> skipped_;
+    };
+
+    // PublishProbeCosts times the native probe, the enter / leave hook stubs and an event write in a
+    // tight loop and publishes the per call costs as the "probe_cost" stats section, so both modes
+    // can be compared from the same stats file. It runs before the event pipeline starts, so the
+    // probes are timed up to the point where they would record (the *_dispatch_ns gauges) and the
+    // record itself on its own (event_write_ns); a recorded call costs about their sum.
+    void PublishProbeCosts();
+}
+
+extern "C" {
+    // The hook stubs read the timestamp first and tail call ProfilerHookRecord. The "WithInfo" hooks
+    // are reached through the runtime's own helper, which already preserves the argument and return
+    // registers, so the stubs follow the plain C calling convention. On Windows x64 they are hand
+    // written in enter_leave_stubs_amd64.asm, elsewhere enter_leave_hooks.cpp has C++ equivalents.
+    void STDMETHODCALLTYPE ProfilerEnterStub(FunctionIDOrClientID functionIdOrClientId, COR_PRF_ELT_INFO eltInfo);
+    void STDMETHODCALLTYPE ProfilerLeaveStub(FunctionIDOrClientID functionIdOrClientId, COR_PRF_ELT_INFO eltInfo);
+    void STDMETHODCALLTYPE ProfilerTailcallStub(FunctionIDOrClientID functionIdOrClientId, COR_PRF_ELT_INFO eltInfo);
+
+    void ProfilerHookRecord(trace::ProbeSite* site, UINT32 kind, UINT64 timestamp);
+}
+
+#endif  // CLR_PROFILER_ENTER_LEAVE_HOOKS_H_
@@ -0,0 +1,30 @@
+; Enter / leave hook stubs for x64 Windows, see enter_leave_hooks.h.
+;
+; void ProfilerEnterStub(FunctionIDOrClientID rcx, COR_PRF_ELT_INFO rdx)
+;
+; rcx is the ProbeSite the FunctionIDMapper2 filter returned as client id. The timestamp is read
+; before anything else so that the stub itself is not part of the measured time, then the stub
+; tail calls ProfilerHookRecord(rcx = site, edx = kind, r8 = timestamp). The stubs never touch
+; the stack, so as leaf functions they need no unwind data.
+
+extern ProfilerHookRecord:proc
+
+HOOK_STUB macro name, kind
+name proc
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r8, rax
+    mov edx, kind
+    jmp ProfilerHookRecord
+name endp
+endm
+
+.code
+
+; the kinds are trace::EventKind::MethodEnter and trace::EventKind::MethodLeave
+HOOK_STUB ProfilerEnterStub, 1
+HOOK_STUB ProfilerLeaveStub, 2
+HOOK_STUB ProfilerTailcallStub, 2
+
+end
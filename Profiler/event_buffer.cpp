@@ -0,0 +1,262 @@
+#include "event_buffer.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "logger.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+
+namespace trace {
+
+    namespace {
+        UINT64 RoundUpToPowerOfTwo(UINT64 value) {
+            UINT64 result = 1;
+            while (result < value) {
+                result <<= 1;
+            }
+            return result;
+        }
+
+        // retires the calling thread's buffer when the thread exits
+        struct ThreadBufferOwner {
+            ThreadEventBuffer* buffer = nullptr;
+            bool attachFailed = false;
+
+            ~ThreadBufferOwner() {
+                if (buffer != nullptr) {
+                    buffer->Retire();
+                }
+            }
+        };
+
+        thread_local ThreadBufferOwner t_owner;
+    }
+
+    thread_local ThreadEventBuffer* EventPipeline::t_buffer = nullptr;
+
+    ThreadEventBuffer::ThreadEventBuffer(UINT32 index, UINT64 capacity)
+        : records_(new EventRecord[capacity]), capacity_(capacity), mask_(capacity - 1), index_(index),
+          head_(0), cachedTail_(0), dropped_(0), tail_(0), retired_(false)
+    {
+    }
+
+    ThreadEventBuffer::~ThreadEventBuffer()
+    {
+        delete[] records_;
+    }
+
+    UINT64 ThreadEventBuffer::Drain(EventRecord* out, UINT64 max)
+    {
+        const UINT64 tail = tail_.load(std::memory_order_relaxed);
+        const UINT64 head = head_.load(std::memory_order_acquire);
+        UINT64 count = head - tail;
+        if (count > max) {
+            count = max;
+        }
+        if (count == 0) {
+            return 0;
+        }
+
+        // the readable region may wrap around the end of the ring
+        const UINT64 start = tail & mask_;
+        const UINT64 first = (std::min)(count, capacity_ - start);
+        memcpy(out, &records_[start], (size_t)first * sizeof(EventRecord));
+        if (first < count) {
+            memcpy(out + first, &records_[0], (size_t)(count - first) * sizeof(EventRecord));
+        }
+
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    EventPipelineSettings EventPipelineSettings::FromConfig(const ConfigSnapshot& config)
+    {
+        EventPipelineSettings settings;
+        const auto& path = config.Value(WStr("PROFILER_EVENTS_FILE"));
+        settings.path = path.empty()
+            ? "profiler_events_" + ToString((uint64_t)GetPID()) + ".bin"
+            : ToString(path);
+        settings.bufferRecords = RoundUpToPowerOfTwo((UINT64)config.Number(WStr("PROFILER_EVENTS_BUFFER_RECORDS"), settings.bufferRecords));
+        settings.maxThreads = (UINT32)config.Number(WStr("PROFILER_EVENTS_MAX_THREADS"), settings.maxThreads);
+        settings.flushIntervalMs = (unsigned)config.Number(WStr("PROFILER_EVENTS_FLUSH_MS"), settings.flushIntervalMs);
+        if (settings.flushIntervalMs == 0) {
+            settings.flushIntervalMs = 1;
+        }
+        return settings;
+    }
+
+    EventPipeline::EventPipeline()
+        : enabled_(false), slots_(new std::atomic<ThreadEventBuffer*>[MaxThreadSlots]), slotHighWater_(0),
+          nextThreadIndex_(0), retiredWritten_(0), retiredDropped_(0), droppedNoSlot_(0), droppedUnattached_(0), bytesWritten_(0),
+          flushes_(0), file_(nullptr), batch_(new EventRecord[FlushBatchRecords]), stopping_(false)
+    {
+        for (UINT32 i = 0; i < MaxThreadSlots; i++) {
+            slots_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    EventPipeline::~EventPipeline()
+    {
+        Stop();
+        delete[] batch_;
+        // buffers still attached to live threads are deliberately leaked, the process is exiting
+        delete[] slots_;
+    }
+
+    bool EventPipeline::Start(const EventPipelineSettings& settings)
+    {
+        std::lock_guard<std::mutex> guard(threadLock_);
+        if (flusher_.joinable()) {
+            return true;
+        }
+
+        settings_ = settings;
+        if (settings_.maxThreads > MaxThreadSlots) {
+            settings_.maxThreads = MaxThreadSlots;
+        }
+
+        file_ = fopen(settings_.path.c_str(), "wb");
+        if (file_ == nullptr) {
+            LOG_ERROR("EventPipeline: unable to open {}", settings_.path);
+            return false;
+        }
+
+        EventFileHeader header{};
+        memcpy(header.magic, "PRFEVT01", sizeof(header.magic));
+        header.version = 1;
+        header.recordSize = sizeof(EventRecord);
+        header.ticksPerSecond = TimestampFrequency();
+        header.processId = (UINT64)GetPID();
+        fwrite(&header, sizeof(header), 1, file_);
+
+        ProfilerStats::Instance()->Register("events", [this](StatsWriter& writer) { WriteStats(writer); });
+
+        stopping_ = false;
+        flusher_ = std::thread(&EventPipeline::FlusherMain, this);
+        enabled_.store(true, std::memory_order_release);
+        return true;
+    }
+
+    void EventPipeline::Stop()
+    {
+        enabled_.store(false, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> guard(threadLock_);
+            stopping_ = true;
+        }
+        wakeUp_.notify_all();
+        if (flusher_.joinable()) {
+            flusher_.join();
+        }
+
+        std::lock_guard<std::mutex> guard(threadLock_);
+        if (file_ != nullptr) {
+            fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+    ThreadEventBuffer* EventPipeline::AttachCurrentThread()
+    {
+        if (t_owner.attachFailed) {
+            droppedNoSlot_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        auto buffer = new ThreadEventBuffer(nextThreadIndex_.fetch_add(1, std::memory_order_relaxed), settings_.bufferRecords);
+        for (UINT32 i = 0; i < settings_.maxThreads; i++) {
+            ThreadEventBuffer* expected = nullptr;
+            if (slots_[i].compare_exchange_strong(expected, buffer, std::memory_order_acq_rel)) {
+                UINT32 highWater = slotHighWater_.load(std::memory_order_relaxed);
+                while (highWater < i + 1 &&
+                    !slotHighWater_.compare_exchange_weak(highWater, i + 1, std::memory_order_release)) {
+                }
+                t_owner.buffer = buffer;
+                t_buffer = buffer;
+                return buffer;
+            }
+        }
+
+        // every slot is taken, this thread's events are counted as dropped from now on
+        delete buffer;
+        t_owner.attachFailed = true;
+        droppedNoSlot_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    UINT64 EventPipeline::Flush(bool final)
+    {
+        UINT64 total = 0;
+        std::lock_guard<std::mutex> guard(reclaimLock_);
+        const UINT32 highWater = slotHighWater_.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < highWater; i++) {
+            ThreadEventBuffer* buffer = slots_[i].load(std::memory_order_acquire);
+            if (buffer == nullptr) {
+                continue;
+            }
+
+            // read retired before draining, so a buffer is only freed once its last records are out
+            const bool retired = buffer->IsRetired();
+            UINT64 count;
+            while ((count = buffer->Drain(batch_, FlushBatchRecords)) > 0) {
+                if (file_ != nullptr) {
+                    fwrite(batch_, sizeof(EventRecord), (size_t)count, file_);
+                }
+                total += count;
+            }
+
+            if (retired && !final) {
+                retiredWritten_.fetch_add(buffer->Written(), std::memory_order_relaxed);
+                retiredDropped_.fetch_add(buffer->Dropped(), std::memory_order_relaxed);
+                slots_[i].store(nullptr, std::memory_order_release);
+                delete buffer;
+            }
+        }
+
+        if (total > 0 && file_ != nullptr) {
+            fflush(file_);
+        }
+        bytesWritten_.fetch_add(total * sizeof(EventRecord), std::memory_order_relaxed);
+        flushes_.fetch_add(1, std::memory_order_relaxed);
+        return total;
+    }
+
+    void EventPipeline::FlusherMain()
+    {
+        std::unique_lock<std::mutex> guard(threadLock_);
+        while (!stopping_) {
+            wakeUp_.wait_for(guard, std::chrono::milliseconds(settings_.flushIntervalMs));
+            guard.unlock();
+            Flush(false);
+            guard.lock();
+        }
+        guard.unlock();
+        Flush(true);
+    }
+
+    void EventPipeline::WriteStats(StatsWriter& writer)
+    {
+        UINT64 written = retiredWritten_.load(std::memory_order_relaxed);
+        UINT64 dropped = retiredDropped_.load(std::memory_order_relaxed);
+        UINT64 threads = 0;
+        std::lock_guard<std::mutex> guard(reclaimLock_);
+        const UINT32 highWater = slotHighWater_.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < highWater; i++) {
+            ThreadEventBuffer* buffer = slots_[i].load(std::memory_order_acquire);
+            if (buffer != nullptr) {
+                written += buffer->Written();
+                dropped += buffer->Dropped();
+                threads++;
+            }
+        }
+
+        writer.Counter("written", written);
+        writer.Counter("dropped_buffer_full", dropped);
+        writer.Counter("dropped_no_slot", droppedNoSlot_.load(std::memory_order_relaxed));
+        writer.Counter("dropped_unattached", droppedUnattached_.load(std::memory_order_relaxed));
+        writer.Counter("bytes_flushed", bytesWritten_.load(std::memory_order_relaxed));
+        writer.Counter("flushes", flushes_.load(std::memory_order_relaxed));
+        writer.Counter("active_threads", threads);
+        writer.Counter("buffer_bytes", settings_.bufferRecords * sizeof(EventRecord));
+    }
+}
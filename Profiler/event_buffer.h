@@ -0,0 +1,214 @@
+#ifndef CLR_PROFILER_EVENT_BUFFER_H_
+#define CLR_PROFILER_EVENT_BUFFER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "timing.h"
+#include "util.h"
+
+namespace trace {
+
+    class ConfigSnapshot;
+    class StatsWriter;
+
+    enum class EventKind : UINT32 {
+        None = 0,
+        MethodEnter = 1,
+        MethodLeave = 2,
+        MethodInstrumented = 3,
+        MethodReJitted = 4,
+        ProbeVariantChanged = 5,
+    };
+
+    // EventRecord is the fixed size binary record written to the event file, 32 bytes with no padding.
+    struct EventRecord {
+        UINT64 timestamp;
+        UINT64 methodId;
+        UINT32 kind;
+        UINT32 threadIndex;
+        UINT64 payload;
+    };
+
+    // EventFileHeader starts every event file, it is followed by a stream of EventRecords.
+    struct EventFileHeader {
+        char magic[8];
+        UINT32 version;
+        UINT32 recordSize;
+        double ticksPerSecond;
+        UINT64 processId;
+    };
+
+    // ThreadEventBuffer is a single producer / single consumer ring of EventRecords. The owning thread
+    // writes without locks or interlocked operations, the flusher thread drains. When the ring is
+    // full the record is dropped and counted rather than blocking the application.
+    class ThreadEventBuffer {
+    public:
+        ThreadEventBuffer(UINT32 index, UINT64 capacity);
+        ~ThreadEventBuffer();
+
+        inline bool TryWrite(EventKind kind, UINT64 methodId, UINT64 payload) {
+            return TryWrite(kind, methodId, payload, ReadTimestamp());
+        }
+
+        // this overload takes a timestamp read earlier, by the enter / leave hook stubs
+        inline bool TryWrite(EventKind kind, UINT64 methodId, UINT64 payload, UINT64 timestamp) {
+            const UINT64 head = head_.load(std::memory_order_relaxed);
+            if (head - cachedTail_ >= capacity_) {
+                cachedTail_ = tail_.load(std::memory_order_acquire);
+                if (head - cachedTail_ >= capacity_) {
+                    dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    return false;
+                }
+            }
+
+            EventRecord& record = records_[head & mask_];
+            record.timestamp = timestamp;
+            record.methodId = methodId;
+            record.kind = (UINT32)kind;
+            record.threadIndex = index_;
+            record.payload = payload;
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Drain copies up to max records into out and frees their space in the ring, flusher only.
+        UINT64 Drain(EventRecord* out, UINT64 max);
+
+        UINT64 Written() const { return head_.load(std::memory_order_relaxed); }
+        UINT64 Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+        bool IsEmpty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed); }
+
+        // Retire is called by the owning thread as it exits, the flusher frees the buffer once drained.
+        void Retire() { retired_.store(true, std::memory_order_release); }
+        bool IsRetired() const { return retired_.load(std::memory_order_acquire); }
+
+    private:
+        EventRecord* const records_;
+        const UINT64 capacity_;
+        const UINT64 mask_;
+        const UINT32 index_;
+
+        // producer and consumer state live on separate cache lines
+        BYTE padding0_[64];
+        std::atomic<UINT64> head_;
+        UINT64 cachedTail_;
+        std::atomic<UINT64> dropped_;
+        BYTE padding1_[64];
+        std::atomic<UINT64> tail_;
+        std::atomic<bool> retired_;
+    };
+
+    struct EventPipelineSettings {
+        std::string path;
+        // records per thread, rounded up to a power of two
+        UINT64 bufferRecords = 8192;
+        // threads that can own a buffer at once, memory use is bounded by maxThreads * bufferRecords * 32 bytes
+        UINT32 maxThreads = 256;
+        unsigned flushIntervalMs = 50;
+
+        static EventPipelineSettings FromConfig(const ConfigSnapshot& config);
+    };
+
+    // EventPipeline hands each application thread its own ThreadEventBuffer and runs the one
+    // background thread that drains them all into the event file.
+    class EventPipeline : public Singleton<EventPipeline> {
+        friend class Singleton<EventPipeline>;
+
+    public:
+        bool Start(const EventPipelineSettings& settings);
+        void Stop();
+
+        bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+        inline bool Write(EventKind kind, UINT64 methodId, UINT64 payload) {
+            ThreadEventBuffer* buffer = CurrentBuffer();
+            return buffer != nullptr && buffer->TryWrite(kind, methodId, payload);
+        }
+
+        inline bool Write(EventKind kind, UINT64 methodId, UINT64 payload, UINT64 timestamp) {
+            ThreadEventBuffer* buffer = CurrentBuffer();
+            return buffer != nullptr && buffer->TryWrite(kind, methodId, payload, timestamp);
+        }
+
+        // WriteAttached writes only to a ring the thread already owns and drops the record otherwise,
+        // it never allocates. The native probe and the hooks use it; their threads are attached from
+        // ThreadAssignedToOSThread, which runs on the thread itself.
+        inline bool WriteAttached(EventKind kind, UINT64 methodId, UINT64 payload) {
+            ThreadEventBuffer* buffer = AttachedBuffer();
+            return buffer != nullptr && buffer->TryWrite(kind, methodId, payload);
+        }
+
+        inline bool WriteAttached(EventKind kind, UINT64 methodId, UINT64 payload, UINT64 timestamp) {
+            ThreadEventBuffer* buffer = AttachedBuffer();
+            return buffer != nullptr && buffer->TryWrite(kind, methodId, payload, timestamp);
+        }
+
+        // AttachThread gives the calling thread its ring ahead of its first event.
+        void AttachThread() {
+            CurrentBuffer();
+        }
+
+    private:
+        EventPipeline();
+        ~EventPipeline();
+
+        static const UINT32 MaxThreadSlots = 4096;
+        static const UINT64 FlushBatchRecords = 4096;
+
+        inline ThreadEventBuffer* CurrentBuffer() {
+            if (!enabled_.load(std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            ThreadEventBuffer* buffer = t_buffer;
+            return buffer != nullptr ? buffer : AttachCurrentThread();
+        }
+
+        inline ThreadEventBuffer* AttachedBuffer() {
+            if (!enabled_.load(std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            ThreadEventBuffer* buffer = t_buffer;
+            if (buffer == nullptr) {
+                droppedUnattached_.fetch_add(1, std::memory_order_relaxed);
+            }
+            return buffer;
+        }
+
+        ThreadEventBuffer* AttachCurrentThread();
+        void FlusherMain();
+        UINT64 Flush(bool final);
+        void WriteStats(StatsWriter& writer);
+
+        static thread_local ThreadEventBuffer* t_buffer;
+
+        std::atomic<bool> enabled_;
+        EventPipelineSettings settings_;
+        std::atomic<ThreadEventBuffer*>* slots_;
+        std::atomic<UINT32> slotHighWater_;
+        std::atomic<UINT32> nextThreadIndex_;
+
+        // totals carried over from buffers that have been retired and freed
+        std::atomic<UINT64> retiredWritten_;
+        std::atomic<UINT64> retiredDropped_;
+        std::atomic<UINT64> droppedNoSlot_;
+        std::atomic<UINT64> droppedUnattached_;
+        std::atomic<UINT64> bytesWritten_;
+        std::atomic<UINT64> flushes_;
+
+        // held while buffers are freed, so stats never read a buffer being deleted
+        std::mutex reclaimLock_;
+
+        FILE* file_;
+        EventRecord* batch_;
+        std::mutex threadLock_;
+        std::condition_variable wakeUp_;
+        bool stopping_;
+        std::thread flusher_;
+    };
+}
+
+#endif  // CLR_PROFILER_EVENT_BUFFER_H_
@@ -0,0 +1,232 @@
+#include "exception_telemetry.h"
+#include <algorithm>
+#include <cstdio>
+#include "clr_helpers.h"
+#include "logger.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+#include "timing.h"
+
+namespace trace {
+
+    thread_local ExceptionTelemetry::ThreadBuffer ExceptionTelemetry::threadBuffer_;
+
+    ExceptionSettings ExceptionSettings::FromConfig(const ConfigSnapshot& config) {
+        ExceptionSettings settings;
+        const auto& path = config.Value(WStr("PROFILER_EXCEPTIONS_FILE"));
+        settings.path = path.empty()
+            ? "profiler_exceptions_" + ToString((uint64_t)GetPID()) + ".txt"
+            : ToString(path);
+        return settings;
+    }
+
+    ExceptionTelemetry::ThreadBuffer::~ThreadBuffer() {
+        if (registered) {
+            ExceptionTelemetry::Instance()->Retire(this);
+        }
+    }
+
+    ExceptionTelemetry::ExceptionTelemetry()
+        : enabled_(false), info_(nullptr), uncaught_(0)
+    {
+    }
+
+    void ExceptionTelemetry::Start(ICorProfilerInfo4* info, const ExceptionSettings& settings) {
+        info_ = info;
+        settings_ = settings;
+        ProfilerStats::Instance()->Register("exceptions", [this](StatsWriter& writer) { WriteStats(writer); });
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    ExceptionTelemetry::ThreadBuffer& ExceptionTelemetry::CurrentBuffer() {
+        ThreadBuffer& buffer = threadBuffer_;
+        if (!buffer.registered) {
+            buffer.records.reserve(ThreadBuffer::Capacity);
+            std::lock_guard<std::mutex> guard(lock_);
+            buffers_.push_back(&buffer);
+            buffer.registered = true;
+        }
+        return buffer;
+    }
+
+    void ExceptionTelemetry::OnThrown(ObjectID thrownObjectId) {
+        ThreadBuffer& buffer = CurrentBuffer();
+
+        // an exception thrown while another is in flight, from a filter or a finally, replaces it
+        if (buffer.active) {
+            Finish(buffer, false);
+        }
+
+        ClassID classId = 0;
+        info_->GetClassFromObject(thrownObjectId, &classId);
+
+        buffer.current = {};
+        buffer.current.key.classId = classId;
+        buffer.throwTimestamp = ReadTimestamp();
+        buffer.active = true;
+    }
+
+    void ExceptionTelemetry::OnSearchFunctionEnter(FunctionID functionId) {
+        ThreadBuffer& buffer = threadBuffer_;
+        if (!buffer.active) {
+            return;
+        }
+        // the search starts in the method that threw
+        if (buffer.current.searchFrames == 0) {
+            buffer.current.key.throwSite = functionId;
+        }
+        buffer.current.searchFrames++;
+    }
+
+    void ExceptionTelemetry::OnUnwindFunctionEnter(FunctionID functionId) {
+        ThreadBuffer& buffer = threadBuffer_;
+        if (buffer.active) {
+            buffer.current.unwindFrames++;
+        }
+    }
+
+    void ExceptionTelemetry::OnCatcherEnter(FunctionID functionId) {
+        ThreadBuffer& buffer = threadBuffer_;
+        if (buffer.active) {
+            Finish(buffer, true);
+        }
+    }
+
+    void ExceptionTelemetry::OnRuntimeCatcherFound() {
+        ThreadBuffer& buffer = threadBuffer_;
+        if (buffer.active) {
+            Finish(buffer, true);
+        }
+    }
+
+    void ExceptionTelemetry::Finish(ThreadBuffer& buffer, bool caught) {
+        buffer.active = false;
+        buffer.current.caught = caught;
+        if (caught) {
+            buffer.current.throwToCatchNs = (UINT64)TicksToNanoseconds(ReadTimestamp() - buffer.throwTimestamp);
+            throwToCatch_.Record(buffer.current.throwToCatchNs);
+        }
+        else {
+            uncaught_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::vector<Record> full;
+        {
+            std::lock_guard<std::mutex> guard(buffer.lock);
+            buffer.records.push_back(buffer.current);
+            if (buffer.records.size() < ThreadBuffer::Capacity) {
+                return;
+            }
+            full.reserve(ThreadBuffer::Capacity);
+            full.swap(buffer.records);
+        }
+        // merged outside the buffer lock, Merge takes the two locks the other way round
+        Flush(full);
+    }
+
+    void ExceptionTelemetry::Add(SiteTable& sites, const Record& record) {
+        auto& site = sites[record.key];
+        site.thrown++;
+        site.searchFrames += record.searchFrames;
+        site.unwindFrames += record.unwindFrames;
+        if (record.caught) {
+            site.caught++;
+            site.throwToCatchNs += record.throwToCatchNs;
+        }
+    }
+
+    void ExceptionTelemetry::Flush(std::vector<Record>& records) {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (const auto& record : records) {
+            Add(sites_, record);
+        }
+        records.clear();
+    }
+
+    void ExceptionTelemetry::Retire(ThreadBuffer* buffer) {
+        std::vector<Record> remaining;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            buffers_.erase(std::remove(buffers_.begin(), buffers_.end(), buffer), buffers_.end());
+        }
+        {
+            std::lock_guard<std::mutex> guard(buffer->lock);
+            remaining.swap(buffer->records);
+        }
+        // an exception still in flight when its thread exits was never caught
+        if (buffer->active) {
+            buffer->active = false;
+            buffer->current.caught = false;
+            remaining.push_back(buffer->current);
+            uncaught_.fetch_add(1, std::memory_order_relaxed);
+        }
+        Flush(remaining);
+    }
+
+    ExceptionTelemetry::SiteTable ExceptionTelemetry::Merge() {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (auto buffer : buffers_) {
+            std::lock_guard<std::mutex> bufferGuard(buffer->lock);
+            for (const auto& record : buffer->records) {
+                Add(sites_, record);
+            }
+            buffer->records.clear();
+        }
+        return sites_;
+    }
+
+    bool ExceptionTelemetry::WriteReport() {
+        if (!IsEnabled()) {
+            return false;
+        }
+
+        const auto sites = Merge();
+        std::vector<std::pair<SiteKey, SiteTotals>> ranked(sites.begin(), sites.end());
+        // throw-to-catch time is the cost, the count breaks ties between sites that were never caught
+        std::sort(ranked.begin(), ranked.end(), [](const std::pair<SiteKey, SiteTotals>& a, const std::pair<SiteKey, SiteTotals>& b) {
+            if (a.second.throwToCatchNs != b.second.throwToCatchNs) {
+                return a.second.throwToCatchNs > b.second.throwToCatchNs;
+            }
+            return a.second.thrown > b.second.thrown;
+        });
+
+        FILE* file = fopen(settings_.path.c_str(), "w");
+        if (file == nullptr) {
+            LOG_ERROR("ExceptionTelemetry: unable to open {}", settings_.path);
+            return false;
+        }
+
+        fprintf(file, "# total throw-to-catch us / thrown / caught / avg frames searched / avg frames unwound / type / throw site\n");
+        for (const auto& entry : ranked) {
+            const auto& totals = entry.second;
+            const auto type = GetClassIdName(info_, entry.first.classId);
+            const auto site = GetFunctionIdName(info_, entry.first.throwSite);
+            fprintf(file, "%.1f\t%llu\t%llu\t%.1f\t%.1f\t%s\t%s\n", totals.throwToCatchNs / 1000.0,
+                (unsigned long long)totals.thrown, (unsigned long long)totals.caught,
+                (double)totals.searchFrames / totals.thrown, (double)totals.unwindFrames / totals.thrown,
+                type.empty() ? "[unknown]" : ToString(type).c_str(),
+                site.empty() ? "[unknown]" : ToString(site).c_str());
+        }
+
+        fclose(file);
+        return true;
+    }
+
+    void ExceptionTelemetry::WriteStats(StatsWriter& writer) {
+        const auto sites = Merge();
+        UINT64 thrown = 0;
+        UINT64 searchFrames = 0;
+        UINT64 unwindFrames = 0;
+        for (const auto& site : sites) {
+            thrown += site.second.thrown;
+            searchFrames += site.second.searchFrames;
+            unwindFrames += site.second.unwindFrames;
+        }
+        writer.Counter("thrown", thrown);
+        writer.Counter("uncaught", uncaught_.load(std::memory_order_relaxed));
+        writer.Counter("sites", sites.size());
+        writer.Counter("frames_searched", searchFrames);
+        writer.Counter("frames_unwound", unwindFrames);
+        throwToCatch_.Write(writer, "throw_to_catch");
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef CLR_PROFILER_EXCEPTION_TELEMETRY_H_
+#define CLR_PROFILER_EXCEPTION_TELEMETRY_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <corprof.h>
+#include "hdr_histogram.h"
+#include "util.h"
+
+namespace trace {
+
+    class ConfigSnapshot;
+    class StatsWriter;
+
+    struct ExceptionSettings {
+        std::string path;
+
+        static ExceptionSettings FromConfig(const ConfigSnapshot& config);
+    };
+
+    // ExceptionTelemetry follows every first-chance exception through the exception callbacks: the
+    // thrown type from ExceptionThrown, the throwing method as the first frame searched, the frames
+    // the two passes search and unwind, and the time from the throw until a catcher runs. Each
+    // finished exception is appended to its thread's buffer, and buffers are merged into a shared
+    // table keyed by type and throw site when they fill up, when their thread exits and when a
+    // report is taken, so the callbacks never contend with one another.
+    class ExceptionTelemetry : public Singleton<ExceptionTelemetry> {
+        friend class Singleton<ExceptionTelemetry>;
+
+    public:
+        void Start(ICorProfilerInfo4* info, const ExceptionSettings& settings);
+        bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+        void OnThrown(ObjectID thrownObjectId);
+        void OnSearchFunctionEnter(FunctionID functionId);
+        void OnUnwindFunctionEnter(FunctionID functionId);
+        void OnCatcherEnter(FunctionID functionId);
+        // OnRuntimeCatcherFound is a catch inside the runtime itself, there is no managed catcher
+        void OnRuntimeCatcherFound();
+
+        // WriteReport writes every type and throw site, costliest first, to settings.path.
+        bool WriteReport();
+
+    private:
+        struct SiteKey {
+            ClassID classId;
+            FunctionID throwSite;
+
+            bool operator==(const SiteKey& other) const { return classId == other.classId && throwSite == other.throwSite; }
+        };
+
+        struct SiteKeyHash {
+            size_t operator()(const SiteKey& key) const {
+                return std::hash<ClassID>()(key.classId) * 31 + std::hash<FunctionID>()(key.throwSite);
+            }
+        };
+
+        struct Record {
+            SiteKey key;
+            UINT32 searchFrames;
+            UINT32 unwindFrames;
+            UINT64 throwToCatchNs;
+            bool caught;
+        };
+
+        struct SiteTotals {
+            UINT64 thrown = 0;
+            UINT64 caught = 0;
+            UINT64 searchFrames = 0;
+            UINT64 unwindFrames = 0;
+            UINT64 throwToCatchNs = 0;
+        };
+
+        typedef std::unordered_map<SiteKey, SiteTotals, SiteKeyHash> SiteTable;
+
+        // ThreadBuffer is one thread's exception in flight and its finished records. Only the owner
+        // appends; the lock is uncontended except while a report drains it.
+        struct ThreadBuffer {
+            static const size_t Capacity = 64;
+
+            ~ThreadBuffer();
+
+            // the exception in flight, only the owning thread reads or writes these
+            bool active = false;
+            Record current = {};
+            UINT64 throwTimestamp = 0;
+
+            std::mutex lock;
+            std::vector<Record> records;
+            bool registered = false;
+        };
+
+        static thread_local ThreadBuffer threadBuffer_;
+
+        ExceptionTelemetry();
+
+        ThreadBuffer& CurrentBuffer();
+        void Finish(ThreadBuffer& buffer, bool caught);
+        static void Add(SiteTable& sites, const Record& record);
+        void Flush(std::vector<Record>& records);
+        void Retire(ThreadBuffer* buffer);
+        SiteTable Merge();
+        void WriteStats(StatsWriter& writer);
+
+        std::atomic<bool> enabled_;
+        ICorProfilerInfo4* info_;
+        ExceptionSettings settings_;
+
+        HdrHistogram throwToCatch_;
+        std::atomic<UINT64> uncaught_;
+
+        // guards the shared table and the list of live buffers, taken only to flush or merge
+        std::mutex lock_;
+        SiteTable sites_;
+        std::vector<ThreadBuffer*> buffers_;
+    };
+}
+
+#endif  // CLR_PROFILER_EXCEPTION_TELEMETRY_H_
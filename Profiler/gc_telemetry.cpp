@@ -0,0 +1,153 @@
+#include "gc_telemetry.h"
+#include "profiler_stats.h"
+#include "timing.h"
+
+namespace trace {
+
+    namespace {
+        const char* const HeapNames[GcTelemetry::Heaps] = { "gen0", "gen1", "gen2", "loh", "poh" };
+        const char* const ReasonNames[GcTelemetry::Reasons] = { "other", "induced" };
+
+        UINT64 ElapsedNanoseconds(UINT64 start) {
+            return (UINT64)TicksToNanoseconds(ReadTimestamp() - start);
+        }
+    }
+
+    GcTelemetry::GcTelemetry()
+        : enabled_(false), info_(nullptr), finalizeable_(0), criticalFinalizeable_(0)
+    {
+        for (auto& count : gcCount_) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void GcTelemetry::Start(ICorProfilerInfo4* info) {
+        info_ = info;
+        ProfilerStats::Instance()->Register("gc", [this](StatsWriter& writer) { WriteStats(writer); });
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    void GcTelemetry::OnSuspendStarted() {
+        suspendStart_ = ReadTimestamp();
+        pauseGeneration_ = -1;
+        pauseReason_ = COR_PRF_GC_OTHER;
+    }
+
+    void GcTelemetry::OnResumeFinished() {
+        if (suspendStart_ == 0) {
+            // attached or enabled in the middle of a suspension
+            return;
+        }
+        const UINT64 elapsed = ElapsedNanoseconds(suspendStart_);
+        suspendStart_ = 0;
+
+        // suspensions for anything but a collection, and GC suspensions that were abandoned before
+        // one started, still stop the application and are kept apart
+        if (pauseGeneration_ < 0) {
+            otherSuspensions_.Record(elapsed);
+            return;
+        }
+        pauses_[pauseReason_][pauseGeneration_].Record(elapsed);
+    }
+
+    void GcTelemetry::OnGarbageCollectionStarted(int generationCount, BOOL generationCollected[], COR_PRF_GC_REASON reason) {
+        int generation = 0;
+        for (int i = 0; i < generationCount && i < Generations; i++) {
+            if (generationCollected[i]) {
+                generation = i;
+            }
+        }
+        gcCount_[generation].fetch_add(1, std::memory_order_relaxed);
+
+        // a pause is charged to the oldest generation collected in it
+        if (generation > pauseGeneration_) {
+            pauseGeneration_ = generation;
+        }
+        if (reason == COR_PRF_GC_INDUCED) {
+            pauseReason_ = COR_PRF_GC_INDUCED;
+        }
+
+        std::lock_guard<std::mutex> guard(collectionLock_);
+        if (openCount_ < MaxNesting) {
+            openGenerations_[openCount_] = generation;
+            openStarts_[openCount_] = ReadTimestamp();
+        }
+        openCount_++;
+    }
+
+    void GcTelemetry::OnGarbageCollectionFinished() {
+        {
+            std::lock_guard<std::mutex> guard(collectionLock_);
+            if (openCount_ > 0) {
+                openCount_--;
+                if (openCount_ < MaxNesting) {
+                    collections_[openGenerations_[openCount_]].Record(ElapsedNanoseconds(openStarts_[openCount_]));
+                }
+            }
+        }
+
+        CaptureGenerationBounds();
+    }
+
+    void GcTelemetry::OnFinalizeableObjectQueued(DWORD finalizerFlags) {
+        finalizeable_.fetch_add(1, std::memory_order_relaxed);
+        if (finalizerFlags & COR_PRF_FINALIZER_CRITICAL) {
+            criticalFinalizeable_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void GcTelemetry::CaptureGenerationBounds() {
+        std::lock_guard<std::mutex> guard(boundsLock_);
+
+        // the range count changes as segments come and go, so grow the buffer until it fits
+        ULONG count = 0;
+        HRESULT hr = info_->GetGenerationBounds(0, &count, nullptr);
+        if (SUCCEEDED(hr) && count > ranges_.size()) {
+            ranges_.resize(count + 8);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = info_->GetGenerationBounds((ULONG)ranges_.size(), &count, ranges_.data());
+        }
+        if (FAILED(hr) || count > ranges_.size()) {
+            failedBounds_++;
+            return;
+        }
+
+        UINT64 bytes[Heaps] = {};
+        for (ULONG i = 0; i < count; i++) {
+            const int generation = ranges_[i].generation;
+            if (generation >= 0 && generation < Heaps) {
+                bytes[generation] += ranges_[i].rangeLength;
+            }
+        }
+        for (int i = 0; i < Heaps; i++) {
+            heapBytes_[i] = bytes[i];
+            if (bytes[i] > peakHeapBytes_[i]) {
+                peakHeapBytes_[i] = bytes[i];
+            }
+        }
+    }
+
+    void GcTelemetry::WriteStats(StatsWriter& writer) {
+        for (int generation = 0; generation < Generations; generation++) {
+            const std::string gen = HeapNames[generation];
+            writer.Counter((gen + "_collections").c_str(), gcCount_[generation].load(std::memory_order_relaxed));
+            collections_[generation].Write(writer, gen + "_duration");
+            for (int reason = 0; reason < Reasons; reason++) {
+                pauses_[reason][generation].Write(writer, "pause_" + gen + "_" + ReasonNames[reason]);
+            }
+        }
+        otherSuspensions_.Write(writer, "non_gc_suspension");
+
+        writer.Counter("finalizeable_objects", finalizeable_.load(std::memory_order_relaxed));
+        writer.Counter("critical_finalizeable_objects", criticalFinalizeable_.load(std::memory_order_relaxed));
+
+        std::lock_guard<std::mutex> guard(boundsLock_);
+        for (int heap = 0; heap < Heaps; heap++) {
+            const std::string name = HeapNames[heap];
+            writer.Counter((name + "_bytes").c_str(), heapBytes_[heap]);
+            writer.Counter((name + "_peak_bytes").c_str(), peakHeapBytes_[heap]);
+        }
+        writer.Counter("failed_generation_bounds", failedBounds_);
+    }
+}
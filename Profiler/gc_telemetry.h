@@ -0,0 +1,81 @@
+#ifndef CLR_PROFILER_GC_TELEMETRY_H_
+#define CLR_PROFILER_GC_TELEMETRY_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <corprof.h>
+#include "hdr_histogram.h"
+#include "util.h"
+
+namespace trace {
+
+    class StatsWriter;
+
+    // GcTelemetry times garbage collections from the suspend, GC and resume callbacks. A pause runs
+    // from RuntimeSuspendStarted to RuntimeResumeFinished and is filed under the reason and the
+    // oldest generation of the collections made while the runtime was suspended; the collections
+    // themselves are timed from GarbageCollectionStarted to GarbageCollectionFinished, which for a
+    // background gen2 spans far more than the pause. Generation sizes are read from
+    // GetGenerationBounds at the end of every collection.
+    class GcTelemetry : public Singleton<GcTelemetry> {
+        friend class Singleton<GcTelemetry>;
+
+    public:
+        // gen0, gen1, gen2; the large and pinned object heaps are only collected with gen2
+        static const int Generations = 3;
+        // COR_PRF_GC_OTHER and COR_PRF_GC_INDUCED
+        static const int Reasons = 2;
+        // gen0, gen1, gen2, large object heap, pinned object heap
+        static const int Heaps = 5;
+
+        void Start(ICorProfilerInfo4* info);
+        bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+        void OnSuspendStarted();
+        void OnResumeFinished();
+        void OnGarbageCollectionStarted(int generationCount, BOOL generationCollected[], COR_PRF_GC_REASON reason);
+        void OnGarbageCollectionFinished();
+        void OnFinalizeableObjectQueued(DWORD finalizerFlags);
+
+    private:
+        GcTelemetry();
+
+        void CaptureGenerationBounds();
+        void WriteStats(StatsWriter& writer);
+
+        std::atomic<bool> enabled_;
+        ICorProfilerInfo4* info_;
+
+        // the runtime suspends for one thing at a time, so the pause in progress needs no lock;
+        // pauseGeneration_ is -1 until a collection starts inside it
+        UINT64 suspendStart_ = 0;
+        int pauseGeneration_ = -1;
+        int pauseReason_ = COR_PRF_GC_OTHER;
+
+        // a background gen2 stays open while ephemeral collections start and finish inside it, so
+        // collections in flight are kept as a stack; GarbageCollectionFinished closes the innermost
+        static const int MaxNesting = 4;
+        std::mutex collectionLock_;
+        int openGenerations_[MaxNesting] = {};
+        UINT64 openStarts_[MaxNesting] = {};
+        int openCount_ = 0;
+
+        HdrHistogram pauses_[Reasons][Generations];
+        HdrHistogram collections_[Generations];
+        HdrHistogram otherSuspensions_;
+
+        std::atomic<UINT64> gcCount_[Generations];
+        std::atomic<UINT64> finalizeable_;
+        std::atomic<UINT64> criticalFinalizeable_;
+
+        // only GarbageCollectionFinished writes the bounds, the lock keeps snapshots whole
+        std::mutex boundsLock_;
+        std::vector<COR_PRF_GC_GENERATION_RANGE> ranges_;
+        UINT64 heapBytes_[Heaps] = {};
+        UINT64 peakHeapBytes_[Heaps] = {};
+        UINT64 failedBounds_ = 0;
+    };
+}
+
+#endif  // CLR_PROFILER_GC_TELEMETRY_H_
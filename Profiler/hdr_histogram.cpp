@@ -0,0 +1,88 @@
+#include "hdr_histogram.h"
+#include "profiler_stats.h"
+
+namespace trace {
+
+    HdrHistogram::HdrHistogram() : count_(0), sum_(0), max_(0) {
+        for (auto& bucket : buckets_) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    unsigned HdrHistogram::IndexOf(UINT64 value) {
+        // below two sub-bucket ranges every value has a bucket of its own
+        if (value < 2 * SubBucketCount) {
+            return (unsigned)value;
+        }
+        unsigned highestBit = 0;
+        for (UINT64 v = value; v > 1; v >>= 1) {
+            highestBit++;
+        }
+        const unsigned shift = highestBit - SubBucketBits;
+        return shift * SubBucketCount + (unsigned)(value >> shift);
+    }
+
+    UINT64 HdrHistogram::HighestEquivalentValue(unsigned index) {
+        if (index < 2 * SubBucketCount) {
+            return index;
+        }
+        const unsigned shift = index / SubBucketCount - 1;
+        const UINT64 subBucket = index - shift * SubBucketCount;
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+    void HdrHistogram::Record(UINT64 nanoseconds) {
+        const UINT64 limit = (1ULL << MaxValueBits) - 1;
+        const UINT64 value = nanoseconds > limit ? limit : nanoseconds;
+
+        buckets_[IndexOf(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+
+        UINT64 max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    double HdrHistogram::Mean() const {
+        const UINT64 count = Count();
+        return count == 0 ? 0.0 : (double)sum_.load(std::memory_order_relaxed) / count;
+    }
+
+    UINT64 HdrHistogram::ValueAtPercentile(double percentile) const {
+        // counts are summed from the buckets rather than taken from count_, so a record landing
+        // mid-read cannot push the target past the end
+        UINT64 total = 0;
+        for (const auto& bucket : buckets_) {
+            total += bucket.load(std::memory_order_relaxed);
+        }
+        if (total == 0) {
+            return 0;
+        }
+
+        UINT64 target = (UINT64)(percentile / 100.0 * total + 0.5);
+        if (target == 0) {
+            target = 1;
+        }
+        UINT64 seen = 0;
+        for (unsigned i = 0; i < BucketCount; i++) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                const UINT64 value = HighestEquivalentValue(i);
+                const UINT64 max = Max();
+                return value < max ? value : max;
+            }
+        }
+        return Max();
+    }
+
+    void HdrHistogram::Write(StatsWriter& writer, const std::string& name) const {
+        writer.Counter((name + "_count").c_str(), Count());
+        writer.Gauge((name + "_mean_us").c_str(), Mean() / 1000.0);
+        writer.Gauge((name + "_p50_us").c_str(), ValueAtPercentile(50) / 1000.0);
+        writer.Gauge((name + "_p90_us").c_str(), ValueAtPercentile(90) / 1000.0);
+        writer.Gauge((name + "_p99_us").c_str(), ValueAtPercentile(99) / 1000.0);
+        writer.Gauge((name + "_p999_us").c_str(), ValueAtPercentile(99.9) / 1000.0);
+        writer.Gauge((name + "_max_us").c_str(), Max() / 1000.0);
+    }
+}
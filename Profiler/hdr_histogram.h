@@ -0,0 +1,51 @@
+#ifndef CLR_PROFILER_HDR_HISTOGRAM_H_
+#define CLR_PROFILER_HDR_HISTOGRAM_H_
+
+#include <atomic>
+#include <string>
+#include <corprof.h>
+
+namespace trace {
+
+    class StatsWriter;
+
+    // HdrHistogram is a fixed size, log-linear histogram of nanosecond durations in the spirit of
+    // HdrHistogram: every power of two is split into 64 linear sub-buckets, so any recorded value
+    // is reported within 1/64 (about 1.6%) of itself. Recording is a relaxed fetch_add on one bucket
+    // and may run concurrently from any number of threads; readers see a consistent enough view for
+    // percentiles without ever stopping writers.
+    class HdrHistogram {
+    public:
+        HdrHistogram();
+
+        void Record(UINT64 nanoseconds);
+
+        UINT64 Count() const { return count_.load(std::memory_order_relaxed); }
+        UINT64 Max() const { return max_.load(std::memory_order_relaxed); }
+        double Mean() const;
+
+        // ValueAtPercentile returns the highest value equivalent to the bucket holding the given
+        // percentile (0 to 100), or 0 when nothing was recorded.
+        UINT64 ValueAtPercentile(double percentile) const;
+
+        // Write publishes <name>_count and the mean, p50, p90, p99, p99.9 and max in microseconds.
+        void Write(StatsWriter& writer, const std::string& name) const;
+
+    private:
+        static const unsigned SubBucketBits = 6;
+        static const unsigned SubBucketCount = 1 << SubBucketBits;
+        // values are clamped to 2^40 ns, a little over 18 minutes
+        static const unsigned MaxValueBits = 40;
+        static const unsigned BucketCount = (MaxValueBits - SubBucketBits + 1) * SubBucketCount + SubBucketCount;
+
+        static unsigned IndexOf(UINT64 value);
+        static UINT64 HighestEquivalentValue(unsigned index);
+
+        std::atomic<UINT64> buckets_[BucketCount];
+        std::atomic<UINT64> count_;
+        std::atomic<UINT64> sum_;
+        std::atomic<UINT64> max_;
+    };
+}
+
+#endif  // CLR_PROFILER_HDR_HISTOGRAM_H_
@@ -125,6 +125,43 @@ void ILRewriterWrapper::LoadIND(unsigned elementType) const
     }
 }
 
+void ILRewriterWrapper::StoreIND(unsigned elementType) const
+{
+    unsigned op_code = 0;
+    switch (elementType)
+    {
+    case ELEMENT_TYPE_I1:       // fall through
+    case ELEMENT_TYPE_U1:       // fall through
+    case ELEMENT_TYPE_BOOLEAN:  op_code = CEE_STIND_I1; break;
+    case ELEMENT_TYPE_I2:       // fall through
+    case ELEMENT_TYPE_U2:       // fall through
+    case ELEMENT_TYPE_CHAR:     op_code = CEE_STIND_I2; break;
+    case ELEMENT_TYPE_I4:       // fall through
+    case ELEMENT_TYPE_U4:       op_code = CEE_STIND_I4; break;
+    case ELEMENT_TYPE_I8:       // fall through
+    case ELEMENT_TYPE_U8:       op_code = CEE_STIND_I8; break;
+    case ELEMENT_TYPE_R4:       op_code = CEE_STIND_R4; break;
+    case ELEMENT_TYPE_R8:       op_code = CEE_STIND_R8; break;
+    case ELEMENT_TYPE_PTR:      // fall through
+    case ELEMENT_TYPE_FNPTR:    // fall through
+    case ELEMENT_TYPE_I:        // fall through
+    case ELEMENT_TYPE_U:        op_code = CEE_STIND_I; break;
+    case ELEMENT_TYPE_STRING:   // fall through
+    case ELEMENT_TYPE_CLASS:    // fall through
+    case ELEMENT_TYPE_ARRAY:    // fall through
+    case ELEMENT_TYPE_SZARRAY:  // fall through
+    case ELEMENT_TYPE_OBJECT:   op_code = CEE_STIND_REF; break;
+    default:
+        break;
+    }
+
+    if (op_code > 0) {
+        ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
+        pNewInstr->m_opcode = op_code;
+        m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+    }
+}
+
 void ILRewriterWrapper::LoadToken(mdToken token) const
 {
     ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
@@ -227,6 +264,35 @@ void ILRewriterWrapper::Duplicate() const {
   m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
 }
 
+void ILRewriterWrapper::Add() const {
+  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
+  pNewInstr->m_opcode = CEE_ADD;
+  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+}
+
+void ILRewriterWrapper::ConvU() const {
+  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
+  pNewInstr->m_opcode = CEE_CONV_U;
+  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+}
+
+void ILRewriterWrapper::ConvI() const {
+  ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
+  pNewInstr->m_opcode = CEE_CONV_I;
+  m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+}
+
+void ILRewriterWrapper::IncrementCounter(volatile INT64* counter) const {
+  // *counter = *counter + 1, the address is baked into the IL as a native int
+  LoadInt64(reinterpret_cast<INT64>(counter));
+  ConvU();
+  Duplicate();
+  LoadIND(ELEMENT_TYPE_I8);
+  LoadInt64(1);
+  Add();
+  StoreIND(ELEMENT_TYPE_I8);
+}
+
 void ILRewriterWrapper::BeginLoadValueIntoArray(const INT32 arrayIndex) const {
   // duplicate the array reference
   Duplicate();
@@ -272,3 +338,20 @@ ILInstr* ILRewriterWrapper::CallMember0(const mdMemberRef& member_ref, bool is_v
     m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
     return pNewInstr;
 }
+
+ILInstr* ILRewriterWrapper::CallIndirect(mdSignature signature) const
+{
+    ILInstr* pNewInstr = m_ILRewriter->NewILInstr();
+    pNewInstr->m_opcode = CEE_CALLI;
+    pNewInstr->m_Arg32 = signature;
+    m_ILRewriter->InsertBefore(m_ILInstr, pNewInstr);
+    return pNewInstr;
+}
+
+void ILRewriterWrapper::CallNative(const void* function, mdSignature signature) const
+{
+    // the arguments are already on the stack, the target address is baked into the IL as a native int
+    LoadInt64(reinterpret_cast<INT64>(function));
+    ConvI();
+    CallIndirect(signature);
+}
@@ -21,6 +21,7 @@ class ILRewriterWrapper {
   void LoadInt32(INT32 value) const;
   void LoadArgument(UINT16 index) const;
   void LoadIND(unsigned elementType) const;
+  void StoreIND(unsigned elementType) const;
   void LoadToken(mdToken token) const;
   void StLocal(unsigned index) const;
   void LoadLocal(unsigned index) const;
@@ -30,12 +31,18 @@ class ILRewriterWrapper {
   void CreateArray(mdTypeRef type_ref, INT32 size) const;
   void CallMember(const mdMemberRef& member_ref, bool is_virtual) const;
   void Duplicate() const;
+  void Add() const;
+  void ConvU() const;
+  void ConvI() const;
+  void IncrementCounter(volatile INT64* counter) const;
   void BeginLoadValueIntoArray(INT32 arrayIndex) const;
   void EndLoadValueIntoArray() const;
   void Return() const;
   ILInstr* Rethrow() const;
   ILInstr* EndFinally() const;
   ILInstr* CallMember0(const mdMemberRef& member_ref, bool is_virtual) const;
+  ILInstr* CallIndirect(mdSignature signature) const;
+  void CallNative(const void* function, mdSignature signature) const;
 };
 
 #endif  // CLR_PROFILER_IL_REWRITER_WRAPPER_H_
@@ -0,0 +1,200 @@
+#include "jit_telemetry.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include "clr_helpers.h"
+#include "logger.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+#include "timing.h"
+
+namespace trace {
+
+    namespace {
+        const char* const PhaseNames[(int)RewritePhase::Count] = { "rewrite_metadata", "rewrite_import", "rewrite_transform", "rewrite_export" };
+
+        // compilations in progress on this thread, innermost last
+        struct PendingCompilations {
+            static const int MaxDepth = 8;
+
+            FunctionID functions[MaxDepth];
+            UINT64 starts[MaxDepth];
+            bool rejits[MaxDepth];
+            int depth = 0;
+        };
+
+        thread_local PendingCompilations pending;
+
+        UINT64 ElapsedNanoseconds(UINT64 start, UINT64 end) {
+            return (UINT64)TicksToNanoseconds(end - start);
+        }
+    }
+
+    JitTelemetrySettings JitTelemetrySettings::FromConfig(const ConfigSnapshot& config) {
+        JitTelemetrySettings settings;
+        const auto& topCount = config.Value(WStr("PROFILER_JIT_TOP"));
+        if (!topCount.empty()) {
+            settings.topCount = (unsigned)strtoul(ToString(topCount).c_str(), nullptr, 10);
+        }
+        const auto& path = config.Value(WStr("PROFILER_JIT_FILE"));
+        settings.path = path.empty()
+            ? "profiler_jit_" + ToString((uint64_t)GetPID()) + ".txt"
+            : ToString(path);
+        return settings;
+    }
+
+    JitTelemetry::JitTelemetry()
+        : enabled_(false), info_(nullptr), jitNs_(0), rewriteNs_(0), unpaired_(0), slowestThreshold_(0)
+    {
+    }
+
+    void JitTelemetry::Start(ICorProfilerInfo4* info, const JitTelemetrySettings& settings) {
+        info_ = info;
+        settings_ = settings;
+        slowest_.reserve(settings_.topCount);
+        ProfilerStats::Instance()->Register("jit", [this](StatsWriter& writer) { WriteStats(writer); });
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    void JitTelemetry::OnCompilationStarted(FunctionID functionId, bool rejit) {
+        PendingCompilations& compilations = pending;
+        if (compilations.depth == PendingCompilations::MaxDepth) {
+            unpaired_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        compilations.functions[compilations.depth] = functionId;
+        compilations.rejits[compilations.depth] = rejit;
+        compilations.starts[compilations.depth] = ReadTimestamp();
+        compilations.depth++;
+    }
+
+    void JitTelemetry::OnCompilationFinished(FunctionID functionId, bool rejit) {
+        const UINT64 end = ReadTimestamp();
+        PendingCompilations& compilations = pending;
+
+        // the innermost pending compilation is the one finishing unless a Started was missed
+        int index = compilations.depth - 1;
+        while (index >= 0 && (compilations.functions[index] != functionId || compilations.rejits[index] != rejit)) {
+            index--;
+        }
+        if (index < 0) {
+            unpaired_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        const UINT64 elapsed = ElapsedNanoseconds(compilations.starts[index], end);
+        // anything pending above the match lost its Finished, drop it with the match
+        unpaired_.fetch_add(compilations.depth - 1 - index, std::memory_order_relaxed);
+        compilations.depth = index;
+
+        (rejit ? rejit_ : jit_).Record(elapsed);
+        jitNs_.fetch_add(elapsed, std::memory_order_relaxed);
+        if (elapsed > slowestThreshold_.load(std::memory_order_relaxed)) {
+            KeepIfSlow({ elapsed, functionId, rejit });
+        }
+    }
+
+    void JitTelemetry::KeepIfSlow(const SlowCompilation& compilation) {
+        if (settings_.topCount == 0) {
+            return;
+        }
+        const auto fastestFirst = [](const SlowCompilation& a, const SlowCompilation& b) { return a.nanoseconds > b.nanoseconds; };
+
+        std::lock_guard<std::mutex> guard(slowestLock_);
+        if (slowest_.size() < settings_.topCount) {
+            slowest_.push_back(compilation);
+            std::push_heap(slowest_.begin(), slowest_.end(), fastestFirst);
+        }
+        else if (compilation.nanoseconds > slowest_.front().nanoseconds) {
+            std::pop_heap(slowest_.begin(), slowest_.end(), fastestFirst);
+            slowest_.back() = compilation;
+            std::push_heap(slowest_.begin(), slowest_.end(), fastestFirst);
+        }
+        if (slowest_.size() == settings_.topCount) {
+            slowestThreshold_.store(slowest_.front().nanoseconds, std::memory_order_relaxed);
+        }
+    }
+
+    void JitTelemetry::RecordRewritePhase(RewritePhase phase, UINT64 nanoseconds) {
+        phases_[(int)phase].Record(nanoseconds);
+    }
+
+    void JitTelemetry::RecordRewrite(UINT64 nanoseconds) {
+        rewrites_.Record(nanoseconds);
+        rewriteNs_.fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+
+    bool JitTelemetry::WriteReport() {
+        if (!IsEnabled()) {
+            return false;
+        }
+
+        std::vector<SlowCompilation> slowest;
+        {
+            std::lock_guard<std::mutex> guard(slowestLock_);
+            slowest = slowest_;
+        }
+        std::sort(slowest.begin(), slowest.end(),
+            [](const SlowCompilation& a, const SlowCompilation& b) { return a.nanoseconds > b.nanoseconds; });
+
+        FILE* file = fopen(settings_.path.c_str(), "w");
+        if (file == nullptr) {
+            LOG_ERROR("JitTelemetry: unable to open {}", settings_.path);
+            return false;
+        }
+
+        fprintf(file, "# slowest compilations, us / jit or rejit / method\n");
+        for (const auto& compilation : slowest) {
+            const auto name = GetFunctionIdName(info_, compilation.functionId);
+            fprintf(file, "%.1f\t%s\t%s\n", compilation.nanoseconds / 1000.0, compilation.rejit ? "rejit" : "jit",
+                name.empty() ? "[unknown]" : ToString(name).c_str());
+        }
+
+        fclose(file);
+        return true;
+    }
+
+    void JitTelemetry::WriteStats(StatsWriter& writer) {
+        jit_.Write(writer, "jit");
+        rejit_.Write(writer, "rejit");
+        rewrites_.Write(writer, "rewrite");
+        for (int i = 0; i < (int)RewritePhase::Count; i++) {
+            phases_[i].Write(writer, PhaseNames[i]);
+        }
+        writer.Counter("unpaired", unpaired_.load(std::memory_order_relaxed));
+
+        // rewrites made from JITCompilationStarted are part of the compilation they precede, those
+        // made from GetReJITParameters come before ReJITCompilationStarted; either way this is the
+        // profiler's rewrite time per unit of compilation time
+        const UINT64 jitNs = jitNs_.load(std::memory_order_relaxed);
+        writer.Gauge("rewrite_to_jit_ratio", jitNs == 0 ? 0.0 : (double)rewriteNs_.load(std::memory_order_relaxed) / jitNs);
+    }
+
+    RewriteTimer::RewriteTimer()
+        : enabled_(JitTelemetry::Instance()->IsEnabled()), phase_(RewritePhase::Metadata), start_(0), phaseStart_(0)
+    {
+        if (enabled_) {
+            start_ = ReadTimestamp();
+            phaseStart_ = start_;
+        }
+    }
+
+    RewriteTimer::~RewriteTimer() {
+        if (!enabled_) {
+            return;
+        }
+        const UINT64 end = ReadTimestamp();
+        JitTelemetry::Instance()->RecordRewritePhase(phase_, ElapsedNanoseconds(phaseStart_, end));
+        JitTelemetry::Instance()->RecordRewrite(ElapsedNanoseconds(start_, end));
+    }
+
+    void RewriteTimer::Next(RewritePhase phase) {
+        if (!enabled_) {
+            return;
+        }
+        const UINT64 now = ReadTimestamp();
+        JitTelemetry::Instance()->RecordRewritePhase(phase_, ElapsedNanoseconds(phaseStart_, now));
+        phase_ = phase;
+        phaseStart_ = now;
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef CLR_PROFILER_JIT_TELEMETRY_H_
+#define CLR_PROFILER_JIT_TELEMETRY_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <corprof.h>
+#include "hdr_histogram.h"
+#include "util.h"
+
+namespace trace {
+
+    class ConfigSnapshot;
+    class StatsWriter;
+
+    // the phases of one InnerRewrite: everything up to the IL import (module metadata, function
+    // info, governor and signature lookups), the import, the probe insertion and the export
+    enum class RewritePhase {
+        Metadata,
+        Import,
+        Transform,
+        Export,
+        Count
+    };
+
+    struct JitTelemetrySettings {
+        // slowest compilations kept for the report
+        unsigned topCount = 20;
+        std::string path;
+
+        static JitTelemetrySettings FromConfig(const ConfigSnapshot& config);
+    };
+
+    // JitTelemetry pairs the JIT and ReJIT Started and Finished callbacks of every FunctionID to time
+    // compilations, and times the phases of the profiler's own rewrites, so warm-up cost can be split
+    // between the JIT and the profiler. Compilations nest on a thread when compiling one method runs
+    // a class constructor that needs another, so pending compilations are kept per thread as a stack.
+    class JitTelemetry : public Singleton<JitTelemetry> {
+        friend class Singleton<JitTelemetry>;
+
+    public:
+        void Start(ICorProfilerInfo4* info, const JitTelemetrySettings& settings);
+        bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+        void OnCompilationStarted(FunctionID functionId, bool rejit);
+        void OnCompilationFinished(FunctionID functionId, bool rejit);
+
+        void RecordRewritePhase(RewritePhase phase, UINT64 nanoseconds);
+        void RecordRewrite(UINT64 nanoseconds);
+
+        // WriteReport writes the slowest compilations, slowest first, to settings.path.
+        bool WriteReport();
+
+    private:
+        struct SlowCompilation {
+            UINT64 nanoseconds;
+            FunctionID functionId;
+            bool rejit;
+        };
+
+        JitTelemetry();
+
+        void KeepIfSlow(const SlowCompilation& compilation);
+        void WriteStats(StatsWriter& writer);
+
+        std::atomic<bool> enabled_;
+        ICorProfilerInfo4* info_;
+        JitTelemetrySettings settings_;
+
+        HdrHistogram jit_;
+        HdrHistogram rejit_;
+        HdrHistogram rewrites_;
+        HdrHistogram phases_[(int)RewritePhase::Count];
+        std::atomic<UINT64> jitNs_;
+        std::atomic<UINT64> rewriteNs_;
+        std::atomic<UINT64> unpaired_;
+
+        // a min-heap of the slowest compilations; slowestThreshold_ is the fastest of them once the
+        // heap is full, so most compilations are turned away without taking the lock
+        std::mutex slowestLock_;
+        std::vector<SlowCompilation> slowest_;
+        std::atomic<UINT64> slowestThreshold_;
+    };
+
+    // RewriteTimer attributes the time spent in one rewrite to its phases. The rewrite starts in the
+    // metadata phase, Next closes the current phase and opens another, and whatever phase is open
+    // when the timer goes out of scope, on success or on an early return, gets the remainder.
+    class RewriteTimer {
+    public:
+        RewriteTimer();
+        ~RewriteTimer();
+
+        void Next(RewritePhase phase);
+
+    private:
+        const bool enabled_;
+        RewritePhase phase_;
+        UINT64 start_;
+        UINT64 phaseStart_;
+    };
+}
+
+#endif  // CLR_PROFILER_JIT_TELEMETRY_H_
@@ -0,0 +1,425 @@
+#include "logger.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include "profiler_config.h"
+#include "profiler_stats.h"
+#include "transcode.h"
+
+#ifndef _WIN32
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace trace {
+
+    namespace {
+        const char* const LevelNames[] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+        const UINT64 TextTruncated = 1ULL << 31;
+
+        UINT64 RoundUpToPowerOfTwo(UINT64 value) {
+            UINT64 result = 1;
+            while (result < value) {
+                result <<= 1;
+            }
+            return result;
+        }
+
+        UINT32 GetCurrentOSThreadId() {
+#ifdef _WIN32
+            return (UINT32)GetCurrentThreadId();
+#else
+            return (UINT32)syscall(SYS_gettid);
+#endif
+        }
+
+        // retires the calling thread's buffer when the thread exits
+        struct LogBufferOwner {
+            ThreadLogBuffer* buffer = nullptr;
+            bool attachFailed = false;
+
+            ~LogBufferOwner() {
+                if (buffer != nullptr) {
+                    buffer->Retire();
+                }
+            }
+        };
+
+        thread_local LogBufferOwner t_owner;
+    }
+
+    std::atomic<int> Logger::level_((int)LogLevel::Off);
+    thread_local ThreadLogBuffer* Logger::t_buffer = nullptr;
+
+    ThreadLogBuffer::ThreadLogBuffer(UINT32 threadId, UINT64 capacity)
+        : records_(new LogRecord[capacity]), capacity_(capacity), mask_(capacity - 1), threadId_(threadId),
+          head_(0), cachedTail_(0), dropped_(0), tail_(0), retired_(false)
+    {
+    }
+
+    ThreadLogBuffer::~ThreadLogBuffer()
+    {
+        delete[] records_;
+    }
+
+    UINT64 ThreadLogBuffer::Drain(LogRecord* out, UINT64 max)
+    {
+        const UINT64 tail = tail_.load(std::memory_order_relaxed);
+        const UINT64 head = head_.load(std::memory_order_acquire);
+        const UINT64 count = (std::min)(head - tail, max);
+        for (UINT64 i = 0; i < count; i++) {
+            out[i] = records_[(tail + i) & mask_];
+        }
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    LogLevel ParseLogLevel(WStringView name)
+    {
+        const std::string level = ToString(name.str());
+        if (level == "trace") return LogLevel::Trace;
+        if (level == "debug") return LogLevel::Debug;
+        if (level == "info") return LogLevel::Info;
+        if (level == "warning") return LogLevel::Warning;
+        if (level == "error") return LogLevel::Error;
+        return LogLevel::Off;
+    }
+
+    LogSettings LogSettings::FromConfig(const ConfigSnapshot& config)
+    {
+        LogSettings settings;
+        settings.level = ParseLogLevel(config.Value(WStr("PROFILER_LOG_LEVEL")));
+        const auto& path = config.Value(WStr("PROFILER_LOG_FILE"));
+        settings.path = path.empty()
+            ? "profiler_" + ToString((uint64_t)GetPID()) + ".log"
+            : ToString(path);
+        settings.maxBytes = (UINT64)config.Number(WStr("PROFILER_LOG_MAX_BYTES"), (double)settings.maxBytes);
+        settings.maxFiles = (std::max)(1u, (unsigned)config.Number(WStr("PROFILER_LOG_FILES"), settings.maxFiles));
+        settings.bufferRecords = RoundUpToPowerOfTwo(
+            (std::max)((UINT64)2, (UINT64)config.Number(WStr("PROFILER_LOG_BUFFER_RECORDS"), (double)settings.bufferRecords)));
+        settings.flushIntervalMs = (std::max)(1u, (unsigned)config.Number(WStr("PROFILER_LOG_FLUSH_MS"), settings.flushIntervalMs));
+        return settings;
+    }
+
+    Logger::Logger()
+        : started_(false), slotHighWater_(0), retiredWritten_(0), retiredDropped_(0), droppedNoSlot_(0),
+          bytesWritten_(0), rotations_(0), startMicroseconds_(0), startTicks_(0), ticksPerMicrosecond_(1),
+          file_(nullptr), fileBytes_(0), stopping_(false)
+    {
+        for (UINT32 i = 0; i < MaxThreadSlots; i++) {
+            slots_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    Logger::~Logger()
+    {
+        Stop();
+        // buffers still attached to live threads are deliberately leaked, the process is exiting
+    }
+
+    bool Logger::Start(const LogSettings& settings)
+    {
+        std::lock_guard<std::mutex> guard(threadLock_);
+        if (writer_.joinable() || settings.level == LogLevel::Off) {
+            return writer_.joinable();
+        }
+
+        settings_ = settings;
+        file_ = settings_.path == "-" ? stdout : fopen(settings_.path.c_str(), "w");
+        if (file_ == nullptr) {
+            return false;
+        }
+
+        startTicks_ = ReadTimestamp();
+        startMicroseconds_ = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        ticksPerMicrosecond_ = TimestampFrequency() / 1e6;
+        batch_.resize((size_t)FlushBatchRecords);
+
+        ProfilerStats::Instance()->Register("log", [this](StatsWriter& writer) { WriteStats(writer); });
+        ProfilerConfig::Instance()->Subscribe([this](const ConfigSnapshot& previous, const ConfigSnapshot& current) {
+            OnConfigChanged(previous, current);
+        });
+
+        stopping_ = false;
+        writer_ = std::thread(&Logger::WriterMain, this);
+        started_.store(true, std::memory_order_release);
+        level_.store((int)settings_.level, std::memory_order_relaxed);
+        return true;
+    }
+
+    void Logger::Stop()
+    {
+        level_.store((int)LogLevel::Off, std::memory_order_relaxed);
+        started_.store(false, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> guard(threadLock_);
+            stopping_ = true;
+        }
+        wakeUp_.notify_all();
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+
+        std::lock_guard<std::mutex> guard(threadLock_);
+        if (file_ != nullptr && file_ != stdout) {
+            fclose(file_);
+        }
+        file_ = nullptr;
+    }
+
+    void Logger::SetLevel(LogLevel level)
+    {
+        if (started_.load(std::memory_order_acquire)) {
+            level_.store((int)level, std::memory_order_relaxed);
+        }
+    }
+
+    void Logger::OnConfigChanged(const ConfigSnapshot& previous, const ConfigSnapshot& current)
+    {
+        const auto& level = current.Value(WStr("PROFILER_LOG_LEVEL"));
+        if (level != previous.Value(WStr("PROFILER_LOG_LEVEL"))) {
+            SetLevel(ParseLogLevel(level));
+        }
+    }
+
+    void Logger::EncodeText(LogRecord& record, LogArgKind kind, const void* data, size_t length, size_t unitSize)
+    {
+        const size_t offset = record.textUsed;
+        const size_t room = (sizeof(record.text) - offset) / unitSize;
+        const size_t copied = (std::min)(length, room);
+        memcpy(record.text + offset, data, copied * unitSize);
+        record.textUsed = (USHORT)(offset + copied * unitSize);
+        record.kinds[record.argCount] = (BYTE)kind;
+        record.values[record.argCount++] = offset | ((UINT64)copied << 16) | (copied < length ? TextTruncated : 0);
+    }
+
+    ThreadLogBuffer* Logger::AttachCurrentThread()
+    {
+        if (t_owner.attachFailed || !started_.load(std::memory_order_acquire)) {
+            droppedNoSlot_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        auto buffer = new ThreadLogBuffer(GetCurrentOSThreadId(), settings_.bufferRecords);
+        for (UINT32 i = 0; i < MaxThreadSlots; i++) {
+            ThreadLogBuffer* expected = nullptr;
+            if (slots_[i].compare_exchange_strong(expected, buffer, std::memory_order_acq_rel)) {
+                UINT32 highWater = slotHighWater_.load(std::memory_order_relaxed);
+                while (highWater < i + 1 &&
+                    !slotHighWater_.compare_exchange_weak(highWater, i + 1, std::memory_order_release)) {
+                }
+                t_owner.buffer = buffer;
+                t_buffer = buffer;
+                return buffer;
+            }
+        }
+
+        // every slot is taken, this thread's messages are counted as dropped from now on
+        delete buffer;
+        t_owner.attachFailed = true;
+        droppedNoSlot_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    UINT64 Logger::Flush(bool final)
+    {
+        UINT64 total = 0;
+        size_t count = 0;
+        std::string line;
+        std::lock_guard<std::mutex> guard(reclaimLock_);
+        const UINT32 highWater = slotHighWater_.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < highWater; i++) {
+            ThreadLogBuffer* buffer = slots_[i].load(std::memory_order_acquire);
+            if (buffer != nullptr) {
+                // read retired before draining, so a buffer is only freed once its last records are out
+                const bool retired = buffer->IsRetired();
+                UINT64 drained;
+                while ((drained = buffer->Drain(&batch_[count], batch_.size() - count)) > 0) {
+                    count += (size_t)drained;
+                    if (count < batch_.size()) {
+                        continue;
+                    }
+                    // a full batch is written out of order with what the remaining buffers hold
+                    std::stable_sort(batch_.begin(), batch_.begin() + count,
+                        [](const LogRecord& a, const LogRecord& b) { return a.timestamp < b.timestamp; });
+                    for (size_t j = 0; j < count; j++) {
+                        Format(batch_[j], line);
+                        WriteLine(line);
+                    }
+                    total += count;
+                    count = 0;
+                }
+
+                if (retired && !final) {
+                    retiredWritten_.fetch_add(buffer->Written(), std::memory_order_relaxed);
+                    retiredDropped_.fetch_add(buffer->Dropped(), std::memory_order_relaxed);
+                    slots_[i].store(nullptr, std::memory_order_release);
+                    delete buffer;
+                }
+            }
+        }
+
+        std::stable_sort(batch_.begin(), batch_.begin() + count,
+            [](const LogRecord& a, const LogRecord& b) { return a.timestamp < b.timestamp; });
+        for (size_t j = 0; j < count; j++) {
+            Format(batch_[j], line);
+            WriteLine(line);
+        }
+        total += count;
+
+        if (total > 0 && file_ != nullptr) {
+            fflush(file_);
+        }
+        return total;
+    }
+
+    void Logger::Format(const LogRecord& record, std::string& line) const
+    {
+        line.clear();
+
+        // ticks from a core whose counter lags the one Start ran on may come out slightly negative
+        const INT64 micros = startMicroseconds_ + (INT64)((double)(INT64)(record.timestamp - startTicks_) / ticksPerMicrosecond_);
+        const time_t seconds = (time_t)(micros / 1000000);
+        struct tm utc;
+#ifdef _WIN32
+        gmtime_s(&utc, &seconds);
+#else
+        gmtime_r(&seconds, &utc);
+#endif
+        char prefix[64];
+        const size_t dateLength = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(prefix + dateLength, sizeof(prefix) - dateLength, ".%06dZ %s [%u] ",
+            (int)(micros % 1000000), LevelNames[record.level < 5 ? record.level : 4], record.threadId);
+        line += prefix;
+
+        char number[32];
+        std::vector<char> utf8;
+        int arg = 0;
+        for (const char* c = record.format; *c != 0; c++) {
+            if (c[0] != '{' || c[1] != '}') {
+                line += *c;
+                continue;
+            }
+            c++;
+            if (arg >= record.argCount) {
+                continue;
+            }
+
+            const UINT64 value = record.values[arg];
+            switch ((LogArgKind)record.kinds[arg++]) {
+            case LogArgKind::Signed:
+                snprintf(number, sizeof(number), "%lld", (long long)(INT64)value);
+                line += number;
+                break;
+            case LogArgKind::Unsigned:
+                snprintf(number, sizeof(number), "%llu", (unsigned long long)value);
+                line += number;
+                break;
+            case LogArgKind::Hex:
+                snprintf(number, sizeof(number), "%llx", (unsigned long long)value);
+                line += number;
+                break;
+            case LogArgKind::Double: {
+                double d;
+                memcpy(&d, &value, sizeof(d));
+                snprintf(number, sizeof(number), "%g", d);
+                line += number;
+                break;
+            }
+            case LogArgKind::Text8:
+            case LogArgKind::Text16: {
+                const BYTE* text = record.text + (value & 0xFFFF);
+                const size_t length = (size_t)((value >> 16) & 0x7FFF);
+                if (record.kinds[arg - 1] == (BYTE)LogArgKind::Text8) {
+                    line.append(reinterpret_cast<const char*>(text), length);
+                }
+                else {
+                    // the text may be unaligned in the record
+                    WCHAR units[sizeof(record.text) / sizeof(WCHAR)];
+                    memcpy(units, text, length * sizeof(WCHAR));
+                    utf8.resize(Utf8Capacity(length) + 1);
+                    line.append(utf8.data(), Utf16ToUtf8(units, length, utf8.data(), utf8.size()));
+                }
+                if (value & TextTruncated) {
+                    line += "...";
+                }
+                break;
+            }
+            }
+        }
+        line += '\n';
+    }
+
+    void Logger::WriteLine(const std::string& line)
+    {
+        if (file_ == nullptr) {
+            return;
+        }
+        if (file_ != stdout && fileBytes_ > 0 && fileBytes_ + line.length() > settings_.maxBytes) {
+            Rotate();
+            if (file_ == nullptr) {
+                return;
+            }
+        }
+        fwrite(line.data(), 1, line.length(), file_);
+        fileBytes_ += line.length();
+        bytesWritten_.fetch_add(line.length(), std::memory_order_relaxed);
+    }
+
+    void Logger::Rotate()
+    {
+        fclose(file_);
+        // path.N-1 falls off the end, every other file moves up one
+        const std::string& path = settings_.path;
+        remove((path + "." + std::to_string(settings_.maxFiles - 1)).c_str());
+        for (unsigned i = settings_.maxFiles - 1; i > 1; i--) {
+            rename((path + "." + std::to_string(i - 1)).c_str(), (path + "." + std::to_string(i)).c_str());
+        }
+        if (settings_.maxFiles > 1) {
+            rename(path.c_str(), (path + ".1").c_str());
+        }
+        file_ = fopen(path.c_str(), "w");
+        fileBytes_ = 0;
+        rotations_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Logger::WriterMain()
+    {
+        std::unique_lock<std::mutex> guard(threadLock_);
+        while (!stopping_) {
+            wakeUp_.wait_for(guard, std::chrono::milliseconds(settings_.flushIntervalMs));
+            guard.unlock();
+            Flush(false);
+            guard.lock();
+        }
+        guard.unlock();
+        Flush(true);
+    }
+
+    void Logger::WriteStats(StatsWriter& writer)
+    {
+        UINT64 written = retiredWritten_.load(std::memory_order_relaxed);
+        UINT64 dropped = retiredDropped_.load(std::memory_order_relaxed);
+        UINT64 threads = 0;
+        std::lock_guard<std::mutex> guard(reclaimLock_);
+        const UINT32 highWater = slotHighWater_.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < highWater; i++) {
+            ThreadLogBuffer* buffer = slots_[i].load(std::memory_order_acquire);
+            if (buffer != nullptr) {
+                written += buffer->Written();
+                dropped += buffer->Dropped();
+                threads++;
+            }
+        }
+
+        writer.Counter("level", (UINT64)level_.load(std::memory_order_relaxed));
+        writer.Counter("written", written);
+        writer.Counter("dropped_buffer_full", dropped);
+        writer.Counter("dropped_no_slot", droppedNoSlot_.load(std::memory_order_relaxed));
+        writer.Counter("bytes_written", bytesWritten_.load(std::memory_order_relaxed));
+        writer.Counter("rotations", rotations_.load(std::memory_order_relaxed));
+        writer.Counter("threads", threads);
+    }
+}
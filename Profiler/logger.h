@@ -0,0 +1,293 @@
+#ifndef CLR_PROFILER_LOGGER_H_
+#define CLR_PROFILER_LOGGER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "string.h"  // NOLINT
+#include "timing.h"
+#include "util.h"
+
+// Log statements below PROFILER_LOG_MIN_LEVEL are compiled out, arguments included:
+// 0 trace, 1 debug, 2 info, 3 warning, 4 error.
+#ifndef PROFILER_LOG_MIN_LEVEL
+#define PROFILER_LOG_MIN_LEVEL 0
+#endif
+
+// PROFILER_LOG(level, format, args...) records a message whose "{}" placeholders are replaced by
+// args in order. format must be a string literal, only its address is recorded.
+#define PROFILER_LOG(level, ...)                                                                   \
+    do {                                                                                           \
+        if ((int)(level) >= PROFILER_LOG_MIN_LEVEL && ::trace::Logger::IsEnabled(level)) {         \
+            ::trace::Logger::Instance()->Write(level, __VA_ARGS__);                                \
+        }                                                                                          \
+    } while (0)
+
+#define LOG_TRACE(...) PROFILER_LOG(::trace::LogLevel::Trace, __VA_ARGS__)
+#define LOG_DEBUG(...) PROFILER_LOG(::trace::LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) PROFILER_LOG(::trace::LogLevel::Info, __VA_ARGS__)
+#define LOG_WARNING(...) PROFILER_LOG(::trace::LogLevel::Warning, __VA_ARGS__)
+#define LOG_ERROR(...) PROFILER_LOG(::trace::LogLevel::Error, __VA_ARGS__)
+
+namespace trace {
+
+    class StatsWriter;
+    class ConfigSnapshot;
+
+    enum class LogLevel : int {
+        Trace = 0,
+        Debug = 1,
+        Info = 2,
+        Warning = 3,
+        Error = 4,
+        Off = 5,
+    };
+
+    // Hex logs an integer in hexadecimal, at the width of its own type.
+    struct Hex {
+        template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+        explicit Hex(T value) : value((UINT64)(typename std::make_unsigned<T>::type)value) {}
+
+        UINT64 value;
+    };
+
+    enum class LogArgKind : BYTE {
+        Signed,
+        Unsigned,
+        Hex,
+        Double,
+        // text copied into the record, UTF-8 or UTF-16
+        Text8,
+        Text16,
+    };
+
+    // LogRecord is the fixed size binary form of one message, 256 bytes. Numbers are kept as they
+    // are and strings are copied into text, formatting happens on the writer thread. Strings that
+    // do not fit are truncated.
+    struct LogRecord {
+        static const int MaxArgs = 8;
+
+        UINT64 timestamp;
+        const char* format;
+        UINT32 threadId;
+        BYTE level;
+        BYTE argCount;
+        USHORT textUsed;
+        BYTE kinds[MaxArgs];
+        // a number, or for text the offset in text (low 16 bits), the length in code units (next 15
+        // bits) and whether it was truncated (bit 31)
+        UINT64 values[MaxArgs];
+        BYTE text[160];
+    };
+
+    // ThreadLogBuffer is a single producer / single consumer ring of LogRecords, like
+    // ThreadEventBuffer. The owning thread encodes a message in place, between Reserve and Commit.
+    class ThreadLogBuffer {
+    public:
+        ThreadLogBuffer(UINT32 threadId, UINT64 capacity);
+        ~ThreadLogBuffer();
+
+        // Reserve returns the next free record, or nullptr when the ring is full.
+        inline LogRecord* Reserve() {
+            const UINT64 head = head_.load(std::memory_order_relaxed);
+            if (head - cachedTail_ >= capacity_) {
+                cachedTail_ = tail_.load(std::memory_order_acquire);
+                if (head - cachedTail_ >= capacity_) {
+                    dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+            }
+            return &records_[head & mask_];
+        }
+
+        inline void Commit() {
+            head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        UINT64 Drain(LogRecord* out, UINT64 max);
+
+        UINT32 ThreadId() const { return threadId_; }
+        UINT64 Written() const { return head_.load(std::memory_order_relaxed); }
+        UINT64 Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+        void Retire() { retired_.store(true, std::memory_order_release); }
+        bool IsRetired() const { return retired_.load(std::memory_order_acquire); }
+
+    private:
+        LogRecord* const records_;
+        const UINT64 capacity_;
+        const UINT64 mask_;
+        const UINT32 threadId_;
+
+        BYTE padding0_[64];
+        std::atomic<UINT64> head_;
+        UINT64 cachedTail_;
+        std::atomic<UINT64> dropped_;
+        BYTE padding1_[64];
+        std::atomic<UINT64> tail_;
+        std::atomic<bool> retired_;
+    };
+
+    struct LogSettings {
+        LogLevel level = LogLevel::Off;
+        // "-" writes to stdout, which is never rotated
+        std::string path;
+        // the file is rotated to path.1, path.2, ... once it reaches maxBytes; maxFiles counts the
+        // current file too
+        UINT64 maxBytes = 16 * 1024 * 1024;
+        unsigned maxFiles = 4;
+        // records per thread, rounded up to a power of two
+        UINT64 bufferRecords = 1024;
+        unsigned flushIntervalMs = 100;
+
+        static LogSettings FromConfig(const ConfigSnapshot& config);
+    };
+
+    // ParseLogLevel reads "trace", "debug", "info", "warning", "error" or "off", defaulting to Off.
+    LogLevel ParseLogLevel(WStringView name);
+
+    // Logger replaces synchronous console output in the callbacks. A message costs its caller a
+    // timestamp, a few stores into a record of the thread's own ring and the copy of its string
+    // arguments; a background thread formats the records of all threads, in timestamp order, and
+    // writes them to a rotating file. A full ring drops the message and counts it.
+    class Logger : public Singleton<Logger> {
+        friend class Singleton<Logger>;
+
+    public:
+        bool Start(const LogSettings& settings);
+        void Stop();
+
+        static inline bool IsEnabled(LogLevel level) {
+            return (int)level >= level_.load(std::memory_order_relaxed);
+        }
+
+        // SetLevel changes the runtime level; it only takes effect once the writer has started.
+        void SetLevel(LogLevel level);
+
+        template <typename... Args>
+        void Write(LogLevel level, const char* format, const Args&... args) {
+            static_assert(sizeof...(Args) <= LogRecord::MaxArgs, "too many log arguments");
+            ThreadLogBuffer* buffer = CurrentBuffer();
+            if (buffer == nullptr) {
+                return;
+            }
+            LogRecord* record = buffer->Reserve();
+            if (record == nullptr) {
+                return;
+            }
+            record->timestamp = ReadTimestamp();
+            record->format = format;
+            record->threadId = buffer->ThreadId();
+            record->level = (BYTE)level;
+            record->argCount = 0;
+            record->textUsed = 0;
+            const int expand[] = { 0, (Encode(*record, args), 0)... };
+            (void)expand;
+            buffer->Commit();
+        }
+
+    private:
+        Logger();
+        ~Logger();
+
+        static const UINT32 MaxThreadSlots = 256;
+        static const UINT64 FlushBatchRecords = 4096;
+
+        inline ThreadLogBuffer* CurrentBuffer() {
+            ThreadLogBuffer* buffer = t_buffer;
+            return buffer != nullptr ? buffer : AttachCurrentThread();
+        }
+
+        template <typename T>
+        static typename std::enable_if<std::is_integral<T>::value>::type Encode(LogRecord& record, T value) {
+            record.kinds[record.argCount] = (BYTE)(std::is_signed<T>::value ? LogArgKind::Signed : LogArgKind::Unsigned);
+            record.values[record.argCount++] = std::is_signed<T>::value ? (UINT64)(INT64)value : (UINT64)value;
+        }
+
+        static void Encode(LogRecord& record, Hex value) {
+            record.kinds[record.argCount] = (BYTE)LogArgKind::Hex;
+            record.values[record.argCount++] = value.value;
+        }
+
+        static void Encode(LogRecord& record, double value) {
+            record.kinds[record.argCount] = (BYTE)LogArgKind::Double;
+            memcpy(&record.values[record.argCount++], &value, sizeof(value));
+        }
+
+        static void Encode(LogRecord& record, const void* value) {
+            Encode(record, Hex((UINT_PTR)value));
+        }
+
+        static void Encode(LogRecord& record, const char* value) {
+            EncodeText(record, LogArgKind::Text8, value, strlen(value), sizeof(char));
+        }
+
+        static void Encode(LogRecord& record, const std::string& value) {
+            EncodeText(record, LogArgKind::Text8, value.data(), value.length(), sizeof(char));
+        }
+
+        static void Encode(LogRecord& record, const WCHAR* value) {
+            size_t length = 0;
+            while (value[length] != 0) {
+                length++;
+            }
+            EncodeText(record, LogArgKind::Text16, value, length, sizeof(WCHAR));
+        }
+
+        static void Encode(LogRecord& record, WStringView value) {
+            EncodeText(record, LogArgKind::Text16, value.data(), value.length(), sizeof(WCHAR));
+        }
+
+        static void Encode(LogRecord& record, const WSTRING& value) {
+            Encode(record, WStringView(value));
+        }
+
+        static void EncodeText(LogRecord& record, LogArgKind kind, const void* data, size_t length, size_t unitSize);
+
+        ThreadLogBuffer* AttachCurrentThread();
+        void WriterMain();
+        UINT64 Flush(bool final);
+        void Format(const LogRecord& record, std::string& line) const;
+        void WriteLine(const std::string& line);
+        void Rotate();
+        void OnConfigChanged(const ConfigSnapshot& previous, const ConfigSnapshot& current);
+        void WriteStats(StatsWriter& writer);
+
+        static std::atomic<int> level_;
+        static thread_local ThreadLogBuffer* t_buffer;
+
+        LogSettings settings_;
+        std::atomic<bool> started_;
+        std::atomic<ThreadLogBuffer*> slots_[MaxThreadSlots];
+        std::atomic<UINT32> slotHighWater_;
+
+        std::atomic<UINT64> retiredWritten_;
+        std::atomic<UINT64> retiredDropped_;
+        std::atomic<UINT64> droppedNoSlot_;
+        std::atomic<UINT64> bytesWritten_;
+        std::atomic<UINT64> rotations_;
+
+        std::mutex reclaimLock_;
+
+        // wall clock and tick count taken together, to date the records
+        INT64 startMicroseconds_;
+        UINT64 startTicks_;
+        double ticksPerMicrosecond_;
+
+        FILE* file_;
+        UINT64 fileBytes_;
+        std::vector<LogRecord> batch_;
+        std::mutex threadLock_;
+        std::condition_variable wakeUp_;
+        bool stopping_;
+        std::thread writer_;
+    };
+}
+
+#endif  // CLR_PROFILER_LOGGER_H_
@@ -0,0 +1,500 @@
+#include "metadata_benchmark.h"
+#include <functional>
+#include <vector>
+#include "clr_helpers.h"
+#include "compressed_int.h"
+#include "logger.h"
+#include "miniutf.hpp"
+#include "name_folding.h"
+#include "profiler_stats.h"
+#include "timing.h"
+#include "transcode.h"
+
+namespace trace {
+
+    namespace {
+        const int Rounds = 5;
+
+        struct EnumerationResult {
+            UINT64 types = 0;
+            UINT64 methods = 0;
+            double callbackNs = 0;
+            double rangeForNs = 0;
+            double collectAllNs = 0;
+        };
+
+        // the enumerator used before the template Enumerator, kept as the baseline: every batch is
+        // fetched through a std::function, and every iterator, end() included, carries a batch buffer
+        template <typename T>
+        class CallbackEnumeratorIterator;
+
+        template <typename T>
+        class CallbackEnumerator {
+        public:
+            CallbackEnumerator(std::function<HRESULT(HCORENUM*, T[], ULONG, ULONG*)> callback,
+                std::function<void(HCORENUM)> close)
+                : callback_(callback), close_(close), ptr_(nullptr) {}
+
+            ~CallbackEnumerator() { close_(ptr_); }
+
+            CallbackEnumeratorIterator<T> begin() const { return CallbackEnumeratorIterator<T>(this, S_OK); }
+            CallbackEnumeratorIterator<T> end() const { return CallbackEnumeratorIterator<T>(this, S_FALSE); }
+
+            HRESULT Next(T arr[], ULONG max, ULONG* cnt) const { return callback_(&ptr_, arr, max, cnt); }
+
+        private:
+            const std::function<HRESULT(HCORENUM*, T[], ULONG, ULONG*)> callback_;
+            const std::function<void(HCORENUM)> close_;
+            mutable HCORENUM ptr_;
+        };
+
+        template <typename T>
+        class CallbackEnumeratorIterator {
+        public:
+            CallbackEnumeratorIterator(const CallbackEnumerator<T>* enumerator, HRESULT status) : enumerator_(enumerator) {
+                status_ = status == S_OK ? Fetch() : status;
+            }
+
+            bool operator!=(const CallbackEnumeratorIterator& other) const {
+                return enumerator_ != other.enumerator_ || (status_ == S_OK) != (other.status_ == S_OK);
+            }
+
+            const T& operator*() const { return arr_[idx_]; }
+
+            CallbackEnumeratorIterator& operator++() {
+                if (idx_ < sz_ - 1) {
+                    idx_++;
+                }
+                else {
+                    idx_ = 0;
+                    status_ = Fetch();
+                }
+                return *this;
+            }
+
+        private:
+            HRESULT Fetch() {
+                const HRESULT hr = enumerator_->Next(arr_, EnumeratorMax, &sz_);
+                return hr == S_OK && sz_ == 0 ? S_FALSE : hr;
+            }
+
+            const CallbackEnumerator<T>* enumerator_;
+            HRESULT status_ = S_FALSE;
+            T arr_[EnumeratorMax]{};
+            ULONG idx_ = 0;
+            ULONG sz_ = 0;
+        };
+
+        UINT64 EnumerateWithCallbacks(const CComPtr<IMetaDataImport2>& metadataImport) {
+            const auto close = [metadataImport](HCORENUM ptr) { metadataImport->CloseEnum(ptr); };
+            UINT64 methods = 0;
+            CallbackEnumerator<mdTypeDef> typeDefs(
+                [metadataImport](HCORENUM* ptr, mdTypeDef arr[], ULONG max, ULONG* cnt) {
+                    return metadataImport->EnumTypeDefs(ptr, arr, max, cnt);
+                }, close);
+            for (const auto typeDef : typeDefs) {
+                CallbackEnumerator<mdMethodDef> methodDefs(
+                    [metadataImport, typeDef](HCORENUM* ptr, mdMethodDef arr[], ULONG max, ULONG* cnt) {
+                        return metadataImport->EnumMethods(ptr, typeDef, arr, max, cnt);
+                    }, close);
+                for (const auto methodDef : methodDefs) {
+                    methods += methodDef != mdMethodDefNil;
+                }
+            }
+            return methods;
+        }
+
+        UINT64 EnumerateWithRangeFor(const CComPtr<IMetaDataImport2>& metadataImport, UINT64& types) {
+            UINT64 methods = 0;
+            types = 0;
+            for (const auto typeDef : EnumTypeDefs(metadataImport)) {
+                types++;
+                for (const auto methodDef : EnumMethods(metadataImport, typeDef)) {
+                    methods += methodDef != mdMethodDefNil;
+                }
+            }
+            return methods;
+        }
+
+        UINT64 EnumerateWithCollectAll(const CComPtr<IMetaDataImport2>& metadataImport) {
+            std::vector<mdTypeDef> typeDefs;
+            std::vector<mdMethodDef> methodDefs;
+            EnumTypeDefs(metadataImport).CollectAll(typeDefs);
+            for (const auto typeDef : typeDefs) {
+                EnumMethods(metadataImport, typeDef).CollectAll(methodDefs);
+            }
+            return methodDefs.size();
+        }
+
+        // the compressed integer parser signatures used before DecodeCompressed, one bounds
+        // checked byte at a time, kept as the baseline
+        bool ParseByte(PCCOR_SIGNATURE& pbCur, PCCOR_SIGNATURE pbEnd, unsigned char* pbOut) {
+            if (pbCur < pbEnd) {
+                *pbOut = *pbCur;
+                pbCur++;
+                return true;
+            }
+            return false;
+        }
+
+        bool ParseNumber(PCCOR_SIGNATURE& pbCur, PCCOR_SIGNATURE pbEnd, unsigned* pOut) {
+            unsigned char b1 = 0, b2 = 0, b3 = 0, b4 = 0;
+            if (!ParseByte(pbCur, pbEnd, &b1) || b1 == 0xff) {
+                return false;
+            }
+            if ((b1 & 0x80) == 0) {
+                *pOut = (int)b1;
+                return true;
+            }
+            if (!ParseByte(pbCur, pbEnd, &b2)) {
+                return false;
+            }
+            if ((b1 & 0x40) == 0) {
+                *pOut = (((b1 & 0x3f) << 8) | b2);
+                return true;
+            }
+            if ((b1 & 0x20) != 0 || !ParseByte(pbCur, pbEnd, &b3) || !ParseByte(pbCur, pbEnd, &b4)) {
+                return false;
+            }
+            *pOut = ((b1 & 0x1f) << 24) | (b2 << 16) | (b3 << 8) | b4;
+            return true;
+        }
+
+        struct SignatureDecodingResult {
+            UINT64 signatures = 0;
+            UINT64 signatureBytes = 0;
+            UINT64 values = 0;
+            UINT64 valueBytes = 0;
+            double decodeNs = 0;
+            double bytewiseNs = 0;
+            double singleNs = 0;
+            double runNs = 0;
+        };
+
+        std::vector<WSTRING> CollectNames(const CComPtr<IMetaDataImport2>& metadataImport) {
+            std::vector<WSTRING> names;
+            std::vector<mdTypeDef> typeDefs;
+            std::vector<mdMethodDef> methodDefs;
+            WCHAR name[NameMaxSize];
+            ULONG length = 0;
+            EnumTypeDefs(metadataImport).CollectAll(typeDefs);
+            for (const auto typeDef : typeDefs) {
+                if (SUCCEEDED(metadataImport->GetTypeDefProps(typeDef, name, NameMaxSize, &length, nullptr, nullptr)) && length > 0) {
+                    names.emplace_back(name, length - 1);
+                }
+                EnumMethods(metadataImport, typeDef).CollectAll(methodDefs);
+            }
+            for (const auto methodDef : methodDefs) {
+                if (SUCCEEDED(metadataImport->GetMethodProps(methodDef, nullptr, name, NameMaxSize, &length, nullptr,
+                    nullptr, nullptr, nullptr, nullptr)) && length > 0) {
+                    names.emplace_back(name, length - 1);
+                }
+            }
+            return names;
+        }
+
+        void KeepBest(double& best, double ns, int round) {
+            if (round == 0 || ns < best) {
+                best = ns;
+            }
+        }
+
+        struct TranscodingResult {
+            UINT64 names = 0;
+            UINT64 units = 0;
+            UINT64 nonAscii = 0;
+            double miniutfNarrowNs = 0;
+            double miniutfWidenNs = 0;
+            double toStringNs = 0;
+            double toWstringNs = 0;
+            double bufferNarrowNs = 0;
+            double bufferWidenNs = 0;
+        };
+
+        struct FoldingResult {
+            UINT64 names = 0;
+            UINT64 mismatches = 0;
+            double miniutfAsciiNs = 0;
+            double foldAsciiNs = 0;
+            double miniutfMixedNs = 0;
+            double foldMixedNs = 0;
+        };
+
+        void Encode(std::vector<COR_SIGNATURE>& stream, ULONG value) {
+            COR_SIGNATURE bytes[4];
+            if (value <= CompressedMasks[4]) {
+                const ULONG length = CorSigCompressData(value, bytes);
+                stream.insert(stream.end(), bytes, bytes + length);
+            }
+        }
+    }
+
+    void BenchmarkMethodEnumeration(const CComPtr<IMetaDataImport2>& metadataImport) {
+        static EnumerationResult result;
+
+        for (int round = 0; round < Rounds; round++) {
+            UINT64 start = ReadTimestamp();
+            const UINT64 callbacks = EnumerateWithCallbacks(metadataImport);
+            const double callbackNs = TicksToNanoseconds(ReadTimestamp() - start);
+
+            start = ReadTimestamp();
+            result.methods = EnumerateWithRangeFor(metadataImport, result.types);
+            const double rangeForNs = TicksToNanoseconds(ReadTimestamp() - start);
+
+            start = ReadTimestamp();
+            const UINT64 collected = EnumerateWithCollectAll(metadataImport);
+            const double collectAllNs = TicksToNanoseconds(ReadTimestamp() - start);
+
+            if (callbacks != result.methods || collected != result.methods) {
+                LOG_WARNING("BenchmarkMethodEnumeration: callbacks found {} methods, range-for {}, CollectAll {}",
+                    callbacks, result.methods, collected);
+            }
+            KeepBest(result.callbackNs, callbackNs, round);
+            KeepBest(result.rangeForNs, rangeForNs, round);
+            KeepBest(result.collectAllNs, collectAllNs, round);
+        }
+
+        LOG_INFO("BenchmarkMethodEnumeration: {} methods in {} types, callbacks {} us, range-for {} us, CollectAll {} us",
+            result.methods, result.types, result.callbackNs / 1000.0, result.rangeForNs / 1000.0, result.collectAllNs / 1000.0);
+
+        ProfilerStats::Instance()->Register("enum_benchmark", [](StatsWriter& writer) {
+            writer.Counter("types", result.types);
+            writer.Counter("methods", result.methods);
+            writer.Gauge("callback_us", result.callbackNs / 1000.0);
+            writer.Gauge("range_for_us", result.rangeForNs / 1000.0);
+            writer.Gauge("collect_all_us", result.collectAllNs / 1000.0);
+        });
+    }
+
+    void BenchmarkSignatureDecoding(const CComPtr<IMetaDataImport2>& metadataImport) {
+        static SignatureDecodingResult result;
+
+        std::vector<std::pair<PCCOR_SIGNATURE, ULONG>> signatures;
+        std::vector<mdTypeDef> typeDefs;
+        std::vector<mdMethodDef> methodDefs;
+        EnumTypeDefs(metadataImport).CollectAll(typeDefs);
+        for (const auto typeDef : typeDefs) {
+            EnumMethods(metadataImport, typeDef).CollectAll(methodDefs);
+        }
+        for (const auto methodDef : methodDefs) {
+            PCCOR_SIGNATURE signature = nullptr;
+            ULONG length = 0;
+            if (SUCCEEDED(metadataImport->GetMethodProps(methodDef, nullptr, nullptr, 0, nullptr, nullptr,
+                &signature, &length, nullptr, nullptr)) && length > 0) {
+                signatures.emplace_back(signature, length);
+                result.signatureBytes += length;
+            }
+        }
+        result.signatures = signatures.size();
+
+        // the values the signatures hold, in the order and with the sizes they really have
+        std::vector<COR_SIGNATURE> stream;
+        ParsedSignature parsed;
+        for (const auto& signature : signatures) {
+            if (FAILED(DecodeMethodSignature(signature.first, signature.second, parsed))) {
+                continue;
+            }
+            Encode(stream, parsed.genericArity);
+            Encode(stream, (ULONG)parsed.params.size());
+            for (const auto& node : parsed.nodes) {
+                if (node.token != mdTokenNil && TypeFromToken(node.token) != mdtBaseType) {
+                    COR_SIGNATURE bytes[4];
+                    const ULONG length = CorSigCompressToken(node.token, bytes);
+                    stream.insert(stream.end(), bytes, bytes + length);
+                }
+                if (node.count > 1) {
+                    Encode(stream, node.count);
+                }
+                if (node.elementType == ELEMENT_TYPE_VAR || node.elementType == ELEMENT_TYPE_MVAR ||
+                    node.elementType == ELEMENT_TYPE_ARRAY) {
+                    Encode(stream, node.value);
+                }
+            }
+        }
+        result.valueBytes = stream.size();
+
+        const PCCOR_SIGNATURE begin = stream.data();
+        const PCCOR_SIGNATURE end = begin + stream.size();
+        std::vector<ULONG> values(stream.size());
+        UINT64 bytewiseSum = 0;
+        UINT64 singleSum = 0;
+        UINT64 runSum = 0;
+
+        for (int round = 0; round < Rounds; round++) {
+            UINT64 start = ReadTimestamp();
+            for (const auto& signature : signatures) {
+                DecodeMethodSignature(signature.first, signature.second, parsed);
+            }
+            KeepBest(result.decodeNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            bytewiseSum = 0;
+            start = ReadTimestamp();
+            for (PCCOR_SIGNATURE cur = begin; cur < end;) {
+                unsigned value;
+                if (!ParseNumber(cur, end, &value)) {
+                    break;
+                }
+                bytewiseSum += value;
+            }
+            KeepBest(result.bytewiseNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            singleSum = 0;
+            result.values = 0;
+            start = ReadTimestamp();
+            for (PCCOR_SIGNATURE cur = begin; cur < end; result.values++) {
+                ULONG value;
+                if (!DecodeCompressed(cur, end, &value)) {
+                    break;
+                }
+                singleSum += value;
+            }
+            KeepBest(result.singleNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            runSum = 0;
+            start = ReadTimestamp();
+            PCCOR_SIGNATURE cur = begin;
+            const ULONG decoded = DecodeCompressedRun(cur, end, values.data(), (ULONG)values.size());
+            for (ULONG i = 0; i < decoded; i++) {
+                runSum += values[i];
+            }
+            KeepBest(result.runNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+        }
+
+        if (bytewiseSum != singleSum || singleSum != runSum) {
+            LOG_WARNING("BenchmarkSignatureDecoding: decoders disagree, {} {} {}", bytewiseSum, singleSum, runSum);
+        }
+
+        ProfilerStats::Instance()->Register("signature_benchmark", [](StatsWriter& writer) {
+            writer.Counter("signatures", result.signatures);
+            writer.Counter("signature_bytes", result.signatureBytes);
+            writer.Gauge("decode_us", result.decodeNs / 1000.0);
+            writer.Counter("values", result.values);
+            writer.Counter("value_bytes", result.valueBytes);
+            writer.Gauge("bytewise_us", result.bytewiseNs / 1000.0);
+            writer.Gauge("single_us", result.singleNs / 1000.0);
+            writer.Gauge("run_us", result.runNs / 1000.0);
+        });
+    }
+
+    void BenchmarkTranscoding(const CComPtr<IMetaDataImport2>& metadataImport) {
+        static TranscodingResult result;
+
+        const std::vector<WSTRING> wideNames = CollectNames(metadataImport);
+
+        std::vector<std::string> names;
+        names.reserve(wideNames.size());
+        size_t longest = 0;
+        for (const auto& wideName : wideNames) {
+            names.push_back(ToString(wideName));
+            result.units += wideName.length();
+            result.nonAscii += names.back().length() != wideName.length();
+            longest = std::max(longest, wideName.length());
+        }
+        result.names = names.size();
+
+        std::vector<char> narrow(Utf8Capacity(longest));
+        std::vector<WCHAR> wide(Utf16Capacity(Utf8Capacity(longest)));
+        UINT64 miniutfUnits = 0;
+        UINT64 stringUnits = 0;
+        UINT64 bufferUnits = 0;
+
+        for (int round = 0; round < Rounds; round++) {
+            miniutfUnits = 0;
+            UINT64 start = ReadTimestamp();
+            for (const auto& wideName : wideNames) {
+                miniutfUnits += miniutf::to_utf8(std::u16string(reinterpret_cast<const char16_t*>(wideName.c_str()))).length();
+            }
+            KeepBest(result.miniutfNarrowNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            start = ReadTimestamp();
+            for (const auto& narrowName : names) {
+                miniutfUnits += miniutf::to_utf16(narrowName).length();
+            }
+            KeepBest(result.miniutfWidenNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            stringUnits = 0;
+            start = ReadTimestamp();
+            for (const auto& wideName : wideNames) {
+                stringUnits += ToString(wideName).length();
+            }
+            KeepBest(result.toStringNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            start = ReadTimestamp();
+            for (const auto& narrowName : names) {
+                stringUnits += ToWSTRING(narrowName).length();
+            }
+            KeepBest(result.toWstringNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            bufferUnits = 0;
+            start = ReadTimestamp();
+            for (const auto& wideName : wideNames) {
+                bufferUnits += Utf16ToUtf8(wideName.data(), wideName.length(), narrow.data(), narrow.size());
+            }
+            KeepBest(result.bufferNarrowNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+
+            start = ReadTimestamp();
+            for (const auto& narrowName : names) {
+                bufferUnits += Utf8ToUtf16(narrowName.data(), narrowName.length(), wide.data(), wide.size());
+            }
+            KeepBest(result.bufferWidenNs, TicksToNanoseconds(ReadTimestamp() - start), round);
+        }
+
+        if (miniutfUnits != stringUnits || stringUnits != bufferUnits) {
+            LOG_WARNING("BenchmarkTranscoding: transcoders disagree, {} {} {}", miniutfUnits, stringUnits, bufferUnits);
+        }
+
+        ProfilerStats::Instance()->Register("transcode_benchmark", [](StatsWriter& writer) {
+            writer.Counter("names", result.names);
+            writer.Counter("code_units", result.units);
+            writer.Counter("non_ascii_names", result.nonAscii);
+            writer.Gauge("miniutf_to_utf8_us", result.miniutfNarrowNs / 1000.0);
+            writer.Gauge("miniutf_to_utf16_us", result.miniutfWidenNs / 1000.0);
+            writer.Gauge("to_string_us", result.toStringNs / 1000.0);
+            writer.Gauge("to_wstring_us", result.toWstringNs / 1000.0);
+            writer.Gauge("buffer_to_utf8_us", result.bufferNarrowNs / 1000.0);
+            writer.Gauge("buffer_to_utf16_us", result.bufferWidenNs / 1000.0);
+        });
+    }
+
+    void BenchmarkFolding(const CComPtr<IMetaDataImport2>& metadataImport) {
+        static FoldingResult result;
+
+        std::vector<std::string> ascii;
+        std::vector<std::string> mixed;
+        for (const auto& name : CollectNames(metadataImport)) {
+            ascii.push_back(ToString(name));
+            // U+00C9, LATIN CAPITAL LETTER E WITH ACUTE
+            mixed.push_back(ascii.back() + "\xC3\x89");
+        }
+        result.names = ascii.size();
+
+        const auto time = [](const std::vector<std::string>& names, bool fold, double& best, int round) {
+            UINT64 bytes = 0;
+            const UINT64 start = ReadTimestamp();
+            for (const auto& name : names) {
+                bytes += fold ? FoldName(name).length() : miniutf::lowercase(miniutf::nfc(name)).length();
+            }
+            KeepBest(best, TicksToNanoseconds(ReadTimestamp() - start), round);
+            return bytes;
+        };
+
+        for (int round = 0; round < Rounds; round++) {
+            result.mismatches = 0;
+            result.mismatches += time(ascii, false, result.miniutfAsciiNs, round) != time(ascii, true, result.foldAsciiNs, round);
+            result.mismatches += time(mixed, false, result.miniutfMixedNs, round) != time(mixed, true, result.foldMixedNs, round);
+        }
+
+        if (result.mismatches != 0) {
+            LOG_WARNING("BenchmarkFolding: FoldName and miniutf disagree");
+        }
+
+        ProfilerStats::Instance()->Register("fold_benchmark", [](StatsWriter& writer) {
+            writer.Counter("names", result.names);
+            writer.Counter("mismatches", result.mismatches);
+            writer.Gauge("miniutf_ascii_us", result.miniutfAsciiNs / 1000.0);
+            writer.Gauge("fold_ascii_us", result.foldAsciiNs / 1000.0);
+            writer.Gauge("miniutf_non_ascii_us", result.miniutfMixedNs / 1000.0);
+            writer.Gauge("fold_non_ascii_us", result.foldMixedNs / 1000.0);
+        });
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef CLR_PROFILER_METADATA_BENCHMARK_H_
+#define CLR_PROFILER_METADATA_BENCHMARK_H_
+
+#include <corprof.h>
+#include "CComPtr.h"
+
+namespace trace {
+
+    // BenchmarkMethodEnumeration times enumerating every MethodDef of a module, EnumTypeDefs and
+    // EnumMethods for each type, with the former std::function enumerator as the baseline, with
+    // range-for and with CollectAll, and publishes the best of several rounds in the
+    // "enum_benchmark" stats section.
+    void BenchmarkMethodEnumeration(const CComPtr<IMetaDataImport2>& metadataImport);
+
+    // BenchmarkSignatureDecoding collects the signature of every MethodDef of a module and times
+    // decoding all of them, then re-encodes the compressed integers and tokens they hold and times
+    // reading that stream one byte at a time, one value at a time and in runs. The best of several
+    // rounds is published in the "signature_benchmark" stats section.
+    void BenchmarkSignatureDecoding(const CComPtr<IMetaDataImport2>& metadataImport);
+
+    // BenchmarkTranscoding collects the names of every TypeDef and MethodDef of a module and times
+    // converting them to UTF-8 and back with miniutf, with ToString and ToWSTRING, and with the
+    // transcoders writing into one reused buffer. The best of several rounds is published in the
+    // "transcode_benchmark" stats section.
+    void BenchmarkTranscoding(const CComPtr<IMetaDataImport2>& metadataImport);
+
+    // BenchmarkFolding collects the UTF-8 names of every TypeDef and MethodDef of a module and times
+    // miniutf::lowercase(miniutf::nfc(name)) against FoldName, once on the names as they are and once
+    // with a precomposed non-ASCII letter appended to each, which takes FoldName off its ASCII path.
+    // The best of several rounds is published in the "fold_benchmark" stats section.
+    void BenchmarkFolding(const CComPtr<IMetaDataImport2>& metadataImport);
+}
+
+#endif  // CLR_PROFILER_METADATA_BENCHMARK_H_
@@ -0,0 +1,312 @@
+#include "module_store.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include "profiler_stats.h"
+
+namespace trace {
+
+    namespace {
+        // most modules are never indexed and only have a handful of methods rewritten
+        const size_t ModuleArenaInitialBlock = 1024;
+
+        bool Less(WStringView a, WStringView b) {
+            return std::lexicographical_compare(a.data(), a.data() + a.length(), b.data(), b.data() + b.length());
+        }
+
+        WStringView Head(WStringView name, size_t length) {
+            return name.length() <= length ? name : WStringView(name.data(), length);
+        }
+
+        // ReadName tells whether a metadata name read into a NameMaxSize buffer is whole. A name that
+        // did not fit comes back truncated, with CLDB_S_TRUNCATION and its full length, and is skipped
+        // rather than read past the buffer.
+        bool ReadName(HRESULT hr, ULONG length) {
+            return SUCCEEDED(hr) && length > 0 && length <= NameMaxSize;
+        }
+    }
+
+    HRESULT MethodNameIndex::Build(const CComPtr<IMetaDataImport2>& metadataImport)
+    {
+        struct Pending {
+            size_t offset;
+            size_t length;
+            size_t typeLength;
+            mdMethodDef token;
+        };
+
+        std::vector<mdTypeDef> typeDefs;
+        HRESULT hr = EnumTypeDefs(metadataImport).CollectAll(typeDefs);
+        if (FAILED(hr)) {
+            return hr;
+        }
+
+        // the names are gathered in one buffer first, then copied into the arena in one piece
+        std::vector<WCHAR> text;
+        std::vector<Pending> pending;
+        std::vector<mdMethodDef> methodDefs;
+        WCHAR typeName[NameMaxSize];
+        WCHAR methodName[NameMaxSize];
+        ULONG typeLength = 0;
+        ULONG methodLength = 0;
+        for (const auto typeDef : typeDefs) {
+            hr = metadataImport->GetTypeDefProps(typeDef, typeName, NameMaxSize, &typeLength, nullptr, nullptr);
+            if (!ReadName(hr, typeLength)) {
+                continue;
+            }
+            methodDefs.clear();
+            EnumMethods(metadataImport, typeDef).CollectAll(methodDefs);
+            for (const auto methodDef : methodDefs) {
+                hr = metadataImport->GetMethodProps(methodDef, nullptr, methodName, NameMaxSize, &methodLength, nullptr,
+                    nullptr, nullptr, nullptr, nullptr);
+                if (!ReadName(hr, methodLength)) {
+                    continue;
+                }
+                pending.push_back({ text.size(), (typeLength - 1) + 1 + (methodLength - 1), typeLength - 1, methodDef });
+                text.insert(text.end(), typeName, typeName + typeLength - 1);
+                text.push_back('.');
+                text.insert(text.end(), methodName, methodName + methodLength - 1);
+            }
+        }
+
+        WCHAR* names = arena_.AllocateArray<WCHAR>(text.size() + 1);
+        std::copy(text.begin(), text.end(), names);
+        auto methods = arena_.AllocateArray<IndexedMethod>(pending.size());
+        for (size_t i = 0; i < pending.size(); i++) {
+            const Pending& method = pending[i];
+            new (&methods[i]) IndexedMethod{
+                WStringView(names + method.offset, method.length),
+                WStringView(names + method.offset + method.typeLength + 1, method.length - method.typeLength - 1),
+                method.token };
+        }
+        std::sort(methods, methods + pending.size(), [](const IndexedMethod& a, const IndexedMethod& b) {
+            return Less(a.fullName, b.fullName);
+        });
+
+        auto byMethodName = arena_.AllocateArray<const IndexedMethod*>(pending.size());
+        for (size_t i = 0; i < pending.size(); i++) {
+            byMethodName[i] = &methods[i];
+        }
+        std::sort(byMethodName, byMethodName + pending.size(), [](const IndexedMethod* a, const IndexedMethod* b) {
+            return Less(a->methodName, b->methodName);
+        });
+
+        byFullName_ = methods;
+        byMethodName_ = byMethodName;
+        count_ = pending.size();
+        return S_OK;
+    }
+
+    bool MayDefineMethod(const CComPtr<IMetaDataImport2>& metadataImport, const std::vector<WSTRING>& targets)
+    {
+        if (targets.empty()) {
+            return false;
+        }
+        const auto tables = metadataImport.As<IMetaDataTables>(IID_IMetaDataTables);
+        ULONG heapSize = 0;
+        if (tables.IsNull() || FAILED(tables->GetStringHeapSize(&heapSize))) {
+            return true;
+        }
+
+        // the heap holds UTF-8 names; type names contain '.' too, so every part of a target after
+        // one of its '.' may be the method name
+        std::vector<std::string> names;
+        for (const auto& target : targets) {
+            names.push_back(ToString(target));
+            for (size_t dot = target.find('.'); dot != WSTRING::npos; dot = target.find('.', dot + 1)) {
+                if (dot + 1 < target.length()) {
+                    names.push_back(ToString(target.substr(dot + 1)));
+                }
+            }
+        }
+        std::sort(names.begin(), names.end());
+
+        ULONG index = 0;
+        while (index < heapSize) {
+            const char* name = nullptr;
+            if (FAILED(tables->GetString(index, &name))) {
+                return true;
+            }
+            const auto it = std::lower_bound(names.begin(), names.end(), name,
+                [](const std::string& a, const char* b) { return strcmp(a.c_str(), b) < 0; });
+            if (it != names.end() && strcmp(it->c_str(), name) == 0) {
+                return true;
+            }
+            ULONG next = 0;
+            if (tables->GetNextString(index, &next) != S_OK || next <= index) {
+                break;
+            }
+            index = next;
+        }
+        return false;
+    }
+
+    MethodNameIndex::Range MethodNameIndex::Find(WStringView fullName) const
+    {
+        return std::equal_range(byFullName_, byFullName_ + count_, IndexedMethod{ fullName, WStringView(), mdTokenNil },
+            [](const IndexedMethod& a, const IndexedMethod& b) { return Less(a.fullName, b.fullName); });
+    }
+
+    MethodNameIndex::Range MethodNameIndex::FindPrefix(WStringView prefix) const
+    {
+        // names are compared on their first prefix.length() characters only, so every name
+        // starting with prefix is equal to it
+        const size_t length = prefix.length();
+        return std::equal_range(byFullName_, byFullName_ + count_, IndexedMethod{ prefix, WStringView(), mdTokenNil },
+            [length](const IndexedMethod& a, const IndexedMethod& b) {
+            return Less(Head(a.fullName, length), Head(b.fullName, length));
+        });
+    }
+
+    void MethodNameIndex::FindMethod(WStringView methodName, std::vector<const IndexedMethod*>& methods) const
+    {
+        IndexedMethod key{ WStringView(), methodName, mdTokenNil };
+        const auto range = std::equal_range(byMethodName_, byMethodName_ + count_, &key,
+            [](const IndexedMethod* a, const IndexedMethod* b) { return Less(a->methodName, b->methodName); });
+        methods.insert(methods.end(), range.first, range.second);
+    }
+
+    void MethodNameIndex::FindSuffix(WStringView name, std::vector<const IndexedMethod*>& methods) const
+    {
+        // the method name is what follows the last '.', or the last ".ctor" / ".cctor"
+        size_t start = name.length();
+        while (start > 0 && name.data()[start - 1] != '.') {
+            start--;
+        }
+        if (start > 0 && (start == 1 || name.data()[start - 2] == '.')) {
+            start--;
+        }
+
+        const size_t first = methods.size();
+        FindMethod(WStringView(name.data() + start, name.length() - start), methods);
+        auto kept = methods.begin() + first;
+        for (auto it = kept; it != methods.end(); ++it) {
+            const WStringView fullName = (*it)->fullName;
+            const size_t offset = fullName.length() - (std::min)(fullName.length(), name.length());
+            const bool matches = fullName.length() >= name.length() &&
+                WStringView(fullName.data() + offset, name.length()) == name &&
+                (offset == 0 || fullName.data()[offset - 1] == '.');
+            if (matches) {
+                *kept++ = *it;
+            }
+        }
+        methods.erase(kept, methods.end());
+    }
+
+    ModuleMetaInfo::ModuleMetaInfo(ModuleID moduleId, mdToken entryPointToken, WStringView assemblyName)
+        : moduleId(moduleId), entryPointToken(entryPointToken), nativeProbeSignature(mdSignatureNil),
+          arena_(ModuleArenaInitialBlock),
+          rewritten_(0, std::hash<mdToken>(), std::equal_to<mdToken>(), TokenSet::allocator_type(&arena_)),
+          nameIndex_(nullptr)
+    {
+        WCHAR* name = arena_.AllocateArray<WCHAR>(assemblyName.length() + 1);
+        std::copy(assemblyName.data(), assemblyName.data() + assemblyName.length(), name);
+        name[assemblyName.length()] = 0;
+        this->assemblyName = WStringView(name, assemblyName.length());
+    }
+
+    ModuleMetaInfo::~ModuleMetaInfo()
+    {
+        delete nameIndex_.load(std::memory_order_relaxed);
+    }
+
+    const MethodNameIndex* ModuleMetaInfo::NameIndex(const CComPtr<IMetaDataImport2>& metadataImport)
+    {
+        MethodNameIndex* index = nameIndex_.load(std::memory_order_acquire);
+        if (index != nullptr) {
+            return index;
+        }
+
+        // threads that race to build it each build their own, the first one published is kept
+        std::unique_ptr<MethodNameIndex> built(new MethodNameIndex());
+        if (FAILED(built->Build(metadataImport))) {
+            return nullptr;
+        }
+        if (nameIndex_.compare_exchange_strong(index, built.get(), std::memory_order_acq_rel)) {
+            return built.release();
+        }
+        return index;
+    }
+
+    bool ModuleMetaInfo::IsRewritten(mdToken functionToken) const
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        return rewritten_.count(functionToken) > 0;
+    }
+
+    void ModuleMetaInfo::MarkRewritten(mdToken functionToken)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        rewritten_.insert(functionToken);
+    }
+
+    size_t ModuleMetaInfo::ArenaBytes() const
+    {
+        const MethodNameIndex* index = nameIndex_.load(std::memory_order_acquire);
+        std::lock_guard<std::mutex> guard(lock_);
+        return arena_.Bytes() + (index != nullptr ? index->ArenaBytes() : 0);
+    }
+
+    ModuleStore::ModuleStore() : loaded_(0), unloaded_(0)
+    {
+        ProfilerStats::Instance()->Register("modules", [this](StatsWriter& writer) { WriteStats(writer); });
+    }
+
+    std::shared_ptr<ModuleMetaInfo> ModuleStore::Add(ModuleID moduleId, mdToken entryPointToken, WStringView assemblyName)
+    {
+        auto module = std::make_shared<ModuleMetaInfo>(moduleId, entryPointToken, assemblyName);
+        std::lock_guard<std::mutex> guard(lock_);
+        const auto added = modules_.emplace(moduleId, module);
+        if (added.second) {
+            loaded_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return added.first->second;
+    }
+
+    std::shared_ptr<ModuleMetaInfo> ModuleStore::Find(ModuleID moduleId) const
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        const auto it = modules_.find(moduleId);
+        return it == modules_.end() ? nullptr : it->second;
+    }
+
+    void ModuleStore::Remove(ModuleID moduleId)
+    {
+        std::shared_ptr<ModuleMetaInfo> removed;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            const auto it = modules_.find(moduleId);
+            if (it == modules_.end()) {
+                return;
+            }
+            removed = std::move(it->second);
+            modules_.erase(it);
+        }
+        unloaded_.fetch_add(1, std::memory_order_relaxed);
+        // unless a rewrite still holds it, the module's arena is freed here, outside the lock
+    }
+
+    std::vector<std::shared_ptr<ModuleMetaInfo>> ModuleStore::Modules() const
+    {
+        std::vector<std::shared_ptr<ModuleMetaInfo>> modules;
+        std::lock_guard<std::mutex> guard(lock_);
+        modules.reserve(modules_.size());
+        for (const auto& entry : modules_) {
+            modules.push_back(entry.second);
+        }
+        return modules;
+    }
+
+    void ModuleStore::WriteStats(StatsWriter& writer)
+    {
+        UINT64 arenaBytes = 0;
+        const auto modules = Modules();
+        for (const auto& module : modules) {
+            arenaBytes += module->ArenaBytes();
+        }
+        writer.Counter("loaded", loaded_.load(std::memory_order_relaxed));
+        writer.Counter("unloaded", unloaded_.load(std::memory_order_relaxed));
+        writer.Counter("live", modules.size());
+        writer.Counter("arena_bytes", arenaBytes);
+    }
+}
@@ -0,0 +1,137 @@
+#ifndef CLR_PROFILER_MODULE_STORE_H_
+#define CLR_PROFILER_MODULE_STORE_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <corprof.h>
+#include "arena.h"
+#include "clr_helpers.h"
+#include "signature_decoder.h"
+#include "string.h"  // NOLINT
+#include "symbol_cache.h"
+#include "util.h"
+
+namespace trace {
+
+    class StatsWriter;
+
+    // IndexedMethod is one MethodDef of a MethodNameIndex, its names are views into the index.
+    struct IndexedMethod {
+        WStringView fullName;
+        // the part of fullName after the type name and the '.'
+        WStringView methodName;
+        mdMethodDef token;
+    };
+
+    // MethodNameIndex maps the "Type.Method" names of every MethodDef of a module to their tokens.
+    // It is built by one pass over the module's TypeDefs and MethodDefs into its own arena and
+    // never changes after, so lookups are binary searches without locks.
+    class MethodNameIndex {
+    public:
+        typedef std::pair<const IndexedMethod*, const IndexedMethod*> Range;
+
+        HRESULT Build(const CComPtr<IMetaDataImport2>& metadataImport);
+
+        // Find returns the methods named fullName, overloads share a name.
+        Range Find(WStringView fullName) const;
+
+        // FindPrefix returns the methods whose full name starts with prefix, in name order.
+        Range FindPrefix(WStringView prefix) const;
+
+        // FindMethod appends the methods named methodName on any type.
+        void FindMethod(WStringView methodName, std::vector<const IndexedMethod*>& methods) const;
+
+        // FindSuffix appends the methods whose full name is name or ends with '.' and name, the
+        // way PROFILER_REJIT_TARGETS names methods.
+        void FindSuffix(WStringView name, std::vector<const IndexedMethod*>& methods) const;
+
+        size_t Count() const { return count_; }
+        size_t ArenaBytes() const { return arena_.Bytes(); }
+
+    private:
+        Arena arena_;
+        // sorted by full name, and the same methods sorted by method name
+        const IndexedMethod* byFullName_ = nullptr;
+        const IndexedMethod* const* byMethodName_ = nullptr;
+        size_t count_ = 0;
+    };
+
+    // MayDefineMethod tells from the module's string heap alone whether it can have a method named
+    // after one of targets, "Type.Method" or "Method" names as in PROFILER_REJIT_TARGETS. That is one
+    // pass over the heap instead of the metadata calls and sort of building a MethodNameIndex. It
+    // can answer true for a name only a type or a reference uses, and answers true when the heap
+    // cannot be read.
+    bool MayDefineMethod(const CComPtr<IMetaDataImport2>& metadataImport, const std::vector<WSTRING>& targets);
+
+    // ModuleMetaInfo is everything the profiler keeps about a loaded module. Its name index,
+    // rewritten tokens, resolved symbols and strings are allocated from the module's own arenas, so
+    // dropping the record frees all of them at once, however many methods the module had.
+    class ModuleMetaInfo {
+    public:
+        ModuleMetaInfo(ModuleID moduleId, mdToken entryPointToken, WStringView assemblyName);
+        ~ModuleMetaInfo();
+
+        const ModuleID moduleId;
+        const mdToken entryPointToken;
+        WStringView assemblyName;
+
+        std::atomic<mdSignature> nativeProbeSignature;
+        AssemblyRefIndex assemblyRefs;
+        SignatureCache signatures;
+        ModuleSymbols symbols;
+
+        // NameIndex returns the module's method name index, enumerating the module's metadata the
+        // first time it is asked for, or nullptr when the metadata cannot be read. The index is
+        // built without holding the lock IsRewritten takes on the JIT path.
+        const MethodNameIndex* NameIndex(const CComPtr<IMetaDataImport2>& metadataImport);
+
+        // IsRewritten and MarkRewritten track the MethodDefs rewritten on the JIT path, generic
+        // instantiations share their MethodDef so it is rewritten once.
+        bool IsRewritten(mdToken functionToken) const;
+        void MarkRewritten(mdToken functionToken);
+
+        size_t ArenaBytes() const;
+
+    private:
+        typedef std::unordered_set<mdToken, std::hash<mdToken>, std::equal_to<mdToken>, ArenaAllocator<mdToken>> TokenSet;
+
+        mutable std::mutex lock_;
+        Arena arena_;
+        TokenSet rewritten_;
+        std::atomic<MethodNameIndex*> nameIndex_;
+    };
+
+    // ModuleStore maps ModuleIDs to their ModuleMetaInfo. Readers get a shared reference, so
+    // ModuleUnloadFinished can remove a module with one erase while a rewrite still uses it; the
+    // record and its arena go away when the last reference does.
+    class ModuleStore : public Singleton<ModuleStore> {
+        friend class Singleton<ModuleStore>;
+
+    public:
+        // Add keeps the record it already has for moduleId, after attach a module can be reported
+        // both by EnumModules and by ModuleLoadFinished.
+        std::shared_ptr<ModuleMetaInfo> Add(ModuleID moduleId, mdToken entryPointToken, WStringView assemblyName);
+        std::shared_ptr<ModuleMetaInfo> Find(ModuleID moduleId) const;
+        void Remove(ModuleID moduleId);
+
+        // Modules returns the modules loaded at the time of the call.
+        std::vector<std::shared_ptr<ModuleMetaInfo>> Modules() const;
+
+    private:
+        ModuleStore();
+
+        void WriteStats(StatsWriter& writer);
+
+        mutable std::mutex lock_;
+        std::unordered_map<ModuleID, std::shared_ptr<ModuleMetaInfo>> modules_;
+        std::atomic<UINT64> loaded_;
+        std::atomic<UINT64> unloaded_;
+    };
+}
+
+#endif  // CLR_PROFILER_MODULE_STORE_H_
@@ -0,0 +1,223 @@
+#include "name_folding.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "miniutf.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PROFILER_FOLDING_SIMD 1
+#include <emmintrin.h>
+#endif
+
+// the lookups miniutfdata.h defines inside miniutf.cpp
+namespace miniutf {
+    int32_t decomp_idx(int32_t codepoint);
+    int32_t ccc(int32_t codepoint);
+    int32_t lowercase_offset(int32_t codepoint);
+}
+
+namespace trace {
+
+    namespace {
+        const unsigned BlockBits = 7;
+        const unsigned BlockSize = 1 << BlockBits;
+        const unsigned BmpSize = 0x10000;
+
+        // FoldTable holds, for every BMP code point, Slow when NFC may change it or the code point
+        // before it, otherwise the index of its lowercase offset. Identical blocks are stored once,
+        // which leaves a few dozen distinct blocks: a lookup reads one entry of blocks_, one of
+        // entries_ and one of offsets_.
+        class FoldTable {
+        public:
+            static const uint8_t Slow = 0xFF;
+
+            static const FoldTable& Instance() {
+                static const FoldTable table;
+                return table;
+            }
+
+            // Lowercase returns the lowercase of a BMP code point, or -1 when the name must go
+            // through miniutf.
+            int32_t Lowercase(uint32_t codepoint) const {
+                const uint8_t entry = entries_[((size_t)blocks_[codepoint >> BlockBits] << BlockBits) | (codepoint & (BlockSize - 1))];
+                return entry == Slow ? -1 : (int32_t)codepoint + offsets_[entry];
+            }
+
+        private:
+            FoldTable() {
+                // a code point is slow when NFC replaces it, when it has a combining class, or when
+                // it is a starter NFC may compose with the code point before it: the last code point
+                // of some canonical decomposition, or a Hangul vowel or trailing consonant, which
+                // are composed algorithmically
+                std::vector<bool> slow(BmpSize);
+                for (uint32_t codepoint = 0xD800; codepoint < 0xE000; codepoint++) {
+                    slow[codepoint] = true;
+                }
+                for (uint32_t codepoint = 0x80; codepoint < BmpSize; codepoint++) {
+                    slow[codepoint] = slow[codepoint] || miniutf::ccc(codepoint) != 0;
+                    const bool hangul = codepoint >= 0xAC00 && codepoint < 0xD7A4;
+                    if ((miniutf::decomp_idx(codepoint) == 0 && !hangul) || (codepoint >= 0xD800 && codepoint < 0xE000)) {
+                        continue;
+                    }
+                    std::string utf8;
+                    miniutf::utf8_encode(codepoint, utf8);
+                    slow[codepoint] = slow[codepoint] || miniutf::nfc(utf8) != utf8;
+                    const auto decomposed = miniutf::to_utf16(miniutf::nfd(utf8));
+                    if (decomposed.length() > 1) {
+                        slow[decomposed.back()] = true;
+                    }
+                }
+                for (uint32_t codepoint = 0x1161; codepoint < 0x1176; codepoint++) {
+                    slow[codepoint] = true;
+                }
+                for (uint32_t codepoint = 0x11A8; codepoint < 0x11C3; codepoint++) {
+                    slow[codepoint] = true;
+                }
+
+                std::unordered_map<int32_t, uint8_t> offsetIndexes;
+                std::unordered_map<std::string, uint16_t> blockIndexes;
+                blocks_.resize(BmpSize / BlockSize);
+                std::string block(BlockSize, '\0');
+                for (uint32_t first = 0; first < BmpSize; first += BlockSize) {
+                    for (uint32_t i = 0; i < BlockSize; i++) {
+                        const uint32_t codepoint = first + i;
+                        uint8_t entry = Slow;
+                        if (!slow[codepoint]) {
+                            const int32_t offset = miniutf::lowercase_offset(codepoint);
+                            const auto inserted = offsetIndexes.emplace(offset, (uint8_t)offsets_.size());
+                            if (inserted.second) {
+                                offsets_.push_back(offset);
+                            }
+                            entry = inserted.first->second;
+                        }
+                        block[i] = (char)entry;
+                    }
+                    const auto inserted = blockIndexes.emplace(block, (uint16_t)(entries_.size() / BlockSize));
+                    if (inserted.second) {
+                        entries_.insert(entries_.end(), block.begin(), block.end());
+                    }
+                    blocks_[first >> BlockBits] = inserted.first->second;
+                }
+            }
+
+            std::vector<uint16_t> blocks_;
+            std::vector<uint8_t> entries_;
+            std::vector<int32_t> offsets_;
+        };
+
+        // LowercaseAscii lowercases the leading ASCII of src into dst and returns how many code
+        // units it wrote; it stops at the first block holding anything else.
+        size_t LowercaseAscii(const char* src, size_t length, char* dst) {
+            size_t i = 0;
+#if PROFILER_FOLDING_SIMD
+            const __m128i beforeA = _mm_set1_epi8('A' - 1);
+            const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+            const __m128i caseBit = _mm_set1_epi8(0x20);
+            for (; i + 16 <= length; i += 16) {
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                if (_mm_movemask_epi8(bytes) != 0) {
+                    break;
+                }
+                const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, beforeA), _mm_cmplt_epi8(bytes, afterZ));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(bytes, _mm_and_si128(upper, caseBit)));
+            }
+#endif
+            for (; i < length && (unsigned char)src[i] < 0x80; i++) {
+                dst[i] = src[i] >= 'A' && src[i] <= 'Z' ? (char)(src[i] | 0x20) : src[i];
+            }
+            return i;
+        }
+
+        size_t LowercaseAscii(const WCHAR* src, size_t length, WCHAR* dst) {
+            size_t i = 0;
+#if PROFILER_FOLDING_SIMD
+            const __m128i beforeA = _mm_set1_epi16('A' - 1);
+            const __m128i afterZ = _mm_set1_epi16('Z' + 1);
+            const __m128i caseBit = _mm_set1_epi16(0x20);
+            const __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 8 <= length; i += 8) {
+                const __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, nonAscii), zero)) != 0xFFFF) {
+                    break;
+                }
+                const __m128i upper = _mm_and_si128(_mm_cmpgt_epi16(units, beforeA), _mm_cmplt_epi16(units, afterZ));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_or_si128(units, _mm_and_si128(upper, caseBit)));
+            }
+#endif
+            for (; i < length && src[i] < 0x80; i++) {
+                dst[i] = src[i] >= 'A' && src[i] <= 'Z' ? (WCHAR)(src[i] | 0x20) : src[i];
+            }
+            return i;
+        }
+
+        // DecodeBmp decodes one two or three byte UTF-8 sequence, or returns -1 for anything else:
+        // invalid UTF-8 and code points beyond the BMP are left to miniutf.
+        int32_t DecodeBmp(const std::string& str, size_t& i) {
+            const unsigned char b0 = str[i];
+            if (b0 >= 0xC0 && b0 < 0xE0 && i + 1 < str.length()) {
+                const unsigned char b1 = str[i + 1];
+                const int32_t codepoint = ((b0 & 0x1F) << 6) | (b1 & 0x3F);
+                if ((b1 & 0xC0) == 0x80 && codepoint >= 0x80) {
+                    i += 2;
+                    return codepoint;
+                }
+            }
+            else if (b0 >= 0xE0 && b0 < 0xF0 && i + 2 < str.length()) {
+                const unsigned char b1 = str[i + 1];
+                const unsigned char b2 = str[i + 2];
+                const int32_t codepoint = ((b0 & 0x0F) << 12) | ((b1 & 0x3F) << 6) | (b2 & 0x3F);
+                if ((b1 & 0xC0) == 0x80 && (b2 & 0xC0) == 0x80 && codepoint >= 0x800) {
+                    i += 3;
+                    return codepoint;
+                }
+            }
+            return -1;
+        }
+    }
+
+    std::string FoldName(const std::string& name) {
+        // a few code points change their UTF-8 length when lowercased, so past the ASCII the output
+        // is appended to
+        std::string folded(name.length(), '\0');
+        size_t i = LowercaseAscii(name.data(), name.length(), &folded[0]);
+        if (i == name.length()) {
+            return folded;
+        }
+        folded.resize(i);
+
+        const FoldTable& table = FoldTable::Instance();
+        while (i < name.length()) {
+            const unsigned char b = name[i];
+            if (b < 0x80) {
+                folded += b >= 'A' && b <= 'Z' ? (char)(b | 0x20) : (char)b;
+                i++;
+                continue;
+            }
+            const int32_t codepoint = DecodeBmp(name, i);
+            const int32_t lower = codepoint < 0 ? -1 : table.Lowercase(codepoint);
+            if (lower < 0) {
+                return miniutf::lowercase(miniutf::nfc(name));
+            }
+            miniutf::utf8_encode(lower, folded);
+        }
+        return folded;
+    }
+
+    WSTRING FoldName(WStringView name) {
+        WSTRING folded(name.length(), 0);
+        size_t i = LowercaseAscii(name.data(), name.length(), &folded[0]);
+
+        const FoldTable* table = i == name.length() ? nullptr : &FoldTable::Instance();
+        // every code point the table lets through lowercases to another BMP code point that is not
+        // a surrogate, so the length is kept
+        for (; i < name.length(); i++) {
+            const int32_t lower = table->Lowercase(name.data()[i]);
+            if (lower < 0) {
+                return ToWSTRING(miniutf::lowercase(miniutf::nfc(ToString(name.str()))));
+            }
+            folded[i] = (WCHAR)lower;
+        }
+        return folded;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef CLR_PROFILER_NAME_FOLDING_H_
+#define CLR_PROFILER_NAME_FOLDING_H_
+
+#include <string>
+#include "string.h"  // NOLINT
+
+namespace trace {
+
+    // FoldName returns name in Normalization Form C and lowercased code point by code point, the
+    // same as miniutf::lowercase(miniutf::nfc(name)), so two names that differ only in case or in
+    // how their accents are encoded fold to the same string.
+    //
+    // ASCII is already in NFC and is lowercased 16 bytes (8 UTF-16 code units) at a time with SSE2.
+    // Other BMP code points are looked up in a two-level table, one byte per code point in blocks of
+    // 128, which says whether the code point is left alone by NFC and by how much it lowercases.
+    // Only a name holding a code point NFC may change, a surrogate pair or invalid UTF-8 goes
+    // through miniutf.
+    std::string FoldName(const std::string& name);
+    WSTRING FoldName(WStringView name);
+}
+
+#endif  // CLR_PROFILER_NAME_FOLDING_H_
@@ -0,0 +1,100 @@
+#include "native_probe.h"
+#include "event_buffer.h"
+#include "profiler_config.h"
+
+namespace trace {
+
+    namespace {
+        const WSTRING SuppressGCTransitionTypeName = "System.Runtime.CompilerServices.CallConvSuppressGCTransition"_W;
+    }
+
+    ProbeAbi GetProbeAbi() {
+        return ProfilerConfig::Instance()->Current()->Value(WStr("PROFILER_PROBE_ABI")) == WStr("native") ? ProbeAbi::Native : ProbeAbi::Managed;
+    }
+
+    ProbeSiteTable::~ProbeSiteTable() {
+        for (auto chunk : chunks_) {
+            delete[] chunk;
+        }
+    }
+
+    ProbeSite* ProbeSiteTable::GetOrAdd(ModuleID moduleId, mdMethodDef methodDef) {
+        std::lock_guard<std::mutex> guard(lock_);
+        const auto key = std::make_pair(moduleId, methodDef);
+        const auto it = sites_.find(key);
+        if (it != sites_.end()) {
+            return it->second;
+        }
+
+        ProbeSite* site;
+        if (!free_.empty()) {
+            site = free_.back();
+            free_.pop_back();
+        }
+        else {
+            if (nextInChunk_ == SitesPerChunk) {
+                if (chunks_.size() == MaxChunks) {
+                    return nullptr;
+                }
+                chunks_.push_back(new ProbeSite[SitesPerChunk]());
+                nextInChunk_ = 0;
+            }
+            site = &chunks_.back()[nextInChunk_++];
+        }
+
+        site->hits = 0;
+        site->moduleId = moduleId;
+        site->methodDef = methodDef;
+        sites_[key] = site;
+        return site;
+    }
+
+    void ProbeSiteTable::ForgetModule(ModuleID moduleId) {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto it = sites_.lower_bound(std::make_pair(moduleId, (mdMethodDef)0));
+        while (it != sites_.end() && it->first.first == moduleId) {
+            free_.push_back(it->second);
+            it = sites_.erase(it);
+        }
+    }
+
+    HRESULT GetNativeProbeSignature(CComPtr<IUnknown>& metadata_interfaces, const AssemblyProperty& corLib,
+        AssemblyRefIndex& assemblyRefs, mdSignature* signature) {
+        auto pEmit = metadata_interfaces.As<IMetaDataEmit2>(IID_IMetaDataEmit);
+        if (pEmit.IsNull()) {
+            return E_FAIL;
+        }
+
+        COR_SIGNATURE sig[16];
+        unsigned offset = 0;
+
+        // the unmanaged calling convention and its modifiers are understood from .NET 5 onwards
+        mdTypeRef suppressTypeRef = mdTypeRefNil;
+        if (corLib.szName == "System.Private.CoreLib"_W && corLib.pMetaData.usMajorVersion >= 5) {
+            const mdAssemblyRef corLibRef = GetCorLibAssemblyRef(metadata_interfaces, corLib, assemblyRefs);
+            if (corLibRef != mdAssemblyRefNil) {
+                pEmit->DefineTypeRefByName(corLibRef, SuppressGCTransitionTypeName.data(), &suppressTypeRef);
+            }
+        }
+
+        if (suppressTypeRef != mdTypeRefNil) {
+            sig[offset++] = IMAGE_CEE_CS_CALLCONV_UNMANAGED;
+            sig[offset++] = 0x01; // number parameters
+            sig[offset++] = ELEMENT_TYPE_CMOD_OPT;
+            offset += CorSigCompressToken(suppressTypeRef, &sig[offset]);
+        }
+        else {
+            sig[offset++] = IMAGE_CEE_CS_CALLCONV_C;
+            sig[offset++] = 0x01; // number parameters
+        }
+        sig[offset++] = ELEMENT_TYPE_VOID; // return type
+        sig[offset++] = ELEMENT_TYPE_I; // ProbeSite*
+
+        return pEmit->GetTokenFromSig(sig, offset, signature);
+    }
+
+    extern "C" void __cdecl ProfilerProbeEnter(ProbeSite* site) {
+        site->hits = site->hits + 1;
+        EventPipeline::Instance()->WriteAttached(EventKind::MethodEnter, site->methodDef, site->moduleId);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef CLR_PROFILER_NATIVE_PROBE_H_
+#define CLR_PROFILER_NATIVE_PROBE_H_
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include "CComPtr.h"
+#include "clr_helpers.h"
+#include "util.h"
+
+namespace trace {
+
+    // ProbeAbi selects what the injected IL calls into.
+    enum class ProbeAbi {
+        // call System.Console.WriteLine, needs the target assembly to reference System.Console
+        Managed,
+        // calli straight into ProfilerProbeEnter with an unmanaged calling convention
+        Native,
+    };
+
+    // GetProbeAbi reads PROFILER_PROBE_ABI, "native" or "managed" (the default).
+    ProbeAbi GetProbeAbi();
+
+    // ProbeSite is the per method state a probe works on, padded to a cache line so that hot methods
+    // on different cores never share one. Its address is baked into the injected IL: the count only
+    // probe increments hits inline, the native probe gets the whole site as its one argument.
+    // hits is a plain (non-interlocked) add, lost updates under contention only make the measured
+    // call rate a slight underestimate.
+    struct ProbeSite {
+        volatile INT64 hits;
+        ModuleID moduleId;
+        mdMethodDef methodDef;
+        BYTE padding[64 - sizeof(INT64) - sizeof(ModuleID) - sizeof(mdMethodDef)];
+    };
+
+    // ProbeSiteTable owns every ProbeSite. Sites are allocated in fixed chunks that are never moved
+    // or freed while the profiler is loaded, so an address compiled into a method stays valid for
+    // as long as that code can run; sites of unloaded modules are recycled.
+    class ProbeSiteTable : public Singleton<ProbeSiteTable> {
+        friend class Singleton<ProbeSiteTable>;
+
+    public:
+        static const unsigned SitesPerChunk = 1024;
+        static const unsigned MaxChunks = 64;
+
+        // GetOrAdd returns the site of the method, allocating one on first use.
+        // Returns nullptr once every chunk is in use.
+        ProbeSite* GetOrAdd(ModuleID moduleId, mdMethodDef methodDef);
+
+        // ForgetModule recycles the sites of an unloaded module.
+        void ForgetModule(ModuleID moduleId);
+
+    private:
+        ProbeSiteTable() {}
+        ~ProbeSiteTable();
+
+        std::mutex lock_;
+        std::vector<ProbeSite*> chunks_;
+        unsigned nextInChunk_ = SitesPerChunk;
+        std::vector<ProbeSite*> free_;
+        std::map<std::pair<ModuleID, mdMethodDef>, ProbeSite*> sites_;
+    };
+
+    // GetNativeProbeSignature returns a stand-alone signature token, for use with calli, matching
+    // ProfilerProbeEnter. When the module's corlib knows about CallConvSuppressGCTransition (.NET 5
+    // and later) the call is declared without a GC transition, otherwise it is a plain cdecl call.
+    HRESULT GetNativeProbeSignature(CComPtr<IUnknown>& metadata_interfaces, const AssemblyProperty& corLib,
+        AssemblyRefIndex& assemblyRefs, mdSignature* signature);
+
+    // ProfilerProbeEnter is the native entry point the injected IL calls. It runs in cooperative
+    // mode with no GC transition, so it must stay short, never block, never allocate, never throw and
+    // never call back into the runtime.
+    extern "C" void __cdecl ProfilerProbeEnter(ProbeSite* site);
+}
+
+#endif  // CLR_PROFILER_NATIVE_PROBE_H_
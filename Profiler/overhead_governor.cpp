@@ -0,0 +1,278 @@
+#include "overhead_governor.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include "event_buffer.h"
+#include "logger.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+#include "util.h"
+
+namespace trace {
+
+    namespace {
+        const unsigned MaxRevertBackoffIntervals = 3600;
+    }
+
+    GovernorSettings GovernorSettings::FromConfig(const ConfigSnapshot& config, ProbeAbi abi) {
+        GovernorSettings settings;
+        if (abi == ProbeAbi::Native) {
+            settings.fullProbeCostNs = settings.nativeProbeCostNs;
+        }
+        settings.cpuBudget = config.Number(WStr("PROFILER_GOVERNOR_BUDGET_PERCENT"), settings.cpuBudget * 100.0) / 100.0;
+        settings.upgradeRatio = config.Number(WStr("PROFILER_GOVERNOR_UPGRADE_RATIO"), settings.upgradeRatio);
+        settings.intervalMs = (unsigned)config.Number(WStr("PROFILER_GOVERNOR_INTERVAL_MS"), settings.intervalMs);
+        settings.confirmIntervals = (unsigned)config.Number(WStr("PROFILER_GOVERNOR_CONFIRM_INTERVALS"), settings.confirmIntervals);
+        settings.revertBackoffIntervals = (unsigned)config.Number(WStr("PROFILER_GOVERNOR_REVERT_BACKOFF_INTERVALS"), settings.revertBackoffIntervals);
+        settings.fullProbeCostNs = config.Number(WStr("PROFILER_GOVERNOR_FULL_PROBE_NS"), settings.fullProbeCostNs);
+        settings.countProbeCostNs = config.Number(WStr("PROFILER_GOVERNOR_COUNT_PROBE_NS"), settings.countProbeCostNs);
+
+        if (settings.intervalMs == 0) {
+            settings.intervalMs = 1;
+        }
+        if (settings.confirmIntervals == 0) {
+            settings.confirmIntervals = 1;
+        }
+        return settings;
+    }
+
+    OverheadGovernor::OverheadGovernor(ICorProfilerInfo4* info, GovernorSettings settings)
+        : corProfilerInfo(info), settings(settings)
+    {
+        this->corProfilerInfo->AddRef();
+    }
+
+    OverheadGovernor::~OverheadGovernor()
+    {
+        Stop();
+        ProfilerStats::Instance()->Unregister("governor");
+        this->corProfilerInfo->Release();
+    }
+
+    void OverheadGovernor::Start()
+    {
+        std::lock_guard<std::mutex> guard(threadLock);
+        if (thread.joinable()) {
+            return;
+        }
+        ProfilerStats::Instance()->Register("governor", [this](StatsWriter& writer) { WriteStats(writer); });
+        stopping = false;
+        thread = std::thread(&OverheadGovernor::ThreadMain, this);
+    }
+
+    void OverheadGovernor::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(threadLock);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void OverheadGovernor::WriteStats(StatsWriter& writer)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        UINT64 counting = 0;
+        UINT64 reverted = 0;
+        for (const auto& entry : methods) {
+            if (entry.second.variant == ProbeVariant::CountOnly) {
+                counting++;
+            }
+            else if (entry.second.variant == ProbeVariant::Reverted) {
+                reverted++;
+            }
+        }
+        writer.Counter("governed_methods", methods.size());
+        writer.Counter("count_only_methods", counting);
+        writer.Counter("reverted_methods", reverted);
+        writer.Counter("downgrades", downgrades);
+        writer.Counter("upgrades", upgrades);
+        writer.Counter("reverts", reverts);
+    }
+
+    ProbeSite* OverheadGovernor::RegisterMethod(ModuleID moduleId, mdMethodDef methodDef)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const MethodKey key(moduleId, methodDef);
+        const auto it = methods.find(key);
+        if (it != methods.end()) {
+            return it->second.site;
+        }
+        if (methods.size() >= MaxGovernedMethods) {
+            return nullptr;
+        }
+
+        ProbeSite* site = ProbeSiteTable::Instance()->GetOrAdd(moduleId, methodDef);
+        if (site == nullptr) {
+            return nullptr;
+        }
+        methods[key] = { moduleId, methodDef, site, ProbeVariant::Full, site->hits, 0, 0, 0, 0 };
+        return site;
+    }
+
+    ProbeVariant OverheadGovernor::GetVariant(ModuleID moduleId, mdMethodDef methodDef)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        const auto it = methods.find(MethodKey(moduleId, methodDef));
+        if (it == methods.end()) {
+            return ProbeVariant::Full;
+        }
+        return it->second.variant;
+    }
+
+    void OverheadGovernor::ForgetModule(ModuleID moduleId)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = methods.lower_bound(MethodKey(moduleId, 0));
+        while (it != methods.end() && it->first.first == moduleId) {
+            it = methods.erase(it);
+        }
+    }
+
+    double OverheadGovernor::ProbeCost(ProbeVariant variant) const
+    {
+        switch (variant) {
+        case ProbeVariant::Full:
+            return settings.fullProbeCostNs;
+        case ProbeVariant::CountOnly:
+            return settings.countProbeCostNs;
+        default:
+            return 0.0;
+        }
+    }
+
+    void OverheadGovernor::Evaluate(double elapsedSeconds)
+    {
+        if (elapsedSeconds <= 0.0) {
+            return;
+        }
+
+        std::vector<MethodKey> rejit;
+        std::vector<MethodKey> revert;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (auto& entry : methods) {
+                auto& method = entry.second;
+                const INT64 hits = method.site->hits;
+                const INT64 delta = hits - method.lastHits;
+                method.lastHits = hits;
+
+                if (method.variant == ProbeVariant::Reverted) {
+                    // no probe, so nothing to measure: wait out the back-off and then put a
+                    // counter back in to find out whether the traffic has gone away
+                    if (++method.revertedIntervals >= method.backoffIntervals) {
+                        method.variant = ProbeVariant::CountOnly;
+                        upgrades++;
+                        method.revertedIntervals = 0;
+                        method.overIntervals = 0;
+                        method.underIntervals = 0;
+                        rejit.push_back(entry.first);
+                        EventPipeline::Instance()->Write(EventKind::ProbeVariantChanged, method.methodDef, (UINT64)method.variant);
+                    }
+                    continue;
+                }
+
+                const double callsPerSecond = (double)delta / elapsedSeconds;
+                const double overhead = callsPerSecond * ProbeCost(method.variant) * 1e-9;
+                const auto richer = ProbeVariant((int)method.variant - 1);
+                const bool canUpgrade = method.variant != ProbeVariant::Full;
+                const double richerOverhead = canUpgrade ? callsPerSecond * ProbeCost(richer) * 1e-9 : 0.0;
+
+                if (overhead > settings.cpuBudget) {
+                    method.underIntervals = 0;
+                    if (++method.overIntervals < settings.confirmIntervals) {
+                        continue;
+                    }
+                    method.overIntervals = 0;
+
+                    if (method.variant == ProbeVariant::Full) {
+                        method.variant = ProbeVariant::CountOnly;
+                        downgrades++;
+                        rejit.push_back(entry.first);
+                    }
+                    else {
+                        method.variant = ProbeVariant::Reverted;
+                        reverts++;
+                        method.revertedIntervals = 0;
+                        method.backoffIntervals = method.backoffIntervals == 0
+                            ? settings.revertBackoffIntervals
+                            : (std::min)(method.backoffIntervals * 2, MaxRevertBackoffIntervals);
+                        revert.push_back(entry.first);
+                    }
+
+                    EventPipeline::Instance()->Write(EventKind::ProbeVariantChanged, method.methodDef, (UINT64)method.variant);
+                    LOG_INFO("OverheadGovernor: downgrading {}, calls/s: {}, overhead: {}", Hex(method.methodDef), callsPerSecond, overhead);
+                }
+                else if (canUpgrade && richerOverhead < settings.cpuBudget * settings.upgradeRatio) {
+                    method.overIntervals = 0;
+                    if (++method.underIntervals < settings.confirmIntervals) {
+                        continue;
+                    }
+                    method.underIntervals = 0;
+                    method.variant = richer;
+                    upgrades++;
+                    rejit.push_back(entry.first);
+
+                    EventPipeline::Instance()->Write(EventKind::ProbeVariantChanged, method.methodDef, (UINT64)method.variant);
+                    LOG_INFO("OverheadGovernor: upgrading {}, calls/s: {}", Hex(method.methodDef), callsPerSecond);
+                }
+                else {
+                    method.overIntervals = 0;
+                    method.underIntervals = 0;
+                }
+            }
+        }
+
+        // the profiler API calls are made outside the lock as GetReJITParameters calls back into GetVariant
+        Apply(rejit, revert);
+    }
+
+    void OverheadGovernor::Apply(const std::vector<MethodKey>& rejit, const std::vector<MethodKey>& revert)
+    {
+        if (!rejit.empty()) {
+            std::vector<ModuleID> moduleIds;
+            std::vector<mdMethodDef> methodIds;
+            for (const auto& key : rejit) {
+                moduleIds.push_back(key.first);
+                methodIds.push_back(key.second);
+            }
+            const HRESULT hr = corProfilerInfo->RequestReJIT((ULONG)moduleIds.size(), moduleIds.data(), methodIds.data());
+            LOG_INFO("OverheadGovernor: RequestReJIT {} methods, result: {}", moduleIds.size(), Hex(hr));
+        }
+
+        if (!revert.empty()) {
+            std::vector<ModuleID> moduleIds;
+            std::vector<mdMethodDef> methodIds;
+            for (const auto& key : revert) {
+                moduleIds.push_back(key.first);
+                methodIds.push_back(key.second);
+            }
+            std::vector<HRESULT> status(revert.size());
+            const HRESULT hr = corProfilerInfo->RequestRevert((ULONG)moduleIds.size(), moduleIds.data(), methodIds.data(), status.data());
+            LOG_INFO("OverheadGovernor: RequestRevert {} methods, result: {}", moduleIds.size(), Hex(hr));
+        }
+    }
+
+    void OverheadGovernor::ThreadMain()
+    {
+        auto last = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> guard(threadLock);
+        while (!stopping) {
+            wakeUp.wait_for(guard, std::chrono::milliseconds(settings.intervalMs));
+            if (stopping) {
+                break;
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            const double elapsed = std::chrono::duration<double>(now - last).count();
+            last = now;
+
+            guard.unlock();
+            Evaluate(elapsed);
+            guard.lock();
+        }
+    }
+}
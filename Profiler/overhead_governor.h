@@ -0,0 +1,110 @@
+#ifndef CLR_PROFILER_OVERHEAD_GOVERNOR_H_
+#define CLR_PROFILER_OVERHEAD_GOVERNOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <corprof.h>
+#include "native_probe.h"
+
+namespace trace {
+
+    class ConfigSnapshot;
+    class StatsWriter;
+
+    // ProbeVariant is the flavour of instrumentation injected into a method, ordered from most to
+    // least expensive. The governor only ever moves a method one step at a time.
+    enum class ProbeVariant : int {
+        Full = 0,       // hit counter + message probe, or the native probe
+        CountOnly = 1,  // hit counter only
+        Reverted = 2    // original IL, no probe at all
+    };
+
+    struct GovernorSettings {
+        // fraction of one CPU a single method's probes may spend before it is downgraded
+        double cpuBudget = 0.01;
+        // a downgraded method is only upgraded again once the richer variant would stay
+        // below cpuBudget * upgradeRatio
+        double upgradeRatio = 0.25;
+        unsigned intervalMs = 1000;
+        // number of consecutive intervals a method must be over / under budget before acting
+        unsigned confirmIntervals = 3;
+        // first back-off before a reverted method is re-instrumented to measure it again,
+        // doubled every time the same method is reverted
+        unsigned revertBackoffIntervals = 30;
+        // the managed probe writes to the console, the native one only records an event
+        double fullProbeCostNs = 2000.0;
+        double nativeProbeCostNs = 20.0;
+        double countProbeCostNs = 2.0;
+
+        static GovernorSettings FromConfig(const ConfigSnapshot& config, ProbeAbi abi);
+    };
+
+    // OverheadGovernor measures the call rate of every governed method through the ProbeSite hit
+    // counters its probes increment and, when the estimated probe cost goes over budget, moves the
+    // method to a cheaper ProbeVariant with RequestReJIT or removes instrumentation with RequestRevert.
+    class OverheadGovernor {
+    public:
+        static const unsigned MaxGovernedMethods = 4096;
+
+        OverheadGovernor(ICorProfilerInfo4* info, GovernorSettings settings);
+        ~OverheadGovernor();
+
+        void Start();
+        void Stop();
+
+        // RegisterMethod returns the probe site of the method, allocating one on first use.
+        // Returns nullptr once MaxGovernedMethods is reached, the method is then left ungoverned.
+        ProbeSite* RegisterMethod(ModuleID moduleId, mdMethodDef methodDef);
+
+        // GetVariant returns the variant GetReJITParameters should emit for the method.
+        ProbeVariant GetVariant(ModuleID moduleId, mdMethodDef methodDef);
+
+        // ForgetModule drops every method of an unloaded module.
+        void ForgetModule(ModuleID moduleId);
+
+        // Evaluate runs one governor tick, it is called by the background thread.
+        void Evaluate(double elapsedSeconds);
+
+    private:
+        struct GovernedMethod {
+            ModuleID moduleId;
+            mdMethodDef methodDef;
+            ProbeSite* site;
+            ProbeVariant variant;
+            INT64 lastHits;
+            unsigned overIntervals;
+            unsigned underIntervals;
+            unsigned backoffIntervals;
+            unsigned revertedIntervals;
+        };
+
+        typedef std::pair<ModuleID, mdMethodDef> MethodKey;
+
+        double ProbeCost(ProbeVariant variant) const;
+        void ThreadMain();
+        void Apply(const std::vector<MethodKey>& rejit, const std::vector<MethodKey>& revert);
+
+        ICorProfilerInfo4* corProfilerInfo;
+        const GovernorSettings settings;
+
+        void WriteStats(StatsWriter& writer);
+
+        std::mutex lock;
+        std::map<MethodKey, GovernedMethod> methods;
+        UINT64 downgrades = 0;
+        UINT64 upgrades = 0;
+        UINT64 reverts = 0;
+
+        std::mutex threadLock;
+        std::condition_variable wakeUp;
+        bool stopping = false;
+        std::thread thread;
+    };
+}
+
+#endif  // CLR_PROFILER_OVERHEAD_GOVERNOR_H_
@@ -0,0 +1,314 @@
+#include "profiler_config.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include "logger.h"
+#include "profiler_stats.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+namespace trace {
+
+    namespace {
+        const int PollIntervalMs = 250;
+
+        int Compare(const WSTRING& left, WStringView right) {
+            return left.compare(0, left.length(), right.data(), right.length());
+        }
+
+        WStringView LastPart(WStringView name) {
+            size_t start = name.length();
+            while (start > 0 && name.data()[start - 1] != '.') {
+                start--;
+            }
+            return WStringView(name.data() + start, name.length() - start);
+        }
+
+        typedef std::vector<std::pair<WSTRING, WSTRING>> Settings;
+
+        void AddSetting(Settings& settings, const WSTRING& name, const WSTRING& value) {
+            const WSTRING trimmedName = Trim(name);
+            if (!trimmedName.empty()) {
+                settings.emplace_back(trimmedName, Trim(value));
+            }
+        }
+
+        Settings CaptureEnvironment() {
+            Settings settings;
+            const WStringView prefix = WStr("PROFILER_");
+#ifdef _WIN32
+            LPWCH block = GetEnvironmentStringsW();
+            if (block == nullptr) {
+                return settings;
+            }
+            for (LPCWSTR entry = block; *entry != 0; entry += wcslen(entry) + 1) {
+                const WSTRING variable(entry);
+#else
+            for (char** entry = environ; entry != nullptr && *entry != nullptr; entry++) {
+                const WSTRING variable = ToWSTRING(*entry);
+#endif
+                const auto equals = variable.find('=');
+                if (equals != WSTRING::npos && variable.compare(0, prefix.length(), prefix.data(), prefix.length()) == 0) {
+                    AddSetting(settings, variable.substr(0, equals), variable.substr(equals + 1));
+                }
+            }
+#ifdef _WIN32
+            FreeEnvironmentStringsW(block);
+#endif
+            return settings;
+        }
+
+        // ReadSettings appends the NAME=value lines of a stream; blank lines and lines starting
+        // with '#' are skipped.
+        void ReadSettings(std::istream& stream, Settings& settings) {
+            std::string line;
+            while (std::getline(stream, line)) {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                const auto equals = line.find('=');
+                const WSTRING name = Trim(ToWSTRING(line.substr(0, equals)));
+                if (equals == std::string::npos || name.empty() || name[0] == '#') {
+                    continue;
+                }
+                AddSetting(settings, name, ToWSTRING(line.substr(equals + 1)));
+            }
+        }
+
+        bool ReadConfigFile(const std::string& path, Settings& settings) {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                return false;
+            }
+            ReadSettings(file, settings);
+            return true;
+        }
+    }
+
+    const WSTRING& ConfigSnapshot::Value(WStringView name) const {
+        static const WSTRING empty;
+        const auto it = std::lower_bound(values_.begin(), values_.end(), name,
+            [](const std::pair<WSTRING, WSTRING>& setting, WStringView key) { return Compare(setting.first, key) < 0; });
+        return it != values_.end() && it->first == name ? it->second : empty;
+    }
+
+    std::vector<WSTRING> ConfigSnapshot::Values(WStringView name) const {
+        std::vector<WSTRING> values;
+        for (const auto& part : Split(Value(name), L';')) {
+            const auto value = Trim(part);
+            if (!value.empty()) {
+                values.push_back(value);
+            }
+        }
+        return values;
+    }
+
+    double ConfigSnapshot::Number(WStringView name, double defaultValue) const {
+        const auto& value = Value(name);
+        if (value.empty()) {
+            return defaultValue;
+        }
+        return strtod(ToString(value).c_str(), nullptr);
+    }
+
+    bool ConfigSnapshot::IsRejitTarget(WStringView fullName) const {
+        const auto matches = [this](WStringView name) {
+            const auto it = std::lower_bound(rejitTargets_.begin(), rejitTargets_.end(), name,
+                [](const WSTRING& target, WStringView key) { return Compare(target, key) < 0; });
+            return it != rejitTargets_.end() && *it == name;
+        };
+        if (matches(fullName)) {
+            return true;
+        }
+        // a method name alone, the part after any '.' of the full name
+        for (size_t i = 0; i < fullName.length(); i++) {
+            if (fullName.data()[i] == '.' && matches(WStringView(fullName.data() + i + 1, fullName.length() - i - 1))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ConfigSnapshot::MayBeRejitTarget(WStringView methodName) const {
+        const WStringView last = LastPart(methodName);
+        const auto it = std::lower_bound(rejitMethodNames_.begin(), rejitMethodNames_.end(), last,
+            [](const WSTRING& name, WStringView key) { return Compare(name, key) < 0; });
+        return it != rejitMethodNames_.end() && *it == last;
+    }
+
+    ProfilerConfig::ProfilerConfig() : stopping_(false) {
+        snapshots_.emplace_back(new ConfigSnapshot());
+        current_.store(snapshots_.back().get(), std::memory_order_release);
+    }
+
+    void ProfilerConfig::Load(const std::string& attachSettings) {
+        std::lock_guard<std::mutex> guard(lock_);
+        environment_ = CaptureEnvironment();
+        std::istringstream attached(attachSettings);
+        ReadSettings(attached, environment_);
+        for (const auto& setting : environment_) {
+            if (setting.first == WStr("PROFILER_CONFIG_FILE")) {
+                path_ = ToString(setting.second);
+            }
+        }
+
+        // a missing file at startup leaves the environment alone in charge
+        Publish(Build(false));
+
+        ProfilerStats::Instance()->Register("config", [this](StatsWriter& writer) { WriteStats(writer); });
+    }
+
+    std::unique_ptr<ConfigSnapshot> ProfilerConfig::Build(bool required) {
+        std::unique_ptr<ConfigSnapshot> snapshot(new ConfigSnapshot());
+        Settings settings = environment_;
+        if (!path_.empty() && !ReadConfigFile(path_, settings)) {
+            readFailures_++;
+            LOG_WARNING("ProfilerConfig: unable to read {}", path_);
+            if (required) {
+                return nullptr;
+            }
+        }
+
+        // the file comes after the environment, so for a name set in both the file's value is last
+        std::stable_sort(settings.begin(), settings.end(),
+            [](const std::pair<WSTRING, WSTRING>& a, const std::pair<WSTRING, WSTRING>& b) { return a.first < b.first; });
+        for (size_t i = 0; i < settings.size(); i++) {
+            if (i + 1 == settings.size() || settings[i + 1].first != settings[i].first) {
+                snapshot->values_.push_back(std::move(settings[i]));
+            }
+        }
+        return snapshot;
+    }
+
+    const ConfigSnapshot* ProfilerConfig::Publish(std::unique_ptr<ConfigSnapshot> snapshot) {
+        snapshot->version_ = snapshots_.size();
+        snapshot->rejitTargets_ = snapshot->Values(WStr("PROFILER_REJIT_TARGETS"));
+        if (snapshot->rejitTargets_.empty()) {
+            snapshot->rejitTargets_.push_back(WStr("ReJitRewriteTarget"));
+        }
+        std::sort(snapshot->rejitTargets_.begin(), snapshot->rejitTargets_.end());
+        for (const auto& target : snapshot->rejitTargets_) {
+            snapshot->rejitMethodNames_.push_back(LastPart(target).str());
+        }
+        std::sort(snapshot->rejitMethodNames_.begin(), snapshot->rejitMethodNames_.end());
+        snapshots_.push_back(std::move(snapshot));
+        current_.store(snapshots_.back().get(), std::memory_order_release);
+        return snapshots_.back().get();
+    }
+
+    void ProfilerConfig::Subscribe(Listener listener) {
+        std::lock_guard<std::mutex> guard(lock_);
+        listeners_.push_back(std::move(listener));
+    }
+
+    bool ProfilerConfig::Reload() {
+        std::lock_guard<std::mutex> reloadGuard(reloadLock_);
+        const ConfigSnapshot* previous;
+        const ConfigSnapshot* current;
+        std::vector<Listener> listeners;
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            // an editor may be halfway through replacing the file, keep what was read last time
+            auto snapshot = Build(true);
+            previous = current_.load(std::memory_order_relaxed);
+            if (snapshot == nullptr || snapshot->values_ == previous->values_) {
+                return false;
+            }
+            current = Publish(std::move(snapshot));
+            reloads_++;
+            listeners = listeners_;
+        }
+
+        // snapshots are never freed, so both stay valid; a listener may subscribe or read stats
+        LOG_INFO("ProfilerConfig: loaded version {} from {}", current->version_, path_);
+        for (const auto& listener : listeners) {
+            listener(*previous, *current);
+        }
+        return true;
+    }
+
+    void ProfilerConfig::Watch() {
+        if (path_.empty() || thread_.joinable()) {
+            return;
+        }
+        stopping_.store(false);
+        thread_ = std::thread(&ProfilerConfig::ThreadMain, this);
+    }
+
+    void ProfilerConfig::Stop() {
+        stopping_.store(true);
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void ProfilerConfig::ThreadMain() {
+        // editors often replace the file rather than write it, so the directory is watched
+        const auto separator = path_.find_last_of("/\\");
+        const std::string directory = separator == std::string::npos ? "." : path_.substr(0, separator == 0 ? 1 : separator);
+        const std::string fileName = separator == std::string::npos ? path_ : path_.substr(separator + 1);
+
+#ifdef _WIN32
+        const HANDLE change = FindFirstChangeNotificationW(ToWSTRING(directory).c_str(), FALSE,
+            FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE);
+        if (change == INVALID_HANDLE_VALUE) {
+            LOG_WARNING("ProfilerConfig: unable to watch {}", directory);
+            return;
+        }
+        while (!stopping_.load()) {
+            // the notification does not say which file changed, Reload ignores a file that did not
+            if (WaitForSingleObject(change, PollIntervalMs) == WAIT_OBJECT_0) {
+                Reload();
+                if (!FindNextChangeNotification(change)) {
+                    break;
+                }
+            }
+        }
+        FindCloseChangeNotification(change);
+#else
+        const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            LOG_WARNING("ProfilerConfig: unable to watch {}", directory);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        alignas(inotify_event) char buffer[4096];
+        while (!stopping_.load()) {
+            pollfd descriptor{ fd, POLLIN, 0 };
+            if (poll(&descriptor, 1, PollIntervalMs) <= 0) {
+                continue;
+            }
+            bool changed = false;
+            ssize_t length;
+            while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (const char* next = buffer; next < buffer + length;) {
+                    const auto event = reinterpret_cast<const inotify_event*>(next);
+                    changed = changed || (event->len > 0 && fileName == event->name);
+                    next += sizeof(inotify_event) + event->len;
+                }
+            }
+            if (changed) {
+                Reload();
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    void ProfilerConfig::WriteStats(StatsWriter& writer) {
+        std::lock_guard<std::mutex> guard(lock_);
+        writer.Counter("version", current_.load(std::memory_order_relaxed)->version_);
+        writer.Counter("reloads", reloads_);
+        writer.Counter("read_failures", readFailures_);
+        writer.Counter("settings", current_.load(std::memory_order_relaxed)->values_.size());
+    }
+}
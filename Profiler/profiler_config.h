@@ -0,0 +1,113 @@
+#ifndef CLR_PROFILER_PROFILER_CONFIG_H_
+#define CLR_PROFILER_PROFILER_CONFIG_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "util.h"
+
+namespace trace {
+
+    class StatsWriter;
+
+    // ConfigSnapshot is every PROFILER_* setting at one point in time: the environment the process
+    // started with, or the settings passed on attach, overridden by the NAME=value lines of
+    // PROFILER_CONFIG_FILE. A published snapshot never changes, so any thread can read it without
+    // a lock.
+    class ConfigSnapshot {
+    public:
+        // Version numbers the published snapshots from 1, the placeholder current before Load is 0.
+        UINT64 Version() const { return version_; }
+
+        // Value returns the trimmed value of a setting, empty when it is not set.
+        const WSTRING& Value(WStringView name) const;
+
+        // Values splits a value on ';', trims the parts and drops the empty ones.
+        std::vector<WSTRING> Values(WStringView name) const;
+
+        bool Flag(WStringView name) const { return Value(name) == WStr("1"); }
+        double Number(WStringView name, double defaultValue) const;
+
+        // RejitTargets are the methods the ReJIT path instruments, from PROFILER_REJIT_TARGETS,
+        // sorted. IsRejitTarget matches a "Type.Method" full name against them; a target without
+        // the type matches the method in any type.
+        const std::vector<WSTRING>& RejitTargets() const { return rejitTargets_; }
+        bool IsRejitTarget(WStringView fullName) const;
+
+        // MayBeRejitTarget tells from a method's own name, without its type, whether IsRejitTarget
+        // can match its full name: a target ends with the part of the name after its last '.'.
+        bool MayBeRejitTarget(WStringView methodName) const;
+
+    private:
+        friend class ProfilerConfig;
+
+        UINT64 version_ = 0;
+        // sorted by name
+        std::vector<std::pair<WSTRING, WSTRING>> values_;
+        std::vector<WSTRING> rejitTargets_;
+        // the part of each target after its last '.', sorted
+        std::vector<WSTRING> rejitMethodNames_;
+    };
+
+    // ProfilerConfig publishes the current ConfigSnapshot through an atomic pointer. Load builds the
+    // first one at Initialize. Watch starts a thread that rebuilds the snapshot whenever the config
+    // file changes, inotify on Linux and a change notification on Windows, and hands the previous
+    // and the new snapshot to every subscriber. Reloads are rare, so replaced snapshots are kept,
+    // never freed, for readers that may still be using them.
+    class ProfilerConfig : public Singleton<ProfilerConfig> {
+        friend class Singleton<ProfilerConfig>;
+
+    public:
+        typedef std::function<void(const ConfigSnapshot& previous, const ConfigSnapshot& current)> Listener;
+
+        // Load captures the PROFILER_* environment and reads the config file, if any. A profiler
+        // attached to a running process gets its settings as NAME=value lines in attachSettings,
+        // they override the environment and are overridden by the file.
+        void Load(const std::string& attachSettings = std::string());
+
+        const ConfigSnapshot* Current() const { return current_.load(std::memory_order_acquire); }
+
+        void Subscribe(Listener listener);
+
+        // Watch does nothing without PROFILER_CONFIG_FILE.
+        void Watch();
+        void Stop();
+
+        // Reload rebuilds the snapshot and, when a setting changed, publishes it and calls the
+        // subscribers on the calling thread, without lock_ held. It returns whether a new snapshot
+        // was published.
+        bool Reload();
+
+    private:
+        ProfilerConfig();
+
+        // Build returns nullptr when the config file cannot be read and required is set.
+        std::unique_ptr<ConfigSnapshot> Build(bool required);
+        const ConfigSnapshot* Publish(std::unique_ptr<ConfigSnapshot> snapshot);
+        void ThreadMain();
+        void WriteStats(StatsWriter& writer);
+
+        std::atomic<const ConfigSnapshot*> current_;
+        std::vector<std::pair<WSTRING, WSTRING>> environment_;
+        std::string path_;
+
+        // held by Reload through notifying, so subscribers see the snapshots in order
+        std::mutex reloadLock_;
+        // held while building and publishing
+        std::mutex lock_;
+        std::vector<std::unique_ptr<ConfigSnapshot>> snapshots_;
+        std::vector<Listener> listeners_;
+        UINT64 reloads_ = 0;
+        UINT64 readFailures_ = 0;
+
+        std::atomic<bool> stopping_;
+        std::thread thread_;
+    };
+}
+
+#endif  // CLR_PROFILER_PROFILER_CONFIG_H_
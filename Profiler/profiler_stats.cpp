@@ -0,0 +1,67 @@
+#include "profiler_stats.h"
+#include <cstdio>
+#include <sstream>
+#include "profiler_config.h"
+
+namespace trace {
+
+    void StatsWriter::Counter(const char* name, UINT64 value) {
+        text_ += section_ + "." + name + " " + ToString(value) + "\n";
+    }
+
+    void StatsWriter::Gauge(const char* name, double value) {
+        std::ostringstream ss;
+        ss << section_ << "." << name << " " << value << "\n";
+        text_ += ss.str();
+    }
+
+    void ProfilerStats::Register(const std::string& section, Source source) {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (auto& entry : sources_) {
+            if (entry.first == section) {
+                entry.second = source;
+                return;
+            }
+        }
+        sources_.emplace_back(section, source);
+    }
+
+    void ProfilerStats::Unregister(const std::string& section) {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (auto it = sources_.begin(); it != sources_.end(); ++it) {
+            if (it->first == section) {
+                sources_.erase(it);
+                return;
+            }
+        }
+    }
+
+    std::string ProfilerStats::Snapshot() {
+        StatsWriter writer;
+        std::lock_guard<std::mutex> guard(lock_);
+        for (const auto& entry : sources_) {
+            writer.BeginSection(entry.first);
+            entry.second(writer);
+        }
+        return writer.Text();
+    }
+
+    bool ProfilerStats::WriteTo(const std::string& path) {
+        const auto text = Snapshot();
+        FILE* file = fopen(path.c_str(), "w");
+        if (file == nullptr) {
+            return false;
+        }
+        const bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+        fclose(file);
+        return ok;
+    }
+
+    std::string GetStatsPath() {
+        const auto& path = ProfilerConfig::Instance()->Current()->Value(WStr("PROFILER_STATS_FILE"));
+        if (!path.empty()) {
+            return ToString(path);
+        }
+        return "profiler_stats_" + ToString((uint64_t)GetPID()) + ".txt";
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef CLR_PROFILER_PROFILER_STATS_H_
+#define CLR_PROFILER_PROFILER_STATS_H_
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "util.h"
+
+namespace trace {
+
+    // StatsWriter collects "section.name value" lines for one stats snapshot.
+    class StatsWriter {
+    private:
+        std::string section_;
+        std::string text_;
+
+    public:
+        void BeginSection(const std::string& section) { section_ = section; }
+        void Counter(const char* name, UINT64 value);
+        void Gauge(const char* name, double value);
+        const std::string& Text() const { return text_; }
+    };
+
+    // ProfilerStats is the single place every subsystem publishes its counters to. Sources are
+    // polled only when a snapshot is taken, so publishing costs nothing on the hot path.
+    class ProfilerStats : public Singleton<ProfilerStats> {
+        friend class Singleton<ProfilerStats>;
+
+    public:
+        typedef std::function<void(StatsWriter&)> Source;
+
+        void Register(const std::string& section, Source source);
+        void Unregister(const std::string& section);
+
+        std::string Snapshot();
+
+        // WriteTo writes a snapshot to the given path, replacing the file.
+        bool WriteTo(const std::string& path);
+
+    private:
+        ProfilerStats() {}
+
+        std::mutex lock_;
+        std::vector<std::pair<std::string, Source>> sources_;
+    };
+
+    // GetStatsPath returns PROFILER_STATS_FILE, or profiler_stats_<pid>.txt when it is not set.
+    std::string GetStatsPath();
+}
+
+#endif  // CLR_PROFILER_PROFILER_STATS_H_
@@ -0,0 +1,366 @@
+#include "selective_instrumentation.h"
+#include <algorithm>
+#include <iterator>
+#include "CComPtr.h"
+#include "logger.h"
+#include "module_store.h"
+#include "profiler_stats.h"
+
+namespace trace {
+
+    namespace {
+        const ULONG EnumBatchSize = 64;
+        // inlines waiting for the background thread, 40 bytes each
+        const size_t InlineQueueSize = 16384;
+        const unsigned DrainIntervalMs = 100;
+    }
+
+    size_t SelectiveInstrumentation::KeyHash::operator()(const MethodKey& key) const {
+        UINT64 hash = (UINT64)key.first * 0x9E3779B97F4A7C15ULL ^ (UINT64)key.second;
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return (size_t)hash;
+    }
+
+    SelectiveInstrumentation::SelectiveInstrumentation()
+        : info_(nullptr), enabled_(false), targets_(nullptr), inlineTail_(0), inlineHead_(0), vetoed_(0), recorded_(0),
+          queueFull_(0), incompleteLists_(0), inlinersRejitted_(0), modulesQueued_(0), stopping_(false)
+    {
+        Publish(Targets());
+    }
+
+    void SelectiveInstrumentation::Start(ICorProfilerInfo8* info, ModuleHandler handler) {
+        info_ = info;
+        handler_ = std::move(handler);
+        inlineQueue_.reset(new PendingInline[InlineQueueSize]);
+        for (size_t i = 0; i < InlineQueueSize; i++) {
+            inlineQueue_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        thread_ = std::thread(&SelectiveInstrumentation::ThreadMain, this);
+        ProfilerStats::Instance()->Register("selective", [this](StatsWriter& writer) { WriteStats(writer); });
+        enabled_.store(true, std::memory_order_release);
+    }
+
+    void SelectiveInstrumentation::Stop() {
+        {
+            std::lock_guard<std::mutex> guard(threadLock_);
+            stopping_ = true;
+        }
+        wakeUp_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    bool SelectiveInstrumentation::ShouldInline(FunctionID callerId, FunctionID calleeId) {
+        MethodKey callee;
+        if (FAILED(info_->GetFunctionInfo(calleeId, nullptr, &callee.first, &callee.second))) {
+            return true;
+        }
+        if (IsTarget(callee)) {
+            vetoed_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        // any method can become a target with a later config reload, so every inline is kept; the
+        // JIT thread only queues it, the background thread adds it to the graph
+        MethodKey caller;
+        if (FAILED(info_->GetFunctionInfo(callerId, nullptr, &caller.first, &caller.second))) {
+            return true;
+        }
+        if (!TryQueueInline(caller, callee)) {
+            queueFull_.fetch_add(1, std::memory_order_relaxed);
+            Record(caller, callee);
+        }
+
+        // Select publishes the targets before it drains the queue, so a callee selected since the
+        // first check is either seen here or has this caller in its list
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (IsTarget(callee)) {
+            vetoed_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    void SelectiveInstrumentation::FindPrecompiledInliners(const std::vector<ModuleID>& newModuleIds,
+        std::vector<ModuleID>& moduleIds, std::vector<mdMethodDef>& methodIds) {
+        std::vector<std::pair<ModuleID, MethodKey>> incomplete;
+        {
+            std::lock_guard<std::mutex> guard(incompleteLock_);
+            incomplete.swap(incomplete_);
+        }
+
+        const Targets* targets = targets_.load(std::memory_order_acquire);
+        std::vector<MethodKey> inliners;
+        for (const auto& target : *targets) {
+            AppendPrecompiledInliners(target, newModuleIds, inliners);
+        }
+        for (const auto& entry : incomplete) {
+            if (IsTarget(entry.second)) {
+                AppendPrecompiledInliners(entry.second, std::vector<ModuleID>(1, entry.first), inliners);
+            }
+        }
+        std::sort(inliners.begin(), inliners.end());
+        inliners.erase(std::unique(inliners.begin(), inliners.end()), inliners.end());
+
+        UINT64 added = 0;
+        for (const auto& inliner : inliners) {
+            if (!IsTarget(inliner)) {
+                moduleIds.push_back(inliner.first);
+                methodIds.push_back(inliner.second);
+                added++;
+            }
+        }
+        inlinersRejitted_.fetch_add(added, std::memory_order_relaxed);
+    }
+
+    void SelectiveInstrumentation::QueueModule(ModuleID moduleId) {
+        {
+            std::lock_guard<std::mutex> guard(threadLock_);
+            pending_.push_back(moduleId);
+        }
+        modulesQueued_.fetch_add(1, std::memory_order_relaxed);
+        wakeUp_.notify_one();
+    }
+
+    void SelectiveInstrumentation::Select(std::vector<ModuleID>& moduleIds, std::vector<mdMethodDef>& methodIds) {
+        std::vector<MethodKey> selected;
+        for (size_t i = 0; i < methodIds.size(); i++) {
+            selected.emplace_back(moduleIds[i], methodIds[i]);
+        }
+        std::sort(selected.begin(), selected.end());
+
+        {
+            std::lock_guard<std::mutex> guard(targetsLock_);
+            Targets targets;
+            std::set_union(targets_.load(std::memory_order_relaxed)->begin(), targets_.load(std::memory_order_relaxed)->end(),
+                selected.begin(), selected.end(), std::back_inserter(targets));
+            Publish(std::move(targets));
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        DrainInlines(true);
+
+        std::vector<ModuleID> loadedModuleIds;
+        for (const auto& module : ModuleStore::Instance()->Modules()) {
+            loadedModuleIds.push_back(module->moduleId);
+        }
+
+        // the inliners are compiled again without the target, so their recorded inlines of it go
+        std::vector<MethodKey> inliners;
+        for (const auto& target : selected) {
+            Shard& shard = shards_[KeyHash()(target) % ShardCount];
+            {
+                std::lock_guard<std::mutex> guard(shard.lock);
+                const auto it = shard.inliners.find(target);
+                if (it != shard.inliners.end()) {
+                    inliners.insert(inliners.end(), it->second.begin(), it->second.end());
+                    shard.inliners.erase(it);
+                }
+            }
+            AppendPrecompiledInliners(target, loadedModuleIds, inliners);
+        }
+        std::sort(inliners.begin(), inliners.end());
+        inliners.erase(std::unique(inliners.begin(), inliners.end()), inliners.end());
+
+        UINT64 added = 0;
+        for (const auto& inliner : inliners) {
+            if (!std::binary_search(selected.begin(), selected.end(), inliner)) {
+                moduleIds.push_back(inliner.first);
+                methodIds.push_back(inliner.second);
+                added++;
+            }
+        }
+        inlinersRejitted_.fetch_add(added, std::memory_order_relaxed);
+        if (added > 0) {
+            LOG_DEBUG("SelectiveInstrumentation: {} targets, {} inliners rejitted", selected.size(), added);
+        }
+    }
+
+    void SelectiveInstrumentation::Deselect(const std::vector<ModuleID>& moduleIds, const std::vector<mdMethodDef>& methodIds) {
+        std::vector<MethodKey> deselected;
+        for (size_t i = 0; i < methodIds.size(); i++) {
+            deselected.emplace_back(moduleIds[i], methodIds[i]);
+        }
+        std::sort(deselected.begin(), deselected.end());
+
+        std::lock_guard<std::mutex> guard(targetsLock_);
+        Targets targets;
+        std::set_difference(targets_.load(std::memory_order_relaxed)->begin(), targets_.load(std::memory_order_relaxed)->end(),
+            deselected.begin(), deselected.end(), std::back_inserter(targets));
+        Publish(std::move(targets));
+    }
+
+    void SelectiveInstrumentation::ForgetModule(ModuleID moduleId) {
+        {
+            std::lock_guard<std::mutex> guard(targetsLock_);
+            Targets targets;
+            const Targets* current = targets_.load(std::memory_order_relaxed);
+            std::copy_if(current->begin(), current->end(), std::back_inserter(targets),
+                [moduleId](const MethodKey& key) { return key.first != moduleId; });
+            if (targets.size() != current->size()) {
+                Publish(std::move(targets));
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(incompleteLock_);
+            incomplete_.erase(std::remove_if(incomplete_.begin(), incomplete_.end(),
+                [moduleId](const std::pair<ModuleID, MethodKey>& entry) {
+                    return entry.first == moduleId || entry.second.first == moduleId;
+                }), incomplete_.end());
+        }
+
+        DrainInlines(true);
+        const auto inModule = [moduleId](const MethodKey& key) { return key.first == moduleId; };
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> guard(shard.lock);
+            for (auto it = shard.inliners.begin(); it != shard.inliners.end();) {
+                auto& inliners = it->second;
+                inliners.erase(std::remove_if(inliners.begin(), inliners.end(), inModule), inliners.end());
+                if (inModule(it->first) || inliners.empty()) {
+                    it = shard.inliners.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    bool SelectiveInstrumentation::IsTarget(const MethodKey& key) const {
+        const Targets* targets = targets_.load(std::memory_order_acquire);
+        return !targets->empty() && std::binary_search(targets->begin(), targets->end(), key);
+    }
+
+    bool SelectiveInstrumentation::TryQueueInline(const MethodKey& caller, const MethodKey& callee) {
+        // a bounded multi-producer queue: each slot's sequence tells whether it is free for the
+        // position a producer claims, or holds the inline written at that position
+        size_t position = inlineTail_.load(std::memory_order_relaxed);
+        for (;;) {
+            PendingInline& slot = inlineQueue_[position & (InlineQueueSize - 1)];
+            const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == position) {
+                if (inlineTail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot.caller = caller;
+                    slot.callee = callee;
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (sequence < position + 1) {
+                return false;
+            }
+            else {
+                position = inlineTail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void SelectiveInstrumentation::DrainInlines(bool claimed) {
+        if (inlineQueue_ == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(drainLock_);
+        // Select and ForgetModule wait for the inlines queued before they started, a producer is
+        // between claiming its slot and writing it only for a few instructions
+        const size_t end = claimed ? inlineTail_.load(std::memory_order_acquire) : 0;
+        for (;;) {
+            PendingInline& slot = inlineQueue_[inlineHead_ & (InlineQueueSize - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != inlineHead_ + 1) {
+                if (inlineHead_ >= end) {
+                    break;
+                }
+                std::this_thread::yield();
+                continue;
+            }
+            Record(slot.caller, slot.callee);
+            slot.sequence.store(inlineHead_ + InlineQueueSize, std::memory_order_release);
+            inlineHead_++;
+        }
+    }
+
+    void SelectiveInstrumentation::Record(const MethodKey& caller, const MethodKey& callee) {
+        Shard& shard = shards_[KeyHash()(callee) % ShardCount];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto& inliners = shard.inliners[callee];
+        if (std::find(inliners.begin(), inliners.end(), caller) == inliners.end()) {
+            inliners.push_back(caller);
+            recorded_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void SelectiveInstrumentation::Publish(Targets targets) {
+        published_.emplace_back(new Targets(std::move(targets)));
+        targets_.store(published_.back().get(), std::memory_order_release);
+    }
+
+    void SelectiveInstrumentation::AppendPrecompiledInliners(const MethodKey& target, const std::vector<ModuleID>& inlinerModuleIds,
+        std::vector<MethodKey>& inliners) {
+        // ReadyToRun code never raises JITInlining, the runtime keeps its own record of the methods
+        // each image inlined
+        for (const auto moduleId : inlinerModuleIds) {
+            BOOL incompleteData = FALSE;
+            CComPtr<ICorProfilerMethodEnum> methods;
+            const HRESULT hr = info_->EnumNgenModuleMethodsInliningThisMethod(moduleId, target.first, target.second,
+                &incompleteData, methods.GetAddressOf());
+            if (incompleteData) {
+                // the runtime could not tell every inliner yet, typically until more modules load;
+                // FindPrecompiledInliners asks again on the next ones
+                incompleteLists_.fetch_add(1, std::memory_order_relaxed);
+                LOG_DEBUG("SelectiveInstrumentation: incomplete inliners of {} in module {}", Hex(target.second), Hex(moduleId));
+                std::lock_guard<std::mutex> guard(incompleteLock_);
+                const auto entry = std::make_pair(moduleId, target);
+                if (std::find(incomplete_.begin(), incomplete_.end(), entry) == incomplete_.end()) {
+                    incomplete_.push_back(entry);
+                }
+            }
+            if (FAILED(hr) || methods.IsNull()) {
+                continue;
+            }
+
+            COR_PRF_METHOD batch[EnumBatchSize];
+            ULONG count = 0;
+            while (SUCCEEDED(methods->Next(EnumBatchSize, batch, &count)) && count > 0) {
+                for (ULONG i = 0; i < count; i++) {
+                    inliners.emplace_back(batch[i].moduleId, batch[i].methodId);
+                }
+                if (count < EnumBatchSize) {
+                    break;
+                }
+            }
+        }
+    }
+
+    void SelectiveInstrumentation::ThreadMain() {
+        std::unique_lock<std::mutex> guard(threadLock_);
+        while (!stopping_) {
+            wakeUp_.wait_for(guard, std::chrono::milliseconds(DrainIntervalMs),
+                [this] { return stopping_ || !pending_.empty(); });
+            if (stopping_) {
+                break;
+            }
+
+            // modules load in bursts, the ones queued meanwhile are searched together
+            std::vector<ModuleID> moduleIds;
+            moduleIds.swap(pending_);
+            guard.unlock();
+            DrainInlines(false);
+            if (!moduleIds.empty()) {
+                handler_(moduleIds);
+            }
+            guard.lock();
+        }
+    }
+
+    void SelectiveInstrumentation::WriteStats(StatsWriter& writer) {
+        writer.Counter("targets", targets_.load(std::memory_order_acquire)->size());
+        writer.Counter("inlines_vetoed", vetoed_.load(std::memory_order_relaxed));
+        writer.Counter("inlines_recorded", recorded_.load(std::memory_order_relaxed));
+        writer.Counter("inline_queue_full", queueFull_.load(std::memory_order_relaxed));
+        writer.Counter("incomplete_inliner_lists", incompleteLists_.load(std::memory_order_relaxed));
+        writer.Counter("inliners_rejitted", inlinersRejitted_.load(std::memory_order_relaxed));
+        writer.Counter("modules_queued", modulesQueued_.load(std::memory_order_relaxed));
+    }
+}
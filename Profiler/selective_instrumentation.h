@@ -0,0 +1,139 @@
+#ifndef CLR_PROFILER_SELECTIVE_INSTRUMENTATION_H_
+#define CLR_PROFILER_SELECTIVE_INSTRUMENTATION_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <corprof.h>
+#include "util.h"
+
+namespace trace {
+
+    class StatsWriter;
+
+    // SelectiveInstrumentation lets the profiler run with ReadyToRun code and inlining enabled.
+    // Only the ReJIT targets are instrumented, so only they have to stay out of their callers:
+    // JITInlining asks ShouldInline, which vetoes the targets and queues every inline it lets through
+    // without taking a lock; the background thread adds them to the inline graph. When a method
+    // becomes a target, the methods that already inlined it, the recorded JIT'd ones and the
+    // precompiled ones the runtime reports, are rejitted with it and compiled again without it
+    // inlined. Loaded modules are searched for targets, and for precompiled inliners of the current
+    // ones, on a background thread, so the loader never waits on the metadata.
+    class SelectiveInstrumentation : public Singleton<SelectiveInstrumentation> {
+        friend class Singleton<SelectiveInstrumentation>;
+
+    public:
+        typedef std::pair<ModuleID, mdMethodDef> MethodKey;
+        // ModuleHandler rejits the targets of newly loaded modules, it runs on the background thread.
+        typedef std::function<void(const std::vector<ModuleID>& moduleIds)> ModuleHandler;
+
+        void Start(ICorProfilerInfo8* info, ModuleHandler handler);
+        void Stop();
+
+        bool IsEnabled() const { return enabled_.load(std::memory_order_acquire); }
+
+        // ShouldInline is JITInlining's answer for calleeId inlined into callerId.
+        bool ShouldInline(FunctionID callerId, FunctionID calleeId);
+
+        // FindPrecompiledInliners appends the methods of newly loaded modules whose precompiled code
+        // inlined one of the current targets, they have to be rejitted to drop it. The images whose
+        // record of inliners was incomplete before are asked again too, as the modules they were
+        // waiting for may be among the new ones.
+        void FindPrecompiledInliners(const std::vector<ModuleID>& newModuleIds, std::vector<ModuleID>& moduleIds,
+            std::vector<mdMethodDef>& methodIds);
+
+        // QueueModule hands a loaded module to the background thread.
+        void QueueModule(ModuleID moduleId);
+
+        // Select makes the methods targets, no longer inlined, and appends to moduleIds / methodIds
+        // the methods that inlined one of them before, to be rejitted in the same request.
+        void Select(std::vector<ModuleID>& moduleIds, std::vector<mdMethodDef>& methodIds);
+
+        // Deselect lets the methods be inlined again.
+        void Deselect(const std::vector<ModuleID>& moduleIds, const std::vector<mdMethodDef>& methodIds);
+
+        // ForgetModule drops the targets and inlines of an unloaded module.
+        void ForgetModule(ModuleID moduleId);
+
+    private:
+        struct KeyHash {
+            size_t operator()(const MethodKey& key) const;
+        };
+
+        // Shard is one stripe of the inline graph, each callee's inliners are in the shard of its key
+        static const size_t ShardCount = 16;
+        struct Shard {
+            std::mutex lock;
+            std::unordered_map<MethodKey, std::vector<MethodKey>, KeyHash> inliners;
+        };
+
+        // PendingInline is a slot of the inline queue
+        struct PendingInline {
+            std::atomic<size_t> sequence;
+            MethodKey caller;
+            MethodKey callee;
+        };
+
+        // Targets is a sorted, immutable set of target methods; a new set is published on every
+        // change and the old ones are kept, like config snapshots, for JIT threads still reading them.
+        typedef std::vector<MethodKey> Targets;
+
+        SelectiveInstrumentation();
+
+        bool IsTarget(const MethodKey& key) const;
+        // TryQueueInline returns false when the queue is full, the caller then records the inline itself.
+        bool TryQueueInline(const MethodKey& caller, const MethodKey& callee);
+        // DrainInlines moves the queued inlines to the graph; with claimed set it also waits for the
+        // ones whose producers are still writing them.
+        void DrainInlines(bool claimed);
+        void Record(const MethodKey& caller, const MethodKey& callee);
+        void Publish(Targets targets);
+        void AppendPrecompiledInliners(const MethodKey& target, const std::vector<ModuleID>& inlinerModuleIds,
+            std::vector<MethodKey>& inliners);
+        void ThreadMain();
+        void WriteStats(StatsWriter& writer);
+
+        ICorProfilerInfo8* info_;
+        ModuleHandler handler_;
+        std::atomic<bool> enabled_;
+
+        std::atomic<const Targets*> targets_;
+        // guards the published sets, held while building a new one
+        std::mutex targetsLock_;
+        std::vector<std::unique_ptr<Targets>> published_;
+
+        Shard shards_[ShardCount];
+
+        std::unique_ptr<PendingInline[]> inlineQueue_;
+        std::atomic<size_t> inlineTail_;
+        // held by the one thread draining the queue at a time
+        std::mutex drainLock_;
+        size_t inlineHead_;
+
+        // (inliner module, target) pairs whose inliner enumeration reported incompleteData
+        std::mutex incompleteLock_;
+        std::vector<std::pair<ModuleID, MethodKey>> incomplete_;
+
+        std::atomic<UINT64> vetoed_;
+        std::atomic<UINT64> recorded_;
+        std::atomic<UINT64> queueFull_;
+        std::atomic<UINT64> incompleteLists_;
+        std::atomic<UINT64> inlinersRejitted_;
+        std::atomic<UINT64> modulesQueued_;
+
+        std::mutex threadLock_;
+        std::condition_variable wakeUp_;
+        std::vector<ModuleID> pending_;
+        bool stopping_;
+        std::thread thread_;
+    };
+}
+
+#endif  // CLR_PROFILER_SELECTIVE_INSTRUMENTATION_H_
@@ -0,0 +1,406 @@
+/***************************************************************************************************
+*****************************                Signature                ******************************
+****************************************************************************************************
+
+Sig ::= MethodDefSig | MethodRefSig | StandAloneMethodSig | FieldSig | PropertySig | LocalVarSig
+
+MethodDefSig ::= [[HASTHIS] [EXPLICITTHIS]] (DEFAULT|VARARG|GENERIC GenParamCount) ParamCount RetType Param*
+
+MethodRefSig ::= [[HASTHIS] [EXPLICITTHIS]] VARARG ParamCount RetType Param* [SENTINEL Param+]
+
+StandAloneMethodSig ::=  [[HASTHIS] [EXPLICITTHIS]] (DEFAULT|VARARG|C|STDCALL|THISCALL|FASTCALL)
+                    ParamCount RetType Param* [SENTINEL Param+]
+
+FieldSig ::= FIELD CustomMod* Type
+
+PropertySig ::= PROPERTY [HASTHIS] ParamCount CustomMod* Type Param*
+
+LocalVarSig ::= LOCAL_SIG Count (TYPEDBYREF | ([CustomMod] [Constraint])* [BYREF] Type)+
+
+
+-------------
+
+CustomMod ::= ( CMOD_OPT | CMOD_REQD ) ( TypeDefEncoded | TypeRefEncoded )
+
+Constraint ::= #define ELEMENT_TYPE_PINNED
+
+Param ::= CustomMod* ( TYPEDBYREF | [BYREF] Type )
+
+RetType ::= CustomMod* ( VOID | TYPEDBYREF | [BYREF] Type )
+
+Type ::= ( BOOLEAN | CHAR | I1 | U1 | U2 | U2 | I4 | U4 | I8 | U8 | R4 | R8 | I | U |
+                | VALUETYPE TypeDefOrRefEncoded
+                | CLASS TypeDefOrRefEncoded
+                | STRING
+                | OBJECT
+                | PTR CustomMod* VOID
+                | PTR CustomMod* Type
+                | FNPTR MethodDefSig
+                | FNPTR MethodRefSig
+                | ARRAY Type ArrayShape
+                | SZARRAY CustomMod* Type
+                | GENERICINST (CLASS | VALUETYPE) TypeDefOrRefEncoded GenArgCount Type*
+                | VAR Number
+                | MVAR Number
+
+ArrayShape ::= Rank NumSizes Size* NumLoBounds LoBound*
+
+TypeDefOrRefEncoded ::= TypeDefEncoded | TypeRefEncoded
+TypeDefEncoded ::= 32-bit-3-part-encoding-for-typedefs-and-typerefs
+TypeRefEncoded ::= 32-bit-3-part-encoding-for-typedefs-and-typerefs
+
+ParamCount ::= 29-bit-encoded-integer
+GenArgCount ::= 29-bit-encoded-integer
+Count ::= 29-bit-encoded-integer
+Rank ::= 29-bit-encoded-integer
+NumSizes ::= 29-bit-encoded-integer
+Size ::= 29-bit-encoded-integer
+NumLoBounds ::= 29-bit-encoded-integer
+LoBounds ::= 29-bit-encoded-integer
+Number ::= 29-bit-encoded-integer
+
+***************************************************************************************************/
+
+#include "signature_decoder.h"
+#include <cstring>
+#include "compressed_int.h"
+
+namespace trace {
+
+    namespace {
+        const unsigned MaxDepth = 64;
+
+        // what follows each element type in a signature
+        enum class SigKind : BYTE {
+            Invalid,
+            Simple,
+            Token,
+            Nested,
+            Array,
+            GenericInst,
+            Number,
+            FnPtr,
+            Modifier,
+            ByRef,
+            Pinned,
+        };
+
+        struct SigKindTable {
+            static const unsigned Size = ELEMENT_TYPE_PINNED + 1;
+            SigKind kinds[Size];
+
+            SigKindTable() {
+                for (auto& kind : kinds) {
+                    kind = SigKind::Invalid;
+                }
+                for (BYTE type = ELEMENT_TYPE_VOID; type <= ELEMENT_TYPE_STRING; type++) {
+                    kinds[type] = SigKind::Simple;
+                }
+                kinds[ELEMENT_TYPE_TYPEDBYREF] = SigKind::Simple;
+                kinds[ELEMENT_TYPE_I] = SigKind::Simple;
+                kinds[ELEMENT_TYPE_U] = SigKind::Simple;
+                kinds[ELEMENT_TYPE_OBJECT] = SigKind::Simple;
+                kinds[ELEMENT_TYPE_CLASS] = SigKind::Token;
+                kinds[ELEMENT_TYPE_VALUETYPE] = SigKind::Token;
+                kinds[ELEMENT_TYPE_PTR] = SigKind::Nested;
+                kinds[ELEMENT_TYPE_SZARRAY] = SigKind::Nested;
+                kinds[ELEMENT_TYPE_ARRAY] = SigKind::Array;
+                kinds[ELEMENT_TYPE_GENERICINST] = SigKind::GenericInst;
+                kinds[ELEMENT_TYPE_VAR] = SigKind::Number;
+                kinds[ELEMENT_TYPE_MVAR] = SigKind::Number;
+                kinds[ELEMENT_TYPE_FNPTR] = SigKind::FnPtr;
+                kinds[ELEMENT_TYPE_CMOD_OPT] = SigKind::Modifier;
+                kinds[ELEMENT_TYPE_CMOD_REQD] = SigKind::Modifier;
+                kinds[ELEMENT_TYPE_BYREF] = SigKind::ByRef;
+                kinds[ELEMENT_TYPE_PINNED] = SigKind::Pinned;
+            }
+
+            SigKind operator[](BYTE type) const {
+                return type < Size ? kinds[type] : SigKind::Invalid;
+            }
+        };
+
+        const SigKindTable Kinds;
+
+        class Decoder {
+        public:
+            Decoder(PCCOR_SIGNATURE base, ULONG length, std::vector<SigNode>& nodes)
+                : base_(base), cur_(base), end_(base + length), nodes_(nodes) {}
+
+            // MethodSig ::= CallConv [GenParamCount] ParamCount RetType Param* [SENTINEL Param+]
+            bool Method(unsigned depth, BYTE* callingConvention, ULONG* genericArity, SigParam* ret,
+                std::vector<SigParam>* params, ULONG* sentinel) {
+                BYTE convention;
+                if (!Byte(&convention)) {
+                    return false;
+                }
+                switch (convention & IMAGE_CEE_CS_CALLCONV_MASK) {
+                case IMAGE_CEE_CS_CALLCONV_FIELD:
+                case IMAGE_CEE_CS_CALLCONV_LOCAL_SIG:
+                case IMAGE_CEE_CS_CALLCONV_PROPERTY:
+                case IMAGE_CEE_CS_CALLCONV_GENERICINST:
+                    return false;
+                default:
+                    break;
+                }
+                *callingConvention = convention;
+
+                ULONG arity = 0;
+                if ((convention & IMAGE_CEE_CS_CALLCONV_GENERIC) != 0 && !Number(&arity)) {
+                    return false;
+                }
+                if (genericArity != nullptr) {
+                    *genericArity = arity;
+                }
+
+                ULONG count;
+                if (!Number(&count) || count > (ULONG)(end_ - cur_)) {
+                    return false;
+                }
+
+                SigParam param;
+                if (!Param(depth, &param)) {
+                    return false;
+                }
+                if (ret != nullptr) {
+                    *ret = param;
+                }
+
+                ULONG firstVararg = count;
+                for (ULONG i = 0; i < count; i++) {
+                    if (cur_ < end_ && *cur_ == ELEMENT_TYPE_SENTINEL) {
+                        if (firstVararg != count) {
+                            return false;
+                        }
+                        firstVararg = i;
+                        cur_++;
+                    }
+                    if (!Param(depth, &param)) {
+                        return false;
+                    }
+                    if (params != nullptr) {
+                        params->push_back(param);
+                    }
+                }
+                if (sentinel != nullptr) {
+                    *sentinel = firstVararg;
+                }
+                return true;
+            }
+
+            bool Skip(PCCOR_SIGNATURE* next) {
+                if (!Type(0, nullptr)) {
+                    return false;
+                }
+                *next = cur_;
+                return true;
+            }
+
+        private:
+            bool Byte(BYTE* out) {
+                if (cur_ >= end_) {
+                    return false;
+                }
+                *out = *cur_++;
+                return true;
+            }
+
+            bool Number(ULONG* out) {
+                return DecodeCompressed(cur_, end_, out);
+            }
+
+            bool TypeDefOrRef(mdToken* out) {
+                return DecodeTypeDefOrRef(cur_, end_, out);
+            }
+
+            // Param ::= CustomMod* ( TYPEDBYREF | [BYREF] Type ), RetType also allows VOID
+            bool Param(unsigned depth, SigParam* param) {
+                PCCOR_SIGNATURE start = nullptr;
+                param->node = (ULONG)nodes_.size();
+                if (!Type(depth, &start)) {
+                    return false;
+                }
+                param->offset = (ULONG)(start - base_);
+                param->length = (ULONG)(cur_ - start);
+                return true;
+            }
+
+            // CustomMod* [PINNED] [BYREF] Type, start is left on the BYREF or the element type
+            bool Type(unsigned depth, PCCOR_SIGNATURE* start) {
+                if (depth >= MaxDepth) {
+                    return false;
+                }
+
+                SigNode node{};
+                node.token = mdTokenNil;
+                node.modifier = mdTokenNil;
+                SigKind kind;
+                for (;;) {
+                    if (start != nullptr && (node.flags & SigNodeByRef) == 0) {
+                        *start = cur_;
+                    }
+                    if (!Byte(&node.elementType)) {
+                        return false;
+                    }
+                    kind = Kinds[node.elementType];
+                    if (kind == SigKind::Modifier) {
+                        node.flags |= node.elementType == ELEMENT_TYPE_CMOD_OPT ? SigNodeModOpt : SigNodeModReqd;
+                        if (!TypeDefOrRef(&node.modifier)) {
+                            return false;
+                        }
+                    }
+                    else if (kind == SigKind::Pinned) {
+                        node.flags |= SigNodePinned;
+                    }
+                    else if (kind == SigKind::ByRef) {
+                        node.flags |= SigNodeByRef;
+                    }
+                    else {
+                        break;
+                    }
+                }
+
+                // nodes_ may grow below, so the node is filled in by index
+                const size_t index = nodes_.size();
+                nodes_.push_back(node);
+
+                switch (kind) {
+                case SigKind::Simple:
+                    break;
+
+                case SigKind::Token:
+                    if (!TypeDefOrRef(&nodes_[index].token)) {
+                        return false;
+                    }
+                    break;
+
+                case SigKind::Nested:
+                    nodes_[index].count = 1;
+                    if (!Type(depth + 1, nullptr)) {
+                        return false;
+                    }
+                    break;
+
+                case SigKind::Array: {
+                    // ARRAY Type Rank NumSizes Size* NumLoBounds LoBound*
+                    nodes_[index].count = 1;
+                    if (!Type(depth + 1, nullptr)) {
+                        return false;
+                    }
+                    ULONG rank;
+                    ULONG sizes;
+                    ULONG bounds;
+                    if (!Number(&rank) || !Number(&sizes) || !SkipCompressedRun(cur_, end_, sizes) ||
+                        !Number(&bounds) || !SkipCompressedRun(cur_, end_, bounds)) {
+                        return false;
+                    }
+                    nodes_[index].value = rank;
+                    break;
+                }
+
+                case SigKind::GenericInst: {
+                    // GENERICINST (CLASS | VALUETYPE) TypeDefOrRefEncoded GenArgCount Type*
+                    BYTE generic;
+                    ULONG arity;
+                    if (!Byte(&generic) || (generic != ELEMENT_TYPE_CLASS && generic != ELEMENT_TYPE_VALUETYPE) ||
+                        !TypeDefOrRef(&nodes_[index].token) || !Number(&arity) || arity == 0 || arity > 0xFFFF) {
+                        return false;
+                    }
+                    if (generic == ELEMENT_TYPE_VALUETYPE) {
+                        nodes_[index].flags |= SigNodeValueType;
+                    }
+                    nodes_[index].count = (USHORT)arity;
+                    for (ULONG i = 0; i < arity; i++) {
+                        if (!Type(depth + 1, nullptr)) {
+                            return false;
+                        }
+                    }
+                    break;
+                }
+
+                case SigKind::Number:
+                    if (!Number(&nodes_[index].value)) {
+                        return false;
+                    }
+                    break;
+
+                case SigKind::FnPtr: {
+                    // FNPTR MethodDefSig | FNPTR MethodRefSig, the return type and parameters follow
+                    // as nested types
+                    BYTE convention;
+                    ULONG before = (ULONG)nodes_.size();
+                    if (!Method(depth + 1, &convention, nullptr, nullptr, nullptr, nullptr)) {
+                        return false;
+                    }
+                    ULONG count = 0;
+                    for (ULONG i = before; i < nodes_.size(); i = nodes_[i].end) {
+                        count++;
+                    }
+                    if (count > 0xFFFF) {
+                        return false;
+                    }
+                    nodes_[index].value = convention;
+                    nodes_[index].count = (USHORT)count;
+                    break;
+                }
+
+                default:
+                    return false;
+                }
+
+                nodes_[index].end = (ULONG)nodes_.size();
+                return true;
+            }
+
+            const PCCOR_SIGNATURE base_;
+            PCCOR_SIGNATURE cur_;
+            const PCCOR_SIGNATURE end_;
+            std::vector<SigNode>& nodes_;
+        };
+    }
+
+    HRESULT DecodeMethodSignature(PCCOR_SIGNATURE signature, ULONG length, ParsedSignature& parsed) {
+        parsed.blob.assign(signature, signature + length);
+        parsed.nodes.clear();
+        parsed.params.clear();
+
+        Decoder decoder(parsed.blob.data(), length, parsed.nodes);
+        if (!decoder.Method(0, &parsed.callingConvention, &parsed.genericArity, &parsed.ret,
+            &parsed.params, &parsed.sentinel)) {
+            return E_FAIL;
+        }
+        if (parsed.sentinel > parsed.params.size()) {
+            parsed.sentinel = (ULONG)parsed.params.size();
+        }
+        parsed.id = SignatureTable::Instance()->Intern(signature, length);
+        return S_OK;
+    }
+
+    bool SkipSignatureType(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end) {
+        // the nodes are thrown away, the scratch vector only keeps its capacity between calls
+        thread_local std::vector<SigNode> scratch;
+        scratch.clear();
+        Decoder decoder(cur, (ULONG)(end - cur), scratch);
+        return decoder.Skip(&cur);
+    }
+
+    std::shared_ptr<const ParsedSignature> SignatureCache::Get(PCCOR_SIGNATURE signature, ULONG length) {
+        const Key key{ signature, length };
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            const auto it = signatures_.find(key);
+            if (it != signatures_.end() && memcmp(it->second->blob.data(), signature, length) == 0) {
+                return it->second;
+            }
+        }
+
+        auto parsed = std::make_shared<ParsedSignature>();
+        if (FAILED(DecodeMethodSignature(signature, length, *parsed))) {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> guard(lock_);
+        signatures_[key] = parsed;
+        return parsed;
+    }
+}
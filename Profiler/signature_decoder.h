@@ -0,0 +1,101 @@
+#ifndef CLR_PROFILER_SIGNATURE_DECODER_H_
+#define CLR_PROFILER_SIGNATURE_DECODER_H_
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <corprof.h>
+#include "signature_table.h"
+
+namespace trace {
+
+    enum SigNodeFlag {
+        SigNodeByRef = 0x01,
+        SigNodePinned = 0x02,
+        SigNodeModOpt = 0x04,
+        SigNodeModReqd = 0x08,
+        // set on a GENERICINST whose generic type is a value type
+        SigNodeValueType = 0x10,
+    };
+
+    // SigNode is one type of a decoded signature. A type and the types nested in it (the element
+    // of an array or pointer, the arguments of a generic instantiation, the return type and
+    // parameters of a function pointer) are stored in pre-order, so a type's nodes run from its
+    // own index up to end.
+    struct SigNode {
+        BYTE elementType;
+        BYTE flags;
+        // nested types: generic arguments, 1 for PTR, SZARRAY and ARRAY, the parameters plus the
+        // return type for FNPTR
+        USHORT count;
+        // VAR and MVAR number, ARRAY rank, FNPTR calling convention
+        ULONG value;
+        // CLASS and VALUETYPE type, GENERICINST generic type
+        mdToken token;
+        // the type of the last custom modifier, when SigNodeModOpt or SigNodeModReqd is set
+        mdToken modifier;
+        ULONG end;
+    };
+
+    // SigParam is the return type or a parameter of a method signature: its root node, and the
+    // bytes of its [BYREF] Type in the signature blob, custom modifiers excluded.
+    struct SigParam {
+        ULONG node;
+        ULONG offset;
+        ULONG length;
+    };
+
+    // ParsedSignature is a decoded method signature. It keeps its own copy of the blob, so the
+    // offsets of ret and params stay valid after the module's metadata moves.
+    struct ParsedSignature {
+        // the blob's id in the SignatureTable
+        SignatureId id = SignatureIdNil;
+        BYTE callingConvention = 0;
+        ULONG genericArity = 0;
+        // index in params of the first vararg parameter after the SENTINEL, params.size() if none
+        ULONG sentinel = 0;
+        SigParam ret{};
+        std::vector<SigParam> params;
+        std::vector<SigNode> nodes;
+        std::vector<COR_SIGNATURE> blob;
+    };
+
+    // DecodeMethodSignature decodes a MethodDefSig, MethodRefSig or StandAloneMethodSig, including
+    // pointers, function pointers, general arrays and custom modifiers.
+    HRESULT DecodeMethodSignature(PCCOR_SIGNATURE signature, ULONG length, ParsedSignature& parsed);
+
+    // SkipSignatureType moves cur past one CustomMod* [BYREF] Type, returning false when the bytes
+    // from cur to end do not start with a valid type.
+    bool SkipSignatureType(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end);
+
+    // SignatureCache decodes each signature blob of a module once. Methods with the same signature
+    // share one blob in the metadata, so they share one ParsedSignature too. Blobs the profiler
+    // emits may reallocate the metadata, so a hit is checked against the cached copy of the blob.
+    class SignatureCache {
+    public:
+        // Get returns the decoded signature, or nullptr when the blob is not a valid method signature.
+        std::shared_ptr<const ParsedSignature> Get(PCCOR_SIGNATURE signature, ULONG length);
+
+    private:
+        struct Key {
+            PCCOR_SIGNATURE signature;
+            ULONG length;
+
+            bool operator==(const Key& other) const {
+                return signature == other.signature && length == other.length;
+            }
+        };
+
+        struct KeyHash {
+            size_t operator()(const Key& key) const {
+                return std::hash<const void*>()(key.signature) ^ key.length;
+            }
+        };
+
+        std::mutex lock_;
+        std::unordered_map<Key, std::shared_ptr<const ParsedSignature>, KeyHash> signatures_;
+    };
+}
+
+#endif  // CLR_PROFILER_SIGNATURE_DECODER_H_
@@ -0,0 +1,75 @@
+#include "signature_table.h"
+#include <cstring>
+#include "profiler_stats.h"
+
+namespace trace {
+
+    namespace {
+        const UINT64 Multiplier = 0x9E3779B97F4A7C15ULL;
+
+        UINT64 Mix(UINT64 hash, UINT64 word) {
+            hash ^= word * Multiplier;
+            hash = (hash << 31) | (hash >> 33);
+            return hash * 0xFF51AFD7ED558CCDULL;
+        }
+    }
+
+    UINT64 HashSignature(PCCOR_SIGNATURE signature, ULONG length) {
+        UINT64 hash = length * Multiplier;
+        ULONG i = 0;
+        for (; i + 8 <= length; i += 8) {
+            UINT64 word;
+            memcpy(&word, signature + i, sizeof(word));
+            hash = Mix(hash, word);
+        }
+        if (i < length) {
+            UINT64 word = 0;
+            memcpy(&word, signature + i, length - i);
+            hash = Mix(hash, word);
+        }
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    SignatureTable::SignatureTable() : lookups_(0) {
+        ProfilerStats::Instance()->Register("signatures", [this](StatsWriter& writer) { WriteStats(writer); });
+    }
+
+    SignatureId SignatureTable::FindLocked(UINT64 hash, PCCOR_SIGNATURE signature, ULONG length) const {
+        const auto range = ids_.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            const Entry& entry = entries_[it->second - 1];
+            if (entry.length == length && memcmp(entry.data, signature, length) == 0) {
+                return it->second;
+            }
+        }
+        return SignatureIdNil;
+    }
+
+    SignatureId SignatureTable::Intern(PCCOR_SIGNATURE signature, ULONG length) {
+        const UINT64 hash = HashSignature(signature, length);
+        lookups_.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> guard(lock_);
+        const SignatureId existing = FindLocked(hash, signature, length);
+        if (existing != SignatureIdNil) {
+            return existing;
+        }
+
+        auto data = static_cast<COR_SIGNATURE*>(arena_.Allocate(length == 0 ? 1 : length));
+        memcpy(data, signature, length);
+        entries_.push_back({ data, length });
+        const SignatureId id = (SignatureId)entries_.size();
+        ids_.emplace(hash, id);
+        return id;
+    }
+
+    void SignatureTable::WriteStats(StatsWriter& writer) {
+        const UINT64 lookups = lookups_.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(lock_);
+        writer.Counter("interned", entries_.size());
+        writer.Counter("lookups", lookups);
+        writer.Counter("shared", lookups - entries_.size());
+        writer.Counter("arena_bytes", arena_.Bytes());
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef CLR_PROFILER_SIGNATURE_TABLE_H_
+#define CLR_PROFILER_SIGNATURE_TABLE_H_
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <corprof.h>
+#include "arena.h"
+#include "util.h"
+
+namespace trace {
+
+    class StatsWriter;
+
+    // SignatureId names an interned signature blob; equal blobs always get the same id, so two
+    // signatures are compared by comparing ids. 0 is never handed out.
+    typedef ULONG SignatureId;
+    const SignatureId SignatureIdNil = 0;
+
+    // HashSignature is a 64-bit hash of a signature blob that reads it eight bytes at a time.
+    UINT64 HashSignature(PCCOR_SIGNATURE signature, ULONG length);
+
+    // SignatureTable interns signature blobs for the life of the process. Ids are byte-level: the
+    // same blob in two modules gets one id even though the TypeDefOrRef tokens in it name types of
+    // each module, so rules keyed by id across modules should only rely on the blob's shape.
+    class SignatureTable : public Singleton<SignatureTable> {
+        friend class Singleton<SignatureTable>;
+
+    public:
+        SignatureId Intern(PCCOR_SIGNATURE signature, ULONG length);
+
+    private:
+        struct Entry {
+            PCCOR_SIGNATURE data;
+            ULONG length;
+        };
+
+        SignatureTable();
+
+        SignatureId FindLocked(UINT64 hash, PCCOR_SIGNATURE signature, ULONG length) const;
+        void WriteStats(StatsWriter& writer);
+
+        std::mutex lock_;
+        Arena arena_;
+        // entry i has id i + 1
+        std::vector<Entry> entries_;
+        std::unordered_multimap<UINT64, SignatureId> ids_;
+
+        std::atomic<UINT64> lookups_;
+    };
+}
+
+#endif  // CLR_PROFILER_SIGNATURE_TABLE_H_
@@ -0,0 +1,230 @@
+#include "stack_sampler.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "clr_helpers.h"
+#include "logger.h"
+#include "profiler_config.h"
+#include "profiler_stats.h"
+#include "thread_registry.h"
+#include "timing.h"
+
+namespace trace {
+
+    CallTree::CallTree() {
+        // node 0 is the root every stack hangs off
+        nodes_.push_back({ 0, 0, 0 });
+    }
+
+    void CallTree::AddStack(const FunctionID* frames, size_t count) {
+        UINT32 node = 0;
+        for (size_t i = count; i > 0; i--) {
+            const ChildKey key{ node, frames[i - 1] };
+            const auto it = children_.find(key);
+            if (it != children_.end()) {
+                node = it->second;
+                continue;
+            }
+            const UINT32 child = (UINT32)nodes_.size();
+            nodes_.push_back({ frames[i - 1], node, 0 });
+            children_.emplace(key, child);
+            node = child;
+        }
+        nodes_[node].samples++;
+    }
+
+    SamplerSettings SamplerSettings::FromConfig(const ConfigSnapshot& config) {
+        SamplerSettings settings;
+        const auto& frequency = config.Value(WStr("PROFILER_SAMPLING_HZ"));
+        if (!frequency.empty()) {
+            settings.frequencyHz = (unsigned)strtoul(ToString(frequency).c_str(), nullptr, 10);
+        }
+        if (settings.frequencyHz == 0) {
+            settings.frequencyHz = 1;
+        }
+        const auto& maxDepth = config.Value(WStr("PROFILER_SAMPLING_MAX_DEPTH"));
+        if (!maxDepth.empty()) {
+            settings.maxDepth = (unsigned)strtoul(ToString(maxDepth).c_str(), nullptr, 10);
+        }
+        const auto& path = config.Value(WStr("PROFILER_SAMPLING_FILE"));
+        settings.path = path.empty()
+            ? "profiler_samples_" + ToString((uint64_t)GetPID()) + ".folded"
+            : ToString(path);
+        return settings;
+    }
+
+    StackSampler::StackSampler(ICorProfilerInfo4* info, SamplerSettings settings)
+        : info_(nullptr), settings_(settings)
+    {
+        info->QueryInterface(__uuidof(ICorProfilerInfo10), reinterpret_cast<void**>(&info_));
+        frames_.reserve(settings_.maxDepth);
+    }
+
+    StackSampler::~StackSampler()
+    {
+        Stop();
+        ProfilerStats::Instance()->Unregister("sampler");
+        if (info_ != nullptr) {
+            info_->Release();
+        }
+    }
+
+    bool StackSampler::Start()
+    {
+        if (info_ == nullptr) {
+            LOG_WARNING("StackSampler: ICorProfilerInfo10 is not available, sampling is disabled");
+            return false;
+        }
+
+        std::lock_guard<std::mutex> guard(threadLock_);
+        if (thread_.joinable()) {
+            return true;
+        }
+        ProfilerStats::Instance()->Register("sampler", [this](StatsWriter& writer) { WriteStats(writer); });
+        stopping_ = false;
+        thread_ = std::thread(&StackSampler::ThreadMain, this);
+        return true;
+    }
+
+    void StackSampler::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(threadLock_);
+            stopping_ = true;
+        }
+        wakeUp_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void StackSampler::ThreadMain()
+    {
+        const auto interval = std::chrono::microseconds(1000000 / settings_.frequencyHz);
+        auto next = std::chrono::steady_clock::now() + interval;
+        std::unique_lock<std::mutex> guard(threadLock_);
+        while (!stopping_) {
+            wakeUp_.wait_until(guard, next);
+            if (stopping_) {
+                break;
+            }
+
+            // keep to the schedule, but never try to catch up on ticks missed while suspended
+            next += interval;
+            const auto now = std::chrono::steady_clock::now();
+            if (next < now) {
+                next = now + interval;
+            }
+
+            guard.unlock();
+            SampleAll();
+            guard.lock();
+        }
+    }
+
+    HRESULT STDMETHODCALLTYPE StackSampler::OnFrame(FunctionID functionId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo,
+        ULONG32 contextSize, BYTE context[], void* clientData)
+    {
+        auto sampler = static_cast<StackSampler*>(clientData);
+        // native frames have no FunctionID
+        if (functionId != 0) {
+            sampler->frames_.push_back(functionId);
+        }
+        return sampler->frames_.size() < sampler->settings_.maxDepth ? S_OK : S_FALSE;
+    }
+
+    void StackSampler::SampleAll()
+    {
+        const UINT64 start = ReadTimestamp();
+        HRESULT hr = info_->SuspendRuntime();
+        if (FAILED(hr)) {
+            std::lock_guard<std::mutex> guard(statsLock_);
+            failedSuspends_++;
+            return;
+        }
+
+        UINT64 samples = 0;
+        UINT64 failed = 0;
+        ThreadRegistry::Instance()->ForEach([&](ThreadID threadId, DWORD osThreadId) {
+            frames_.clear();
+            hr = info_->DoStackSnapshot(threadId, &StackSampler::OnFrame, COR_PRF_SNAPSHOT_DEFAULT, this, nullptr, 0);
+            // a walk cut off at maxDepth reports that it was aborted but still has its frames
+            if (FAILED(hr) && frames_.size() < settings_.maxDepth) {
+                failed++;
+                return;
+            }
+            // threads with no managed code on the stack are not samples
+            if (!frames_.empty()) {
+                tree_.AddStack(frames_.data(), frames_.size());
+                samples++;
+            }
+        });
+
+        info_->ResumeRuntime();
+
+        std::lock_guard<std::mutex> guard(statsLock_);
+        ticks_++;
+        samples_ += samples;
+        failedWalks_ += failed;
+        suspendedTicks_ += ReadTimestamp() - start;
+        nodes_ = tree_.NodeCount();
+    }
+
+    const std::string& StackSampler::FunctionName(FunctionID functionId)
+    {
+        const auto it = names_.find(functionId);
+        if (it != names_.end()) {
+            return it->second;
+        }
+
+        const auto resolved = GetFunctionIdName(info_, functionId);
+        std::string name = resolved.empty() ? "[unknown]" : ToString(resolved);
+
+        // ';' separates frames and ' ' the count in the folded format
+        for (auto& c : name) {
+            if (c == ';' || c == ' ') {
+                c = '_';
+            }
+        }
+        return names_.emplace(functionId, name).first->second;
+    }
+
+    bool StackSampler::WriteFolded()
+    {
+        FILE* file = fopen(settings_.path.c_str(), "w");
+        if (file == nullptr) {
+            LOG_ERROR("StackSampler: unable to open {}", settings_.path);
+            return false;
+        }
+
+        std::string line;
+        tree_.ForEachPath([&](const std::vector<FunctionID>& path, UINT64 samples) {
+            line.clear();
+            for (size_t i = 0; i < path.size(); i++) {
+                if (i > 0) {
+                    line += ';';
+                }
+                line += FunctionName(path[i]);
+            }
+            line += ' ';
+            line += ToString(samples);
+            line += '\n';
+            fwrite(line.data(), 1, line.size(), file);
+        });
+
+        fclose(file);
+        return true;
+    }
+
+    void StackSampler::WriteStats(StatsWriter& writer)
+    {
+        std::lock_guard<std::mutex> guard(statsLock_);
+        writer.Counter("ticks", ticks_);
+        writer.Counter("samples", samples_);
+        writer.Counter("failed_walks", failedWalks_);
+        writer.Counter("failed_suspends", failedSuspends_);
+        writer.Counter("call_tree_nodes", nodes_);
+        writer.Counter("threads", ThreadRegistry::Instance()->Count());
+        writer.Gauge("avg_pause_us", ticks_ == 0 ? 0.0 : TicksToNanoseconds(suspendedTicks_) / ticks_ / 1000.0);
+    }
+}
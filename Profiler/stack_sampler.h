@@ -0,0 +1,128 @@
+#ifndef CLR_PROFILER_STACK_SAMPLER_H_
+#define CLR_PROFILER_STACK_SAMPLER_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <corprof.h>
+#include "util.h"
+
+namespace trace {
+
+    class ConfigSnapshot;
+    class StatsWriter;
+
+    // CallTree interns sampled stacks as a tree of FunctionIDs, each distinct call path is stored
+    // once and carries the number of samples that ended in it.
+    class CallTree {
+    public:
+        CallTree();
+
+        // AddStack records one sample, frames are leaf first as DoStackSnapshot reports them.
+        void AddStack(const FunctionID* frames, size_t count);
+
+        size_t NodeCount() const { return nodes_.size(); }
+
+        // ForEachPath calls visit(path, samples) for every node with samples of its own, path is
+        // root first.
+        template <typename Visit>
+        void ForEachPath(Visit visit) const {
+            std::vector<FunctionID> path;
+            for (UINT32 i = 1; i < nodes_.size(); i++) {
+                if (nodes_[i].samples == 0) {
+                    continue;
+                }
+                path.clear();
+                for (UINT32 node = i; node != 0; node = nodes_[node].parent) {
+                    path.push_back(nodes_[node].function);
+                }
+                std::reverse(path.begin(), path.end());
+                visit(path, nodes_[i].samples);
+            }
+        }
+
+    private:
+        struct Node {
+            FunctionID function;
+            UINT32 parent;
+            UINT64 samples;
+        };
+
+        struct ChildKey {
+            UINT32 parent;
+            FunctionID function;
+            bool operator==(const ChildKey& other) const { return parent == other.parent && function == other.function; }
+        };
+
+        struct ChildKeyHash {
+            size_t operator()(const ChildKey& key) const {
+                return std::hash<FunctionID>()(key.function) * 31 + key.parent;
+            }
+        };
+
+        std::vector<Node> nodes_;
+        std::unordered_map<ChildKey, UINT32, ChildKeyHash> children_;
+    };
+
+    struct SamplerSettings {
+        unsigned frequencyHz = 100;
+        // frames deeper than this are cut off at the root end
+        unsigned maxDepth = 256;
+        std::string path;
+
+        static SamplerSettings FromConfig(const ConfigSnapshot& config);
+    };
+
+    // StackSampler wakes up frequencyHz times a second, suspends the runtime, walks every thread in
+    // the ThreadRegistry with DoStackSnapshot and resumes. Samples are wall clock: a blocked thread
+    // is sampled as often as a running one.
+    class StackSampler {
+    public:
+        StackSampler(ICorProfilerInfo4* info, SamplerSettings settings);
+        ~StackSampler();
+
+        // Start fails when the runtime does not implement ICorProfilerInfo10 (.NET Core 3.0+).
+        bool Start();
+        void Stop();
+
+        // WriteFolded writes the call tree in folded stack format, one "root;...;leaf count" line
+        // per path, the input flame graph tools expect. Call it after Stop.
+        bool WriteFolded();
+
+    private:
+        static HRESULT STDMETHODCALLTYPE OnFrame(FunctionID functionId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo,
+            ULONG32 contextSize, BYTE context[], void* clientData);
+
+        void ThreadMain();
+        void SampleAll();
+        const std::string& FunctionName(FunctionID functionId);
+        void WriteStats(StatsWriter& writer);
+
+        ICorProfilerInfo10* info_;
+        const SamplerSettings settings_;
+
+        // only the sampler thread touches these while it runs
+        CallTree tree_;
+        std::vector<FunctionID> frames_;
+        std::unordered_map<FunctionID, std::string> names_;
+
+        std::mutex statsLock_;
+        UINT64 ticks_ = 0;
+        UINT64 samples_ = 0;
+        UINT64 failedWalks_ = 0;
+        UINT64 failedSuspends_ = 0;
+        UINT64 suspendedTicks_ = 0;
+        size_t nodes_ = 0;
+
+        std::mutex threadLock_;
+        std::condition_variable wakeUp_;
+        bool stopping_ = false;
+        std::thread thread_;
+    };
+}
+
+#endif  // CLR_PROFILER_STACK_SAMPLER_H_
@@ -1,5 +1,5 @@
 #include "string.h"
-#include "miniutf.hpp"
+#include "transcode.h"
 #include <sstream>
 
 namespace trace {
@@ -12,13 +12,24 @@ std::string ToString(const uint64_t i) {
   return ss.str();
 }
 std::string ToString(const WSTRING& wstr) {
-  std::u16string ustr(reinterpret_cast<const char16_t*>(wstr.c_str()));
-  return miniutf::to_utf8(ustr);
+  // stop at the first NUL like the c_str() conversion this replaced
+  const size_t length = std::char_traits<WCHAR>::length(wstr.c_str());
+  // most names are ASCII and fit in length bytes, the rest are retried with room for the worst case
+  std::string str(length, '\0');
+  size_t written = Utf16ToUtf8(wstr.data(), length, &str[0], str.size());
+  if (written == TranscodeOverflow) {
+    str.resize(Utf8Capacity(length));
+    written = Utf16ToUtf8(wstr.data(), length, &str[0], str.size());
+  }
+  str.resize(written);
+  return str;
 }
 
 WSTRING ToWSTRING(const std::string& str) {
-  auto ustr = miniutf::to_utf16(str);
-  return WSTRING(reinterpret_cast<const WCHAR*>(ustr.c_str()));
+  const size_t length = std::char_traits<char>::length(str.c_str());
+  WSTRING wstr(Utf16Capacity(length), 0);
+  wstr.resize(Utf8ToUtf16(str.data(), length, &wstr[0], wstr.size()));
+  return wstr;
 }
 
 WCHAR operator"" _W(const char c) { return WCHAR(c); }
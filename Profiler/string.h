@@ -2,6 +2,7 @@
 #define CLR_PROFILER_STRING_H_
 
 #include <corhlpr.h>
+#include <initializer_list>
 #include <string>
 
 namespace trace {
@@ -9,6 +10,63 @@ namespace trace {
     typedef std::basic_string<WCHAR> WSTRING;
     typedef std::basic_stringstream<WCHAR> WSTRINGSTREAM;
 
+    // WStr makes a WCHAR string literal at compile time, with static storage, where "..."_W
+    // converts and allocates every time it runs.
+#ifdef _WIN32
+#define WStr(value) L##value
+#else
+#define WStr(value) u##value
+#endif
+
+    // WStringView is a length and a pointer to WCHARs it does not own: a null terminated string
+    // such as a WStr literal, a buffer and the length filled in it, or a WSTRING that outlives the
+    // view.
+    class WStringView {
+    public:
+        constexpr WStringView() : data_(nullptr), length_(0) {}
+        // the length is counted up to the terminator, a buffer only partly filled is viewed with an
+        // explicit length instead
+        WStringView(const WCHAR* str) : data_(str), length_(std::char_traits<WCHAR>::length(str)) {}
+        constexpr explicit WStringView(const WCHAR* data, size_t length) : data_(data), length_(length) {}
+        WStringView(const WSTRING& str) : data_(str.data()), length_(str.length()) {}
+
+        constexpr const WCHAR* data() const { return data_; }
+        constexpr size_t length() const { return length_; }
+        constexpr bool empty() const { return length_ == 0; }
+        WSTRING str() const { return WSTRING(data_, length_); }
+
+    private:
+        const WCHAR* data_;
+        size_t length_;
+    };
+
+    inline bool operator==(WStringView left, WStringView right) {
+        return left.length() == right.length() &&
+            std::char_traits<WCHAR>::compare(left.data(), right.data(), left.length()) == 0;
+    }
+    inline bool operator!=(WStringView left, WStringView right) { return !(left == right); }
+    inline bool operator==(const WSTRING& left, WStringView right) { return WStringView(left) == right; }
+    inline bool operator!=(const WSTRING& left, WStringView right) { return !(WStringView(left) == right); }
+    inline bool operator==(WStringView left, const WSTRING& right) { return left == WStringView(right); }
+    inline bool operator!=(WStringView left, const WSTRING& right) { return !(left == WStringView(right)); }
+
+    // Append adds view to the end of str.
+    inline WSTRING& Append(WSTRING& str, WStringView view) { return str.append(view.data(), view.length()); }
+
+    // Concat joins parts with a single allocation.
+    inline WSTRING Concat(std::initializer_list<WStringView> parts) {
+        size_t length = 0;
+        for (const auto& part : parts) {
+            length += part.length();
+        }
+        WSTRING result;
+        result.reserve(length);
+        for (const auto& part : parts) {
+            result.append(part.data(), part.length());
+        }
+        return result;
+    }
+
     std::string ToString(const std::string& str);
     std::string ToString(const char* str);
     std::string ToString(const uint64_t i);
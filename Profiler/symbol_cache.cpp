@@ -0,0 +1,433 @@
+#include "symbol_cache.h"
+#include <cstring>
+#include <new>
+#include "clr_helpers.h"
+#include "module_store.h"
+#include "profiler_stats.h"
+#include "signature_table.h"
+#include "type_name_formatter.h"
+
+namespace trace {
+
+    namespace {
+        // most modules resolve a handful of names, the table doubles for the ones that resolve more
+        const size_t InitialCapacity = 64;
+        const size_t InitialSpecCapacity = 16;
+        const size_t InitialFunctionCapacity = 4096;
+        const size_t SymbolArenaInitialBlock = 1024;
+
+        // marks the slot of an entry ForgetModule unlinked, lookups probe past it
+        const char UnlinkedSlot = 0;
+
+        size_t HashToken(mdToken token) {
+            UINT64 hash = (UINT64)token * 0x9E3779B97F4A7C15ULL;
+            hash ^= hash >> 33;
+            hash *= 0xFF51AFD7ED558CCDULL;
+            hash ^= hash >> 33;
+            return (size_t)hash;
+        }
+
+        size_t HashFunction(FunctionID functionId) {
+            UINT64 hash = (UINT64)functionId * 0x9E3779B97F4A7C15ULL;
+            hash ^= hash >> 33;
+            hash *= 0xFF51AFD7ED558CCDULL;
+            hash ^= hash >> 33;
+            return (size_t)hash;
+        }
+
+        CComPtr<IMetaDataImport2> GetMetaDataImport(ICorProfilerInfo3* info, ModuleID moduleId) {
+            CComPtr<IUnknown> metadata_interfaces;
+            auto hr = info->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport2, metadata_interfaces.GetAddressOf());
+            if (FAILED(hr)) {
+                return CComPtr<IMetaDataImport2>();
+            }
+            return metadata_interfaces.As<IMetaDataImport2>(IID_IMetaDataImport);
+        }
+
+        WSTRING ResolveMethodName(const CComPtr<IMetaDataImport2>& metadataImport, mdToken methodToken) {
+            const auto functionInfo = GetFunctionInfo(metadataImport, methodToken);
+            if (!functionInfo.IsValid()) {
+                return WSTRING();
+            }
+            return Concat({ functionInfo.type.name, WStr("."), functionInfo.name });
+        }
+
+        WSTRING ResolveTypeName(const CComPtr<IMetaDataImport2>& metadataImport, mdToken typeToken) {
+            const auto typeInfo = GetTypeInfo(metadataImport, typeToken);
+            return typeInfo.IsValid() ? typeInfo.name : WSTRING();
+        }
+    }
+
+    size_t HashSymbolName(WStringView name) {
+        // FNV-1a
+        UINT64 hash = 0xCBF29CE484222325ULL;
+        for (size_t i = 0; i < name.length(); i++) {
+            hash ^= (UINT64)name.data()[i];
+            hash *= 0x100000001B3ULL;
+        }
+        return (size_t)hash;
+    }
+
+    ModuleSymbols::ModuleSymbols() : arena_(SymbolArenaInitialBlock) {
+        tokens_.store(NewTable(InitialCapacity), std::memory_order_release);
+        specs_.store(NewTable(InitialSpecCapacity), std::memory_order_release);
+    }
+
+    ModuleSymbols::Table* ModuleSymbols::NewTable(size_t capacity) {
+        auto slots = arena_.AllocateArray<std::atomic<const Entry*>>(capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            new (&slots[i]) std::atomic<const Entry*>(nullptr);
+        }
+        return new (arena_.Allocate(sizeof(Table))) Table{ slots, capacity - 1, 0 };
+    }
+
+    const ModuleSymbols::Entry* ModuleSymbols::FindEntry(const std::atomic<Table*>& table, size_t hash, mdToken token,
+        PCCOR_SIGNATURE blob, ULONG blobLength) {
+        const Table* current = table.load(std::memory_order_acquire);
+        for (size_t i = hash;; i++) {
+            const Entry* entry = current->slots[i & current->mask].load(std::memory_order_acquire);
+            if (entry == nullptr) {
+                return nullptr;
+            }
+            if (entry->hash == hash && entry->token == token && entry->blobLength == blobLength &&
+                (blobLength == 0 || memcmp(entry->blob, blob, blobLength) == 0)) {
+                return entry;
+            }
+        }
+    }
+
+    const SymbolName* ModuleSymbols::Find(mdToken token) const {
+        const Entry* entry = FindEntry(tokens_, HashToken(token), token, nullptr, 0);
+        return entry != nullptr ? &entry->name : nullptr;
+    }
+
+    const SymbolName* ModuleSymbols::Add(mdToken token, WStringView name) {
+        return AddEntry(tokens_, HashToken(token), token, nullptr, 0, name);
+    }
+
+    const SymbolName* ModuleSymbols::FindSpec(PCCOR_SIGNATURE blob, ULONG length) const {
+        const Entry* entry = FindEntry(specs_, (size_t)HashSignature(blob, length), mdTokenNil, blob, length);
+        return entry != nullptr ? &entry->name : nullptr;
+    }
+
+    const SymbolName* ModuleSymbols::AddSpec(PCCOR_SIGNATURE blob, ULONG length, WStringView name) {
+        return length == 0 ? nullptr : AddEntry(specs_, (size_t)HashSignature(blob, length), mdTokenNil, blob, length, name);
+    }
+
+    const SymbolName* ModuleSymbols::AddEntry(std::atomic<Table*>& table, size_t hash, mdToken token, PCCOR_SIGNATURE blob,
+        ULONG blobLength, WStringView name) {
+        std::lock_guard<std::mutex> guard(writeLock_);
+
+        // another thread may have resolved the same key while this one was reading metadata
+        const Entry* existing = FindEntry(table, hash, token, blob, blobLength);
+        if (existing != nullptr) {
+            return &existing->name;
+        }
+
+        Table* current = table.load(std::memory_order_relaxed);
+        if ((current->count + 1) * 2 > current->mask + 1) {
+            // readers still in the old table finish there, it is freed with the arena
+            Table* grown = NewTable((current->mask + 1) * 2);
+            for (size_t i = 0; i <= current->mask; i++) {
+                const Entry* entry = current->slots[i].load(std::memory_order_relaxed);
+                if (entry != nullptr) {
+                    for (size_t j = entry->hash;; j++) {
+                        if (grown->slots[j & grown->mask].load(std::memory_order_relaxed) == nullptr) {
+                            grown->slots[j & grown->mask].store(entry, std::memory_order_relaxed);
+                            break;
+                        }
+                    }
+                }
+            }
+            grown->count = current->count;
+            current = grown;
+            table.store(current, std::memory_order_release);
+        }
+
+        // the blob is copied, the metadata of a dynamic module can move as it grows
+        BYTE* blobCopy = nullptr;
+        if (blobLength > 0) {
+            blobCopy = arena_.AllocateArray<BYTE>(blobLength);
+            memcpy(blobCopy, blob, blobLength);
+        }
+        WCHAR* data = arena_.AllocateArray<WCHAR>(name.length() + 1);
+        std::char_traits<WCHAR>::copy(data, name.data(), name.length());
+        data[name.length()] = 0;
+        auto entry = new (arena_.Allocate(sizeof(Entry))) Entry{ hash, token, blobCopy, blobLength,
+            SymbolName{ data, name.length(), HashSymbolName(name) } };
+        for (size_t i = hash;; i++) {
+            if (current->slots[i & current->mask].load(std::memory_order_relaxed) == nullptr) {
+                current->slots[i & current->mask].store(entry, std::memory_order_release);
+                current->count++;
+                return &entry->name;
+            }
+        }
+    }
+
+    size_t ModuleSymbols::Count() const {
+        std::lock_guard<std::mutex> guard(writeLock_);
+        return tokens_.load(std::memory_order_relaxed)->count + specs_.load(std::memory_order_relaxed)->count;
+    }
+
+    size_t ModuleSymbols::ArenaBytes() const {
+        std::lock_guard<std::mutex> guard(writeLock_);
+        return arena_.Bytes();
+    }
+
+    SymbolCache::FunctionTable::FunctionTable(size_t capacity)
+        : slots(new std::atomic<const FunctionEntry*>[capacity]), mask(capacity - 1), used(0), live(0)
+    {
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    SymbolCache::SymbolCache() : readers_(0), table_(new FunctionTable(InitialFunctionCapacity)), hits_(0), misses_(0), uncached_(0) {
+        functions_.store(table_.get(), std::memory_order_release);
+        ProfilerStats::Instance()->Register("symbols", [this](StatsWriter& writer) { WriteStats(writer); });
+    }
+
+    std::shared_ptr<ModuleMetaInfo> SymbolCache::FindModule(ModuleID moduleId) {
+        auto module = ModuleStore::Instance()->Find(moduleId);
+        if (module == nullptr) {
+            uncached_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return module;
+    }
+
+    Symbol SymbolCache::MethodName(ICorProfilerInfo3* info, ModuleID moduleId, mdToken methodToken) {
+        return MethodName(info, FindModule(moduleId), moduleId, methodToken);
+    }
+
+    Symbol SymbolCache::MethodName(ICorProfilerInfo3* info, const std::shared_ptr<ModuleMetaInfo>& module, ModuleID moduleId,
+        mdToken methodToken) {
+        if (module != nullptr) {
+            const SymbolName* name = module->symbols.Find(methodToken);
+            if (name != nullptr) {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return Symbol(module, name);
+            }
+        }
+
+        const auto metadata_import = GetMetaDataImport(info, moduleId);
+        if (metadata_import.IsNull()) {
+            return Symbol();
+        }
+        if (module == nullptr) {
+            return Symbol(ResolveMethodName(metadata_import, methodToken));
+        }
+        const SymbolName* name = MethodName(metadata_import, module->symbols, methodToken);
+        return name == nullptr ? Symbol() : Symbol(module, name);
+    }
+
+    Symbol SymbolCache::FunctionName(ICorProfilerInfo3* info, FunctionID functionId) {
+        // the entry and the table it is in stay allocated until the count drops, the Symbol then
+        // holds the module on its own
+        readers_.fetch_add(1, std::memory_order_seq_cst);
+        const FunctionEntry* entry = FindFunction(functionId);
+        Symbol cached = entry != nullptr ? Symbol(entry->module, entry->name) : Symbol();
+        readers_.fetch_sub(1, std::memory_order_seq_cst);
+        if (cached.IsValid()) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return cached;
+        }
+
+        ModuleID moduleId;
+        mdToken functionToken = mdTokenNil;
+        if (FAILED(info->GetFunctionInfo(functionId, NULL, &moduleId, &functionToken))) {
+            return Symbol();
+        }
+        const auto module = FindModule(moduleId);
+        Symbol name = MethodName(info, module, moduleId, functionToken);
+        if (module != nullptr && name.IsValid()) {
+            AddFunction(functionId, module, moduleId, module->symbols.Find(functionToken));
+        }
+        return name;
+    }
+
+    const SymbolCache::FunctionEntry* SymbolCache::FindFunction(FunctionID functionId) const {
+        const FunctionTable* table = functions_.load(std::memory_order_seq_cst);
+        for (size_t i = HashFunction(functionId);; i++) {
+            const FunctionEntry* entry = table->slots[i & table->mask].load(std::memory_order_acquire);
+            if (entry == nullptr) {
+                return nullptr;
+            }
+            if (entry != reinterpret_cast<const FunctionEntry*>(&UnlinkedSlot) && entry->functionId == functionId) {
+                return entry;
+            }
+        }
+    }
+
+    void SymbolCache::AddFunction(FunctionID functionId, const std::shared_ptr<ModuleMetaInfo>& module, ModuleID moduleId,
+        const SymbolName* name) {
+        std::lock_guard<std::mutex> guard(writeLock_);
+
+        // another thread may have added it, and a module removed meanwhile is not pinned again
+        if (FindFunction(functionId) != nullptr || ModuleStore::Instance()->Find(moduleId) != module) {
+            return;
+        }
+
+        if ((table_->used + 1) * 2 > table_->mask + 1) {
+            size_t capacity = table_->mask + 1;
+            while ((table_->live + 1) * 4 > capacity) {
+                capacity *= 2;
+            }
+            Rebuild(capacity);
+        }
+
+        auto& functions = modules_[moduleId];
+        functions.push_back(FunctionEntry{ functionId, module, name });
+        const FunctionEntry* entry = &functions.back();
+        for (size_t i = HashFunction(functionId);; i++) {
+            if (table_->slots[i & table_->mask].load(std::memory_order_relaxed) == nullptr) {
+                table_->slots[i & table_->mask].store(entry, std::memory_order_release);
+                table_->used++;
+                table_->live++;
+                break;
+            }
+        }
+        Reclaim();
+    }
+
+    void SymbolCache::ForgetModule(ModuleID moduleId) {
+        std::lock_guard<std::mutex> guard(writeLock_);
+        const auto it = modules_.find(moduleId);
+        if (it == modules_.end()) {
+            return;
+        }
+
+        // open addressing cannot empty a slot, the module's own slots are marked instead of
+        // rebuilding the table, and the next growth drops them
+        for (const auto& entry : it->second) {
+            for (size_t i = HashFunction(entry.functionId);; i++) {
+                auto& slot = table_->slots[i & table_->mask];
+                const FunctionEntry* linked = slot.load(std::memory_order_relaxed);
+                if (linked == nullptr) {
+                    break;
+                }
+                if (linked == &entry) {
+                    slot.store(reinterpret_cast<const FunctionEntry*>(&UnlinkedSlot), std::memory_order_seq_cst);
+                    table_->live--;
+                    break;
+                }
+            }
+        }
+        retiredModules_.push_back(std::move(it->second));
+        modules_.erase(it);
+        Reclaim();
+    }
+
+    void SymbolCache::Rebuild(size_t capacity) {
+        std::unique_ptr<FunctionTable> rebuilt(new FunctionTable(capacity));
+        for (size_t i = 0; i <= table_->mask; i++) {
+            const FunctionEntry* entry = table_->slots[i].load(std::memory_order_relaxed);
+            if (entry == nullptr || entry == reinterpret_cast<const FunctionEntry*>(&UnlinkedSlot)) {
+                continue;
+            }
+            for (size_t j = HashFunction(entry->functionId);; j++) {
+                if (rebuilt->slots[j & rebuilt->mask].load(std::memory_order_relaxed) == nullptr) {
+                    rebuilt->slots[j & rebuilt->mask].store(entry, std::memory_order_relaxed);
+                    break;
+                }
+            }
+        }
+        rebuilt->used = table_->live;
+        rebuilt->live = table_->live;
+        functions_.store(rebuilt.get(), std::memory_order_seq_cst);
+        retiredTables_.push_back(std::move(table_));
+        table_ = std::move(rebuilt);
+    }
+
+    void SymbolCache::Reclaim() {
+        // a lookup that starts after the count was seen at zero loads the table as published above,
+        // so nothing retired so far can still be read
+        if ((!retiredTables_.empty() || !retiredModules_.empty()) && readers_.load(std::memory_order_seq_cst) == 0) {
+            retiredTables_.clear();
+            retiredModules_.clear();
+        }
+    }
+
+    Symbol SymbolCache::TypeName(ICorProfilerInfo3* info, ModuleID moduleId, mdToken typeToken) {
+        auto module = FindModule(moduleId);
+        if (module != nullptr) {
+            const SymbolName* name = module->symbols.Find(typeToken);
+            if (name != nullptr) {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return Symbol(std::move(module), name);
+            }
+        }
+
+        const auto metadata_import = GetMetaDataImport(info, moduleId);
+        if (metadata_import.IsNull()) {
+            return Symbol();
+        }
+        if (module == nullptr) {
+            return Symbol(ResolveTypeName(metadata_import, typeToken));
+        }
+        const SymbolName* name = TypeName(metadata_import, module->symbols, typeToken);
+        return name == nullptr ? Symbol() : Symbol(std::move(module), name);
+    }
+
+    const SymbolName* SymbolCache::MethodName(const CComPtr<IMetaDataImport2>& metadataImport, ModuleSymbols& symbols, mdToken methodToken) {
+        const SymbolName* name = symbols.Find(methodToken);
+        if (name != nullptr) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return name;
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+
+        const auto resolved = ResolveMethodName(metadataImport, methodToken);
+        return resolved.empty() ? nullptr : symbols.Add(methodToken, resolved);
+    }
+
+    const SymbolName* SymbolCache::TypeName(const CComPtr<IMetaDataImport2>& metadataImport, ModuleSymbols& symbols, mdToken typeToken) {
+        const SymbolName* name = symbols.Find(typeToken);
+        if (name != nullptr) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return name;
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+
+        if (TypeFromToken(typeToken) == mdtTypeSpec) {
+            PCCOR_SIGNATURE blob = nullptr;
+            ULONG length = 0;
+            if (FAILED(metadataImport->GetTypeSpecFromToken(typeToken, &blob, &length)) || length == 0) {
+                return nullptr;
+            }
+            const SymbolName* spec = symbols.FindSpec(blob, length);
+            if (spec == nullptr) {
+                TypeNameFormatter formatter(metadataImport, &symbols);
+                PCCOR_SIGNATURE cur = blob;
+                const WSTRING& formatted = formatter.Format(cur, blob + length);
+                if (formatted.empty()) {
+                    return nullptr;
+                }
+                spec = symbols.AddSpec(blob, length, formatted);
+            }
+            return symbols.Add(typeToken, spec->view());
+        }
+
+        const auto resolved = ResolveTypeName(metadataImport, typeToken);
+        return resolved.empty() ? nullptr : symbols.Add(typeToken, resolved);
+    }
+
+    void SymbolCache::WriteStats(StatsWriter& writer) {
+        writer.Counter("hits", hits_.load(std::memory_order_relaxed));
+        writer.Counter("misses", misses_.load(std::memory_order_relaxed));
+        writer.Counter("uncached", uncached_.load(std::memory_order_relaxed));
+
+        // the names of unloaded modules are gone with them, only the loaded ones are counted
+        UINT64 names = 0;
+        UINT64 arenaBytes = 0;
+        for (const auto& module : ModuleStore::Instance()->Modules()) {
+            names += module->symbols.Count();
+            arenaBytes += module->symbols.ArenaBytes();
+        }
+        writer.Counter("names", names);
+        writer.Counter("arena_bytes", arenaBytes);
+
+        std::lock_guard<std::mutex> guard(writeLock_);
+        writer.Counter("functions", table_->live);
+        writer.Counter("retired_tables", retiredTables_.size());
+    }
+}
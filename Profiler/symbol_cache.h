@@ -0,0 +1,190 @@
+#ifndef CLR_PROFILER_SYMBOL_CACHE_H_
+#define CLR_PROFILER_SYMBOL_CACHE_H_
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <corprof.h>
+#include "arena.h"
+#include "string.h"  // NOLINT
+#include "util.h"
+#include "CComPtr.h"
+
+namespace trace {
+
+    class ModuleMetaInfo;
+    class StatsWriter;
+
+    // HashSymbolName is the hash a SymbolName carries, callers compare names against it before
+    // comparing characters.
+    size_t HashSymbolName(WStringView name);
+
+    // SymbolName is a resolved name and its HashSymbolName. Its characters live in the arena of the
+    // module it was resolved for and go away with the module.
+    struct SymbolName {
+        const WCHAR* data;
+        size_t length;
+        size_t hash;
+
+        WStringView view() const { return WStringView(data, length); }
+        WSTRING str() const { return WSTRING(data, length); }
+    };
+
+    // ModuleSymbols holds the names resolved for one module's TypeDefs, TypeRefs, TypeSpecs and
+    // MethodDefs, by token, and the formatted names of its TypeSpec blobs, by blob.
+    // Lookups read an open addressing table without taking a lock; only Add takes the writer lock. The entries, names and
+    // every table outgrown so far are allocated from the ModuleSymbols arena, which lives in the
+    // module's ModuleMetaInfo, so an unload frees them all without touching any other module.
+    class ModuleSymbols {
+    public:
+        ModuleSymbols();
+
+        // Find returns the name of a token, or nullptr when it has not been resolved yet.
+        const SymbolName* Find(mdToken token) const;
+        const SymbolName* Add(mdToken token, WStringView name);
+
+        // FindSpec returns the name formatted for a TypeSpec blob, or nullptr; two TypeSpec tokens
+        // with the same blob share it.
+        const SymbolName* FindSpec(PCCOR_SIGNATURE blob, ULONG length) const;
+        const SymbolName* AddSpec(PCCOR_SIGNATURE blob, ULONG length, WStringView name);
+
+        size_t Count() const;
+        size_t ArenaBytes() const;
+
+    private:
+        // a token entry has no blob, a blob entry no token
+        struct Entry {
+            size_t hash;
+            mdToken token;
+            PCCOR_SIGNATURE blob;
+            ULONG blobLength;
+            SymbolName name;
+        };
+
+        struct Table {
+            std::atomic<const Entry*>* slots;
+            size_t mask;
+            size_t count;
+        };
+
+        Table* NewTable(size_t capacity);
+        static const Entry* FindEntry(const std::atomic<Table*>& table, size_t hash, mdToken token,
+            PCCOR_SIGNATURE blob, ULONG blobLength);
+        const SymbolName* AddEntry(std::atomic<Table*>& table, size_t hash, mdToken token, PCCOR_SIGNATURE blob,
+            ULONG blobLength, WStringView name);
+
+        std::atomic<Table*> tokens_;
+        std::atomic<Table*> specs_;
+
+        // held by writers only: arena allocations and table growth
+        mutable std::mutex writeLock_;
+        Arena arena_;
+    };
+
+    // Symbol is a name handed out by the SymbolCache. A cached name is kept alive by the module
+    // record the Symbol holds; the name of a module the ModuleStore does not track is held by value.
+    class Symbol {
+    public:
+        Symbol() : name_(nullptr) {}
+        Symbol(std::shared_ptr<ModuleMetaInfo> module, const SymbolName* name) : module_(std::move(module)), name_(name) {}
+        explicit Symbol(WSTRING name) : name_(nullptr), value_(std::move(name)) {}
+
+        bool IsValid() const { return name_ != nullptr || !value_.empty(); }
+        WStringView View() const { return name_ != nullptr ? name_->view() : WStringView(value_); }
+        WSTRING str() const { return name_ != nullptr ? name_->str() : value_; }
+        size_t Hash() const { return name_ != nullptr ? name_->hash : HashSymbolName(value_); }
+
+    private:
+        std::shared_ptr<ModuleMetaInfo> module_;
+        const SymbolName* name_;
+        WSTRING value_;
+    };
+
+    // SymbolCache resolves method and type names once per module. Names are cached in the
+    // ModuleSymbols of the module's ModuleMetaInfo and dropped with it on unload; modules the
+    // ModuleStore does not track, in sampling mode or the ones RegisterModule skips, are resolved
+    // from metadata on every call.
+    //
+    // FunctionIDs of tracked modules are cached in a lock-free open addressing table whose entries
+    // hold their module record, so a hit needs neither GetFunctionInfo nor the ModuleStore lock.
+    // ForgetModule unlinks a module's entries on unload; they, and the tables outgrown, are freed
+    // by the next writer that finds no lookup in flight.
+    class SymbolCache : public Singleton<SymbolCache> {
+        friend class Singleton<SymbolCache>;
+
+    public:
+        // MethodName returns "Type.Method" for a MethodDef, or an invalid Symbol when it cannot be
+        // resolved.
+        Symbol MethodName(ICorProfilerInfo3* info, ModuleID moduleId, mdToken methodToken);
+
+        // FunctionName returns "Type.Method" for a FunctionID, instantiations of a generic method all
+        // share the name of its MethodDef.
+        Symbol FunctionName(ICorProfilerInfo3* info, FunctionID functionId);
+
+        // ForgetModule drops the FunctionIDs of a module, it is called once the module is removed
+        // from the ModuleStore since the runtime reuses the FunctionIDs of unloaded modules.
+        void ForgetModule(ModuleID moduleId);
+
+        // TypeName returns the name of a TypeDef or TypeRef.
+        Symbol TypeName(ICorProfilerInfo3* info, ModuleID moduleId, mdToken typeToken);
+
+        // These resolve through the ModuleSymbols of a module the caller already holds, or return
+        // nullptr. A TypeSpec is formatted from its blob, once per distinct blob.
+        const SymbolName* MethodName(const CComPtr<IMetaDataImport2>& metadataImport, ModuleSymbols& symbols, mdToken methodToken);
+        const SymbolName* TypeName(const CComPtr<IMetaDataImport2>& metadataImport, ModuleSymbols& symbols, mdToken typeToken);
+
+    private:
+        struct FunctionEntry {
+            FunctionID functionId;
+            std::shared_ptr<ModuleMetaInfo> module;
+            const SymbolName* name;
+        };
+
+        struct FunctionTable {
+            explicit FunctionTable(size_t capacity);
+
+            std::unique_ptr<std::atomic<const FunctionEntry*>[]> slots;
+            size_t mask;
+            // used counts the slots ForgetModule left unlinked as well, only a rebuild reuses them
+            size_t used;
+            size_t live;
+        };
+
+        // the entries of one module, a deque so that growing it does not move them
+        typedef std::deque<FunctionEntry> ModuleFunctions;
+
+        SymbolCache();
+
+        std::shared_ptr<ModuleMetaInfo> FindModule(ModuleID moduleId);
+        Symbol MethodName(ICorProfilerInfo3* info, const std::shared_ptr<ModuleMetaInfo>& module, ModuleID moduleId,
+            mdToken methodToken);
+
+        const FunctionEntry* FindFunction(FunctionID functionId) const;
+        void AddFunction(FunctionID functionId, const std::shared_ptr<ModuleMetaInfo>& module, ModuleID moduleId,
+            const SymbolName* name);
+        void Rebuild(size_t capacity);
+        void Reclaim();
+        void WriteStats(StatsWriter& writer);
+
+        std::atomic<FunctionTable*> functions_;
+        // lookups in flight in the FunctionID table, what they may still read is retired, not freed
+        std::atomic<size_t> readers_;
+
+        // held by writers only
+        std::mutex writeLock_;
+        std::unique_ptr<FunctionTable> table_;
+        std::unordered_map<ModuleID, ModuleFunctions> modules_;
+        std::vector<std::unique_ptr<FunctionTable>> retiredTables_;
+        std::vector<ModuleFunctions> retiredModules_;
+
+        std::atomic<UINT64> hits_;
+        std::atomic<UINT64> misses_;
+        std::atomic<UINT64> uncached_;
+    };
+}
+
+#endif  // CLR_PROFILER_SYMBOL_CACHE_H_
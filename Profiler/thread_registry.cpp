@@ -0,0 +1,43 @@
+#include "thread_registry.h"
+
+namespace trace {
+
+    void ThreadRegistry::Add(ThreadID threadId) {
+        for (UINT32 i = 0; i < MaxThreads; i++) {
+            ThreadID expected = 0;
+            if (slots_[i].threadId.compare_exchange_strong(expected, threadId, std::memory_order_acq_rel)) {
+                slots_[i].osThreadId.store(0, std::memory_order_relaxed);
+                UINT32 highWater = highWater_.load(std::memory_order_relaxed);
+                while (highWater < i + 1 &&
+                    !highWater_.compare_exchange_weak(highWater, i + 1, std::memory_order_release)) {
+                }
+                count_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+
+        // more live threads than slots, this one is never sampled
+        overflows_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void ThreadRegistry::Remove(ThreadID threadId) {
+        const UINT32 highWater = highWater_.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < highWater; i++) {
+            ThreadID expected = threadId;
+            if (slots_[i].threadId.compare_exchange_strong(expected, 0, std::memory_order_acq_rel)) {
+                count_.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    void ThreadRegistry::SetOSThreadId(ThreadID threadId, DWORD osThreadId) {
+        const UINT32 highWater = highWater_.load(std::memory_order_acquire);
+        for (UINT32 i = 0; i < highWater; i++) {
+            if (slots_[i].threadId.load(std::memory_order_acquire) == threadId) {
+                slots_[i].osThreadId.store(osThreadId, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+}
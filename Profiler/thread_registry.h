@@ -0,0 +1,55 @@
+#ifndef CLR_PROFILER_THREAD_REGISTRY_H_
+#define CLR_PROFILER_THREAD_REGISTRY_H_
+
+#include <atomic>
+#include <corprof.h>
+#include "util.h"
+
+namespace trace {
+
+    // ThreadRegistry tracks the live managed threads from the ThreadCreated, ThreadDestroyed and
+    // ThreadAssignedToOSThread callbacks. Slots are claimed and released with single atomic
+    // operations, so neither the callbacks nor the sampler ever wait on one another.
+    class ThreadRegistry : public Singleton<ThreadRegistry> {
+        friend class Singleton<ThreadRegistry>;
+
+    public:
+        static const UINT32 MaxThreads = 4096;
+
+        void Add(ThreadID threadId);
+        void Remove(ThreadID threadId);
+        void SetOSThreadId(ThreadID threadId, DWORD osThreadId);
+
+        // ForEach calls visit(threadId, osThreadId) for every registered thread. A thread added or
+        // removed while ForEach runs may or may not be visited.
+        template <typename Visit>
+        void ForEach(Visit visit) const {
+            const UINT32 highWater = highWater_.load(std::memory_order_acquire);
+            for (UINT32 i = 0; i < highWater; i++) {
+                const ThreadID threadId = slots_[i].threadId.load(std::memory_order_acquire);
+                if (threadId != 0) {
+                    visit(threadId, slots_[i].osThreadId.load(std::memory_order_relaxed));
+                }
+            }
+        }
+
+        UINT32 Count() const { return count_.load(std::memory_order_relaxed); }
+        UINT64 Overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+    private:
+        ThreadRegistry() : slots_(new Slot[MaxThreads]), highWater_(0), count_(0), overflows_(0) {}
+        ~ThreadRegistry() { delete[] slots_; }
+
+        struct Slot {
+            std::atomic<ThreadID> threadId{ 0 };
+            std::atomic<DWORD> osThreadId{ 0 };
+        };
+
+        Slot* const slots_;
+        std::atomic<UINT32> highWater_;
+        std::atomic<UINT32> count_;
+        std::atomic<UINT64> overflows_;
+    };
+}
+
+#endif  // CLR_PROFILER_THREAD_REGISTRY_H_
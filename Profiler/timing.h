@@ -0,0 +1,49 @@
+#ifndef CLR_PROFILER_TIMING_H_
+#define CLR_PROFILER_TIMING_H_
+
+#include <chrono>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace trace {
+
+    // ReadTimestamp returns a raw, monotonic tick count that is cheap enough to take on every probe.
+    // Ticks are converted to time with TimestampFrequency.
+    inline UINT64 ReadTimestamp() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    // TimestampFrequency returns ReadTimestamp ticks per second, calibrated once against the
+    // steady clock on first use.
+    inline double TimestampFrequency() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        static const double frequency = [] {
+            const auto start = std::chrono::steady_clock::now();
+            const UINT64 startTicks = ReadTimestamp();
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            const UINT64 endTicks = ReadTimestamp();
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return (double)(endTicks - startTicks) / seconds;
+        }();
+        return frequency;
+#else
+        return 1e9;
+#endif
+    }
+
+    inline double TicksToNanoseconds(UINT64 ticks) {
+        return (double)ticks * 1e9 / TimestampFrequency();
+    }
+}
+
+#endif  // CLR_PROFILER_TIMING_H_
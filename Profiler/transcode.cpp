@@ -0,0 +1,268 @@
+#include "transcode.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PROFILER_TRANSCODE_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define PROFILER_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define PROFILER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace trace {
+
+    static_assert(sizeof(WCHAR) == 2, "WCHAR is expected to hold UTF-16 code units");
+
+    namespace {
+        const char32_t Replacement = 0xFFFD;
+
+#if PROFILER_TRANSCODE_SIMD
+        bool HasAvx2() {
+            static const bool avx2 = [] {
+#if defined(_MSC_VER)
+                int registers[4];
+                __cpuid(registers, 0);
+                if (registers[0] < 7) {
+                    return false;
+                }
+                __cpuid(registers, 1);
+                // the OS must save the YMM registers
+                if ((registers[2] & (1 << 27)) == 0 || (_xgetbv(0) & 0x6) != 0x6) {
+                    return false;
+                }
+                __cpuidex(registers, 7, 0);
+                return (registers[1] & (1 << 5)) != 0;
+#else
+                return __builtin_cpu_supports("avx2") != 0;
+#endif
+            }();
+            return avx2;
+        }
+
+        // NarrowAscii copies the leading ASCII code units of src to dst, 16 at a time, and returns
+        // how many it copied; it stops at the first block holding anything else.
+        size_t NarrowAsciiSse2(const WCHAR* src, size_t length, char* dst) {
+            const __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+            const __m128i zero = _mm_setzero_si128();
+            size_t i = 0;
+            for (; i + 16 <= length; i += 16) {
+                const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8));
+                // SSE2 has no ptest: every unit must compare equal to zero once its low 7 bits are masked off
+                const __m128i masked = _mm_and_si128(_mm_or_si128(low, high), nonAscii);
+                if (_mm_movemask_epi8(_mm_cmpeq_epi16(masked, zero)) != 0xFFFF) {
+                    break;
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(low, high));
+            }
+            return i;
+        }
+
+        PROFILER_TARGET_AVX2 size_t NarrowAsciiAvx2(const WCHAR* src, size_t length, char* dst) {
+            const __m256i nonAscii = _mm256_set1_epi16((short)0xFF80);
+            size_t i = 0;
+            for (; i + 32 <= length; i += 32) {
+                const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+                const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 16));
+                if (!_mm256_testz_si256(_mm256_or_si256(low, high), nonAscii)) {
+                    break;
+                }
+                // packus works within 128-bit lanes, the permute puts the quarters back in order
+                const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), packed);
+            }
+            return i;
+        }
+
+        // WidenAscii is the other way round: ASCII bytes to UTF-16 code units.
+        size_t WidenAsciiSse2(const char* src, size_t length, WCHAR* dst) {
+            const __m128i zero = _mm_setzero_si128();
+            size_t i = 0;
+            for (; i + 16 <= length; i += 16) {
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+                if (_mm_movemask_epi8(bytes) != 0) {
+                    break;
+                }
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_unpacklo_epi8(bytes, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 8), _mm_unpackhi_epi8(bytes, zero));
+            }
+            return i;
+        }
+
+        PROFILER_TARGET_AVX2 size_t WidenAsciiAvx2(const char* src, size_t length, WCHAR* dst) {
+            size_t i = 0;
+            for (; i + 32 <= length; i += 32) {
+                const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+                if (_mm256_movemask_epi8(bytes) != 0) {
+                    break;
+                }
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                    _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 16),
+                    _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
+            }
+            return i;
+        }
+#endif
+
+        size_t NarrowAscii(const WCHAR* src, size_t length, char* dst) {
+#if PROFILER_TRANSCODE_SIMD
+            size_t i = HasAvx2() ? NarrowAsciiAvx2(src, length, dst) : 0;
+            i += NarrowAsciiSse2(src + i, length - i, dst + i);
+#else
+            size_t i = 0;
+#endif
+            for (; i < length && src[i] < 0x80; i++) {
+                dst[i] = (char)src[i];
+            }
+            return i;
+        }
+
+        size_t WidenAscii(const char* src, size_t length, WCHAR* dst) {
+#if PROFILER_TRANSCODE_SIMD
+            size_t i = HasAvx2() ? WidenAsciiAvx2(src, length, dst) : 0;
+            i += WidenAsciiSse2(src + i, length - i, dst + i);
+#else
+            size_t i = 0;
+#endif
+            for (; i < length && (unsigned char)src[i] < 0x80; i++) {
+                dst[i] = (WCHAR)src[i];
+            }
+            return i;
+        }
+
+        // the scalar decoders follow miniutf: an invalid sequence decodes to U+FFFD and consumes
+        // one code unit
+        char32_t DecodeUtf16(const WCHAR* src, size_t length, size_t& i) {
+            const char32_t unit = src[i++];
+            if (unit < 0xD800 || unit >= 0xE000) {
+                return unit;
+            }
+            if (unit < 0xDC00 && i < length && src[i] >= 0xDC00 && src[i] < 0xE000) {
+                return 0x10000 + ((unit - 0xD800) << 10) + (src[i++] - 0xDC00);
+            }
+            return Replacement;
+        }
+
+        char32_t DecodeUtf8(const char* src, size_t length, size_t& i) {
+            const unsigned char b0 = src[i];
+            size_t size;
+            char32_t pt;
+            char32_t min;
+            if (b0 < 0x80) {
+                i++;
+                return b0;
+            }
+            else if (b0 < 0xC0) {
+                size = 0;
+            }
+            else if (b0 < 0xE0) {
+                size = 2; pt = b0 & 0x1F; min = 0x80;
+            }
+            else if (b0 < 0xF0) {
+                size = 3; pt = b0 & 0x0F; min = 0x800;
+            }
+            else if (b0 < 0xF8) {
+                size = 4; pt = b0 & 0x07; min = 0x10000;
+            }
+            else {
+                size = 0;
+            }
+            if (size == 0 || length - i < size) {
+                i++;
+                return Replacement;
+            }
+            for (size_t k = 1; k < size; k++) {
+                const unsigned char b = src[i + k];
+                if ((b & 0xC0) != 0x80) {
+                    i++;
+                    return Replacement;
+                }
+                pt = (pt << 6) | (b & 0x3F);
+            }
+            if (pt < min || pt >= 0x110000) {
+                i++;
+                return Replacement;
+            }
+            i += size;
+            return pt;
+        }
+
+        size_t EncodeUtf8(char32_t pt, char* dst) {
+            if (pt < 0x80) {
+                dst[0] = (char)pt;
+                return 1;
+            }
+            if (pt < 0x800) {
+                dst[0] = (char)((pt >> 6) | 0xC0);
+                dst[1] = (char)((pt & 0x3F) | 0x80);
+                return 2;
+            }
+            if (pt < 0x10000) {
+                dst[0] = (char)((pt >> 12) | 0xE0);
+                dst[1] = (char)(((pt >> 6) & 0x3F) | 0x80);
+                dst[2] = (char)((pt & 0x3F) | 0x80);
+                return 3;
+            }
+            dst[0] = (char)((pt >> 18) | 0xF0);
+            dst[1] = (char)(((pt >> 12) & 0x3F) | 0x80);
+            dst[2] = (char)(((pt >> 6) & 0x3F) | 0x80);
+            dst[3] = (char)((pt & 0x3F) | 0x80);
+            return 4;
+        }
+    }
+
+    size_t Utf16ToUtf8(const WCHAR* src, size_t length, char* dst, size_t capacity) {
+        size_t in = 0;
+        size_t out = 0;
+        while (in < length) {
+            const size_t room = capacity - out;
+            const size_t ascii = NarrowAscii(src + in, (length - in < room ? length - in : room), dst + out);
+            in += ascii;
+            out += ascii;
+            if (in == length) {
+                break;
+            }
+            // one code point, four bytes at most, then back to the ASCII kernels
+            char buffer[4];
+            const size_t size = EncodeUtf8(DecodeUtf16(src, length, in), buffer);
+            if (capacity - out < size) {
+                return TranscodeOverflow;
+            }
+            for (size_t k = 0; k < size; k++) {
+                dst[out++] = buffer[k];
+            }
+        }
+        return out;
+    }
+
+    size_t Utf8ToUtf16(const char* src, size_t length, WCHAR* dst, size_t capacity) {
+        size_t in = 0;
+        size_t out = 0;
+        while (in < length) {
+            const size_t room = capacity - out;
+            const size_t ascii = WidenAscii(src + in, (length - in < room ? length - in : room), dst + out);
+            in += ascii;
+            out += ascii;
+            if (in == length) {
+                break;
+            }
+            const char32_t pt = DecodeUtf8(src, length, in);
+            const size_t size = pt < 0x10000 ? 1 : 2;
+            if (capacity - out < size) {
+                return TranscodeOverflow;
+            }
+            if (size == 1) {
+                dst[out++] = (WCHAR)pt;
+            }
+            else {
+                dst[out++] = (WCHAR)(((pt - 0x10000) >> 10) + 0xD800);
+                dst[out++] = (WCHAR)((pt & 0x3FF) + 0xDC00);
+            }
+        }
+        return out;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef CLR_PROFILER_TRANSCODE_H_
+#define CLR_PROFILER_TRANSCODE_H_
+
+#include <cstddef>
+#include <corhlpr.h>
+
+namespace trace {
+
+    // TranscodeOverflow is returned when the output buffer is too small; nothing is promised about
+    // what was written to it.
+    const size_t TranscodeOverflow = (size_t)-1;
+
+    // Utf8Capacity is the most UTF-8 bytes length UTF-16 code units can need; Utf16Capacity the
+    // most UTF-16 code units length UTF-8 bytes can need.
+    inline size_t Utf8Capacity(size_t length) { return length * 3; }
+    inline size_t Utf16Capacity(size_t length) { return length; }
+
+    // Utf16ToUtf8 and Utf8ToUtf16 transcode into a caller's buffer and return the number of code
+    // units written. Runs of ASCII are narrowed or widened 16 or 32 at a time with SSE2 or AVX2;
+    // other code points go through the scalar path, which replaces invalid sequences with U+FFFD
+    // the way miniutf does.
+    size_t Utf16ToUtf8(const WCHAR* src, size_t length, char* dst, size_t capacity);
+    size_t Utf8ToUtf16(const char* src, size_t length, WCHAR* dst, size_t capacity);
+}
+
+#endif  // CLR_PROFILER_TRANSCODE_H_
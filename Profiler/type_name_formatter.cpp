@@ -0,0 +1,258 @@
+#include "type_name_formatter.h"
+#include "clr_helpers.h"
+#include "compressed_int.h"
+#include "symbol_cache.h"
+
+namespace trace {
+
+    namespace {
+        const unsigned MaxDepth = 64;
+
+        struct PrimitiveNameTable {
+            const WSTRING* names[ELEMENT_TYPE_MAX];
+
+            PrimitiveNameTable() : names() {
+                names[ELEMENT_TYPE_VOID] = &SystemVoid;
+                names[ELEMENT_TYPE_BOOLEAN] = &SystemBoolean;
+                names[ELEMENT_TYPE_CHAR] = &SystemChar;
+                names[ELEMENT_TYPE_I1] = &SystemSByte;
+                names[ELEMENT_TYPE_U1] = &SystemByte;
+                names[ELEMENT_TYPE_I2] = &SystemInt16;
+                names[ELEMENT_TYPE_U2] = &SystemUInt16;
+                names[ELEMENT_TYPE_I4] = &SystemInt32;
+                names[ELEMENT_TYPE_U4] = &SystemUInt32;
+                names[ELEMENT_TYPE_I8] = &SystemInt64;
+                names[ELEMENT_TYPE_U8] = &SystemUInt64;
+                names[ELEMENT_TYPE_R4] = &SystemSingle;
+                names[ELEMENT_TYPE_R8] = &SystemDouble;
+                names[ELEMENT_TYPE_I] = &SystemIntPtr;
+                names[ELEMENT_TYPE_U] = &SystemUIntPtr;
+                names[ELEMENT_TYPE_STRING] = &SystemString;
+                names[ELEMENT_TYPE_OBJECT] = &SystemObject;
+                names[ELEMENT_TYPE_TYPEDBYREF] = &SystemTypedReference;
+            }
+        };
+
+        const PrimitiveNameTable PrimitiveNames;
+    }
+
+    TypeNameFormatter::TypeNameFormatter(const CComPtr<IMetaDataImport2>& metadataImport, ModuleSymbols* symbols)
+        : metadataImport_(metadataImport), symbols_(symbols), buffer_(ownBuffer_)
+    {
+    }
+
+    TypeNameFormatter::TypeNameFormatter(const CComPtr<IMetaDataImport2>& metadataImport, WSTRING& buffer)
+        : metadataImport_(metadataImport), symbols_(nullptr), buffer_(buffer)
+    {
+    }
+
+    const WSTRING& TypeNameFormatter::Format(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end) {
+        buffer_.clear();
+        if (!Append(cur, end, 0)) {
+            buffer_.clear();
+        }
+        return buffer_;
+    }
+
+    bool TypeNameFormatter::AppendToken(mdToken token, unsigned depth) {
+        // a TypeSpec is formatted in place, within the depth limit, so one that names itself ends
+        if (TypeFromToken(token) == mdtTypeSpec) {
+            PCCOR_SIGNATURE blob = nullptr;
+            ULONG length = 0;
+            if (FAILED(metadataImport_->GetTypeSpecFromToken(token, &blob, &length))) {
+                return false;
+            }
+            return Append(blob, blob + length, depth + 1);
+        }
+        if (symbols_ == nullptr) {
+            buffer_ += GetTypeInfo(metadataImport_, token).name;
+            return true;
+        }
+        const SymbolName* name = SymbolCache::Instance()->TypeName(metadataImport_, *symbols_, token);
+        if (name != nullptr) {
+            buffer_.append(name->data, name->length);
+        }
+        return true;
+    }
+
+    void TypeNameFormatter::AppendNumber(ULONG number) {
+        WCHAR digits[10];
+        int count = 0;
+        do {
+            digits[count++] = (WCHAR)('0' + number % 10);
+            number /= 10;
+        } while (number != 0);
+        while (count > 0) {
+            buffer_ += digits[--count];
+        }
+    }
+
+    bool TypeNameFormatter::Append(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, unsigned depth) {
+        if (depth >= MaxDepth) {
+            return false;
+        }
+
+        // custom modifiers and PINNED say nothing about the name
+        while (cur < end && (*cur == ELEMENT_TYPE_CMOD_OPT || *cur == ELEMENT_TYPE_CMOD_REQD || *cur == ELEMENT_TYPE_PINNED)) {
+            mdToken modifier;
+            if (*cur++ != ELEMENT_TYPE_PINNED && !DecodeTypeDefOrRef(cur, end, &modifier)) {
+                return false;
+            }
+        }
+
+        if (cur < end && *cur == ELEMENT_TYPE_BYREF) {
+            cur++;
+            if (!Append(cur, end, depth + 1)) {
+                return false;
+            }
+            buffer_ += '&';
+            return true;
+        }
+
+        if (cur >= end) {
+            return false;
+        }
+        const BYTE elementType = *cur;
+        if (elementType < ELEMENT_TYPE_MAX && PrimitiveNames.names[elementType] != nullptr) {
+            cur++;
+            buffer_ += *PrimitiveNames.names[elementType];
+            return true;
+        }
+
+        switch (elementType) {
+        case ELEMENT_TYPE_CLASS:
+        case ELEMENT_TYPE_VALUETYPE: {
+            cur++;
+            mdToken token;
+            if (!DecodeTypeDefOrRef(cur, end, &token)) {
+                return false;
+            }
+            return AppendToken(token, depth);
+        }
+
+        case ELEMENT_TYPE_VAR:
+        case ELEMENT_TYPE_MVAR: {
+            cur++;
+            ULONG number;
+            if (!DecodeCompressed(cur, end, &number)) {
+                return false;
+            }
+            buffer_ += elementType == ELEMENT_TYPE_VAR ? WStr("!") : WStr("!!");
+            AppendNumber(number);
+            return true;
+        }
+
+        case ELEMENT_TYPE_GENERICINST:
+        case ELEMENT_TYPE_SZARRAY:
+        case ELEMENT_TYPE_ARRAY:
+        case ELEMENT_TYPE_PTR:
+        case ELEMENT_TYPE_FNPTR:
+            return AppendComposite(cur, end, depth);
+
+        default:
+            return false;
+        }
+    }
+
+    bool TypeNameFormatter::AppendComposite(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, unsigned depth) {
+        const BYTE elementType = *cur++;
+        switch (elementType) {
+        case ELEMENT_TYPE_GENERICINST: {
+            // GENERICINST (CLASS | VALUETYPE) TypeDefOrRefEncoded GenArgCount Type*
+            if (cur >= end) {
+                return false;
+            }
+            cur++;
+            mdToken token;
+            ULONG count;
+            if (!DecodeTypeDefOrRef(cur, end, &token) || !DecodeCompressed(cur, end, &count) ||
+                !AppendToken(token, depth)) {
+                return false;
+            }
+            buffer_ += '[';
+            for (ULONG i = 0; i < count; i++) {
+                if (i != 0) {
+                    buffer_ += ',';
+                }
+                if (!Append(cur, end, depth + 1)) {
+                    return false;
+                }
+            }
+            buffer_ += ']';
+            return true;
+        }
+
+        case ELEMENT_TYPE_SZARRAY:
+            if (!Append(cur, end, depth + 1)) {
+                return false;
+            }
+            buffer_ += WStr("[]");
+            return true;
+
+        case ELEMENT_TYPE_PTR:
+            if (!Append(cur, end, depth + 1)) {
+                return false;
+            }
+            buffer_ += '*';
+            return true;
+
+        case ELEMENT_TYPE_ARRAY: {
+            // ARRAY Type Rank NumSizes Size* NumLoBounds LoBound*
+            if (!Append(cur, end, depth + 1)) {
+                return false;
+            }
+            ULONG rank;
+            ULONG sizes;
+            ULONG bounds;
+            if (!DecodeCompressed(cur, end, &rank) || !DecodeCompressed(cur, end, &sizes) ||
+                !SkipCompressedRun(cur, end, sizes) || !DecodeCompressed(cur, end, &bounds) ||
+                !SkipCompressedRun(cur, end, bounds)) {
+                return false;
+            }
+            buffer_ += '[';
+            for (ULONG i = 1; i < rank; i++) {
+                buffer_ += ',';
+            }
+            buffer_ += ']';
+            return true;
+        }
+
+        case ELEMENT_TYPE_FNPTR: {
+            // FNPTR MethodDefSig, written as method Ret(Param,Param)
+            if (cur >= end) {
+                return false;
+            }
+            const BYTE convention = *cur++;
+            ULONG count;
+            if ((convention & IMAGE_CEE_CS_CALLCONV_GENERIC) != 0 && !DecodeCompressed(cur, end, &count)) {
+                return false;
+            }
+            if (!DecodeCompressed(cur, end, &count)) {
+                return false;
+            }
+            buffer_ += WStr("method ");
+            if (!Append(cur, end, depth + 1)) {
+                return false;
+            }
+            buffer_ += '(';
+            for (ULONG i = 0; i < count; i++) {
+                if (i != 0) {
+                    buffer_ += ',';
+                }
+                if (cur < end && *cur == ELEMENT_TYPE_SENTINEL) {
+                    cur++;
+                    buffer_ += WStr("...,");
+                }
+                if (!Append(cur, end, depth + 1)) {
+                    return false;
+                }
+            }
+            buffer_ += ')';
+            return true;
+        }
+
+        default:
+            return false;
+        }
+    }
+}
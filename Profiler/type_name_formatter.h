@@ -0,0 +1,44 @@
+#ifndef CLR_PROFILER_TYPE_NAME_FORMATTER_H_
+#define CLR_PROFILER_TYPE_NAME_FORMATTER_H_
+
+#include <corprof.h>
+#include "string.h"  // NOLINT
+#include "CComPtr.h"
+
+namespace trace {
+
+    class ModuleSymbols;
+
+    // TypeNameFormatter writes the name of a signature type by appending each of its parts into one
+    // buffer, instead of concatenating a new string per nesting level. Given the module's symbols,
+    // TypeDef and TypeRef names are resolved through them, once per module, and SymbolCache keeps
+    // the formatted name of each TypeSpec blob there; without them names are read from metadata.
+    // Nested TypeSpecs are formatted in place.
+    //
+    // Types are written as System.Int32, Name[Arg,Arg] for generic instantiations, T[] and T[,]
+    // for arrays, T* for pointers, T& for byrefs, !n and !!n for type and method type parameters.
+    class TypeNameFormatter {
+    public:
+        explicit TypeNameFormatter(const CComPtr<IMetaDataImport2>& metadataImport, ModuleSymbols* symbols = nullptr);
+        // This one formats into buffer, so a caller formatting repeatedly reuses its capacity.
+        TypeNameFormatter(const CComPtr<IMetaDataImport2>& metadataImport, WSTRING& buffer);
+
+        // Format formats the type at cur, [BYREF] Type with any custom modifiers, and moves cur
+        // past it. The name stays valid until the next call; it is empty when the type is malformed
+        // or nested deeper than the formatter follows.
+        const WSTRING& Format(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end);
+
+    private:
+        bool Append(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, unsigned depth);
+        bool AppendComposite(PCCOR_SIGNATURE& cur, PCCOR_SIGNATURE end, unsigned depth);
+        bool AppendToken(mdToken token, unsigned depth);
+        void AppendNumber(ULONG number);
+
+        const CComPtr<IMetaDataImport2>& metadataImport_;
+        ModuleSymbols* symbols_;
+        WSTRING ownBuffer_;
+        WSTRING& buffer_;
+    };
+}
+
+#endif  // CLR_PROFILER_TYPE_NAME_FORMATTER_H_
@@ -1,7 +1,13 @@
 ﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
 using System.IO;
+using System.Linq;
 using System.Reflection;
+using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
+using System.Text;
+using System.Text.RegularExpressions;
 using System.Threading;
 
 namespace ProfilerTestHarness
@@ -17,8 +23,29 @@ namespace ProfilerTestHarness
         static void ReJitRewriteTarget()
         { }
 
+        [MethodImpl(MethodImplOptions.NoInlining)]
+        static void BenchmarkBaseline()
+        { }
+
+        static long Mix(long value, long salt)
+        {
+            return (value ^ salt) + (salt << 1);
+        }
+
         static unsafe void Main(string[] args)
         {
+            if (args.Length > 0 && args[0] == "bench")
+            {
+                RunProbeBenchmark(args.Length > 1 ? int.Parse(args[1]) : 10_000_000);
+                return;
+            }
+
+            if (args.Length > 0 && args[0] == "selective")
+            {
+                RunSelectiveBenchmark(args.Length > 1 ? int.Parse(args[1]) : 100_000_000);
+                return;
+            }
+
             SetupAndCheckEnvironment();
 
 
@@ -40,6 +67,88 @@ namespace ProfilerTestHarness
             Console.WriteLine("Test over.");
         }
 
+        // Times calls to the instrumented JitRewriteTarget against an uninstrumented baseline, run it
+        // once with PROFILER_PROBE_ABI=managed and once with PROFILER_PROBE_ABI=native to compare the
+        // probe ABIs. Console output is discarded while timing so the managed probe is measured
+        // without terminal I/O.
+        private static void RunProbeBenchmark(int iterations)
+        {
+            var output = Console.Out;
+            Console.SetOut(TextWriter.Null);
+
+            JitRewriteTarget();
+            BenchmarkBaseline();
+
+            var stopwatch = Stopwatch.StartNew();
+            for (var i = 0; i < iterations; i++)
+            {
+                BenchmarkBaseline();
+            }
+            var baseline = stopwatch.Elapsed.TotalMilliseconds * 1e6 / iterations;
+
+            stopwatch.Restart();
+            for (var i = 0; i < iterations; i++)
+            {
+                JitRewriteTarget();
+            }
+            var instrumented = stopwatch.Elapsed.TotalMilliseconds * 1e6 / iterations;
+
+            Console.SetOut(output);
+            Console.WriteLine($"probe abi: {Environment.GetEnvironmentVariable("PROFILER_PROBE_ABI") ?? "managed"}");
+            Console.WriteLine($"baseline: {baseline:F2} ns/call");
+            Console.WriteLine($"instrumented: {instrumented:F2} ns/call");
+            Console.WriteLine($"probe overhead: {instrumented - baseline:F2} ns/call");
+        }
+
+        // Compares selective mode with the global COR_PRF_DISABLE_ALL_NGEN_IMAGES /
+        // COR_PRF_DISABLE_INLINING flags, run it once with PROFILER_SELECTIVE_ENABLED=0 and once with 1.
+        // Startup is the time from process start to Main plus a first pass over precompiled framework
+        // code; throughput is a loop over a small method the JIT would inline and over framework
+        // collections.
+        private static void RunSelectiveBenchmark(int iterations)
+        {
+            var toMain = (DateTime.Now - Process.GetCurrentProcess().StartTime).TotalMilliseconds;
+
+            var stopwatch = Stopwatch.StartNew();
+            var warmUp = WarmUpFramework();
+            var firstPass = stopwatch.Elapsed.TotalMilliseconds;
+
+            stopwatch.Restart();
+            long sum = 0;
+            for (var i = 0; i < iterations; i++)
+            {
+                sum = Mix(sum, i);
+            }
+            var inlinable = stopwatch.Elapsed.TotalMilliseconds * 1e6 / iterations;
+
+            var lookups = iterations / 10;
+            var map = Enumerable.Range(0, 1024).ToDictionary(i => i, i => (long)i);
+            stopwatch.Restart();
+            for (var i = 0; i < lookups; i++)
+            {
+                sum += map[i & 1023];
+            }
+            var framework = stopwatch.Elapsed.TotalMilliseconds * 1e6 / lookups;
+
+            Console.WriteLine($"selective: {Environment.GetEnvironmentVariable("PROFILER_SELECTIVE_ENABLED") ?? "0"}");
+            Console.WriteLine($"process start to Main: {toMain:F1} ms");
+            Console.WriteLine($"first framework pass: {firstPass:F1} ms");
+            Console.WriteLine($"inlinable call: {inlinable:F2} ns/call");
+            Console.WriteLine($"dictionary lookup: {framework:F2} ns/lookup");
+            Console.WriteLine($"checksum: {sum + warmUp}");
+        }
+
+        private static long WarmUpFramework()
+        {
+            var matches = new Regex(@"(\w+)@(\w+)\.com").Matches("a@b.com c@d.com e@f.com").Count;
+            var multiples = Enumerable.Range(0, 10_000).Where(i => i % 3 == 0).Select(i => (long)i * 2).Sum();
+            var text = string.Join(",", Enumerable.Range(0, 1_000).Select(i => i.ToString("X")));
+            var bytes = Encoding.UTF8.GetBytes(text);
+            var sorted = new List<string>(text.Split(','));
+            sorted.Sort(StringComparer.OrdinalIgnoreCase);
+            return matches + multiples + bytes.Length + sorted.Count;
+        }
+
         private static unsafe void SetupAndCheckEnvironment()
         {
             Console.WriteLine("Setup and check environment ...");